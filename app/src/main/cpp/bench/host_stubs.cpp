@@ -0,0 +1,43 @@
+// Functions referenced by benchmarked sources outside of the measured code, e.g. proxy
+// handshakes in init_remote_server_socket(). Benchmarks never call them
+
+#include "dpi-bypass.h"
+#include "dns.h"
+#include "sni.h"
+
+#include <cstdlib>
+
+int resolve_host(const std::string& host, std::string & ip, bool hostlist_condition)
+{
+    abort();
+}
+
+int recv_string_tls(int & socket, SSL *context, std::string & message, struct timeval timeout, unsigned int & last_char)
+{
+    abort();
+}
+
+int send_string_tls(int & socket, TLSContext *context, const std::string & string_to_send, unsigned int last_char)
+{
+    abort();
+}
+
+int verify_certificate(struct TLSContext *context, struct TLSCertificate **certificate_chain, int len)
+{
+    abort();
+}
+
+SSL* init_tls_client(int & client_socket, std::string & sni, bool is_set_sni, tls_validation_function verify_callback)
+{
+    abort();
+}
+
+void SSL_CTX_free(struct TLSContext *context)
+{
+    abort();
+}
+
+int SSL_shutdown(struct TLSContext *context)
+{
+    abort();
+}
@@ -0,0 +1,118 @@
+// Hostlist matching checks and lookups per second against a 500k entry list
+//
+// List is written as txt file and loaded with parse_hostlist(), half of entries are plain hosts and
+// half are wildcards. Lookups mix exact hits, subdomains of wildcards and misses, and are compared
+// with a linear scan of the entries. With --check only the matching rules are checked
+
+#include "dpi-bypass.h"
+#include "hostlist.h"
+
+#include <algorithm>
+#include <chrono>
+
+struct Settings settings;
+
+const int HOSTLIST_SIZE = 500000;
+const int LOOKUPS_COUNT = 2000000;
+
+static int failed = 0;
+
+void check(const std::string & host, bool expected)
+{
+    bool result = find_in_hostlist(host);
+    if(result != expected)
+        failed = 1;
+    printf("%-40s %-5s %s\n", host.c_str(), result ? "found" : "-", result == expected ? "ok" : "FAILED");
+}
+
+std::string get_host(int i)
+{
+    return "host" + std::to_string(i) + ".example.org";
+}
+
+int main(int argc, char * argv[])
+{
+    bool is_bench = !(argc > 1 && strcmp(argv[1], "--check") == 0);
+
+    char path[] = "/tmp/hostlist_bench_XXXXXX";
+    int fd = mkstemp(path);
+    if(fd == -1)
+    {
+        printf("Failed to create hostlist file\n");
+        return 1;
+    }
+
+    // Odd entries are wildcards. Windows newlines, case and trailing dot are normalized on load
+    std::string hostlist = "Example.COM\r\n*.cdn.net.\n";
+    for(int i = 0; i < HOSTLIST_SIZE - 2; i++)
+        hostlist += (i % 2 ? "*." : "") + get_host(i) + "\n";
+    bool is_written = write(fd, hostlist.data(), hostlist.size()) == (ssize_t) hostlist.size();
+    close(fd);
+
+    settings.hostlist.hostlist_path = path;
+    settings.hostlist.hostlist_format = "txt";
+    auto start = std::chrono::steady_clock::now();
+    int ret = is_written ? parse_hostlist() : -1;
+    double load_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    unlink(path);
+    if(ret == -1)
+    {
+        printf("Failed to load hostlist\n");
+        return 1;
+    }
+
+    // Plain entries match only the host itself, wildcards match their domain and all subdomains
+    check("example.com", true);
+    check("EXAMPLE.com.", true);
+    check("www.example.com", false);
+    check("com", false);
+    check("cdn.net", true);
+    check("a.b.cdn.net", true);
+    check("xcdn.net", false);
+    check("net", false);
+    check(get_host(0), true);
+    check("a." + get_host(0), false);
+    check(get_host(1), true);
+    check("a." + get_host(1), true);
+    check(get_host(HOSTLIST_SIZE), false);
+    check("", false);
+
+    if(is_bench)
+    {
+        printf("%-40s %8.0f ms\n", "Load of 500k entries", load_seconds * 1000);
+
+        // Hosts are built before timing, so only lookups are measured
+        std::vector<std::string> hosts;
+        for(int i = 0; i < 4096; i++)
+        {
+            int index = (i * 7919) % (HOSTLIST_SIZE + HOSTLIST_SIZE / 4);
+            hosts.push_back(i % 3 ? get_host(index) : "cdn" + std::to_string(i) + "." + get_host(index));
+        }
+
+        int found = 0;
+        start = std::chrono::steady_clock::now();
+        for(int i = 0; i < LOOKUPS_COUNT; i++)
+            found += find_in_hostlist(hosts[i % hosts.size()]);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        printf("%-40s %8.0f lookups/s (%d%% found)\n", "Lookups", LOOKUPS_COUNT / seconds,
+               (int) ((uint64_t) found * 100 / LOOKUPS_COUNT));
+
+        // Comparison with scan of all entries, as find_in_hostlist did before hostlist was indexed
+        std::vector<std::string> entries;
+        std::istringstream stream(hostlist);
+        std::string entry;
+        while(std::getline(stream, entry))
+            entries.push_back(entry);
+
+        const int SCANS_COUNT = 200;
+        found = 0;
+        start = std::chrono::steady_clock::now();
+        for(int i = 0; i < SCANS_COUNT; i++)
+            found += std::find(entries.begin(), entries.end(), hosts[i % hosts.size()]) != entries.end();
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        printf("%-40s %8.0f lookups/s (%d%% found)\n", "Linear scan", SCANS_COUNT / seconds,
+               found * 100 / SCANS_COUNT);
+    }
+
+    return failed;
+}
@@ -0,0 +1,27 @@
+#ifndef DPITUNNEL_BENCH_ANDROID_LOG_H
+#define DPITUNNEL_BENCH_ANDROID_LOG_H
+
+// Host replacement of the NDK log header. Messages are dropped, so they don't disturb timings
+
+enum android_LogPriority
+{
+    ANDROID_LOG_UNKNOWN = 0,
+    ANDROID_LOG_DEFAULT,
+    ANDROID_LOG_VERBOSE,
+    ANDROID_LOG_DEBUG,
+    ANDROID_LOG_INFO,
+    ANDROID_LOG_WARN,
+    ANDROID_LOG_ERROR,
+    ANDROID_LOG_FATAL,
+    ANDROID_LOG_SILENT
+};
+
+static inline int __android_log_print(int prio, const char * tag, const char * fmt, ...)
+{
+    (void) prio;
+    (void) tag;
+    (void) fmt;
+    return 0;
+}
+
+#endif //DPITUNNEL_BENCH_ANDROID_LOG_H
@@ -0,0 +1,7 @@
+#ifndef DPITUNNEL_BENCH_JNI_H
+#define DPITUNNEL_BENCH_JNI_H
+
+// Host builds of the benchmarks don't run in a Java VM. dpi-bypass.h includes jni.h, but the
+// benchmarked sources don't use it
+
+#endif //DPITUNNEL_BENCH_JNI_H
@@ -0,0 +1,112 @@
+#ifndef DPITUNNEL_BENCH_ARM_NEON_H
+#define DPITUNNEL_BENCH_ARM_NEON_H
+
+// Host replacement of the NEON header with scalar versions of the intrinsics chacha20_simd.c uses,
+// so its NEON code can be checked against the vectors on x86 build hosts. Only lane semantics
+// matter here, not speed
+
+#include <stdint.h>
+#include <string.h>
+
+typedef struct { uint8_t v[8]; } uint8x8_t;
+typedef struct { uint8_t v[16]; } uint8x16_t;
+typedef struct { uint16_t v[8]; } uint16x8_t;
+typedef struct { uint32_t v[2]; } uint32x2_t;
+typedef struct { uint32_t v[4]; } uint32x4_t;
+typedef struct { uint64_t v[1]; } uint64x1_t;
+typedef struct { uint64_t v[2]; } uint64x2_t;
+typedef struct { uint32x4_t val[2]; } uint32x4x2_t;
+
+#define BENCH_NEON_LANES(x) ((int) (sizeof((x).v) / sizeof((x).v[0])))
+
+#define BENCH_NEON_REINTERPRET(name, to_type, from_type) \
+    static inline to_type name(from_type a) { to_type r; memcpy(&r, &a, sizeof(r)); return r; }
+
+BENCH_NEON_REINTERPRET(vreinterpretq_u16_u32, uint16x8_t, uint32x4_t)
+BENCH_NEON_REINTERPRET(vreinterpretq_u32_u16, uint32x4_t, uint16x8_t)
+BENCH_NEON_REINTERPRET(vreinterpretq_u8_u32, uint8x16_t, uint32x4_t)
+BENCH_NEON_REINTERPRET(vreinterpret_u64_u8, uint64x1_t, uint8x8_t)
+
+#define BENCH_NEON_BINARY(name, type, op) \
+    static inline type name(type a, type b) \
+    { \
+        for (int i = 0; i < BENCH_NEON_LANES(a); i++) \
+            a.v[i] = a.v[i] op b.v[i]; \
+        return a; \
+    }
+
+BENCH_NEON_BINARY(vadd_u32, uint32x2_t, +)
+BENCH_NEON_BINARY(vorr_u32, uint32x2_t, |)
+BENCH_NEON_BINARY(vaddq_u32, uint32x4_t, +)
+BENCH_NEON_BINARY(veorq_u32, uint32x4_t, ^)
+BENCH_NEON_BINARY(veorq_u8, uint8x16_t, ^)
+BENCH_NEON_BINARY(vaddq_u64, uint64x2_t, +)
+BENCH_NEON_BINARY(vandq_u64, uint64x2_t, &)
+BENCH_NEON_BINARY(vorrq_u64, uint64x2_t, |)
+
+#define BENCH_NEON_SHIFT(name, type, op) \
+    static inline type name(type a, int n) \
+    { \
+        for (int i = 0; i < BENCH_NEON_LANES(a); i++) \
+            a.v[i] = a.v[i] op n; \
+        return a; \
+    }
+
+BENCH_NEON_SHIFT(vshlq_n_u32, uint32x4_t, <<)
+BENCH_NEON_SHIFT(vshlq_n_u64, uint64x2_t, <<)
+BENCH_NEON_SHIFT(vshrq_n_u64, uint64x2_t, >>)
+
+static inline uint32x2_t vdup_n_u32(uint32_t x) { uint32x2_t r = {{x, x}}; return r; }
+static inline uint32x4_t vdupq_n_u32(uint32_t x) { uint32x4_t r = {{x, x, x, x}}; return r; }
+static inline uint64x2_t vdupq_n_u64(uint64_t x) { uint64x2_t r = {{x, x}}; return r; }
+
+static inline uint8x8_t vld1_u8(const uint8_t *p) { uint8x8_t r; memcpy(&r, p, sizeof(r)); return r; }
+static inline uint8x16_t vld1q_u8(const uint8_t *p) { uint8x16_t r; memcpy(&r, p, sizeof(r)); return r; }
+static inline uint32x2_t vld1_u32(const uint32_t *p) { uint32x2_t r; memcpy(&r, p, sizeof(r)); return r; }
+static inline uint32x4_t vld1q_u32(const uint32_t *p) { uint32x4_t r; memcpy(&r, p, sizeof(r)); return r; }
+static inline void vst1_u32(uint32_t *p, uint32x2_t a) { memcpy(p, &a, sizeof(a)); }
+static inline void vst1q_u8(uint8_t *p, uint8x16_t a) { memcpy(p, &a, sizeof(a)); }
+
+// Shift right and insert, n top bits of a are kept
+static inline uint32x4_t vsriq_n_u32(uint32x4_t a, uint32x4_t b, int n)
+{
+    for (int i = 0; i < 4; i++)
+        a.v[i] = (a.v[i] & ~(0xffffffffu >> n)) | (b.v[i] >> n);
+    return a;
+}
+
+// Swap 16-bit halves of every 32-bit word
+static inline uint16x8_t vrev32q_u16(uint16x8_t a)
+{
+    for (int i = 0; i < 8; i += 2)
+    {
+        uint16_t t = a.v[i];
+        a.v[i] = a.v[i + 1];
+        a.v[i + 1] = t;
+    }
+    return a;
+}
+
+static inline uint32x4x2_t vtrnq_u32(uint32x4_t a, uint32x4_t b)
+{
+    uint32x4x2_t r = {{{{a.v[0], b.v[0], a.v[2], b.v[2]}}, {{a.v[1], b.v[1], a.v[3], b.v[3]}}}};
+    return r;
+}
+
+static inline uint32x2_t vget_low_u32(uint32x4_t a) { uint32x2_t r = {{a.v[0], a.v[1]}}; return r; }
+static inline uint32x2_t vget_high_u32(uint32x4_t a) { uint32x2_t r = {{a.v[2], a.v[3]}}; return r; }
+static inline uint32x4_t vcombine_u32(uint32x2_t a, uint32x2_t b) { uint32x4_t r = {{a.v[0], a.v[1], b.v[0], b.v[1]}}; return r; }
+static inline uint64x2_t vcombine_u64(uint64x1_t a, uint64x1_t b) { uint64x2_t r = {{a.v[0], b.v[0]}}; return r; }
+
+static inline uint32x2_t vmovn_u64(uint64x2_t a) { uint32x2_t r = {{(uint32_t) a.v[0], (uint32_t) a.v[1]}}; return r; }
+static inline uint64x2_t vmovl_u32(uint32x2_t a) { uint64x2_t r = {{a.v[0], a.v[1]}}; return r; }
+
+static inline uint64x2_t vmull_u32(uint32x2_t a, uint32x2_t b)
+{
+    uint64x2_t r = {{(uint64_t) a.v[0] * b.v[0], (uint64_t) a.v[1] * b.v[1]}};
+    return r;
+}
+
+static inline uint64x2_t vmlal_u32(uint64x2_t c, uint32x2_t a, uint32x2_t b) { return vaddq_u64(c, vmull_u32(a, b)); }
+
+#endif //DPITUNNEL_BENCH_ARM_NEON_H
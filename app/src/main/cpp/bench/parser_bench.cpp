@@ -0,0 +1,163 @@
+// HTTP request parser checks and time per call against the std::regex parser it replaced
+//
+// Samples are requests as browsers and apps send them to the proxy, and a body chunk which must be
+// left alone. With --check only parsed fields and modified request lines are checked
+
+#include "dpi-bypass.h"
+#include "packet.h"
+
+#include <chrono>
+#include <regex>
+
+struct Settings settings;
+
+const int ITERATIONS_COUNT = 200000;
+const int REGEX_ITERATIONS_COUNT = 2000;
+
+struct Sample
+{
+    const char * request;
+    // Expected parse_request() result, method is empty if request must be rejected
+    const char * method;
+    const char * host;
+    int port;
+    // Expected first line after modify_http_request()
+    const char * modified_line;
+};
+
+const Sample samples[] = {
+    {"GET http://www.example.com/index.html?q=1 HTTP/1.1\r\n"
+     "Host: www.example.com\r\n"
+     "Proxy-Connection: keep-alive\r\n"
+     "User-Agent: Mozilla/5.0 (Linux; Android 10; Pixel 3) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/86.0.4240.75 Mobile Safari/537.36\r\n"
+     "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/webp,*/*;q=0.8\r\n"
+     "Accept-Encoding: gzip, deflate\r\n"
+     "Accept-Language: en-US,en;q=0.9\r\n\r\n",
+     "GET", "example.com", 80, "GET /index.html?q=1 HTTP/1.1"},
+    {"CONNECT play.googleapis.com:443 HTTP/1.1\r\n"
+     "Host: play.googleapis.com:443\r\n"
+     "Proxy-Connection: keep-alive\r\n"
+     "User-Agent: Dalvik/2.1.0 (Linux; U; Android 10; Pixel 3 Build/QQ3A.200805.001)\r\n\r\n",
+     "CONNECT", "play.googleapis.com", 443, "CONNECT play.googleapis.com:443 HTTP/1.1"},
+    {"GET /api/v1/items?page=2 HTTP/1.1\r\n"
+     "User-Agent: okhttp/4.9.0\r\n"
+     "Accept-Encoding: gzip\r\n"
+     "host: api.example.net:8080\r\n"
+     "Connection: Keep-Alive\r\n\r\n",
+     "GET", "api.example.net", 8080, "GET /api/v1/items?page=2 HTTP/1.1"},
+    {"POST http://upload.example.org:8000 HTTP/1.1\r\n"
+     "Host: upload.example.org:8000\r\n"
+     "Content-Type: application/json\r\n"
+     "Content-Length: 16\r\n\r\n"
+     "{\"key\": \"value\"}",
+     "POST", "upload.example.org", 8000, "POST / HTTP/1.1"},
+    {"ssion=1&next=http://redirect.example.com/path HTTP/1.1\r\n",
+     "", "", 0, "ssion=1&next=http://redirect.example.com/path HTTP/1.1"},
+};
+
+// parse_request before it was replaced by the one-pass parser
+int parse_request_regex(const std::string& request, std::string & method, std::string & host, int & port)
+{
+    size_t method_end_position = request.find(' ');
+    if(method_end_position == std::string::npos)
+        return -1;
+    method = request.substr(0, method_end_position);
+
+    std::string regex_string = "[-a-zA-Z0-9@:%._\\+~#=]{2,256}\\.[-a-z0-9]{1,16}(:[0-9]{1,5})?";
+    std::regex url_find_regex(regex_string);
+    std::smatch match;
+    if(std::regex_search(request, match, url_find_regex) == 0)
+        return -1;
+
+    std::string found_url = match.str(0);
+    size_t www = found_url.find("www.");
+    if(www != std::string::npos)
+        found_url.erase(www, 4);
+
+    size_t port_start_position = found_url.find(':');
+    if(port_start_position == std::string::npos)
+    {
+        port = method == "CONNECT" ? 443 : 80;
+        host = found_url;
+    }
+    else
+    {
+        port = std::stoi(found_url.substr(port_start_position + 1, found_url.size() - port_start_position));
+        host = found_url.substr(0, port_start_position);
+    }
+
+    return 0;
+}
+
+// URL removal of modify_http_request before it was replaced, other steps depend on settings
+void modify_http_request_regex(std::string & request)
+{
+    if(request.empty()) return;
+
+    std::string regex_string = "(https?://)?[-a-zA-Z0-9@:%._\\+~#=]{2,256}\\.[-a-z0-9]{2,16}(:[0-9]{1,5})?";
+    std::regex url_find_regex(regex_string);
+    std::smatch match;
+    if(std::regex_search(request, match, url_find_regex) == 0)
+        return;
+
+    std::string found_url = match.str(0);
+    request.replace(request.find(found_url), found_url.size(), "");
+}
+
+template <typename Function>
+double time_per_call_ns(int iterations, Function function)
+{
+    auto start = std::chrono::steady_clock::now();
+    for(int i = 0; i < iterations; i++)
+        function();
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / iterations;
+}
+
+int main(int argc, char * argv[])
+{
+    bool is_bench = !(argc > 1 && strcmp(argv[1], "--check") == 0);
+    int failed = 0;
+
+    settings.http.is_use_http_proxy = false;
+
+    for(const Sample & sample : samples)
+    {
+        std::string request = sample.request;
+        std::string method, host;
+        int port = 0;
+        bool is_parsed = parse_request(request, method, host, port) == 0;
+        bool ok = *sample.method ? is_parsed && method == sample.method && host == sample.host && port == sample.port
+                                 : !is_parsed;
+
+        modify_http_request(request, false);
+        std::string modified_line = request.substr(0, request.find("\r\n"));
+        ok = ok && modified_line == sample.modified_line;
+
+        if(!ok)
+            failed = 1;
+        printf("%-44s %s\n", std::string(request, 0, std::min<size_t>(request.find("\r\n"), 44)).c_str(),
+               ok ? "ok" : "FAILED");
+    }
+
+    if(is_bench)
+    {
+        // Average over samples, requests are copied in both cases as modify changes them
+        double parse_ns = 0, parse_regex_ns = 0, modify_ns = 0, modify_regex_ns = 0;
+        for(const Sample & sample : samples)
+        {
+            const std::string request = sample.request;
+            std::string method, host, modified;
+            int port;
+            parse_ns += time_per_call_ns(ITERATIONS_COUNT, [&] { parse_request(request, method, host, port); });
+            parse_regex_ns += time_per_call_ns(REGEX_ITERATIONS_COUNT, [&] { parse_request_regex(request, method, host, port); });
+            modify_ns += time_per_call_ns(ITERATIONS_COUNT, [&] { modified = request; modify_http_request(modified, false); });
+            modify_regex_ns += time_per_call_ns(REGEX_ITERATIONS_COUNT, [&] { modified = request; modify_http_request_regex(modified); });
+        }
+
+        size_t count = sizeof(samples) / sizeof(samples[0]);
+        printf("%-28s %10.0f ns regex %10.0f ns one-pass\n", "parse_request", parse_regex_ns / count, parse_ns / count);
+        printf("%-28s %10.0f ns regex %10.0f ns one-pass\n", "modify_http_request", modify_regex_ns / count, modify_ns / count);
+    }
+
+    return failed;
+}
@@ -0,0 +1,158 @@
+// Socket syscalls per MB read while relaying, old SO_RCVTIMEO polling against reads until EAGAIN
+//
+// Sender writes 16 KiB bursts over loopback TCP with short pauses, like a throttled download.
+// Receiver waits for readiness with poll() and drains the socket, as the relay does. Syscalls are
+// counted with count_io(), the counters the service logs on stop. Max read is the most data one read
+// call returned, it's held back from the other side until the call returns
+
+#include "dpi-bypass.h"
+#include "socket.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <chrono>
+#include <netinet/in.h>
+
+struct Settings settings;
+
+const size_t TOTAL_SIZE = 64 * 1024 * 1024;
+const size_t BURST_SIZE = 16384;
+const int BURST_PAUSE_US = 100;
+// Same as RELAY_READ_SIZE of reactor
+const size_t READ_SIZE = 65536;
+
+// recv_string before reads until EAGAIN: 50us receive timeout set on every call, blocking recv()
+// until it times out
+int recv_string_rcvtimeo(int & socket, std::string & message, unsigned int & last_char)
+{
+    ssize_t read_size;
+    size_t message_offset = 0;
+    uint64_t syscalls = 1;
+
+    struct timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = 50;
+    if(setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, (char *) &timeout, sizeof(timeout)) < 0)
+        return -1;
+
+    while(true)
+    {
+        if(message.size() - message_offset < 1024)
+            message.resize(message.size() + 1024);
+
+        read_size = recv(socket, &message[0] + message_offset, message.size() - message_offset, 0);
+        syscalls++;
+        if(read_size < 0)
+        {
+            if(errno == EWOULDBLOCK)	break;
+            if(errno == EINTR)      continue;
+            count_io(syscalls, message_offset);
+            return -1;
+        }
+        else if(read_size == 0)
+        {
+            count_io(syscalls, message_offset);
+            last_char = message_offset;
+            return message_offset == 0 ? -1 : 0;
+        }
+
+        message_offset += read_size;
+    }
+
+    count_io(syscalls, message_offset);
+    last_char = message_offset;
+
+    return 0;
+}
+
+void send_bursts(int socket)
+{
+    std::string burst(BURST_SIZE, 'x');
+    for(size_t sent = 0; sent < TOTAL_SIZE; sent += BURST_SIZE)
+    {
+        if(send(socket, burst.data(), burst.size(), MSG_NOSIGNAL) != (ssize_t) burst.size())
+            break;
+        usleep(BURST_PAUSE_US);
+    }
+    close(socket);
+}
+
+int connect_pair(int & client_socket, int & server_socket)
+{
+    int listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t address_size = sizeof(address);
+    if(bind(listen_socket, (struct sockaddr *) &address, sizeof(address)) < 0
+        || listen(listen_socket, 1) < 0
+        || getsockname(listen_socket, (struct sockaddr *) &address, &address_size) < 0)
+        return -1;
+
+    client_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if(connect(client_socket, (struct sockaddr *) &address, sizeof(address)) < 0)
+        return -1;
+    server_socket = accept(listen_socket, NULL, NULL);
+    close(listen_socket);
+
+    return server_socket < 0 ? -1 : 0;
+}
+
+int run(const char * name, bool is_rcvtimeo)
+{
+    int client_socket, server_socket;
+    if(connect_pair(client_socket, server_socket) == -1)
+    {
+        printf("%s: failed to connect over loopback\n", name);
+        return -1;
+    }
+    if(!is_rcvtimeo && set_socket_nonblocking(client_socket) == -1)
+        return -1;
+
+    reset_stats();
+    std::thread sender(send_bursts, server_socket);
+    auto start = std::chrono::steady_clock::now();
+
+    std::string message;
+    message.reserve(READ_SIZE);
+    uint64_t wakeups = 0;
+    // Data isn't relayed before read call returns, so largest return shows added latency
+    unsigned int max_read = 0;
+    struct timeval timeout = {10, 0};
+    while(true)
+    {
+        // Old relay loop made the same poll() before reading
+        if(wait_for_socket(client_socket, POLLIN, timeout) == -1)
+            break;
+        wakeups++;
+
+        unsigned int last_char = 0;
+        bool is_eof = false;
+        int ret = is_rcvtimeo ? recv_string_rcvtimeo(client_socket, message, last_char)
+                              : recv_string(client_socket, message, READ_SIZE, last_char, is_eof);
+        max_read = std::max(max_read, last_char);
+        if(ret == -1 || is_eof)
+            break;
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    sender.join();
+    close(client_socket);
+
+    double megabytes = stats.io_bytes / 1048576.0;
+    printf("%-28s %8.1f syscalls/MB %8llu wakeups %8u KiB max read %8.1f MB/s\n", name,
+           stats.io_syscalls / megabytes, (unsigned long long) wakeups, max_read / 1024, megabytes / seconds);
+
+    return stats.io_bytes == TOTAL_SIZE ? 0 : -1;
+}
+
+int main()
+{
+    int failed = run("SO_RCVTIMEO 50us polling", true) == -1;
+    failed |= run("non-blocking until EAGAIN", false) == -1;
+
+    if(failed)
+        printf("Not all data was received\n");
+
+    return failed;
+}
@@ -0,0 +1,267 @@
+// Known-answer checks and throughput of the tlse record ciphers on the build host
+//
+// Not part of the app, CMakeLists.txt builds it only outside of the NDK. Exits with 1 if any
+// vector doesn't match. AES-GCM and SHA-256 are checked and timed with the hardware kernels
+// enabled and disabled, ChaCha20-Poly1305 with the SIMD code the compiler targets.
+//
+// Long vectors are SHA-256 digests of ciphertext and tag of a 16 KiB record computed with OpenSSL,
+// so the multi-block code paths are covered too. Record: key[i] = i, nonce[i] = 0x40 + i,
+// aad[i] = 0x80 + i (13 bytes), plaintext[i] = i * 7 + 1
+
+#include "tlse.c"
+
+#define BENCH_RECORD_SIZE 16384
+#define BENCH_SECONDS 0.5
+
+static int failed = 0;
+
+static double get_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int from_hex(const char *hex, unsigned char *out) {
+    int len = 0;
+    for (; hex[0] && hex[1]; hex += 2) {
+        unsigned int byte;
+        sscanf(hex, "%2x", &byte);
+        out[len++] = (unsigned char) byte;
+    }
+    return len;
+}
+
+static void check(const char *name, const unsigned char *result, const char *expected_hex, int len) {
+    unsigned char expected[512];
+    int expected_len = from_hex(expected_hex, expected);
+    int ok = (expected_len == len) && (memcmp(result, expected, len) == 0);
+    if (!ok)
+        failed = 1;
+    printf("%-44s %s\n", name, ok ? "ok" : "FAILED");
+}
+
+static void sha256_digest(const unsigned char *in, unsigned long len, unsigned char *out) {
+    hash_state md;
+    sha256_init(&md);
+    sha256_process(&md, in, len);
+    sha256_done(&md, out);
+}
+
+static void aes_gcm(const unsigned char *key, int key_len, const unsigned char *iv,
+                    const unsigned char *aad, int aad_len, const unsigned char *pt, int len,
+                    unsigned char *out) {
+    gcm_state gcm;
+    unsigned long tag_len = 16;
+    gcm_init(&gcm, find_cipher("aes"), key, key_len);
+    gcm_add_iv(&gcm, iv, 12);
+    gcm_add_aad(&gcm, aad, aad_len);
+    gcm_process(&gcm, (unsigned char *) pt, len, out, GCM_ENCRYPT);
+    gcm_done(&gcm, out + len, &tag_len);
+}
+
+static void chacha20_poly1305(const unsigned char *key, const unsigned char *nonce,
+                              const unsigned char *aad, int aad_len, const unsigned char *pt, int len,
+                              unsigned char *out) {
+    struct chacha_ctx ctx;
+    unsigned char poly1305_key[POLY1305_KEYLEN];
+    chacha_keysetup(&ctx, key, 256);
+    chacha_ivsetup_96bitnonce(&ctx, nonce, NULL);
+    chacha20_poly1305_key(&ctx, poly1305_key);
+    chacha20_poly1305_aead(&ctx, (unsigned char *) pt, len, (unsigned char *) aad, aad_len, poly1305_key, out);
+}
+
+static unsigned char record_key[32];
+static unsigned char record_nonce[12];
+static unsigned char record_aad[13];
+static unsigned char record[BENCH_RECORD_SIZE];
+static unsigned char record_out[BENCH_RECORD_SIZE + 16];
+
+static void init_record() {
+    for (int i = 0; i < 32; i++)
+        record_key[i] = i;
+    for (int i = 0; i < 12; i++)
+        record_nonce[i] = 0x40 + i;
+    for (int i = 0; i < 13; i++)
+        record_aad[i] = 0x80 + i;
+    for (int i = 0; i < BENCH_RECORD_SIZE; i++)
+        record[i] = (unsigned char) (i * 7 + 1);
+}
+
+static void check_aes_gcm(const char *mode) {
+    // McGrew and Viega GCM test cases 4 and 16
+    static const char *gcm_pt = "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+                                "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39";
+    unsigned char key[32], iv[12], aad[20], pt[60], out[60 + 16], digest[32];
+    char name[64];
+    from_hex("feffe9928665731c6d6a8f9467308308feffe9928665731c6d6a8f9467308308", key);
+    from_hex("cafebabefacedbaddecaf888", iv);
+    from_hex("feedfacedeadbeeffeedfacedeadbeefabaddad2", aad);
+    from_hex(gcm_pt, pt);
+
+    aes_gcm(key, 16, iv, aad, sizeof(aad), pt, sizeof(pt), out);
+    snprintf(name, sizeof(name), "%s AES-128-GCM test case 4", mode);
+    check(name, out, "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e"
+                     "21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091"
+                     "5bc94fbc3221a5db94fae95ae7121a47", sizeof(out));
+
+    aes_gcm(key, 32, iv, aad, sizeof(aad), pt, sizeof(pt), out);
+    snprintf(name, sizeof(name), "%s AES-256-GCM test case 16", mode);
+    check(name, out, "522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd2555d1aa"
+                     "8cb08e48590dbb3da7b08b1056828838c5f61e6393ba7a0abcc9f662"
+                     "76fc6ece0f4e1768cddf8853bb2d551b", sizeof(out));
+
+    aes_gcm(record_key, 16, record_nonce, record_aad, sizeof(record_aad), record, BENCH_RECORD_SIZE, record_out);
+    sha256_digest(record_out, sizeof(record_out), digest);
+    snprintf(name, sizeof(name), "%s AES-128-GCM 16 KiB record", mode);
+    check(name, digest, "a1b4150729e0f65cbcfeac88fa3416f13c58a2602b7116d8d27e29202ffe1b76", 32);
+
+    aes_gcm(record_key, 32, record_nonce, record_aad, sizeof(record_aad), record, BENCH_RECORD_SIZE, record_out);
+    sha256_digest(record_out, sizeof(record_out), digest);
+    snprintf(name, sizeof(name), "%s AES-256-GCM 16 KiB record", mode);
+    check(name, digest, "c2954a21f96b5fb161d2eb8b94d45dc40e4588c80b0a7d24d56fea1468c4af52", 32);
+}
+
+static void check_sha256(const char *mode) {
+    // FIPS 180-2 examples
+    static const char *two_blocks = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    unsigned char digest[32];
+    char name[64];
+
+    sha256_digest((const unsigned char *) "abc", 3, digest);
+    snprintf(name, sizeof(name), "%s SHA-256 \"abc\"", mode);
+    check(name, digest, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad", 32);
+
+    sha256_digest((const unsigned char *) two_blocks, strlen(two_blocks), digest);
+    snprintf(name, sizeof(name), "%s SHA-256 448 bits", mode);
+    check(name, digest, "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1", 32);
+
+    // One million 'a' fed in uneven chunks
+    unsigned char chunk[1000];
+    hash_state md;
+    memset(chunk, 'a', sizeof(chunk));
+    sha256_init(&md);
+    for (unsigned long done = 0, step = 1; done < 1000000; done += step, step = step % 997 + 1)
+        sha256_process(&md, chunk, done + step > 1000000 ? 1000000 - done : step);
+    sha256_done(&md, digest);
+    snprintf(name, sizeof(name), "%s SHA-256 million 'a'", mode);
+    check(name, digest, "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0", 32);
+}
+
+static void check_chacha20_poly1305() {
+    // RFC 8439 section 2.8.2
+    static const char *plaintext = "Ladies and Gentlemen of the class of '99: If I could offer you only one tip "
+                                   "for the future, sunscreen would be it.";
+    unsigned char key[32], nonce[12], aad[12], out[114 + 16], digest[32];
+    from_hex("808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f", key);
+    from_hex("070000004041424344454647", nonce);
+    from_hex("50515253c0c1c2c3c4c5c6c7", aad);
+
+    chacha20_poly1305(key, nonce, aad, sizeof(aad), (const unsigned char *) plaintext, 114, out);
+    check("ChaCha20-Poly1305 RFC 8439 2.8.2", out,
+          "d31a8d34648e60db7b86afbc53ef7ec2a4aded51296e08fea9e2b5a736ee62d6"
+          "3dbea45e8ca9671282fafb69da92728b1a71de0a9e060b2905d6a5b67ecd3b36"
+          "92ddbd7f2d778b8c9803aee328091b58fab324e4fad675945585808b4831d7bc"
+          "3ff4def08e4b7a9de576d26586cec64b6116"
+          "1ae10b594f09e26a7e902ecbd0600691", sizeof(out));
+
+    chacha20_poly1305(record_key, record_nonce, record_aad, sizeof(record_aad), record, BENCH_RECORD_SIZE, record_out);
+    sha256_digest(record_out, sizeof(record_out), digest);
+    check("ChaCha20-Poly1305 16 KiB record", digest,
+          "b4d79918ec0f101876de5b7ecc4b689a3746f8536bef66786f0c03bae1a46116", 32);
+
+    // Calls shorter than a SIMD chunk keep the scalar code, which has to produce the same stream
+    struct chacha_ctx ctx;
+    unsigned int counter = 1;
+    unsigned char scalar_out[BENCH_RECORD_SIZE];
+    chacha_keysetup(&ctx, record_key, 256);
+    chacha_ivsetup_96bitnonce(&ctx, record_nonce, (unsigned char *) &counter);
+    for (int i = 0; i < BENCH_RECORD_SIZE; i += CHACHA_BLOCKLEN)
+        chacha_encrypt_bytes(&ctx, record + i, scalar_out + i, CHACHA_BLOCKLEN);
+    int ok = memcmp(scalar_out, record_out, BENCH_RECORD_SIZE) == 0;
+    if (!ok)
+        failed = 1;
+    printf("%-44s %s\n", "ChaCha20 scalar matches SIMD", ok ? "ok" : "FAILED");
+}
+
+static void report(const char *name, double start, long records) {
+    printf("%-44s %8.1f MB/s\n", name, records * (double) BENCH_RECORD_SIZE / (get_time() - start) / 1e6);
+}
+
+static void bench_aes_gcm_sha256(const char *mode) {
+    char name[64];
+    for (int key_len = 16; key_len <= 32; key_len += 16) {
+        gcm_state gcm;
+        unsigned long tag_len = 16;
+        long records = 0;
+        double start = get_time();
+        gcm_init(&gcm, find_cipher("aes"), record_key, key_len);
+        while (get_time() - start < BENCH_SECONDS) {
+            gcm_reset(&gcm);
+            gcm_add_iv(&gcm, record_nonce, 12);
+            gcm_add_aad(&gcm, record_aad, sizeof(record_aad));
+            gcm_process(&gcm, record, BENCH_RECORD_SIZE, record_out, GCM_ENCRYPT);
+            gcm_done(&gcm, record_out + BENCH_RECORD_SIZE, &tag_len);
+            records++;
+        }
+        snprintf(name, sizeof(name), "%s AES-%d-GCM", mode, key_len * 8);
+        report(name, start, records);
+    }
+
+    hash_state md;
+    long records = 0;
+    double start = get_time();
+    sha256_init(&md);
+    while (get_time() - start < BENCH_SECONDS) {
+        sha256_process(&md, record, BENCH_RECORD_SIZE);
+        records++;
+    }
+    snprintf(name, sizeof(name), "%s SHA-256", mode);
+    report(name, start, records);
+}
+
+static void bench_chacha20_poly1305() {
+    long records = 0;
+    double start = get_time();
+    while (get_time() - start < BENCH_SECONDS) {
+        chacha20_poly1305(record_key, record_nonce, record_aad, sizeof(record_aad), record, BENCH_RECORD_SIZE, record_out);
+        records++;
+    }
+    report("ChaCha20-Poly1305", start, records);
+}
+
+int main(int argc, char *argv[]) {
+    // With --check only the vectors are run
+    int is_bench = !(argc > 1 && strcmp(argv[1], "--check") == 0);
+
+    tls_init();
+    init_record();
+
+#ifdef LTC_HW_ACCEL
+    int hw_caps = ltc_hw_detect();
+    printf("Hardware AES %s, GHASH %s, SHA-256 %s\n",
+           hw_caps & LTC_HW_AES ? "yes" : "no", hw_caps & LTC_HW_GHASH ? "yes" : "no",
+           hw_caps & LTC_HW_SHA256 ? "yes" : "no");
+
+    // Portable code first, then whatever the CPU supports
+    for (int i = 0; i < 2; i++) {
+        const char *mode = i == 0 ? "portable" : "hw";
+        ltc_hw_caps = i == 0 ? 0 : hw_caps;
+        check_aes_gcm(mode);
+        check_sha256(mode);
+        if (is_bench)
+            bench_aes_gcm_sha256(mode);
+    }
+#else
+    printf("Hardware kernels aren't built for this target\n");
+    check_aes_gcm("portable");
+    check_sha256("portable");
+    if (is_bench)
+        bench_aes_gcm_sha256("portable");
+#endif
+
+    check_chacha20_poly1305();
+    if (is_bench)
+        bench_chacha20_poly1305();
+
+    return failed;
+}
@@ -0,0 +1,98 @@
+#ifndef DPITUNNEL_BOUNDED_CACHE_H
+#define DPITUNNEL_BOUNDED_CACHE_H
+
+#include <chrono>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+// Map with expire time per entry and limited size. If it's full, least recently used entry is evicted.
+// Not thread safe, caller locks it
+template <typename Value>
+class BoundedCache
+{
+public:
+    explicit BoundedCache(size_t max_size) : max_size(max_size == 0 ? 1 : max_size) {}
+
+    // Returns entry if it exists and isn't expired, and marks it as recently used. Expired entry is removed
+    Value* find(const std::string & key, std::chrono::steady_clock::time_point now)
+    {
+        auto it = index.find(key);
+        if(it == index.end())
+            return NULL;
+
+        if(it->second->expire_time <= now)
+        {
+            entries.erase(it->second);
+            index.erase(it);
+            return NULL;
+        }
+
+        // Move entry to front, so it's evicted last
+        entries.splice(entries.begin(), entries, it->second);
+
+        return &it->second->value;
+    }
+
+    // Adds entry or replaces existing one. Returns true if other entry was evicted to make room
+    bool insert(const std::string & key, const Value & value, std::chrono::steady_clock::time_point expire_time)
+    {
+        auto it = index.find(key);
+        if(it != index.end())
+        {
+            it->second->value = value;
+            it->second->expire_time = expire_time;
+            entries.splice(entries.begin(), entries, it->second);
+            return false;
+        }
+
+        bool is_evicted = false;
+        if(entries.size() >= max_size)
+        {
+            index.erase(entries.back().key);
+            entries.pop_back();
+            is_evicted = true;
+        }
+
+        entries.push_front(Entry{key, value, expire_time});
+        index[key] = entries.begin();
+
+        return is_evicted;
+    }
+
+    void erase(const std::string & key)
+    {
+        auto it = index.find(key);
+        if(it == index.end())
+            return;
+
+        entries.erase(it->second);
+        index.erase(it);
+    }
+
+    void clear()
+    {
+        index.clear();
+        entries.clear();
+    }
+
+    size_t size() const
+    {
+        return entries.size();
+    }
+
+private:
+    struct Entry
+    {
+        std::string key;
+        Value value;
+        std::chrono::steady_clock::time_point expire_time;
+    };
+
+    size_t max_size;
+    // Most recently used entries are at front
+    std::list<Entry> entries;
+    std::unordered_map<std::string, typename std::list<Entry>::iterator> index;
+};
+
+#endif //DPITUNNEL_BOUNDED_CACHE_H
@@ -0,0 +1,87 @@
+#include "dpi-bypass.h"
+#include "buffer_pool.h"
+#include "stats.h"
+
+#include <mutex>
+
+struct BufferClass
+{
+    size_t size;
+    std::mutex mutex;
+    std::vector<std::string *> free_buffers;
+};
+
+// Free buffers above this limit are returned to system
+const size_t MAX_FREE_BUFFERS = 64;
+
+BufferClass buffer_classes[BUFFER_CLASSES_COUNT] = {{BUFFER_SIZE_SMALL}, {BUFFER_SIZE_LARGE}};
+
+std::string* acquire_buffer(size_t size)
+{
+    // Find smallest class that fits requested size
+    unsigned int class_index = size <= BUFFER_SIZE_SMALL ? 0 : 1;
+    BufferClass & buffer_class = buffer_classes[class_index];
+
+    std::string *buffer = NULL;
+    {
+        std::lock_guard<std::mutex> lock(buffer_class.mutex);
+        if(!buffer_class.free_buffers.empty())
+        {
+            buffer = buffer_class.free_buffers.back();
+            buffer_class.free_buffers.pop_back();
+            stats.pool_free[class_index]--;
+        }
+    }
+
+    if(buffer == NULL)
+    {
+        buffer = new std::string();
+        buffer->reserve(buffer_class.size);
+        stats.pool_allocated[class_index]++;
+    }
+    stats.pool_in_use++;
+
+    // Buffer is empty, but has at least class size capacity
+    return buffer;
+}
+
+void release_buffer(std::string *buffer)
+{
+    if(buffer == NULL)
+        return;
+
+    stats.pool_in_use--;
+
+    // Buffer could grow while used, so class is chosen by its current capacity
+    size_t capacity = buffer->capacity();
+    unsigned int class_index = capacity >= BUFFER_SIZE_LARGE ? 1 : 0;
+
+    // Buffers grown far above class size would keep peak memory, so don't cache them
+    if(capacity <= BUFFER_SIZE_LARGE * 2)
+    {
+        BufferClass & buffer_class = buffer_classes[class_index];
+        buffer->clear();
+
+        std::lock_guard<std::mutex> lock(buffer_class.mutex);
+        if(buffer_class.free_buffers.size() < MAX_FREE_BUFFERS)
+        {
+            buffer_class.free_buffers.push_back(buffer);
+            stats.pool_free[class_index]++;
+            return;
+        }
+    }
+
+    delete buffer;
+}
+
+void deinit_buffer_pool()
+{
+    for(unsigned int i = 0; i < BUFFER_CLASSES_COUNT; i++)
+    {
+        std::lock_guard<std::mutex> lock(buffer_classes[i].mutex);
+        for(std::string *buffer : buffer_classes[i].free_buffers)
+            delete buffer;
+        buffer_classes[i].free_buffers.clear();
+        stats.pool_free[i] = 0;
+    }
+}
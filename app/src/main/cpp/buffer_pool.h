@@ -0,0 +1,15 @@
+#ifndef DPITUNNEL_BUFFER_POOL_H
+#define DPITUNNEL_BUFFER_POOL_H
+
+#include <string>
+
+// Size classes of pooled I/O buffers
+const size_t BUFFER_SIZE_SMALL = 16384;
+const size_t BUFFER_SIZE_LARGE = 65536;
+const unsigned int BUFFER_CLASSES_COUNT = 2;
+
+std::string* acquire_buffer(size_t size);
+void release_buffer(std::string *buffer);
+void deinit_buffer_pool();
+
+#endif //DPITUNNEL_BUFFER_POOL_H
@@ -0,0 +1,103 @@
+#include "dpi-bypass.h"
+#include "cert_cache.h"
+#include "stats.h"
+
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+struct CertCacheEntry
+{
+    std::string sni_str;
+    // Server context with parsed certificate and key. Connections make their TLS sessions from it with SSL_new()
+    std::shared_ptr<SSL> server_context;
+    size_t size;
+};
+
+struct CertCacheShard
+{
+    std::mutex mutex;
+    // Most recently used entries are at front
+    std::list<CertCacheEntry> entries;
+    std::unordered_map<std::string, std::list<CertCacheEntry>::iterator> index;
+    size_t size;
+};
+
+// Shards reduce lock contention between workers
+const unsigned int CERT_CACHE_SHARDS_COUNT = 8;
+
+CertCacheShard cert_cache_shards[CERT_CACHE_SHARDS_COUNT];
+size_t cert_cache_max_shard_entries;
+size_t cert_cache_max_shard_size;
+
+void init_cert_cache(size_t max_entries, size_t max_size)
+{
+    cert_cache_max_shard_entries = std::max((size_t) 1, max_entries / CERT_CACHE_SHARDS_COUNT);
+    cert_cache_max_shard_size = max_size / CERT_CACHE_SHARDS_COUNT;
+}
+
+void deinit_cert_cache()
+{
+    // Contexts still used by connections are freed when these connections close
+    for(CertCacheShard & shard : cert_cache_shards)
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.index.clear();
+        shard.entries.clear();
+        shard.size = 0;
+    }
+}
+
+CertCacheShard & get_cert_cache_shard(const std::string & sni_str)
+{
+    return cert_cache_shards[std::hash<std::string>()(sni_str) % CERT_CACHE_SHARDS_COUNT];
+}
+
+void remove_from_shard(CertCacheShard & shard, std::list<CertCacheEntry>::iterator it)
+{
+    shard.size -= it->size;
+    shard.index.erase(it->sni_str);
+    shard.entries.erase(it);
+}
+
+std::shared_ptr<SSL> find_in_cert_cache(const std::string & sni_str)
+{
+    CertCacheShard & shard = get_cert_cache_shard(sni_str);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    auto it = shard.index.find(sni_str);
+    if(it == shard.index.end())
+    {
+        stats.cert_cache_misses++;
+        return NULL;
+    }
+    stats.cert_cache_hits++;
+
+    // Move entry to front, so it's evicted last
+    shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+
+    return it->second->server_context;
+}
+
+void add_to_cert_cache(const std::string & sni_str, const std::shared_ptr<SSL> & server_context, size_t size)
+{
+    CertCacheShard & shard = get_cert_cache_shard(sni_str);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    // Same certificate could be created by two connections at the same time. Keep the latest one
+    auto it = shard.index.find(sni_str);
+    if(it != shard.index.end())
+        remove_from_shard(shard, it->second);
+
+    // Evict least recently used entries until new one fits. Single entry may exceed byte budget, keep it anyway
+    while(!shard.entries.empty()
+        && (shard.entries.size() >= cert_cache_max_shard_entries || shard.size + size > cert_cache_max_shard_size))
+    {
+        remove_from_shard(shard, std::prev(shard.entries.end()));
+        stats.cert_cache_evictions++;
+    }
+
+    shard.entries.push_front(CertCacheEntry{sni_str, server_context, size});
+    shard.index[sni_str] = shard.entries.begin();
+    shard.size += size;
+}
@@ -0,0 +1,13 @@
+#ifndef DPITUNNEL_CERT_CACHE_H
+#define DPITUNNEL_CERT_CACHE_H
+
+#include <tlse.h>
+#include <memory>
+#include <string>
+
+void init_cert_cache(size_t max_entries, size_t max_size);
+void deinit_cert_cache();
+std::shared_ptr<SSL> find_in_cert_cache(const std::string & sni_str);
+void add_to_cert_cache(const std::string & sni_str, const std::shared_ptr<SSL> & server_context, size_t size);
+
+#endif //DPITUNNEL_CERT_CACHE_H
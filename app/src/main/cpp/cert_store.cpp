@@ -0,0 +1,306 @@
+#include "dpi-bypass.h"
+#include "cert_store.h"
+
+#include <mutex>
+#include <unordered_map>
+#include <sys/stat.h>
+
+// Store file is append-only sequence of records after header. Newer record for same hosts replaces older one
+struct CertStoreHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    // Certificates signed by other root CA are useless, so store is dropped when CA changes
+    uint64_t ca_hash;
+};
+
+struct CertStoreRecordHeader
+{
+    uint32_t magic;
+    uint32_t sni_size;
+    uint32_t crt_size;
+    uint32_t key_size;
+    int64_t expire_time;
+};
+
+struct CertStoreEntry
+{
+    off_t offset;
+    off_t size;
+    int64_t expire_time;
+};
+
+const uint32_t CERT_STORE_MAGIC = 0x43545044; // "DPTC"
+const uint32_t CERT_STORE_RECORD_MAGIC = 0x52545044; // "DPTR"
+const uint32_t CERT_STORE_VERSION = 1;
+// Limit for sizes read from file, so corrupted record can't make us allocate much memory
+const uint32_t MAX_CERT_STORE_FIELD_SIZE = 65536;
+// Store is rewritten on start if replaced and expired records take more space than this and than live ones
+const off_t MIN_CERT_STORE_GARBAGE_SIZE = 1048576;
+
+int cert_store_fd = -1;
+off_t cert_store_size;
+// Records by hash of host names. Only header of records is read on start, certificates are read when requested
+std::unordered_map<uint64_t, CertStoreEntry> cert_store_index;
+std::mutex cert_store_mutex;
+
+uint64_t hash_string(const std::string & string)
+{
+    // FNV-1a. Hash is saved to file, so it must be same in every run
+    uint64_t hash = 14695981039346656037ULL;
+    for(unsigned char c : string)
+    {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+int read_all(int fd, void *buffer, size_t size, off_t offset)
+{
+    size_t read_size = 0;
+    while(read_size != size)
+    {
+        ssize_t ret = pread(fd, (char *) buffer + read_size, size - read_size, offset + read_size);
+        if(ret < 0 && errno == EINTR)
+            continue;
+        if(ret <= 0)
+            return -1;
+        read_size += ret;
+    }
+
+    return 0;
+}
+
+int write_all(int fd, const std::string & data, off_t offset)
+{
+    size_t written_size = 0;
+    while(written_size != data.size())
+    {
+        ssize_t ret = pwrite(fd, data.c_str() + written_size, data.size() - written_size, offset + written_size);
+        if(ret < 0 && errno == EINTR)
+            continue;
+        if(ret <= 0)
+            return -1;
+        written_size += ret;
+    }
+
+    return 0;
+}
+
+int reset_cert_store(uint64_t ca_hash)
+{
+    CertStoreHeader header;
+    header.magic = CERT_STORE_MAGIC;
+    header.version = CERT_STORE_VERSION;
+    header.ca_hash = ca_hash;
+
+    cert_store_index.clear();
+    if(ftruncate(cert_store_fd, 0) == -1 ||
+            write_all(cert_store_fd, std::string((const char *) &header, sizeof(header)), 0) == -1)
+        return -1;
+    cert_store_size = sizeof(header);
+
+    return 0;
+}
+
+void compact_cert_store(const std::string & store_path)
+{
+    std::string log_tag = "CPP/compact_cert_store";
+
+    // Copy live records to new file and replace store with it
+    std::string compacted_path = store_path + ".tmp";
+    int compacted_fd = open(compacted_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(compacted_fd == -1)
+    {
+        log_error(log_tag.c_str(), "Can't create compacted certificate store. Errno: %s", std::strerror(errno));
+        return;
+    }
+
+    std::string data(sizeof(CertStoreHeader), ' ');
+    std::unordered_map<uint64_t, CertStoreEntry> compacted_index;
+    off_t compacted_size = data.size();
+    bool is_failed = read_all(cert_store_fd, &data[0], data.size(), 0) == -1 ||
+            write_all(compacted_fd, data, 0) == -1;
+    for(auto it = cert_store_index.begin(); !is_failed && it != cert_store_index.end(); ++it)
+    {
+        data.resize(it->second.size);
+        is_failed = read_all(cert_store_fd, &data[0], data.size(), it->second.offset) == -1 ||
+                write_all(compacted_fd, data, compacted_size) == -1;
+        compacted_index[it->first] = CertStoreEntry{compacted_size, it->second.size, it->second.expire_time};
+        compacted_size += data.size();
+    }
+
+    if(is_failed || rename(compacted_path.c_str(), store_path.c_str()) == -1)
+    {
+        log_error(log_tag.c_str(), "Can't compact certificate store. Errno: %s", std::strerror(errno));
+        close(compacted_fd);
+        unlink(compacted_path.c_str());
+        return;
+    }
+
+    close(cert_store_fd);
+    cert_store_fd = compacted_fd;
+    cert_store_index.swap(compacted_index);
+    cert_store_size = compacted_size;
+}
+
+int init_cert_store(const std::string & store_path, const std::string & ca_crt_pem)
+{
+    std::string log_tag = "CPP/init_cert_store";
+
+    std::lock_guard<std::mutex> lock(cert_store_mutex);
+    if(cert_store_fd != -1)
+        return 0;
+
+    if((cert_store_fd = open(store_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1)
+    {
+        log_error(log_tag.c_str(), "Can't open certificate store. Errno: %s", std::strerror(errno));
+        return -1;
+    }
+
+    struct stat store_stat;
+    if(fstat(cert_store_fd, &store_stat) == -1)
+    {
+        log_error(log_tag.c_str(), "Can't stat certificate store. Errno: %s", std::strerror(errno));
+        close(cert_store_fd);
+        cert_store_fd = -1;
+        return -1;
+    }
+
+    // Check that store is made by this version for current root CA
+    uint64_t ca_hash = hash_string(ca_crt_pem);
+    CertStoreHeader header;
+    if(store_stat.st_size < (off_t) sizeof(header) || read_all(cert_store_fd, &header, sizeof(header), 0) == -1 ||
+            header.magic != CERT_STORE_MAGIC || header.version != CERT_STORE_VERSION || header.ca_hash != ca_hash)
+    {
+        if(reset_cert_store(ca_hash) == -1)
+        {
+            log_error(log_tag.c_str(), "Can't create certificate store. Errno: %s", std::strerror(errno));
+            close(cert_store_fd);
+            cert_store_fd = -1;
+            return -1;
+        }
+        return 0;
+    }
+
+    // Build index from record headers
+    off_t offset = sizeof(header);
+    int64_t now = time(NULL);
+    while(offset < store_stat.st_size)
+    {
+        CertStoreRecordHeader record_header;
+        if(offset + (off_t) sizeof(record_header) > store_stat.st_size ||
+                read_all(cert_store_fd, &record_header, sizeof(record_header), offset) == -1 ||
+                record_header.magic != CERT_STORE_RECORD_MAGIC || record_header.sni_size > MAX_CERT_STORE_FIELD_SIZE ||
+                record_header.crt_size > MAX_CERT_STORE_FIELD_SIZE || record_header.key_size > MAX_CERT_STORE_FIELD_SIZE)
+            break;
+
+        off_t record_size = sizeof(record_header) + record_header.sni_size + record_header.crt_size + record_header.key_size;
+        if(offset + record_size > store_stat.st_size)
+            break;
+
+        std::string sni_str(record_header.sni_size, ' ');
+        if(read_all(cert_store_fd, &sni_str[0], sni_str.size(), offset + sizeof(record_header)) == -1)
+            break;
+
+        if(record_header.expire_time > now)
+            cert_store_index[hash_string(sni_str)] = CertStoreEntry{offset, record_size, record_header.expire_time};
+        else
+            cert_store_index.erase(hash_string(sni_str));
+
+        offset += record_size;
+    }
+
+    // Drop record written partially, e.g. when service was killed
+    if(offset != store_stat.st_size && ftruncate(cert_store_fd, offset) == -1)
+    {
+        log_error(log_tag.c_str(), "Can't truncate certificate store. Errno: %s", std::strerror(errno));
+        close(cert_store_fd);
+        cert_store_fd = -1;
+        cert_store_index.clear();
+        return -1;
+    }
+    cert_store_size = offset;
+
+    off_t live_size = 0;
+    for(const auto & entry : cert_store_index)
+        live_size += entry.second.size;
+    off_t garbage_size = cert_store_size - sizeof(header) - live_size;
+    if(garbage_size > MIN_CERT_STORE_GARBAGE_SIZE && garbage_size > live_size)
+        compact_cert_store(store_path);
+
+    log_debug(log_tag.c_str(), "Loaded %zu certificates from store", cert_store_index.size());
+
+    return 0;
+}
+
+void deinit_cert_store()
+{
+    std::lock_guard<std::mutex> lock(cert_store_mutex);
+    if(cert_store_fd != -1)
+        close(cert_store_fd);
+    cert_store_fd = -1;
+    cert_store_index.clear();
+}
+
+int find_in_cert_store(const std::string & sni_str, struct GeneratedCA & certificate)
+{
+    CertStoreEntry entry;
+    int fd;
+    {
+        std::lock_guard<std::mutex> lock(cert_store_mutex);
+        auto it = cert_store_index.find(hash_string(sni_str));
+        if(it == cert_store_index.end() || it->second.expire_time <= time(NULL))
+            return -1;
+        entry = it->second;
+        fd = cert_store_fd;
+    }
+
+    // Records are never changed after append, so they can be read without lock
+    CertStoreRecordHeader record_header;
+    if(read_all(fd, &record_header, sizeof(record_header), entry.offset) == -1)
+        return -1;
+
+    std::string record(record_header.sni_size + record_header.crt_size + record_header.key_size, ' ');
+    if(read_all(fd, &record[0], record.size(), entry.offset + sizeof(record_header)) == -1)
+        return -1;
+
+    // Different hosts can have same hash
+    if(record.compare(0, record_header.sni_size, sni_str) != 0)
+        return -1;
+
+    certificate.public_key_pem = record.substr(record_header.sni_size, record_header.crt_size);
+    certificate.private_key_pem = record.substr(record_header.sni_size + record_header.crt_size, record_header.key_size);
+
+    return 0;
+}
+
+void add_to_cert_store(const std::string & sni_str, const struct GeneratedCA & certificate, int64_t expire_time)
+{
+    std::string log_tag = "CPP/add_to_cert_store";
+
+    CertStoreRecordHeader record_header;
+    record_header.magic = CERT_STORE_RECORD_MAGIC;
+    record_header.sni_size = sni_str.size();
+    record_header.crt_size = certificate.public_key_pem.size();
+    record_header.key_size = certificate.private_key_pem.size();
+    record_header.expire_time = expire_time;
+
+    std::string record((const char *) &record_header, sizeof(record_header));
+    record.append(sni_str).append(certificate.public_key_pem).append(certificate.private_key_pem);
+
+    std::lock_guard<std::mutex> lock(cert_store_mutex);
+    if(cert_store_fd == -1)
+        return;
+
+    if(write_all(cert_store_fd, record, cert_store_size) == -1)
+    {
+        log_error(log_tag.c_str(), "Can't write to certificate store. Errno: %s", std::strerror(errno));
+        return;
+    }
+
+    cert_store_index[hash_string(sni_str)] = CertStoreEntry{cert_store_size, (off_t) record.size(), expire_time};
+    cert_store_size += record.size();
+}
@@ -0,0 +1,12 @@
+#ifndef DPITUNNEL_CERT_STORE_H
+#define DPITUNNEL_CERT_STORE_H
+
+#include <string>
+#include "sni_cert_gen.h"
+
+int init_cert_store(const std::string & store_path, const std::string & ca_crt_pem);
+void deinit_cert_store();
+int find_in_cert_store(const std::string & sni_str, struct GeneratedCA & certificate);
+void add_to_cert_store(const std::string & sni_str, const struct GeneratedCA & certificate, int64_t expire_time);
+
+#endif //DPITUNNEL_CERT_STORE_H
@@ -0,0 +1,66 @@
+#include "dpi-bypass.h"
+#include "bounded_cache.h"
+#include "chain_cache.h"
+#include "stats.h"
+#include <openssl/sha.h>
+
+#include <chrono>
+#include <mutex>
+
+// Verified chains are trusted for this time. Expiry dates are still checked on every handshake
+const unsigned int CHAIN_CACHE_TTL = 600;
+const size_t MAX_CHAIN_CACHE_SIZE = 1024;
+
+// Only presence of fingerprint matters, value isn't used
+BoundedCache<bool> chain_cache(MAX_CHAIN_CACHE_SIZE);
+std::mutex chain_cache_mutex;
+
+void deinit_chain_cache()
+{
+    std::lock_guard<std::mutex> lock(chain_cache_mutex);
+    chain_cache.clear();
+}
+
+int get_chain_fingerprint(struct TLSCertificate **certificate_chain, int len, std::string & fingerprint)
+{
+    SHA256_CTX sha256;
+    SHA256_Init(&sha256);
+
+    for(int i = 0; i < len; i++)
+    {
+        unsigned int der_len;
+        const unsigned char *der = tls_certificate_der(certificate_chain[i], &der_len);
+        if(der == NULL)
+            return -1;
+        // Prefix each certificate with its size, so different chains can't give same input
+        unsigned char der_len_bytes[4] = {(unsigned char) (der_len >> 24), (unsigned char) (der_len >> 16),
+                                          (unsigned char) (der_len >> 8), (unsigned char) der_len};
+        SHA256_Update(&sha256, der_len_bytes, sizeof(der_len_bytes));
+        SHA256_Update(&sha256, der, der_len);
+    }
+
+    fingerprint.resize(SHA256_DIGEST_LENGTH);
+    SHA256_Final(reinterpret_cast<unsigned char *>(&fingerprint[0]), &sha256);
+
+    return 0;
+}
+
+bool find_in_chain_cache(const std::string & fingerprint)
+{
+    std::lock_guard<std::mutex> lock(chain_cache_mutex);
+
+    if(chain_cache.find(fingerprint, std::chrono::steady_clock::now()) == NULL)
+    {
+        stats.chain_cache_misses++;
+        return false;
+    }
+    stats.chain_cache_hits++;
+
+    return true;
+}
+
+void add_to_chain_cache(const std::string & fingerprint)
+{
+    std::lock_guard<std::mutex> lock(chain_cache_mutex);
+    chain_cache.insert(fingerprint, true, std::chrono::steady_clock::now() + std::chrono::seconds(CHAIN_CACHE_TTL));
+}
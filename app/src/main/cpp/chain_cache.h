@@ -0,0 +1,12 @@
+#ifndef DPITUNNEL_CHAIN_CACHE_H
+#define DPITUNNEL_CHAIN_CACHE_H
+
+#include <tlse.h>
+#include <string>
+
+void deinit_chain_cache();
+int get_chain_fingerprint(struct TLSCertificate **certificate_chain, int len, std::string & fingerprint);
+bool find_in_chain_cache(const std::string & fingerprint);
+void add_to_chain_cache(const std::string & fingerprint);
+
+#endif //DPITUNNEL_CHAIN_CACHE_H
@@ -1,83 +1,12 @@
 #include "dpi-bypass.h"
 #include "dns.h"
+#include "dns_cache.h"
 #include "hostlist.h"
 
 extern struct Settings settings;
 extern JavaVM* javaVm;
-extern jclass utils_class;
 extern jclass localdnsserver_class;
 
-int resolve_host_over_doh(std::string host, std::string & ip)
-{
-    std::string log_tag = "CPP/resolve_host_over_doh";
-
-    // Make request to DoH with Java code
-
-    // Get JNIEnv
-    JNIEnv* jni_env;
-    javaVm->GetEnv((void**) &jni_env, JNI_VERSION_1_6);
-
-    // Attach JNIEnv
-    javaVm->AttachCurrentThread(&jni_env, NULL);
-
-    // Find Java method
-    jmethodID utils_make_doh_request = jni_env->GetStaticMethodID(utils_class, "makeDOHRequest", "(Ljava/lang/String;Ljava/lang/String;)Ljava/lang/String;");
-    if(utils_make_doh_request == NULL)
-    {
-        javaVm->DetachCurrentThread();
-        log_error(log_tag.c_str(), "Failed to find makeDOHRequest method");
-        return -1;
-    }
-
-    // Since we have some doh servers, we need to use they by turns
-    std::string response_string;
-
-    char delimiter = '\n';
-    std::string doh_server;
-    std::istringstream stream(settings.dns.dns_doh_servers);
-    bool isOK = false;
-    jobject response_string_object;
-    while (std::getline(stream, doh_server, delimiter))
-    {
-        // Call method
-        jobject doh_server_jstring = jni_env->NewStringUTF(doh_server.c_str());
-        jobject host_jstring = jni_env->NewStringUTF(host.c_str());
-        response_string_object = (jstring) jni_env->CallStaticObjectMethod(utils_class, utils_make_doh_request, (jstring) doh_server_jstring, (jstring) host_jstring);
-
-        const char * str = jni_env->GetStringUTFChars((jstring) response_string_object, 0);
-        response_string = std::string(str);
-        jni_env->ReleaseStringUTFChars((jstring) response_string_object, str);
-
-        // Release doh_server and host strings
-        jni_env->DeleteLocalRef(doh_server_jstring);
-        jni_env->DeleteLocalRef(host_jstring);
-
-        // Release result string
-        jni_env->DeleteLocalRef(response_string_object);
-
-        if(response_string.empty())
-        {
-            log_error(log_tag.c_str(), "Failed to make request to DoH server. Trying again...");
-        } else {
-            isOK = true;
-            break;
-        }
-    }
-
-    // Detach thread
-    javaVm->DetachCurrentThread();
-
-    if(!isOK)
-    {
-        log_error(log_tag.c_str(), "No request to the DoH servers was successful. Can't process client");
-        return -1;
-    }
-
-    ip = response_string;
-
-    return 0;
-}
-
 int resolve_host_over_dns(const std::string& host, std::string & ip)
 {
     std::string log_tag = "CPP/resolve_host_over_dns";
@@ -133,14 +62,9 @@ int resolve_host(const std::string& host, std::string & ip, bool hostlist_condit
         return 0;
     }
 
-    if(settings.dns.is_use_doh && (settings.hostlist.is_use_hostlist ? (settings.dns.is_use_doh_only_for_site_in_hostlist ? hostlist_condition : true) : true))
-    {
-        return resolve_host_over_doh(host, ip);
-    }
-    else
-    {
-        return resolve_host_over_dns(host, ip);
-    }
+    bool is_use_doh = settings.dns.is_use_doh && (settings.hostlist.is_use_hostlist ? (settings.dns.is_use_doh_only_for_site_in_hostlist ? hostlist_condition : true) : true);
+
+    return resolve_host_cached(host, is_use_doh, ip);
 }
 
 int reverse_resolve_host(std::string & host)
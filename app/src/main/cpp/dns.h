@@ -1,6 +1,7 @@
 #ifndef DPITUNNEL_DNS_H
 #define DPITUNNEL_DNS_H
 
+int resolve_host_over_dns(const std::string& host, std::string & ip);
 int resolve_host(const std::string& host, std::string & ip, bool hostlist_condition);
 int reverse_resolve_host(std::string & host);
 
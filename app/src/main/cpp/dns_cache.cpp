@@ -0,0 +1,99 @@
+#include "dpi-bypass.h"
+#include "bounded_cache.h"
+#include "dns.h"
+#include "dns_cache.h"
+#include "doh.h"
+#include "stats.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+struct DnsCacheEntry
+{
+    std::string ip;
+    // False if lookup failed. Failures are cached too, so broken names aren't queried on every connection
+    bool is_resolved;
+    // Lookup is in progress. Other threads wait for its result instead of sending same query
+    bool is_pending;
+};
+
+// Shards reduce lock contention between workers
+const unsigned int DNS_CACHE_SHARDS_COUNT = 16;
+const size_t MAX_DNS_CACHE_SHARD_SIZE = 256;
+const unsigned int NEGATIVE_TTL = 10;
+
+struct DnsCacheShard
+{
+    std::mutex mutex;
+    std::condition_variable lookup_finished;
+    BoundedCache<DnsCacheEntry> entries{MAX_DNS_CACHE_SHARD_SIZE};
+};
+
+DnsCacheShard dns_cache_shards[DNS_CACHE_SHARDS_COUNT];
+unsigned int dns_cache_min_ttl;
+unsigned int dns_cache_max_ttl;
+
+void init_dns_cache(unsigned int min_ttl, unsigned int max_ttl)
+{
+    dns_cache_min_ttl = min_ttl;
+    dns_cache_max_ttl = max_ttl < min_ttl ? min_ttl : max_ttl;
+}
+
+void deinit_dns_cache()
+{
+    for(DnsCacheShard & shard : dns_cache_shards)
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.entries.clear();
+    }
+}
+
+int resolve_host_cached(const std::string & host, bool is_use_doh, std::string & ip)
+{
+    // Same name can be resolved by different resolvers, so their answers are stored separately
+    std::string key = (is_use_doh ? "doh:" : "dns:") + host;
+    DnsCacheShard & shard = dns_cache_shards[std::hash<std::string>()(key) % DNS_CACHE_SHARDS_COUNT];
+
+    std::unique_lock<std::mutex> lock(shard.mutex);
+
+    // Wait if same name is being resolved now. Waiter is counted once however many wakeups it takes.
+    // Pending entry doesn't expire, but it may be evicted, then this thread resolves name itself
+    DnsCacheEntry *entry = shard.entries.find(key, std::chrono::steady_clock::now());
+    if(entry != NULL && entry->is_pending)
+        stats.dns_cache_coalesced++;
+    while(entry != NULL && entry->is_pending)
+    {
+        shard.lookup_finished.wait(lock);
+        entry = shard.entries.find(key, std::chrono::steady_clock::now());
+    }
+
+    if(entry != NULL)
+    {
+        stats.dns_cache_hits++;
+        if(!entry->is_resolved)
+            return -1;
+        ip = entry->ip;
+        return 0;
+    }
+    stats.dns_cache_misses++;
+
+    shard.entries.insert(key, DnsCacheEntry{"", false, true}, std::chrono::steady_clock::time_point::max());
+    lock.unlock();
+
+    // Resolve without lock, so other names of shard aren't blocked
+    unsigned int ttl = 0;
+    int ret = is_use_doh ? resolve_host_over_doh(host, ip, ttl) : resolve_host_over_dns(host, ip);
+
+    if(ret == 0)
+        ttl = std::max(dns_cache_min_ttl, std::min(ttl, dns_cache_max_ttl));
+    else
+        ttl = NEGATIVE_TTL;
+
+    lock.lock();
+    shard.entries.insert(key, DnsCacheEntry{ip, ret == 0, false}, std::chrono::steady_clock::now() + std::chrono::seconds(ttl));
+    lock.unlock();
+    shard.lookup_finished.notify_all();
+
+    return ret;
+}
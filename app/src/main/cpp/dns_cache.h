@@ -0,0 +1,10 @@
+#ifndef DPITUNNEL_DNS_CACHE_H
+#define DPITUNNEL_DNS_CACHE_H
+
+#include <string>
+
+void init_dns_cache(unsigned int min_ttl, unsigned int max_ttl);
+void deinit_dns_cache();
+int resolve_host_cached(const std::string & host, bool is_use_doh, std::string & ip);
+
+#endif //DPITUNNEL_DNS_CACHE_H
@@ -0,0 +1,405 @@
+#include "dpi-bypass.h"
+#include "doh.h"
+#include "dns.h"
+#include "sni.h"
+#include "socket.h"
+
+#include <algorithm>
+#include <mutex>
+
+struct DohConnection
+{
+    int socket;
+    SSL *context;
+};
+
+struct DohServer
+{
+    std::string host;
+    int port;
+    std::string path;
+    std::mutex mutex;
+    // Established connections not used by any query now
+    std::vector<DohConnection> idle_connections;
+};
+
+// Connect and response timeout
+const struct timeval DOH_TIMEOUT = {0, 700000};
+// Concurrent queries use separate connections. Only this count of them is kept open
+const size_t MAX_IDLE_DOH_CONNECTIONS = 4;
+
+const unsigned char DNS_TYPE_A = 1;
+const unsigned char DNS_CLASS_IN = 1;
+
+std::vector<DohServer *> doh_servers;
+
+int parse_doh_url(const std::string & url, DohServer *server)
+{
+    // Proper process test.com and test.com/dns-query urls
+    std::string address = url;
+    const std::string https_prefix = "https://";
+    if(address.compare(0, https_prefix.size(), https_prefix) == 0)
+        address.erase(0, https_prefix.size());
+
+    size_t path_position = address.find('/');
+    std::string host_port = address.substr(0, path_position);
+    server->path = path_position == std::string::npos ? "" : address.substr(path_position);
+
+    // Remove '/' if it exists on string end
+    if(!server->path.empty() && server->path.back() == '/')
+        server->path.pop_back();
+    const std::string query_path = "dns-query";
+    if(server->path.size() < query_path.size() ||
+            server->path.compare(server->path.size() - query_path.size(), query_path.size(), query_path) != 0)
+        server->path += '/';
+
+    size_t port_position = host_port.find(':');
+    server->host = host_port.substr(0, port_position);
+    server->port = port_position == std::string::npos ? 443 : atoi(host_port.substr(port_position + 1).c_str());
+
+    if(server->host.empty() || server->port <= 0)
+        return -1;
+
+    return 0;
+}
+
+void close_doh_connection(DohConnection & connection)
+{
+    SSL_shutdown(connection.context);
+    close(connection.socket);
+    SSL_CTX_free(connection.context);
+}
+
+int verify_doh_certificate(struct TLSContext *context, struct TLSCertificate **certificate_chain, int len)
+{
+    // Proxied connections skip subject check because of fake SNI, but DoH server is always contacted by its real name
+    int err = verify_certificate(context, certificate_chain, len);
+    if(err)
+        return err;
+
+    if(certificate_chain == NULL || len <= 0 || tls_sni(context) == NULL)
+        return bad_certificate;
+
+    return tls_certificate_valid_subject(certificate_chain[0], tls_sni(context));
+}
+
+int open_doh_connection(DohServer *server, DohConnection & connection)
+{
+    std::string log_tag = "CPP/open_doh_connection";
+
+    // DoH server address is resolved with system resolver
+    std::string server_ip(50, ' ');
+    if(resolve_host_over_dns(server->host, server_ip) == -1)
+        return -1;
+
+    struct sockaddr_in server_address;
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(server->port);
+    if(inet_pton(AF_INET, server_ip.c_str(), &server_address.sin_addr) <= 0)
+    {
+        log_error(log_tag.c_str(), "Invalid DoH server ip address");
+        return -1;
+    }
+
+    if((connection.socket = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    {
+        log_error(log_tag.c_str(), "Can't create DoH server socket");
+        return -1;
+    }
+
+    if(connect_with_timeout(connection.socket, server_address, DOH_TIMEOUT) == -1)
+    {
+        log_error(log_tag.c_str(), "Can't connect to DoH server %s", server->host.c_str());
+        close(connection.socket);
+        return -1;
+    }
+
+    // Handshake is made in blocking mode, so limit it with timeout
+    if(setsockopt(connection.socket, SOL_SOCKET, SO_RCVTIMEO, (char *) &DOH_TIMEOUT, sizeof(DOH_TIMEOUT)) < 0
+    || setsockopt(connection.socket, SOL_SOCKET, SO_SNDTIMEO, (char *) &DOH_TIMEOUT, sizeof(DOH_TIMEOUT)) < 0)
+    {
+        log_error(log_tag.c_str(), "Can't setsockopt on socket");
+        close(connection.socket);
+        return -1;
+    }
+
+    connection.context = init_tls_client(connection.socket, server->host, true, verify_doh_certificate);
+    if(connection.context == NULL)
+    {
+        close(connection.socket);
+        return -1;
+    }
+
+    return 0;
+}
+
+void build_dns_query(const std::string & host, std::string & query)
+{
+    // Header. ID is zero to make requests cache friendly, only recursion desired flag is set
+    query.assign("\x00\x00\x01\x00\x00\x01\x00\x00\x00\x00\x00\x00", 12);
+
+    // Question name as sequence of labels
+    std::istringstream stream(host);
+    std::string label;
+    while(std::getline(stream, label, '.'))
+        if(!label.empty())
+        {
+            query += (char) std::min(label.size(), (size_t) 63);
+            query.append(label, 0, 63);
+        }
+    query += '\0';
+
+    // Question type and class
+    query += '\0';
+    query += (char) DNS_TYPE_A;
+    query += '\0';
+    query += (char) DNS_CLASS_IN;
+}
+
+int skip_dns_name(const std::string & message, size_t & offset)
+{
+    while(offset < message.size())
+    {
+        unsigned char length = message[offset];
+        if((length & 0xC0) == 0xC0) // Compressed name ends with pointer
+        {
+            offset += 2;
+            return offset <= message.size() ? 0 : -1;
+        }
+        offset += length + 1;
+        if(length == 0)
+            return 0;
+    }
+
+    return -1;
+}
+
+int parse_dns_response(const std::string & message, std::string & ip, unsigned int & ttl)
+{
+    std::string log_tag = "CPP/parse_dns_response";
+
+    if(message.size() < 12)
+    {
+        log_error(log_tag.c_str(), "DNS response is too short");
+        return -1;
+    }
+
+    unsigned char rcode = message[3] & 0x0F;
+    if(rcode != 0)
+    {
+        log_error(log_tag.c_str(), "DNS server returned error %d", rcode);
+        return -1;
+    }
+
+    unsigned int questions_count = ((unsigned char) message[4] << 8) | (unsigned char) message[5];
+    unsigned int answers_count = ((unsigned char) message[6] << 8) | (unsigned char) message[7];
+
+    size_t offset = 12;
+    for(unsigned int i = 0; i < questions_count; i++)
+    {
+        // Skip name, type and class
+        if(skip_dns_name(message, offset) == -1)
+            return -1;
+        offset += 4;
+    }
+
+    // Find first A record. Records of CNAME chain are skipped, but their TTL limits TTL of answer
+    ttl = UINT32_MAX;
+    for(unsigned int i = 0; i < answers_count; i++)
+    {
+        if(skip_dns_name(message, offset) == -1 || offset + 10 > message.size())
+            return -1;
+
+        const unsigned char *record = (const unsigned char *) message.c_str() + offset;
+        unsigned int type = (record[0] << 8) | record[1];
+        unsigned int record_class = (record[2] << 8) | record[3];
+        unsigned int record_ttl = (record[4] << 24) | (record[5] << 16) | (record[6] << 8) | record[7];
+        unsigned int data_length = (record[8] << 8) | record[9];
+        offset += 10;
+        if(offset + data_length > message.size())
+            return -1;
+
+        ttl = std::min(ttl, record_ttl);
+        if(type == DNS_TYPE_A && record_class == DNS_CLASS_IN && data_length == 4)
+        {
+            char address[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, message.c_str() + offset, address, sizeof(address));
+            ip = address;
+            return 0;
+        }
+
+        offset += data_length;
+    }
+
+    log_error(log_tag.c_str(), "DNS response doesn't contain address");
+    return -1;
+}
+
+int exchange_doh_message(DohServer *server, DohConnection & connection, const std::string & query, std::string & response, bool & is_keep_alive)
+{
+    std::string log_tag = "CPP/exchange_doh_message";
+
+    std::string request = "POST " + server->path + " HTTP/1.1\r\n"
+                          "Host: " + server->host + "\r\n"
+                          "Content-Type: application/dns-message\r\n"
+                          "Accept: application/dns-message\r\n"
+                          "Content-Length: " + std::to_string(query.size()) + "\r\n\r\n" + query;
+    if(send_string_tls(connection.socket, connection.context, request, request.size()) == -1)
+        return -1;
+
+    // Read until headers and whole body are received
+    std::string buffer(1024, ' ');
+    std::string message;
+    size_t headers_end = std::string::npos;
+    size_t content_length = 0;
+    while(headers_end == std::string::npos || message.size() < headers_end + content_length)
+    {
+        unsigned int last_char;
+        if(recv_string_tls(connection.socket, connection.context, buffer, DOH_TIMEOUT, last_char) == -1)
+            return -1;
+        message.append(buffer, 0, last_char);
+
+        if(headers_end != std::string::npos)
+            continue;
+
+        size_t headers_size = message.find("\r\n\r\n");
+        if(headers_size == std::string::npos)
+            continue;
+        headers_end = headers_size + 4;
+
+        std::string headers = message.substr(0, headers_end);
+        std::transform(headers.begin(), headers.end(), headers.begin(), ::tolower);
+
+        // Status line looks like "HTTP/1.1 200 OK"
+        if(headers.size() < 13 || headers.compare(0, 7, "http/1.") != 0 ||
+                (headers.compare(8, 5, " 200 ") != 0 && headers.compare(8, 6, " 200\r\n") != 0))
+        {
+            log_error(log_tag.c_str(), "DoH server returned error: %s", headers.substr(0, headers.find('\r')).c_str());
+            return -1;
+        }
+
+        size_t length_position = headers.find("\r\ncontent-length:");
+        if(length_position == std::string::npos)
+        {
+            log_error(log_tag.c_str(), "DoH response without Content-Length is not supported");
+            return -1;
+        }
+        content_length = atoi(headers.c_str() + length_position + 17);
+        is_keep_alive = headers.find("\r\nconnection: close") == std::string::npos;
+    }
+
+    response = message.substr(headers_end, content_length);
+
+    return 0;
+}
+
+bool take_idle_connection(DohServer *server, DohConnection & connection)
+{
+    std::lock_guard<std::mutex> lock(server->mutex);
+    if(server->idle_connections.empty())
+        return false;
+
+    connection = server->idle_connections.back();
+    server->idle_connections.pop_back();
+
+    return true;
+}
+
+void put_idle_connection(DohServer *server, DohConnection & connection)
+{
+    {
+        std::lock_guard<std::mutex> lock(server->mutex);
+        if(server->idle_connections.size() < MAX_IDLE_DOH_CONNECTIONS)
+        {
+            server->idle_connections.push_back(connection);
+            return;
+        }
+    }
+
+    close_doh_connection(connection);
+}
+
+int query_doh_server(DohServer *server, const std::string & query, std::string & response)
+{
+    DohConnection connection;
+    bool is_reused = take_idle_connection(server, connection);
+
+    while(true)
+    {
+        if(!is_reused && open_doh_connection(server, connection) == -1)
+            return -1;
+
+        bool is_keep_alive = false;
+        if(exchange_doh_message(server, connection, query, response, is_keep_alive) == 0)
+        {
+            if(is_keep_alive)
+                put_idle_connection(server, connection);
+            else
+                close_doh_connection(connection);
+            return 0;
+        }
+        close_doh_connection(connection);
+
+        // Idle connection could be closed by server, so try again with new one
+        if(!is_reused)
+            return -1;
+        is_reused = false;
+    }
+}
+
+int resolve_host_over_doh(const std::string & host, std::string & ip, unsigned int & ttl)
+{
+    std::string log_tag = "CPP/resolve_host_over_doh";
+
+    std::string query;
+    build_dns_query(host, query);
+
+    // Since we have some doh servers, we need to use they by turns
+    for(DohServer *server : doh_servers)
+    {
+        std::string response;
+        if(query_doh_server(server, query, response) == 0 && parse_dns_response(response, ip, ttl) == 0)
+            return 0;
+
+        log_error(log_tag.c_str(), "Failed to make request to DoH server. Trying again...");
+    }
+
+    log_error(log_tag.c_str(), "No request to the DoH servers was successful. Can't process client");
+    return -1;
+}
+
+int init_doh(const std::string & doh_servers_list)
+{
+    std::string log_tag = "CPP/init_doh";
+
+    char delimiter = '\n';
+    std::string doh_server;
+    std::istringstream stream(doh_servers_list);
+    while(std::getline(stream, doh_server, delimiter))
+    {
+        if(doh_server.empty())
+            continue;
+
+        DohServer *server = new DohServer();
+        if(parse_doh_url(doh_server, server) == -1)
+        {
+            log_error(log_tag.c_str(), "Failed to parse DoH server url: %s", doh_server.c_str());
+            delete server;
+            continue;
+        }
+        doh_servers.push_back(server);
+    }
+
+    return 0;
+}
+
+void deinit_doh()
+{
+    for(DohServer *server : doh_servers)
+    {
+        for(DohConnection & connection : server->idle_connections)
+            close_doh_connection(connection);
+        delete server;
+    }
+    doh_servers.clear();
+}
@@ -0,0 +1,10 @@
+#ifndef DPITUNNEL_DOH_H
+#define DPITUNNEL_DOH_H
+
+#include <string>
+
+int init_doh(const std::string & doh_servers_list);
+void deinit_doh();
+int resolve_host_over_doh(const std::string & host, std::string & ip, unsigned int & ttl);
+
+#endif //DPITUNNEL_DOH_H
@@ -1,22 +1,31 @@
 #include "dpi-bypass.h"
+#include "buffer_pool.h"
+#include "cert_cache.h"
+#include "chain_cache.h"
 #include "dns.h"
+#include "dns_cache.h"
+#include "doh.h"
 #include "hostlist.h"
 #include "packet.h"
+#include "reactor.h"
+#include "session_cache.h"
 #include "socket.h"
 #include "sni.h"
+#include "sni_cert_gen.h"
+#include "stats.h"
+#include "workers.h"
 
 Settings settings;
 JavaVM* javaVm;
 
 const std::string CONNECTION_ESTABLISHED_RESPONSE("HTTP/1.1 200 Connection established\r\n\r\n");
 const std::string SNI_REPLACE_VARIABLE("${SNI}");
-std::vector<std::thread> threads;
 bool stop_flag;
 int server_socket;
 int interrupt_pipe[2];
+extern int connection_released_fd;
 
 jclass localdnsserver_class;
-jclass utils_class;
 
 void replaceAll(std::string &s, const std::string &search, const std::string &replace )
 {
@@ -31,7 +40,7 @@ void replaceAll(std::string &s, const std::string &search, const std::string &re
     }
 }
 
-void proxy_https(int client_socket, std::string host, int port)
+int proxy_https(int client_socket, std::string host, int port)
 {
 	std::string log_tag = "CPP/proxy_https";
 
@@ -56,20 +65,7 @@ void proxy_https(int client_socket, std::string host, int port)
 	SSL *client_context;
 	if(init_remote_server_socket(remote_server_socket, host, port, true, hostlist_condition, client_context) == -1)
 	{
-		return;
-	}
-
-	// Split only first https packet, what contains unencrypted sni
-	bool is_clienthello_request = true;
-
-	// Set proper timeout
-	struct timeval structtimeval;
-	structtimeval.tv_sec = 0;
-	structtimeval.tv_usec = 0;
-	if(setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, (char *) &structtimeval, sizeof(structtimeval)) < 0)
-	{
-		log_error(log_tag.c_str(), "Can't setsockopt on socket");
-		return;
+		return -1;
 	}
 
 	// Disable TCP Nagle's algorithm
@@ -78,11 +74,11 @@ void proxy_https(int client_socket, std::string host, int port)
     || setsockopt(remote_server_socket, IPPROTO_TCP, TCP_NODELAY, (char *) &yes, sizeof(yes)) < 0)
     {
         log_error(log_tag.c_str(), "Can't setsockopt on socket");
-        return;
+        return -1;
     }
 
 	// Init tlse if SNI replace enabled
-	struct TLSContext *server_server_context;
+	std::shared_ptr<SSL> server_server_context;
 	struct TLSContext *server_client_context;
 	if(settings.sni.is_use_sni_replace && hostlist_condition && !settings.https.is_use_https_proxy)
 	{
@@ -91,19 +87,18 @@ void proxy_https(int client_socket, std::string host, int port)
         server_server_context = init_tls_server_server(hosts_str, hosts_arr);
         if(server_server_context == NULL)
         {
-            SSL_CTX_free(server_server_context);
             close(client_socket);
             close(remote_server_socket);
-            return;
+            return -1;
         }
-		server_client_context = init_tls_server_client(client_socket, server_server_context);
+		server_client_context = init_tls_server_client(client_socket, server_server_context.get());
 		if(server_client_context == NULL){
             SSL_shutdown(server_client_context);
             shutdown(client_socket, SHUT_RDWR);
             close(client_socket);
             SSL_free(server_client_context);
             close(remote_server_socket);
-			return;
+			return -1;
 		}
 
 		// Insert original host address if need
@@ -117,171 +112,42 @@ void proxy_https(int client_socket, std::string host, int port)
             close(remote_server_socket);
             SSL_CTX_free(client_context);
 
-			SSL_CTX_free(server_server_context);
             SSL_shutdown(server_client_context);
             shutdown(client_socket, SHUT_RDWR);
             close(client_socket);
             SSL_free(server_client_context);
-            return;
+            return -1;
         }
 	}
 
-    struct pollfd fds[3];
-
-	// fds[0] is client socket
-	fds[0].fd = client_socket;
-	fds[0].events = POLLIN;
-
-	// fds[1] is remote server socket
-	fds[1].fd = remote_server_socket;
-	fds[1].events = POLLIN;
-
-	// fds[2] is interrupt pipe
-	fds[2].fd = interrupt_pipe[0];
-	fds[2].events = POLLIN;
-
-	// Set poll() timeout
-	int timeout = 10000;
-
-	std::string buffer(1024, ' ');
-
-	bool is_first_time = true;
-
-	// last_char indicates position of string end
-	unsigned int last_char;
-
-	while (!stop_flag)
-	{
-		int ret = poll(fds, 3, timeout);
-
-		// Check state
-		if ( ret == -1 )
-		{
-			log_error(log_tag.c_str(), "Poll error. Errno: %s", std::strerror(errno));
-			break;
-		}
-		else if ( ret == 0 ) // Just timeout
-			continue;
-		else
-		{
-			if(fds[0].revents & POLLERR || fds[1].revents & POLLERR ||
-			   fds[0].revents & POLLHUP || fds[1].revents & POLLHUP ||
-			   fds[0].revents & POLLNVAL || fds[1].revents & POLLNVAL)
-				break;
-
-			// Process client socket
-			if (fds[0].revents & POLLIN)
-			{
-				fds[0].revents = 0;
-
-				// Transfer data
-				if(hostlist_condition && settings.https.is_use_https_proxy)
-				{
-					if(recv_string(client_socket, buffer, last_char) == -1) // Receive request from client
-						break;
-
-					if (send_string_tls(remote_server_socket, client_context, buffer, last_char) ==
-						-1) // Send request to server
-						break;
-				}
-				else if(settings.sni.is_use_sni_replace && hostlist_condition)
-				{
-				    if (recv_string_tls(client_socket, server_client_context, buffer, last_char) ==
-				        -1) // Receive request from client
-				        break;
-
-
-					if (send_string_tls(remote_server_socket, client_context, buffer, last_char) ==
-						-1) // Send request to server
-						break;
-				}
-				else
-				{
-					if(recv_string(client_socket, buffer, last_char) == -1) // Receive request from client
-						break;
-
-					// Check if split is need
-					if(hostlist_condition && settings.https.is_use_split && is_clienthello_request)
-					{
-						if(send_string(remote_server_socket, buffer, settings.https.split_position, last_char) == -1) // Send request to server
-							break;
-						// VPN mode specific
-						// VPN mode requires splitting for all packets
-						is_clienthello_request = settings.other.is_use_vpn;
-					}
-					else
-						if(send_string(remote_server_socket, buffer, last_char) == -1) // Send request to server
-							break;
-				}
-			}
-
-			// Process server socket
-			if (fds[1].revents & POLLIN)
-			{
-				fds[1].revents = 0;
-
-				// Transfer data
-				if(hostlist_condition && settings.https.is_use_https_proxy)
-				{
-					if (recv_string_tls(remote_server_socket, client_context, buffer, last_char) ==
-						-1) // Receive response from server
-						break;
-
-					if(send_string(client_socket, buffer, last_char) == -1) // Send response to client
-						break;
-				}
-				else if(settings.sni.is_use_sni_replace && hostlist_condition)
-				{
-					if (recv_string_tls(remote_server_socket, client_context, buffer, last_char) ==
-						-1) // Receive response from server
-						break;
-					if (send_string_tls(client_socket, server_client_context, buffer, last_char) ==
-						-1)  // Send response to client
-						break;
-				}
-				else
-				{
-					if(recv_string(remote_server_socket, buffer, last_char) == -1) // Receive response from server
-						break;
-					if(send_string(client_socket, buffer, last_char) == -1) // Send response to client
-						break;
-				}
-			}
-
-			fds[0].revents = 0;
-			fds[1].revents = 0;
-			fds[2].revents = 0;
-		}
-	}
-
-	if(settings.https.is_use_https_proxy && hostlist_condition)
-    {
-        SSL_shutdown(client_context);
-        close(remote_server_socket);
-        SSL_CTX_free(client_context);
-
-        close(client_socket);
-    }
+	// Pass connection to reactor. It will transfer data until one of sides closes connection
+	Connection *connection = create_connection(client_socket, remote_server_socket);
+	connection->hostlist_condition = hostlist_condition;
+	if(hostlist_condition && settings.https.is_use_https_proxy)
+		connection->remote_server.tls_context = client_context;
 	else if(settings.sni.is_use_sni_replace && hostlist_condition)
 	{
-		SSL_shutdown(client_context);
-		close(remote_server_socket);
-		SSL_CTX_free(client_context);
-
-		SSL_CTX_free(server_server_context);
-		SSL_shutdown(server_client_context);
-		shutdown(client_socket, SHUT_RDWR);
-		close(client_socket);
-		SSL_free(server_client_context);
+		connection->client.tls_context = server_client_context;
+		connection->remote_server.tls_context = client_context;
+		connection->server_server_context = server_server_context;
 	}
 	else
 	{
-		close(remote_server_socket);
-		close(client_socket);
+		// Split only first https packet, what contains unencrypted sni
+		// VPN mode requires splitting for all packets
+		connection->is_split_needed = hostlist_condition && settings.https.is_use_split;
+		connection->is_split_always = settings.other.is_use_vpn;
+		connection->split_position = settings.https.split_position;
+		// Data is neither decrypted nor modified, so kernel can move it between sockets
+		connection->is_splice_allowed = true;
 	}
+
+	add_connection(connection);
+
+	return 0;
 }
 
-void proxy_http(int client_socket, std::string host, int port, std::string first_request)
+int proxy_http(int client_socket, std::string host, int port, std::string & first_request)
 {
 	std::string log_tag = "CPP/proxy_http";
 
@@ -294,7 +160,7 @@ void proxy_http(int client_socket, std::string host, int port, std::string first
 	SSL *client_context;
 	if(init_remote_server_socket(remote_server_socket, host, port, false, hostlist_condition, client_context) == -1)
 	{
-		return;
+		return -1;
 	}
 
 	// Disable TCP Nagle's algorithm
@@ -303,7 +169,7 @@ void proxy_http(int client_socket, std::string host, int port, std::string first
 	   || setsockopt(remote_server_socket, IPPROTO_TCP, TCP_NODELAY, (char *) &yes, sizeof(yes)) < 0)
 	{
 		log_error(log_tag.c_str(), "Can't setsockopt on socket");
-		return;
+		return -1;
 	}
 
 	// Modify http request to bypass dpi
@@ -323,7 +189,7 @@ void proxy_http(int client_socket, std::string host, int port, std::string first
 			{
 				close(remote_server_socket);
 				close(client_socket);
-				return;
+				return -1;
 			}
 		}
 		else
@@ -332,120 +198,32 @@ void proxy_http(int client_socket, std::string host, int port, std::string first
 			{
 				close(remote_server_socket);
 				close(client_socket);
-				return;
+				return -1;
 			}
 		}
 	}
 
-	struct pollfd fds[3];
-
-	// fds[0] is client socket
-	fds[0].fd = client_socket;
-	fds[0].events = POLLIN;
-
-	// fds[1] is remote server socket
-	fds[1].fd = remote_server_socket;
-	fds[1].events = POLLIN;
-
-	// fds[2] is interrupt pipe
-	fds[2].fd = interrupt_pipe[0];
-	fds[2].events = POLLIN;
-
-	// Set poll() timeout
-	int timeout = 10000;
-
-	std::string buffer(1024, ' ');
-
-	while (!stop_flag)
+	// Pass connection to reactor. It will transfer data until one of sides closes connection
+	Connection *connection = create_connection(client_socket, remote_server_socket);
+	connection->hostlist_condition = hostlist_condition;
+	connection->is_http = true;
+	if(hostlist_condition && settings.http.is_use_https_proxy)
+		connection->remote_server.tls_context = client_context;
+	else
 	{
-		int ret = poll(fds, 3, timeout);
-
-		// Check state
-		if ( ret == -1 )
-		{
-			log_error(log_tag.c_str(), "Poll error. Errno: %s", std::strerror(errno));
-			break;
-		}
-		else if ( ret == 0 ) // Just timeout
-			continue;
-		else
-		{
-			if(fds[0].revents & POLLERR || fds[1].revents & POLLERR ||
-				fds[0].revents & POLLHUP || fds[1].revents & POLLHUP ||
-				fds[0].revents & POLLNVAL || fds[1].revents & POLLNVAL)
-				break;
-
-			// Process client socket
-			if (fds[0].revents & POLLIN)
-			{
-				fds[0].revents = 0;
-
-				// Transfer data
-				if(recv_string(client_socket, buffer, last_char) == -1) // Receive request from client
-					break;
-				// Modify http request to bypass dpi
-				modify_http_request(buffer, hostlist_condition);
-
-				if(hostlist_condition && settings.http.is_use_https_proxy)
-				{
-					if(send_string_tls(remote_server_socket, client_context, buffer, last_char) == -1)
-						break;
-				}
-				else
-				{
-					// Check if split is need
-					if(hostlist_condition && settings.http.is_use_split)
-					{
-						if(send_string(remote_server_socket, buffer, settings.http.split_position, last_char) == -1) // Send request to serv$
-							break;
-					}
-					else
-					if(send_string(remote_server_socket, buffer, last_char) == -1) // Send request to server
-						break;
-				}
-			}
-
-			// Process server socket
-			if (fds[1].revents & POLLIN)
-			{
-				fds[1].revents = 0;
-
-				// Transfer data
-				if(hostlist_condition && settings.http.is_use_https_proxy)
-					recv_string_tls(remote_server_socket, client_context, buffer, last_char);
-				else if(recv_string(remote_server_socket, buffer, last_char) == -1) // Receive response from server
-					break;
-
-				if(send_string(client_socket, buffer, last_char) == -1) // Send response to client
-					break;
-			}
-
-			fds[0].revents = 0;
-			fds[1].revents = 0;
-			fds[2].revents = 0;
-		}
+		connection->is_split_needed = hostlist_condition && settings.http.is_use_split;
+		connection->is_split_always = true;
+		connection->split_position = settings.http.split_position;
 	}
 
-    if(settings.https.is_use_https_proxy && hostlist_condition)
-    {
-        SSL_shutdown(client_context);
-        close(remote_server_socket);
-        SSL_CTX_free(client_context);
+	add_connection(connection);
 
-        close(client_socket);
-    }
-    else
-    {
-        close(remote_server_socket);
-        close(client_socket);
-    }
+	return 0;
 }
 
-void process_client(int client_socket)
+int process_request(int client_socket, std::string & request)
 {
-    std::string log_tag = "CPP/process_client";
-
-	std::string request(1024, ' ');
+    std::string log_tag = "CPP/process_request";
 
 	// Receive with timeout
     struct timeval timeout;
@@ -458,7 +236,7 @@ void process_client(int client_socket)
 	if(recv_string(client_socket, request, timeout, last_char) == -1)
 	{
 		close(client_socket);
-		return;
+		return -1;
 	}
 
 	request.resize(last_char);
@@ -470,7 +248,7 @@ void process_client(int client_socket)
 	{
 		log_error(log_tag.c_str(), "Can't parse first http request, so can't process client");
 		close(client_socket);
-		return;
+		return -1;
 	}
 
 	if(method == "CONNECT")
@@ -478,17 +256,27 @@ void process_client(int client_socket)
 		if(send_string(client_socket, CONNECTION_ESTABLISHED_RESPONSE, CONNECTION_ESTABLISHED_RESPONSE.size()) == -1)
 		{
 			close(client_socket);
-			return;
+			return -1;
 		}
 
-		proxy_https(client_socket, host, port);
+		return proxy_https(client_socket, host, port);
 	}
 	else
 	{
-		proxy_http(client_socket, host, port, request);
+		return proxy_http(client_socket, host, port, request);
 	}
 }
 
+int process_client(int client_socket)
+{
+	// First request is read to pooled buffer, it is returned when connection is set up
+	std::string *request = acquire_buffer(BUFFER_SIZE_SMALL);
+	int ret = process_request(client_socket, *request);
+	release_buffer(request);
+
+	return ret;
+}
+
 extern "C" JNIEXPORT jint JNICALL Java_ru_evgeniy_dpitunnel_service_NativeService_init(JNIEnv* env, jobject obj, jobject prefs_object, jstring app_files_path)
 {
     std::string log_tag = "CPP/init";
@@ -497,8 +285,8 @@ extern "C" JNIEXPORT jint JNICALL Java_ru_evgeniy_dpitunnel_service_NativeServic
     env->GetJavaVM(&javaVm);
 
     // Reset resources
-    threads.clear();
     stop_flag = false;
+    reset_stats();
 
 	jclass temp;
 
@@ -513,17 +301,6 @@ extern "C" JNIEXPORT jint JNICALL Java_ru_evgeniy_dpitunnel_service_NativeServic
 	localdnsserver_class = (jclass) env->NewGlobalRef(temp);
 	env->DeleteLocalRef(temp);
 
-	// Find Utils class
-	temp = env->FindClass("ru/evgeniy/dpitunnel/util/Utils");
-	if(temp == NULL)
-	{
-		log_error(log_tag.c_str(), "Failed to find Utils class");
-		return -1;
-	}
-	// Store globally
-	utils_class = (jclass) env->NewGlobalRef(temp);
-	env->DeleteLocalRef(temp);
-
     // Find SharedPreferences
     jclass prefs_class = env->FindClass("android/content/SharedPreferences");
     if(prefs_class == NULL)
@@ -552,6 +329,7 @@ extern "C" JNIEXPORT jint JNICALL Java_ru_evgeniy_dpitunnel_service_NativeServic
     const char * str;
     jobject string_object;
     jobject string_object1;
+    jobject string_object2;
 
     // HTTPS options
     string_object1 = env->NewStringUTF("https_split");
@@ -588,6 +366,23 @@ extern "C" JNIEXPORT jint JNICALL Java_ru_evgeniy_dpitunnel_service_NativeServic
     env->DeleteLocalRef(string_object1);
     env->DeleteLocalRef(string_object);
 
+    string_object1 = env->NewStringUTF("sni_cert_cache_entries");
+    string_object2 = env->NewStringUTF("512");
+    string_object = env->CallObjectMethod(prefs_object, prefs_getString, (jstring) string_object1, (jstring) string_object2);
+    settings.sni.cert_cache_entries = (size_t) atoi((const char *) env->GetStringUTFChars((jstring) string_object, 0));
+    env->DeleteLocalRef(string_object1);
+    env->DeleteLocalRef(string_object2);
+    env->DeleteLocalRef(string_object);
+
+    // Size is set in kilobytes
+    string_object1 = env->NewStringUTF("sni_cert_cache_size");
+    string_object2 = env->NewStringUTF("4096");
+    string_object = env->CallObjectMethod(prefs_object, prefs_getString, (jstring) string_object1, (jstring) string_object2);
+    settings.sni.cert_cache_size = (size_t) atoi((const char *) env->GetStringUTFChars((jstring) string_object, 0)) * 1024;
+    env->DeleteLocalRef(string_object1);
+    env->DeleteLocalRef(string_object2);
+    env->DeleteLocalRef(string_object);
+
     // HTTP options
     string_object1 = env->NewStringUTF("http_split");
     settings.http.is_use_split = env->CallBooleanMethod(prefs_object, prefs_getBool, (jstring) string_object1, false);
@@ -662,6 +457,22 @@ extern "C" JNIEXPORT jint JNICALL Java_ru_evgeniy_dpitunnel_service_NativeServic
     env->DeleteLocalRef(string_object1);
     env->DeleteLocalRef(string_object);
 
+    string_object1 = env->NewStringUTF("dns_cache_min_ttl");
+    string_object2 = env->NewStringUTF("60");
+    string_object = env->CallObjectMethod(prefs_object, prefs_getString, (jstring) string_object1, (jstring) string_object2);
+    settings.dns.cache_min_ttl = (unsigned int) atoi((const char *) env->GetStringUTFChars((jstring) string_object, 0));
+    env->DeleteLocalRef(string_object1);
+    env->DeleteLocalRef(string_object2);
+    env->DeleteLocalRef(string_object);
+
+    string_object1 = env->NewStringUTF("dns_cache_max_ttl");
+    string_object2 = env->NewStringUTF("3600");
+    string_object = env->CallObjectMethod(prefs_object, prefs_getString, (jstring) string_object1, (jstring) string_object2);
+    settings.dns.cache_max_ttl = (unsigned int) atoi((const char *) env->GetStringUTFChars((jstring) string_object, 0));
+    env->DeleteLocalRef(string_object1);
+    env->DeleteLocalRef(string_object2);
+    env->DeleteLocalRef(string_object);
+
     // Hostlist options
     string_object1 = env->NewStringUTF("hostlist_enable");
     settings.hostlist.is_use_hostlist = env->CallBooleanMethod(prefs_object, prefs_getBool, (jstring) string_object1, false);
@@ -716,6 +527,31 @@ extern "C" JNIEXPORT jint JNICALL Java_ru_evgeniy_dpitunnel_service_NativeServic
     env->DeleteLocalRef(string_object1);
     env->DeleteLocalRef(string_object);
 
+    // Settings added in new versions may be absent in old preferences, so pass default value
+    string_object1 = env->NewStringUTF("other_reactors");
+    string_object2 = env->NewStringUTF("0");
+    string_object = env->CallObjectMethod(prefs_object, prefs_getString, (jstring) string_object1, (jstring) string_object2);
+    settings.other.reactors_count = (unsigned int) atoi((const char *) env->GetStringUTFChars((jstring) string_object, 0));
+    env->DeleteLocalRef(string_object1);
+    env->DeleteLocalRef(string_object2);
+    env->DeleteLocalRef(string_object);
+
+    string_object1 = env->NewStringUTF("other_workers");
+    string_object2 = env->NewStringUTF("16");
+    string_object = env->CallObjectMethod(prefs_object, prefs_getString, (jstring) string_object1, (jstring) string_object2);
+    settings.other.workers_count = (unsigned int) atoi((const char *) env->GetStringUTFChars((jstring) string_object, 0));
+    env->DeleteLocalRef(string_object1);
+    env->DeleteLocalRef(string_object2);
+    env->DeleteLocalRef(string_object);
+
+    string_object1 = env->NewStringUTF("other_max_connections");
+    string_object2 = env->NewStringUTF("512");
+    string_object = env->CallObjectMethod(prefs_object, prefs_getString, (jstring) string_object1, (jstring) string_object2);
+    settings.other.max_connections = (unsigned int) atoi((const char *) env->GetStringUTFChars((jstring) string_object, 0));
+    env->DeleteLocalRef(string_object1);
+    env->DeleteLocalRef(string_object2);
+    env->DeleteLocalRef(string_object);
+
     string_object1 = env->NewStringUTF("other_vpn_setting");
     settings.other.is_use_vpn = env->CallBooleanMethod(prefs_object, prefs_getBool, (jstring) string_object1, false);
     env->DeleteLocalRef(string_object1);
@@ -760,7 +596,7 @@ extern "C" JNIEXPORT jint JNICALL Java_ru_evgeniy_dpitunnel_service_NativeServic
 	}
 
 	// Listen to socket
-	if(listen(server_socket, 10) < 0)
+	if(listen(server_socket, SOMAXCONN) < 0)
 	{
 		log_error(log_tag.c_str(), "Can't listen to server socket");
 		return -1;
@@ -768,6 +604,33 @@ extern "C" JNIEXPORT jint JNICALL Java_ru_evgeniy_dpitunnel_service_NativeServic
 
 	// Init interrupt pipe
 	pipe(interrupt_pipe);
+
+	// Parse root CA certificates once. They are used to verify remote servers and DoH servers
+	init_root_store();
+
+	// Parse DoH servers. Connections to them are opened on first lookup and kept alive
+	init_doh(settings.dns.dns_doh_servers);
+	init_dns_cache(settings.dns.cache_min_ttl, settings.dns.cache_max_ttl);
+
+	// Pre-generate keys for MITM certificates
+	if(settings.sni.is_use_sni_replace)
+	{
+		init_cert_cache(settings.sni.cert_cache_entries, settings.sni.cert_cache_size);
+		init_cert_gen();
+	}
+
+	// Start workers. They will set up accepted connections
+	if(init_workers(settings.other.workers_count, settings.other.max_connections, process_client) == -1)
+	{
+		return -1;
+	}
+
+	// Start reactors. They will process established connections
+	if(init_reactors(settings.other.reactors_count) == -1)
+	{
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -775,7 +638,7 @@ extern "C" JNIEXPORT void Java_ru_evgeniy_dpitunnel_service_NativeService_accept
 {
     std::string log_tag = "CPP/acceptClientCycle";
 
-	struct pollfd fds[2];
+	struct pollfd fds[3];
 
 	// fds[0] is server socket
 	fds[0].fd = server_socket;
@@ -785,12 +648,19 @@ extern "C" JNIEXPORT void Java_ru_evgeniy_dpitunnel_service_NativeService_accept
 	fds[1].fd = interrupt_pipe[0];
 	fds[1].events = POLLIN;
 
+	// fds[2] signals what some connection was closed
+	fds[2].fd = connection_released_fd;
+	fds[2].events = POLLIN;
+
 	// Set poll() timeout
 	int timeout = 10000;
 
     while(!stop_flag)
     {
-		int ret = poll(fds, 2, timeout);
+		// Don't accept new clients while connections limit is reached. They will wait in listen backlog
+		fds[0].events = is_connections_limit_reached() ? 0 : POLLIN;
+
+		int ret = poll(fds, 3, timeout);
 
 		// Check state
 		if ( ret == -1 )
@@ -807,6 +677,13 @@ extern "C" JNIEXPORT void Java_ru_evgeniy_dpitunnel_service_NativeService_accept
 			   fds[0].revents & POLLNVAL)
 				break;
 
+			// Reset released connection event
+			if (fds[2].revents & POLLIN)
+			{
+				uint64_t value;
+				read(connection_released_fd, &value, sizeof(value));
+			}
+
 			//Accept client
 			if (fds[0].revents & POLLIN)
 			{
@@ -819,13 +696,13 @@ extern "C" JNIEXPORT void Java_ru_evgeniy_dpitunnel_service_NativeService_accept
 					return;
 				}
 
-				// Create new thread
-				std::thread t1(process_client, client_socket);
-				threads.push_back(std::move(t1));
+				// Pass client to workers
+				add_client(client_socket);
 			}
 
 			fds[0].revents = 0;
 			fds[1].revents = 0;
+			fds[2].revents = 0;
 		}
     }
 }
@@ -839,10 +716,22 @@ extern "C" JNIEXPORT void Java_ru_evgeniy_dpitunnel_service_NativeService_deInit
     // Interrupt poll() by closing pipe
     close(interrupt_pipe[0]);
     close(interrupt_pipe[1]);
-	// Wait for all threads
-	for(auto& t1 : threads)
-		if(t1.joinable())
-			t1.join();
+	// Wait for workers
+	deinit_workers();
+	// Stop reactors and close all connections
+	deinit_reactors();
+	// Close DoH connections and forget resolved names
+	deinit_doh();
+	deinit_dns_cache();
+	deinit_cert_cache();
+	deinit_cert_gen();
+	deinit_chain_cache();
+	deinit_session_cache();
+	deinit_root_store();
+	// Report collected statistics
+	log_stats();
+	// Free cached buffers
+	deinit_buffer_pool();
 
     // Shutdown server socket
     if(shutdown(server_socket, SHUT_RDWR) == -1)
@@ -7,7 +7,6 @@
 #include <thread>
 #include <string>
 #include <cstring>
-#include <regex>
 #include <fstream>
 #include <sstream>
 
@@ -44,6 +43,8 @@ struct Settings
     {
         bool is_use_sni_replace;
         std::string sni_spell;
+        size_t cert_cache_entries;
+        size_t cert_cache_size;
     } sni;
 
     struct
@@ -68,6 +69,8 @@ struct Settings
         bool is_use_doh;
         bool is_use_doh_only_for_site_in_hostlist;
         std::string dns_doh_servers;
+        unsigned int cache_min_ttl;
+        unsigned int cache_max_ttl;
     } dns;
 
     struct
@@ -84,6 +87,9 @@ struct Settings
         std::string https_proxy_server;
         std::string proxy_credentials;
         int bind_port;
+        unsigned int reactors_count;
+        unsigned int workers_count;
+        unsigned int max_connections;
         bool is_use_vpn;
     } other;
 
@@ -3,35 +3,116 @@
 #include "fileIO.h"
 #include "dns.h"
 
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
 extern struct Settings settings;
 
-std::vector<std::string> hostlist_vector;
+struct HostlistNode
+{
+    // Child domains by their leftmost label
+    std::unordered_map<std::string, unsigned int> children;
+    // This domain and all its subdomains are in hostlist
+    bool is_wildcard;
+};
 
-bool find_in_hostlist(const std::string & host) // string_host used to store domain of remote server, because host can contain IP in VPN mode
+// Plain entries like example.com match only this host, as before wildcards were supported.
+// Entries like *.example.com match example.com itself and all its subdomains
+std::unordered_set<std::string> hostlist_hosts;
+// Wildcard entries stored by labels in reversed order. First node is root
+std::vector<HostlistNode> hostlist_trie;
+
+void normalize_host(std::string & host)
 {
-    std::string log_tag = "CPP/find_in_hostlist";
+    // Hostlist files can have Windows newlines and trailing dot in names
+    while(!host.empty() && (isspace(host.back()) || host.back() == '.'))
+        host.pop_back();
+    std::transform(host.begin(), host.end(), host.begin(), ::tolower);
+}
+
+void add_to_hostlist(std::string host)
+{
+    normalize_host(host);
+    if(host.empty())
+        return;
+
+    if(host.compare(0, 2, "*.") != 0)
+    {
+        hostlist_hosts.insert(host);
+        return;
+    }
+
+    // Walk labels from top level domain, creating missing nodes
+    unsigned int node = 0;
+    size_t label_end = host.size();
+    while(label_end > 2)
+    {
+        size_t label_start = host.rfind('.', label_end - 1) + 1;
+        std::string label = host.substr(label_start, label_end - label_start);
 
-    for(const std::string& host_in_vector : hostlist_vector)
-        if(host_in_vector == host)
+        auto child = hostlist_trie[node].children.find(label);
+        if(child == hostlist_trie[node].children.end())
         {
-            log_debug(log_tag.c_str(), "Found host in hostlist. %s, %s", host_in_vector.c_str(), host.c_str());
-            return true;
+            hostlist_trie.push_back(HostlistNode());
+            hostlist_trie.back().is_wildcard = false;
+            hostlist_trie[node].children[label] = hostlist_trie.size() - 1;
+            node = hostlist_trie.size() - 1;
         }
+        else
+            node = child->second;
 
-    return false;
+        label_end = label_start - 1;
+    }
+    hostlist_trie[node].is_wildcard = true;
 }
 
-bool find_in_hostlist(const std::vector<std::string>& host_arr) // string_host used to store domain of remote server, because host can contain IP in VPN mode
+bool find_in_hostlist_trie(const std::string & host)
+{
+    // One step per label, so lookup time doesn't depend on hostlist size
+    unsigned int node = 0;
+    size_t label_end = host.size();
+    while(label_end != 0)
+    {
+        if(hostlist_trie[node].is_wildcard)
+            return true;
+
+        size_t label_start = host.rfind('.', label_end - 1);
+        label_start = label_start == std::string::npos ? 0 : label_start + 1;
+
+        auto child = hostlist_trie[node].children.find(host.substr(label_start, label_end - label_start));
+        if(child == hostlist_trie[node].children.end())
+            return false;
+        node = child->second;
+
+        label_end = label_start == 0 ? 0 : label_start - 1;
+    }
+
+    // All labels matched, so host is the wildcard domain itself
+    return hostlist_trie[node].is_wildcard;
+}
+
+bool find_in_hostlist(const std::string & host) // string_host used to store domain of remote server, because host can contain IP in VPN mode
 {
     std::string log_tag = "CPP/find_in_hostlist";
 
+    std::string normalized_host = host;
+    normalize_host(normalized_host);
+
+    if(hostlist_hosts.count(normalized_host) != 0 || find_in_hostlist_trie(normalized_host))
+    {
+        log_debug(log_tag.c_str(), "Found host in hostlist. %s", host.c_str());
+        return true;
+    }
+
+    return false;
+}
+
+bool find_in_hostlist(const std::vector<std::string>& host_arr) // string_host used to store domain of remote server, because host can contain IP in VPN mode
+{
     for(const std::string& host : host_arr)
-        for(const std::string& host_in_vector : hostlist_vector)
-            if(host_in_vector == host)
-            {
-                log_debug(log_tag.c_str(), "Found host in hostlist. %s, %s", host_in_vector.c_str(), host.c_str());
-                return true;
-            }
+        if(find_in_hostlist(host))
+            return true;
 
     return false;
 }
@@ -48,6 +129,11 @@ int parse_hostlist()
         return -1;
     }
 
+    // Drop hostlist of previous start
+    hostlist_hosts.clear();
+    hostlist_trie.assign(1, HostlistNode());
+    hostlist_trie[0].is_wildcard = false;
+
     // Parse hostlist file
     if(settings.hostlist.hostlist_format == "json")
     {
@@ -60,10 +146,10 @@ int parse_hostlist()
             return -1;
         }
 
-        // Convert rapidjson::Document to vector<string>
-        hostlist_vector.reserve(hostlist_document.GetArray().Size());
+        // Convert rapidjson::Document to hostlist index
+        hostlist_hosts.reserve(hostlist_document.GetArray().Size());
         for(const auto & host_in_list : hostlist_document.GetArray())
-            hostlist_vector.push_back(host_in_list.GetString());
+            add_to_hostlist(host_in_list.GetString());
     }
     else if(settings.hostlist.hostlist_format == "txt")
     {
@@ -72,7 +158,7 @@ int parse_hostlist()
         std::string host;
         std::istringstream stream(hostlist_string);
         while (std::getline(stream, host, delimiter))
-            hostlist_vector.push_back(host);
+            add_to_hostlist(host);
     }
 
     return 0;
@@ -3,52 +3,152 @@
 
 extern struct Settings settings;
 
-int parse_request(const std::string& request, std::string & method, std::string & host, int & port)
+bool equals_ignore_case(std::string_view first, std::string_view second)
 {
-    // Extract method
-    size_t method_end_position = request.find(' ');
-    if(method_end_position == std::string::npos)
+    if(first.size() != second.size())
+        return false;
+
+    for(size_t i = 0; i < first.size(); i++)
+        if(tolower(first[i]) != tolower(second[i]))
+            return false;
+
+    return true;
+}
+
+int parse_authority(std::string_view authority, std::string_view & host, int & port)
+{
+    // IPv6 address is enclosed in brackets
+    size_t port_start_position = authority.rfind(':');
+    if(port_start_position == std::string_view::npos ||
+            (authority.front() == '[' && port_start_position < authority.find(']')))
     {
-        return -1;
+        host = authority;
+        return 0;
     }
-    method = request.substr(0, method_end_position);
 
-    // Extract hostname an port if exists
-    std::string regex_string = "[-a-zA-Z0-9@:%._\\+~#=]{2,256}\\.[-a-z0-9]{1,16}(:[0-9]{1,5})?";
-    std::regex url_find_regex(regex_string);
-    std::smatch match;
+    host = authority.substr(0, port_start_position);
+    std::string_view port_string = authority.substr(port_start_position + 1);
+    if(port_string.empty() || port_string.size() > 5)
+        return -1;
 
-    if(std::regex_search(request, match, url_find_regex) == 0)
+    port = 0;
+    for(char c : port_string)
     {
-        return -1;
+        if(c < '0' || c > '9')
+            return -1;
+        port = port * 10 + (c - '0');
     }
 
-    // Get string from regex output
-    std::string found_url = match.str(0);
+    return 0;
+}
+
+int parse_http_request(std::string_view request, HttpRequest & http_request)
+{
+    // Request line: method, target and version separated by single spaces
+    size_t method_end_position = request.find(' ');
+    if(method_end_position == std::string_view::npos || method_end_position == 0)
+        return -1;
+    http_request.method = request.substr(0, method_end_position);
+    for(char c : http_request.method)
+        if(c < 'A' || c > 'Z') // Not a request, e.g. body of previous one
+            return -1;
 
-    // Remove "www." if exists
-    size_t www = found_url.find("www.");
-    if(www != std::string::npos)
+    size_t target_end_position = request.find(' ', method_end_position + 1);
+    if(target_end_position == std::string_view::npos || target_end_position == method_end_position + 1)
+        return -1;
+    http_request.target = request.substr(method_end_position + 1, target_end_position - method_end_position - 1);
+
+    if(request.compare(target_end_position + 1, 5, "HTTP/") != 0)
+        return -1;
+    size_t line_end_position = request.find('\n', target_end_position);
+    if(line_end_position == std::string_view::npos)
+        return -1;
+
+    // Authority and path from target
+    http_request.authority = std::string_view();
+    http_request.path = http_request.target;
+    http_request.is_absolute_form = false;
+    size_t scheme_end_position = http_request.target.find("://");
+    if(http_request.method == "CONNECT")
+    {
+        http_request.authority = http_request.target;
+        http_request.path = std::string_view();
+    }
+    else if(scheme_end_position != std::string_view::npos && http_request.target.front() != '/')
     {
-        found_url.erase(www, 4);
+        size_t authority_end_position = http_request.target.find_first_of("/?", scheme_end_position + 3);
+        if(authority_end_position == std::string_view::npos)
+            authority_end_position = http_request.target.size();
+        http_request.authority = http_request.target.substr(scheme_end_position + 3, authority_end_position - scheme_end_position - 3);
+        http_request.path = http_request.target.substr(authority_end_position);
+        http_request.is_absolute_form = true;
     }
 
-    // Check if port exists
-    size_t port_start_position = found_url.find(':');
-    if(port_start_position == std::string::npos)
+    // Headers. Only Host header is needed. Request can be incomplete, so parse until data ends
+    http_request.host_header_position = std::string_view::npos;
+    http_request.host_header_end = std::string_view::npos;
+    size_t line_start_position = line_end_position + 1;
+    while(line_start_position < request.size())
     {
-        // If no set deafult port
-        if(method == "CONNECT")	port = 443;
-        else port = 80;
-        host = found_url;
+        line_end_position = request.find('\n', line_start_position);
+        if(line_end_position == std::string_view::npos)
+            line_end_position = request.size();
+
+        std::string_view line = request.substr(line_start_position, line_end_position - line_start_position);
+        if(!line.empty() && line.back() == '\r')
+            line.remove_suffix(1);
+        if(line.empty()) // End of headers
+            break;
+
+        size_t name_end_position = line.find(':');
+        if(name_end_position != std::string_view::npos && equals_ignore_case(line.substr(0, name_end_position), "host"))
+        {
+            http_request.host_header_position = line_start_position;
+            http_request.host_header_end = line_start_position + line.size();
+
+            if(http_request.authority.empty())
+            {
+                std::string_view value = line.substr(name_end_position + 1);
+                while(!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+                    value.remove_prefix(1);
+                while(!value.empty() && (value.back() == ' ' || value.back() == '\t'))
+                    value.remove_suffix(1);
+                http_request.authority = value;
+            }
+            break;
+        }
+
+        line_start_position = line_end_position + 1;
     }
-    else
+
+    if(http_request.authority.empty())
+        return -1;
+
+    // Set default port if there is no port in authority
+    http_request.port = http_request.method == "CONNECT" ? 443 : 80;
+    if(parse_authority(http_request.authority, http_request.host, http_request.port) == -1 || http_request.host.empty())
+        return -1;
+
+    return 0;
+}
+
+int parse_request(const std::string& request, std::string & method, std::string & host, int & port)
+{
+    HttpRequest http_request;
+    if(parse_http_request(request, http_request) == -1)
     {
-        // If yes extract port
-        port = std::stoi(found_url.substr(port_start_position + 1, found_url.size() - port_start_position));
-        host = found_url.substr(0, port_start_position);
+        return -1;
     }
 
+    method.assign(http_request.method.data(), http_request.method.size());
+    port = http_request.port;
+
+    // Remove "www." if exists
+    std::string_view found_host = http_request.host;
+    if(found_host.compare(0, 4, "www.") == 0)
+        found_host.remove_prefix(4);
+    host.assign(found_host.data(), found_host.size());
+
     return 0;
 }
 
@@ -58,25 +158,28 @@ void modify_http_request(std::string & request, bool hostlist_condition)
 
     if(request.empty()) return;
 
+    // Only beginning of request is modified. Other chunks are request bodies
+    HttpRequest http_request;
+    if(parse_http_request(request, http_request) == -1)
+        return;
+
+    size_t host_header_position = http_request.host_header_position;
+
     // First of all remove url in first string of request if need
     // We mustn't do it when user enabled "Use HTTP proxy" mode
-    if(!settings.http.is_use_http_proxy)
+    if(!settings.http.is_use_http_proxy && http_request.is_absolute_form)
     {
-        std::string regex_string = "(https?://)?[-a-zA-Z0-9@:%._\\+~#=]{2,256}\\.[-a-z0-9]{2,16}(:[0-9]{1,5})?";
-        std::regex url_find_regex(regex_string);
-        std::smatch match;
-        if(std::regex_search(request, match, url_find_regex) == 0)
-        {
-            log_error(log_tag.c_str(), "Failed to remove url, while modifying request");
-            return;
-        }
-
-        // Get string from regex output
-        std::string found_url = match.str(0);
-        request.replace(request.find(found_url), found_url.size(), "");
+        // Leave only path, it must be "/" at least
+        size_t target_position = http_request.target.data() - request.data();
+        size_t url_size = http_request.target.size() - http_request.path.size();
+        if(http_request.path.empty())
+            request.replace(target_position, url_size--, "/");
+        else
+            request.erase(target_position, url_size);
+        if(host_header_position != std::string::npos)
+            host_header_position -= url_size;
     }
 
-    size_t host_header_position = request.find("Host:");
     if(host_header_position == std::string::npos)
     {
         log_error(log_tag.c_str(), "Failed to find Host: header");
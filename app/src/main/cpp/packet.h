@@ -1,6 +1,27 @@
 #ifndef DPITUNNEL_PACKET_H
 #define DPITUNNEL_PACKET_H
 
+#include <string>
+#include <string_view>
+
+struct HttpRequest
+{
+    std::string_view method;
+    // Request target as written in request line
+    std::string_view target;
+    // host[:port] from target, or from Host header if target is a path
+    std::string_view authority;
+    std::string_view host;
+    int port;
+    std::string_view path;
+    // Target contains scheme and authority, e.g. http://example.com/index.html
+    bool is_absolute_form;
+    // Offsets of Host header line start and end. npos if there is no Host header
+    size_t host_header_position;
+    size_t host_header_end;
+};
+
+int parse_http_request(std::string_view request, HttpRequest & http_request);
 int parse_request(const std::string& request, std::string & method, std::string & host, int & port);
 void modify_http_request(std::string & request, bool hostlist_condition);
 
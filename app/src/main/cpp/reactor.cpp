@@ -0,0 +1,636 @@
+#include "dpi-bypass.h"
+#include "reactor.h"
+#include "packet.h"
+#include "socket.h"
+#include "sni.h"
+#include "workers.h"
+#include "buffer_pool.h"
+#include "stats.h"
+
+#include <atomic>
+#include <mutex>
+#include <unordered_set>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+
+extern bool stop_flag;
+
+struct Reactor
+{
+    int epoll_fd;
+    // Used to wake up reactor when new connections are added or service is stopping
+    int wakeup_fd;
+    std::thread thread;
+    std::mutex incoming_mutex;
+    std::vector<Connection *> incoming;
+    std::unordered_set<Connection *> connections;
+};
+
+const int MAX_EVENTS = 64;
+// Max bytes moved by one splice() call. Default pipe capacity is 64K
+const size_t SPLICE_SIZE = 65536;
+// Max bytes read from one endpoint per event, so fast sender doesn't hold reactor. Rest is read on next epoll_wait()
+const size_t RELAY_READ_SIZE = BUFFER_SIZE_LARGE;
+
+std::vector<Reactor *> reactors;
+std::atomic<unsigned int> next_reactor(0);
+
+Connection* create_connection(int client_socket, int remote_server_socket)
+{
+    Connection *connection = new Connection();
+
+    connection->client.connection = connection;
+    connection->client.socket = client_socket;
+    connection->client.tls_context = NULL;
+    connection->client.pending = NULL;
+    connection->client.events = 0;
+    connection->client.pipe_fds[0] = -1;
+    connection->client.pipe_fds[1] = -1;
+    connection->client.pipe_pending = 0;
+    connection->client.is_read_closed = false;
+    connection->client.is_write_closed = false;
+    connection->client.is_finished = false;
+
+    connection->remote_server.connection = connection;
+    connection->remote_server.socket = remote_server_socket;
+    connection->remote_server.tls_context = NULL;
+    connection->remote_server.pending = NULL;
+    connection->remote_server.events = 0;
+    connection->remote_server.pipe_fds[0] = -1;
+    connection->remote_server.pipe_fds[1] = -1;
+    connection->remote_server.pipe_pending = 0;
+    connection->remote_server.is_read_closed = false;
+    connection->remote_server.is_write_closed = false;
+    connection->remote_server.is_finished = false;
+
+    connection->server_server_context.reset();
+    connection->hostlist_condition = false;
+    connection->is_http = false;
+    connection->is_split_needed = false;
+    connection->is_split_always = false;
+    connection->split_position = 0;
+    connection->is_splice_allowed = false;
+    connection->is_closed = false;
+
+    return connection;
+}
+
+ssize_t send_nonblocking(ConnectionEndpoint *endpoint, const char *data, size_t size)
+{
+    std::string log_tag = "CPP/send_nonblocking";
+
+    size_t offset = 0;
+    while(offset != size)
+    {
+        ssize_t send_size = send(endpoint->socket, data + offset, size - offset, MSG_DONTWAIT | MSG_NOSIGNAL);
+        count_io(1, 0);
+        if(send_size < 0)
+        {
+            if(errno == EINTR)	continue; // All is good. This is just interrrupt.
+            if(errno == EWOULDBLOCK || errno == EAGAIN)	break; // Socket buffer is full, wait for EPOLLOUT
+            log_error(log_tag.c_str(), "There is critical send error. Can't process client. Errno: %s", std::strerror(errno));
+            return -1;
+        }
+        if(send_size == 0)
+            return -1;
+        offset += send_size;
+    }
+
+    // Return count of sent bytes
+    return offset;
+}
+
+int flush_endpoint(ConnectionEndpoint *endpoint)
+{
+    std::string log_tag = "CPP/flush_endpoint";
+
+    if(endpoint->pending != NULL)
+    {
+        ssize_t offset = send_nonblocking(endpoint, endpoint->pending->c_str(), endpoint->pending->size());
+        if(offset == -1)
+            return -1;
+        endpoint->pending->erase(0, offset);
+
+        // Spliced data always comes after queued data
+        if(!endpoint->pending->empty())
+            return 0;
+
+        // Endpoint is idle, give buffer back to pool
+        release_buffer(endpoint->pending);
+        endpoint->pending = NULL;
+    }
+
+    while(endpoint->pipe_pending != 0)
+    {
+        ssize_t send_size = splice(endpoint->pipe_fds[0], NULL, endpoint->socket, NULL, endpoint->pipe_pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        count_io(1, 0);
+        if(send_size < 0)
+        {
+            if(errno == EINTR)	continue; // All is good. This is just interrrupt.
+            if(errno == EWOULDBLOCK || errno == EAGAIN)	break; // Socket buffer is full, wait for EPOLLOUT
+            log_error(log_tag.c_str(), "There is critical splice error. Can't process client. Errno: %s", std::strerror(errno));
+            return -1;
+        }
+        if(send_size == 0)
+            return -1;
+        endpoint->pipe_pending -= send_size;
+    }
+
+    return 0;
+}
+
+bool has_pending(ConnectionEndpoint *endpoint)
+{
+    return endpoint->pending != NULL || endpoint->pipe_pending != 0;
+}
+
+int write_to_endpoint(ConnectionEndpoint *endpoint, const char *data, size_t size)
+{
+    // Send directly if nothing is queued. Only unsent rest is copied to pooled buffer
+    ssize_t offset = 0;
+    if(!has_pending(endpoint))
+    {
+        offset = send_nonblocking(endpoint, data, size);
+        if(offset == -1)
+            return -1;
+    }
+
+    if((size_t) offset != size)
+    {
+        if(endpoint->pending == NULL)
+            endpoint->pending = acquire_buffer(size - offset);
+        endpoint->pending->append(data + offset, size - offset);
+    }
+
+    return 0;
+}
+
+int splice_to_endpoint(ConnectionEndpoint *source, ConnectionEndpoint *destination)
+{
+    std::string log_tag = "CPP/splice_to_endpoint";
+
+    ssize_t read_size;
+    size_t read_total = 0;
+    uint64_t syscalls = 0;
+
+    // Move data from socket to pipe until socket is drained or pipe is full
+    while(true)
+    {
+        read_size = splice(source->socket, NULL, destination->pipe_fds[1], NULL, SPLICE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        syscalls++;
+        if(read_size < 0)
+        {
+            if(errno == EWOULDBLOCK || errno == EAGAIN)	break;
+            if(errno == EINTR)      continue; // All is good. This is just interrrupt.
+            log_error(log_tag.c_str(), "There is critical splice error. Can't process client. Errno: %s", std::strerror(errno));
+            count_io(syscalls, read_total);
+            return -1;
+        }
+        else if(read_size == 0)
+        {
+            // Data already in pipe is written before end of stream is passed on
+            source->is_read_closed = true;
+            break;
+        }
+
+        destination->pipe_pending += read_size;
+        read_total += read_size;
+    }
+
+    count_io(syscalls, read_total);
+
+    return flush_endpoint(destination);
+}
+
+bool is_splice_possible(Connection *connection, ConnectionEndpoint *source, ConnectionEndpoint *destination)
+{
+    // Once direction uses pipe, all its data must go through it to keep order
+    if(destination->pipe_fds[0] != -1)
+        return true;
+
+    // Packets to remote server can't be spliced while they must be split
+    if(!connection->is_splice_allowed || destination->pending != NULL ||
+            (destination == &connection->remote_server && connection->is_split_needed))
+        return false;
+
+    if(pipe2(destination->pipe_fds, O_NONBLOCK | O_CLOEXEC) == -1)
+    {
+        // Too many open files, fall back to copying through user space
+        std::string log_tag = "CPP/is_splice_possible";
+        log_error(log_tag.c_str(), "Can't create pipe, splice disabled for connection. Errno: %s", std::strerror(errno));
+        destination->pipe_fds[0] = -1;
+        destination->pipe_fds[1] = -1;
+        connection->is_splice_allowed = false;
+        return false;
+    }
+
+    return true;
+}
+
+int send_to_endpoint(Connection *connection, ConnectionEndpoint *destination, std::string & buffer, unsigned int last_char, std::string & tls_buffer)
+{
+    if(last_char == 0)
+        return 0;
+
+    if(destination->tls_context != NULL)
+    {
+        tls_buffer.clear();
+        if(encrypt_string_tls(destination->tls_context, buffer, last_char, tls_buffer) == -1)
+            return -1;
+        return write_to_endpoint(destination, tls_buffer.c_str(), tls_buffer.size());
+    }
+
+    if(destination == &connection->remote_server && connection->is_split_needed && !has_pending(destination))
+    {
+        // Split packet only if there is nothing queued, otherwise parts will be merged in one segment anyway.
+        // First part is sent by its own call, rest is sent or queued like any other data
+        connection->is_split_needed = connection->is_split_always;
+        ssize_t offset = send_nonblocking(destination, buffer.c_str(), std::min<size_t>(connection->split_position, last_char));
+        if(offset == -1)
+            return -1;
+        return write_to_endpoint(destination, buffer.c_str() + offset, last_char - offset);
+    }
+
+    return write_to_endpoint(destination, buffer.c_str(), last_char);
+}
+
+int relay(Connection *connection, ConnectionEndpoint *source, ConnectionEndpoint *destination, std::string & buffer, std::string & tls_buffer)
+{
+    // Zero-copy path for plain tunnels
+    if(is_splice_possible(connection, source, destination))
+        return splice_to_endpoint(source, destination);
+
+    // last_char indicates position of string end
+    unsigned int last_char;
+    bool is_eof;
+
+    if(source->tls_context != NULL)
+    {
+        if(recv_string_tls(source->socket, source->tls_context, buffer, RELAY_READ_SIZE, last_char, is_eof) == -1)
+            return -1;
+    }
+    else if(recv_string(source->socket, buffer, RELAY_READ_SIZE, last_char, is_eof) == -1)
+        return -1;
+
+    // Data read before end of stream is still forwarded
+    source->is_read_closed = is_eof;
+
+    // Modify http request to bypass dpi
+    if(connection->is_http && source == &connection->client && last_char != 0)
+    {
+        buffer.resize(last_char);
+        modify_http_request(buffer, connection->hostlist_condition);
+        last_char = buffer.size();
+    }
+
+    return send_to_endpoint(connection, destination, buffer, last_char, tls_buffer);
+}
+
+int close_endpoint_write(ConnectionEndpoint *endpoint, ConnectionEndpoint *opposite)
+{
+    // Pass end of stream from opposite side only after all data before it is written
+    if(!opposite->is_read_closed || endpoint->is_write_closed || has_pending(endpoint))
+        return 0;
+
+    if(endpoint->tls_context != NULL)
+    {
+        // TLS stream is ended by close_notify alert. Context can't be read after it, so reading side is closed too
+        SSL_shutdown(endpoint->tls_context);
+        endpoint->is_read_closed = true;
+
+        unsigned int alert_size;
+        const unsigned char *alert = tls_get_write_buffer(endpoint->tls_context, &alert_size);
+        if(alert != NULL && alert_size != 0)
+        {
+            int ret = write_to_endpoint(endpoint, reinterpret_cast<const char *>(alert), alert_size);
+            tls_buffer_clear(endpoint->tls_context);
+            if(ret == -1)
+                return -1;
+            // Wait until alert is written
+            if(has_pending(endpoint))
+                return 0;
+        }
+    }
+
+    endpoint->is_write_closed = true;
+    if(shutdown(endpoint->socket, SHUT_WR) == -1)
+        return -1;
+
+    return 0;
+}
+
+bool is_connection_finished(Connection *connection)
+{
+    // Both directions passed end of stream and have no queued data
+    return connection->client.is_read_closed && connection->client.is_write_closed &&
+            connection->remote_server.is_read_closed && connection->remote_server.is_write_closed;
+}
+
+void send_close_notify(ConnectionEndpoint *endpoint)
+{
+    // Best effort, socket is closed right after. Skipped if alert was sent already or if it would follow cut off data
+    if(endpoint->is_write_closed || has_pending(endpoint))
+        return;
+
+    SSL_shutdown(endpoint->tls_context);
+
+    unsigned int alert_size;
+    const unsigned char *alert = tls_get_write_buffer(endpoint->tls_context, &alert_size);
+    if(alert != NULL && alert_size != 0)
+        send_nonblocking(endpoint, reinterpret_cast<const char *>(alert), alert_size);
+    tls_buffer_clear(endpoint->tls_context);
+}
+
+void close_connection(Reactor *reactor, Connection *connection)
+{
+    if(connection->is_closed)
+        return;
+    connection->is_closed = true;
+
+    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, connection->client.socket, NULL);
+    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, connection->remote_server.socket, NULL);
+
+    if(connection->remote_server.tls_context != NULL)
+    {
+        send_close_notify(&connection->remote_server);
+        close(connection->remote_server.socket);
+        SSL_CTX_free(connection->remote_server.tls_context);
+    }
+    else
+        close(connection->remote_server.socket);
+
+    if(connection->client.tls_context != NULL)
+    {
+        send_close_notify(&connection->client);
+        shutdown(connection->client.socket, SHUT_RDWR);
+        close(connection->client.socket);
+        SSL_free(connection->client.tls_context);
+        // Context is freed here unless it's still in certificate cache or used by other connections
+        connection->server_server_context.reset();
+    }
+    else
+        close(connection->client.socket);
+
+    for(ConnectionEndpoint *endpoint : {&connection->client, &connection->remote_server})
+    {
+        if(endpoint->pipe_fds[0] != -1)
+        {
+            close(endpoint->pipe_fds[0]);
+            close(endpoint->pipe_fds[1]);
+        }
+        release_buffer(endpoint->pending);
+        endpoint->pending = NULL;
+    }
+
+    release_connection();
+}
+
+int update_endpoint_events(Reactor *reactor, ConnectionEndpoint *endpoint, ConnectionEndpoint *opposite)
+{
+    if(endpoint->is_finished)
+        return 0;
+
+    // Socket with both directions closed would report EPOLLHUP all the time, but there is nothing to do with it
+    if(endpoint->is_read_closed && endpoint->is_write_closed)
+    {
+        endpoint->is_finished = true;
+        return epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, endpoint->socket, NULL);
+    }
+
+    // Stop reading if opposite side can't accept data or end of stream was read. Wait for write if we have queued data
+    uint32_t events = (has_pending(opposite) || endpoint->is_read_closed ? 0 : EPOLLIN) | (has_pending(endpoint) ? EPOLLOUT : 0);
+    if(events == endpoint->events)
+        return 0;
+
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = endpoint;
+    if(epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, endpoint->socket, &event) == -1)
+        return -1;
+    endpoint->events = events;
+
+    return 0;
+}
+
+int register_connection(Reactor *reactor, Connection *connection)
+{
+    // Reads and writes are driven by epoll, so sockets must never block
+    if(set_socket_nonblocking(connection->client.socket) == -1 ||
+            set_socket_nonblocking(connection->remote_server.socket) == -1)
+        return -1;
+
+    struct epoll_event event;
+
+    event.events = EPOLLIN;
+    event.data.ptr = &connection->client;
+    if(epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, connection->client.socket, &event) == -1)
+        return -1;
+    connection->client.events = EPOLLIN;
+
+    event.events = EPOLLIN;
+    event.data.ptr = &connection->remote_server;
+    if(epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, connection->remote_server.socket, &event) == -1)
+        return -1;
+    connection->remote_server.events = EPOLLIN;
+
+    return 0;
+}
+
+void reactor_cycle(Reactor *reactor)
+{
+    std::string log_tag = "CPP/reactor_cycle";
+
+    struct epoll_event events[MAX_EVENTS];
+
+    // Set epoll_wait() timeout
+    int timeout = 10000;
+
+    // Buffers are shared by all connections of reactor
+    std::string *buffer = acquire_buffer(BUFFER_SIZE_LARGE);
+    std::string *tls_buffer = acquire_buffer(BUFFER_SIZE_LARGE);
+
+    // Connections closed during current iteration. They will be freed when all events are processed
+    std::vector<Connection *> closed;
+
+    while(!stop_flag)
+    {
+        int ret = epoll_wait(reactor->epoll_fd, events, MAX_EVENTS, timeout);
+
+        // Check state
+        if(ret == -1)
+        {
+            if(errno == EINTR)	continue;
+            log_error(log_tag.c_str(), "Epoll error. Errno: %s", std::strerror(errno));
+            break;
+        }
+
+        for(int i = 0; i < ret; i++)
+        {
+            // Process wakeup event
+            if(events[i].data.ptr == NULL)
+            {
+                uint64_t value;
+                read(reactor->wakeup_fd, &value, sizeof(value));
+
+                std::vector<Connection *> incoming;
+                {
+                    std::lock_guard<std::mutex> lock(reactor->incoming_mutex);
+                    incoming.swap(reactor->incoming);
+                }
+                for(Connection *connection : incoming)
+                {
+                    reactor->connections.insert(connection);
+                    if(register_connection(reactor, connection) == -1)
+                    {
+                        log_error(log_tag.c_str(), "Can't add connection to epoll. Errno: %s", std::strerror(errno));
+                        close_connection(reactor, connection);
+                        closed.push_back(connection);
+                    }
+                }
+                continue;
+            }
+
+            ConnectionEndpoint *endpoint = (ConnectionEndpoint *) events[i].data.ptr;
+            Connection *connection = endpoint->connection;
+            if(connection->is_closed)
+                continue;
+
+            ConnectionEndpoint *opposite = endpoint == &connection->client ?
+                    &connection->remote_server : &connection->client;
+
+            // EPOLLHUP without error comes after both directions were shut down, rest of data can still be read
+            bool is_failed = (events[i].events & EPOLLERR) ||
+                    ((events[i].events & EPOLLHUP) && !endpoint->is_write_closed);
+
+            // Send queued data
+            if(!is_failed && events[i].events & EPOLLOUT)
+                is_failed = flush_endpoint(endpoint) == -1;
+
+            // Transfer data
+            if(!is_failed && !endpoint->is_read_closed && events[i].events & (EPOLLIN | EPOLLHUP))
+                is_failed = relay(connection, endpoint, opposite, *buffer, *tls_buffer) == -1;
+
+            // Pass end of stream once data before it is written
+            if(!is_failed)
+                is_failed = close_endpoint_write(opposite, endpoint) == -1 ||
+                        close_endpoint_write(endpoint, opposite) == -1;
+
+            if(!is_failed)
+                is_failed = update_endpoint_events(reactor, endpoint, opposite) == -1 ||
+                        update_endpoint_events(reactor, opposite, endpoint) == -1;
+
+            if(is_failed || is_connection_finished(connection))
+            {
+                close_connection(reactor, connection);
+                closed.push_back(connection);
+            }
+        }
+
+        for(Connection *connection : closed)
+        {
+            reactor->connections.erase(connection);
+            delete connection;
+        }
+        closed.clear();
+    }
+
+    release_buffer(buffer);
+    release_buffer(tls_buffer);
+}
+
+int init_reactors(unsigned int reactors_count)
+{
+    std::string log_tag = "CPP/init_reactors";
+
+    // Use one reactor per core by default
+    if(reactors_count == 0)
+        reactors_count = std::thread::hardware_concurrency();
+    if(reactors_count == 0)
+        reactors_count = 1;
+
+    for(unsigned int i = 0; i < reactors_count; i++)
+    {
+        Reactor *reactor = new Reactor();
+
+        if((reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+        {
+            log_error(log_tag.c_str(), "Can't create epoll. Errno: %s", std::strerror(errno));
+            delete reactor;
+            return -1;
+        }
+
+        if((reactor->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+        {
+            log_error(log_tag.c_str(), "Can't create eventfd. Errno: %s", std::strerror(errno));
+            close(reactor->epoll_fd);
+            delete reactor;
+            return -1;
+        }
+
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        if(epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->wakeup_fd, &event) == -1)
+        {
+            log_error(log_tag.c_str(), "Can't add eventfd to epoll. Errno: %s", std::strerror(errno));
+            close(reactor->wakeup_fd);
+            close(reactor->epoll_fd);
+            delete reactor;
+            return -1;
+        }
+
+        reactor->thread = std::thread(reactor_cycle, reactor);
+        reactors.push_back(reactor);
+    }
+
+    log_debug(log_tag.c_str(), "Started %u reactors", reactors_count);
+
+    return 0;
+}
+
+void deinit_reactors()
+{
+    // Wake up all reactors. They will see stop_flag and exit
+    for(Reactor *reactor : reactors)
+    {
+        uint64_t value = 1;
+        write(reactor->wakeup_fd, &value, sizeof(value));
+    }
+
+    for(Reactor *reactor : reactors)
+    {
+        if(reactor->thread.joinable())
+            reactor->thread.join();
+
+        // Release all connections, including not registered ones
+        for(Connection *connection : reactor->incoming)
+            reactor->connections.insert(connection);
+        reactor->incoming.clear();
+        for(Connection *connection : reactor->connections)
+        {
+            close_connection(reactor, connection);
+            delete connection;
+        }
+        reactor->connections.clear();
+
+        close(reactor->wakeup_fd);
+        close(reactor->epoll_fd);
+        delete reactor;
+    }
+    reactors.clear();
+}
+
+void add_connection(Connection *connection)
+{
+    // Distribute connections between reactors by turns
+    Reactor *reactor = reactors[next_reactor++ % reactors.size()];
+
+    {
+        std::lock_guard<std::mutex> lock(reactor->incoming_mutex);
+        reactor->incoming.push_back(connection);
+    }
+
+    uint64_t value = 1;
+    write(reactor->wakeup_fd, &value, sizeof(value));
+}
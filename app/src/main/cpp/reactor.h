@@ -0,0 +1,54 @@
+#ifndef DPITUNNEL_REACTOR_H
+#define DPITUNNEL_REACTOR_H
+
+#include <tlse.h>
+#include <memory>
+#include <string>
+
+struct Connection;
+
+struct ConnectionEndpoint
+{
+    Connection *connection;
+    int socket;
+    // NULL if endpoint is plain TCP
+    SSL *tls_context;
+    // Data waiting until socket becomes writable. Pooled buffer, NULL if nothing is queued
+    std::string *pending;
+    // Kernel pipe with spliced data waiting to be written to socket. -1 if not created yet
+    int pipe_fds[2];
+    size_t pipe_pending;
+    // Events currently registered in epoll
+    uint32_t events;
+    // Peer closed its sending side. Data read before it is still forwarded
+    bool is_read_closed;
+    // Sending side was shut down after all queued data was written
+    bool is_write_closed;
+    // Socket is removed from epoll when both directions are closed
+    bool is_finished;
+};
+
+struct Connection
+{
+    ConnectionEndpoint client;
+    ConnectionEndpoint remote_server;
+    // Holds certificate of MITM server if SNI replace enabled. Shared with certificate cache
+    std::shared_ptr<SSL> server_server_context;
+    bool hostlist_condition;
+    bool is_http;
+    // Next packet to remote server must be split
+    bool is_split_needed;
+    // VPN mode and HTTP require splitting for all packets
+    bool is_split_always;
+    unsigned int split_position;
+    // Plain tunnel, data can be moved between sockets with splice() once no split is needed
+    bool is_splice_allowed;
+    bool is_closed;
+};
+
+Connection* create_connection(int client_socket, int remote_server_socket);
+int init_reactors(unsigned int reactors_count);
+void deinit_reactors();
+void add_connection(Connection *connection);
+
+#endif //DPITUNNEL_REACTOR_H
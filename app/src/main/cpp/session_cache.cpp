@@ -0,0 +1,72 @@
+#include "dpi-bypass.h"
+#include "bounded_cache.h"
+#include "session_cache.h"
+
+#include <chrono>
+#include <mutex>
+
+// Servers usually keep sessions and ticket keys longer, refused session just costs full handshake.
+// MITM server gives out ticket lifetime of the same length
+const unsigned int SESSION_CACHE_TTL = 1800;
+// Upstream sessions are kept one per server address and SNI
+const size_t MAX_SESSION_CACHE_SIZE = 1024;
+// Every client connection to MITM server adds new session, so they are kept separately and can't evict upstream ones
+const size_t MAX_MITM_SESSION_CACHE_SIZE = 4096;
+
+// Serialized TLS sessions: session id, master secret or PSK and ticket
+BoundedCache<std::string> session_cache(MAX_SESSION_CACHE_SIZE);
+std::mutex session_cache_mutex;
+BoundedCache<std::string> mitm_session_cache(MAX_MITM_SESSION_CACHE_SIZE);
+std::mutex mitm_session_cache_mutex;
+
+void deinit_session_cache()
+{
+    {
+        std::lock_guard<std::mutex> lock(session_cache_mutex);
+        session_cache.clear();
+    }
+    std::lock_guard<std::mutex> lock(mitm_session_cache_mutex);
+    mitm_session_cache.clear();
+}
+
+bool find_in_session_cache(const std::string & key, std::string & session)
+{
+    std::lock_guard<std::mutex> lock(session_cache_mutex);
+
+    const std::string *saved_session = session_cache.find(key, std::chrono::steady_clock::now());
+    if(saved_session == NULL)
+        return false;
+    session = *saved_session;
+
+    return true;
+}
+
+void add_to_session_cache(const std::string & key, const std::string & session)
+{
+    std::lock_guard<std::mutex> lock(session_cache_mutex);
+    session_cache.insert(key, session, std::chrono::steady_clock::now() + std::chrono::seconds(SESSION_CACHE_TTL));
+}
+
+void remove_from_session_cache(const std::string & key)
+{
+    std::lock_guard<std::mutex> lock(session_cache_mutex);
+    session_cache.erase(key);
+}
+
+bool find_in_mitm_session_cache(const std::string & key, std::string & session)
+{
+    std::lock_guard<std::mutex> lock(mitm_session_cache_mutex);
+
+    const std::string *saved_session = mitm_session_cache.find(key, std::chrono::steady_clock::now());
+    if(saved_session == NULL)
+        return false;
+    session = *saved_session;
+
+    return true;
+}
+
+void add_to_mitm_session_cache(const std::string & key, const std::string & session)
+{
+    std::lock_guard<std::mutex> lock(mitm_session_cache_mutex);
+    mitm_session_cache.insert(key, session, std::chrono::steady_clock::now() + std::chrono::seconds(SESSION_CACHE_TTL));
+}
@@ -0,0 +1,13 @@
+#ifndef DPITUNNEL_SESSION_CACHE_H
+#define DPITUNNEL_SESSION_CACHE_H
+
+#include <string>
+
+void deinit_session_cache();
+bool find_in_session_cache(const std::string & key, std::string & session);
+void add_to_session_cache(const std::string & key, const std::string & session);
+void remove_from_session_cache(const std::string & key);
+bool find_in_mitm_session_cache(const std::string & key, std::string & session);
+void add_to_mitm_session_cache(const std::string & key, const std::string & session);
+
+#endif //DPITUNNEL_SESSION_CACHE_H
@@ -1,12 +1,19 @@
+#include "cert_cache.h"
+#include "chain_cache.h"
 #include "fileIO.h"
+#include "session_cache.h"
 #include "sni.h"
 #include "sni_cert_gen.h"
 #include "socket.h"
 #include "dpi-bypass.h"
+#include "stats.h"
+
+#include <chrono>
 
 extern struct Settings settings;
 
-std::string root_cert_store;
+// Verified root CA certificates. Parsed once and shared by all client contexts
+struct TLSRootStore *root_store = NULL;
 
 int verify_signature(struct TLSContext *context, struct TLSCertificate **certificate_chain, int len) {
     return no_error;
@@ -25,6 +32,12 @@ int verify_certificate(struct TLSContext *context, struct TLSCertificate **certi
                 return err;
         }
     }
+    // Skip signature checks if same chain was verified recently
+    std::string fingerprint;
+    bool is_fingerprint_valid = certificate_chain && len > 0 && get_chain_fingerprint(certificate_chain, len, fingerprint) == 0;
+    if (is_fingerprint_valid && find_in_chain_cache(fingerprint))
+        return no_error;
+
     // check if chain is valid
     err = tls_certificate_chain_is_valid(certificate_chain, len);
     if (err)
@@ -42,55 +55,83 @@ int verify_certificate(struct TLSContext *context, struct TLSCertificate **certi
     if (err)
         return err;
 
+    if (is_fingerprint_valid)
+        add_to_chain_cache(fingerprint);
+
     return no_error;
 }
 
-int recv_string_tls(int & socket, SSL *context, std::string & message, unsigned int & last_char)
+int recv_string_tls(int & socket, SSL *context, std::string & message, size_t max_size, unsigned int & last_char, bool & is_eof)
 {
     std::string log_tag = "CPP/recv_string_tls";
 
     ssize_t read_size;
     size_t message_offset = 0;
+    uint64_t syscalls = 0;
 
-    // Set receive timeout on socket
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 50;
-    if(setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, (char *) &timeout, sizeof(timeout)) < 0)
-    {
-        log_error(log_tag.c_str(), "Can't setsockopt on socket");
-        return -1;
-    }
+    is_eof = false;
 
-    while(true)
+    // Socket is non-blocking, so read until TLS layer reports EAGAIN or max_size bytes are read.
+    // Records already decrypted by TLS layer are taken anyway, epoll won't report them
+    while(message_offset < max_size || SSL_pending(context) > 0)
     {
         if(message.size() - message_offset < 1024) // If there isn't any space in message string - just increase it
         {
-            message.resize(message.size() + 1024);
+            // Use reserved capacity of pooled buffer first
+            message.resize(std::max(message.capacity(), message.size() + 1024));
         }
 
         read_size = SSL_read(context, &message[0] + message_offset, message.size() - message_offset);
+        syscalls++;
         if(read_size < 0)
         {
-            if(errno == EWOULDBLOCK || errno == EAGAIN)	break;
-            if(errno == EINTR)      continue; // All is good. This is just interrrupt.
+            // errno is only meaningful if TLS layer itself didn't fail
+            bool is_tls_error = SSL_get_error(context, read_size) != 0;
+            if(!is_tls_error && (errno == EWOULDBLOCK || errno == EAGAIN))	break;
+            if(!is_tls_error && errno == EINTR)      continue; // All is good. This is just interrrupt.
             else
             {
                 log_error(log_tag.c_str(), "There is critical recv error. Can't process client. Errno: %s", std::strerror(errno));
+                count_io(syscalls, message_offset);
                 return -1;
             }
         }
-        else if(read_size == 0)	return -1;
+        else if(read_size == 0)
+        {
+            is_eof = true;
+            break;
+        }
 
         message_offset += read_size;
     }
 
+    count_io(syscalls, message_offset);
+
     // Set position of last character
     last_char = message_offset;
 
     return 0;
 }
 
+int recv_string_tls(int & socket, SSL *context, std::string & message, unsigned int & last_char)
+{
+    bool is_eof;
+    if(recv_string_tls(socket, context, message, SIZE_MAX, last_char, is_eof) == -1)
+        return -1;
+
+    // Data read before connection was closed is returned first, next call fails
+    return is_eof && last_char == 0 ? -1 : 0;
+}
+
+int recv_string_tls(int & socket, SSL *context, std::string & message, struct timeval timeout, unsigned int & last_char)
+{
+    // Wait for first data
+    if(wait_for_socket(socket, POLLIN, timeout) == -1)
+        return -1;
+
+    return recv_string_tls(socket, context, message, last_char);
+}
+
 int send_string_tls(int & socket, TLSContext *context, const std::string & string_to_send, unsigned int last_char)
 {
     std::string log_tag = "CPP/send_string_tls";
@@ -101,43 +142,122 @@ int send_string_tls(int & socket, TLSContext *context, const std::string & strin
 
     size_t offset = 0;
 
-    // Set send timeout on socket
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 300;
-    if(setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, (char *) &timeout, sizeof(timeout)) < 0)
-    {
-        log_error(log_tag.c_str(), "Can't setsockopt on socket");
-        return -1;
-    }
-
+    // SSL_write() encrypts data to full size records and sends them with one call.
+    // Records the socket didn't accept stay in context write buffer, so they are flushed before next write
     while(last_char - offset != 0)
     {
-        ssize_t send_size = SSL_write(context, string_to_send.c_str() + offset, last_char - offset);
-        if(send_size < 0)
+        int send_size = SSL_write(context, string_to_send.c_str() + offset, last_char - offset);
+        if(send_size <= 0)
+        {
+            log_error(log_tag.c_str(), "There is critical send error. Can't process client. Errno: %s", std::strerror(errno));
+            return -1;
+        }
+        offset += send_size;
+
+        unsigned int pending_size;
+        while(tls_get_write_buffer(context, &pending_size) != NULL && pending_size != 0)
         {
-            if(errno == EAGAIN) break;
-            if(errno == EINTR)      continue; // All is good. This is just interrrupt.
-            else {
+            if(wait_for_socket(socket, POLLOUT, SEND_TIMEOUT) == -1)
+                return -1;
+            if(SSL_flush(context) < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
                 log_error(log_tag.c_str(), "There is critical send error. Can't process client. Errno: %s", std::strerror(errno));
                 return -1;
             }
         }
-        if(send_size == 0)
+    }
+
+    return 0;
+}
+
+int encrypt_string_tls(SSL *context, const std::string & string_to_encrypt, unsigned int last_char, std::string & encrypted)
+{
+    std::string log_tag = "CPP/encrypt_string_tls";
+
+    size_t offset = 0;
+
+    // tls_write() puts one record per call to the context write buffer, so call it until all data is consumed
+    while(last_char - offset != 0)
+    {
+        int write_size = tls_write(context, reinterpret_cast<const unsigned char *>(string_to_encrypt.c_str()) + offset, last_char - offset);
+        if(write_size <= 0)
         {
+            log_error(log_tag.c_str(), "Failed to encrypt data. Error: %d", write_size);
             return -1;
         }
-        offset += send_size;
+        offset += write_size;
+    }
+
+    // Take encrypted records. They will be sent by caller
+    unsigned int encrypted_size;
+    const unsigned char *encrypted_buffer = tls_get_write_buffer(context, &encrypted_size);
+    if(encrypted_buffer != NULL && encrypted_size != 0)
+        encrypted.append(reinterpret_cast<const char *>(encrypted_buffer), encrypted_size);
+    tls_buffer_clear(context);
+
+    return 0;
+}
+
+int init_root_store()
+{
+    std::string log_tag = "CPP/init_root_store";
+
+    std::string root_cert_pem;
+    if(read_file(settings.app_files_dir + "/root.pem", root_cert_pem) != 0)
+    {
+        log_error(log_tag.c_str(), "Failed to read verified root CA certificates");
+        return -1;
+    }
+
+    root_store = tls_root_store_load(reinterpret_cast<const unsigned char *>(root_cert_pem.c_str()), root_cert_pem.size());
+    if(root_store == NULL)
+    {
+        log_error(log_tag.c_str(), "Failed to parse verified root CA certificates");
+        return -1;
     }
+    log_debug(log_tag.c_str(), "Loaded %d root CA certificates", tls_root_store_count(root_store));
 
     return 0;
 }
 
-SSL* init_tls_server_server(const std::string & sni_str, const std::vector<std::string> & sni_arr)
+void deinit_root_store()
+{
+    tls_root_store_free(root_store);
+    root_store = NULL;
+}
+
+std::string get_mitm_session_key(SSL *context, const unsigned char *id, unsigned int id_len)
+{
+    // Sessions are resumed only for the same SNI, so client gets the same certificate
+    const char *sni = tls_sni(context);
+    return std::string(sni != NULL ? sni : "") + "/" + std::string(reinterpret_cast<const char *>(id), id_len);
+}
+
+int get_mitm_session(SSL *context, const unsigned char *id, unsigned int id_len, unsigned char *session, unsigned int session_len)
+{
+    std::string saved_session;
+    if (!find_in_mitm_session_cache(get_mitm_session_key(context, id, id_len), saved_session) || saved_session.size() > session_len)
+        return 0;
+    memcpy(session, saved_session.c_str(), saved_session.size());
+
+    return saved_session.size();
+}
+
+void put_mitm_session(SSL *context, const unsigned char *id, unsigned int id_len, const unsigned char *session, unsigned int session_len)
+{
+    add_to_mitm_session_cache(get_mitm_session_key(context, id, id_len), std::string(reinterpret_cast<const char *>(session), session_len));
+}
+
+std::shared_ptr<SSL> init_tls_server_server(const std::string & sni_str, const std::vector<std::string> & sni_arr)
 {
     std::string log_tag = "CPP/init_tls_server_server";
 
-    SSL *server_context = SSL_CTX_new(SSLv3_server_method());
+    // Parsed certificates are shared by all connections to the same hosts
+    std::shared_ptr<SSL> server_context = find_in_cert_cache(sni_str);
+    if (server_context)
+        return server_context;
+
+    server_context = std::shared_ptr<SSL>(SSL_CTX_new(SSLv3_server_method()), SSL_CTX_free);
 
     if (!server_context) {
         log_error(log_tag.c_str(), "Error creating server context");
@@ -146,19 +266,27 @@ SSL* init_tls_server_server(const std::string & sni_str, const std::vector<std::
 
     // Generate certificates
     GeneratedCA certificate;
-    generate_ssl_cert(sni_str, sni_arr, certificate);
+    if (generate_ssl_cert(sni_str, sni_arr, certificate) != 0)
+        return NULL;
 
     // Load certificates
-    tls_load_certificates(server_context,
+    tls_load_certificates(server_context.get(),
                           reinterpret_cast<const unsigned char *>(&certificate.public_key_pem[0]), certificate.public_key_pem.size());
-    tls_load_private_key(server_context,
+    tls_load_private_key(server_context.get(),
                          reinterpret_cast<const unsigned char *>(&certificate.private_key_pem[0]), certificate.private_key_pem.size());
 
-    if (!SSL_CTX_check_private_key(server_context)) {
+    if (!SSL_CTX_check_private_key(server_context.get())) {
         log_error(log_tag.c_str(), "Private key not loaded");
         return NULL;
     }
 
+    // Browsers open several connections to the same host. Let them resume session instead of full handshake
+    tls_set_session_store(server_context.get(), get_mitm_session, put_mitm_session);
+
+    // Parsed objects keep DER copies and decoded fields, which take about twice as much memory as PEM
+    add_to_cert_cache(sni_str, server_context,
+                      sni_str.size() + 2 * (certificate.public_key_pem.size() + certificate.private_key_pem.size()));
+
     return server_context;
 }
 
@@ -167,47 +295,76 @@ SSL* init_tls_server_client(int & client_socket, SSL* server_context)
     std::string log_tag = "CPP/init_tls_server_client";
 
     SSL *client = SSL_new(server_context);
+    if (!client) {
+        log_error(log_tag.c_str(), "Error creating client context");
+        return NULL;
+    }
 
-    SSL_set_io(server_context, (void  *) recv, (void  *) send);
+    // Server context is shared between threads, so set callbacks on connection's own context
+    SSL_set_io(client, (void  *) recv, (void  *) send);
 
     SSL_set_fd(client, client_socket);
 
-    if (!SSL_accept(client))
+    // Runs on worker thread, so peer which stops responding mustn't hold it
+    if (set_socket_timeout(client_socket, HANDSHAKE_TIMEOUT) == -1)
     {
-        log_error(log_tag.c_str(), "Error in handshake");
+        SSL_free(client);
         return NULL;
     }
 
+    std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+    int ret = SSL_accept(client);
+    if (set_socket_timeout(client_socket, {0, 0}) == -1 || ret != 1)
+    {
+        if (ret != 1)
+            log_error(log_tag.c_str(), "Error in handshake");
+        SSL_free(client);
+        return NULL;
+    }
+
+    count_mitm_handshake(tls_session_resumed(client),
+                         std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_time).count());
+
     return client;
 }
 
-SSL* init_tls_client(int & socket, std::string & sni, bool is_set_sni)
+std::string get_session_key(int socket, const std::string & sni, bool is_set_sni)
 {
-    std::string log_tag = "CPP/init_tls_client";
+    struct sockaddr_in address;
+    socklen_t address_size = sizeof(address);
+    if (getpeername(socket, (struct sockaddr *) &address, &address_size) != 0 || address.sin_family != AF_INET)
+        return "";
 
-    SSL *client_context = SSL_CTX_new(SSLv3_client_method());
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &address.sin_addr, ip, sizeof(ip));
 
-    // Load root certificates
-    // Read them from file if need
-    if (root_cert_store.empty())
-        if(read_file(settings.app_files_dir + "/root.pem", root_cert_store) != 0)
-        {
-            log_error(log_tag.c_str(), "Failed to read verified root CA certificates");
-            return NULL;
-        }
-    // Load them to tlse
-    tls_load_root_certificates(client_context,
-                               reinterpret_cast<const unsigned char *>(root_cert_store.c_str()),
-                               root_cert_store.size());
+    // Server may choose certificate and session store by SNI, so sessions are kept per IP and SNI
+    return std::string(ip) + ":" + std::to_string(ntohs(address.sin_port)) + "/" + (is_set_sni ? sni : "");
+}
 
-    // Set certificate validate function
-    SSL_CTX_set_verify(client_context, SSL_VERIFY_PEER, verify_certificate);
+SSL* init_tls_client(int & socket, std::string & sni, bool is_set_sni, tls_validation_function verify_callback)
+{
+    std::string log_tag = "CPP/init_tls_client";
+
+    SSL *client_context = SSL_CTX_new(SSLv3_client_method());
 
     if (!client_context) {
         log_error(log_tag.c_str(), "Error initializing client context");
         return NULL;
     }
 
+    // Use shared root certificates
+    if (tls_set_root_store(client_context, root_store) != 0)
+    {
+        log_error(log_tag.c_str(), "Verified root CA certificates aren't loaded");
+        SSL_CTX_free(client_context);
+        return NULL;
+    }
+
+    // Set certificate validate function
+    SSL_CTX_set_verify(client_context, SSL_VERIFY_PEER, verify_callback);
+
     // Switch socket to blocking mode
     long arg;
     if((arg = fcntl(socket, F_GETFL, NULL)) < 0) {
@@ -227,12 +384,47 @@ SSL* init_tls_client(int & socket, std::string & sni, bool is_set_sni)
     if(is_set_sni)
         tls_sni_set(client_context, sni.c_str());
 
+    // Offer session saved by previous connection to the same server with the same SNI
+    std::string session_key = get_session_key(socket, sni, is_set_sni);
+    std::string session;
+    if (!session_key.empty() && find_in_session_cache(session_key, session))
+        tls_session_import(client_context, reinterpret_cast<const unsigned char *>(session.c_str()), session.size());
+
+    // Runs on worker thread, so server which stops responding mustn't hold it
+    if (set_socket_timeout(socket, HANDSHAKE_TIMEOUT) == -1) {
+        SSL_CTX_free(client_context);
+        return NULL;
+    }
+
+    std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
     int ret;
     if ((ret = SSL_connect(client_context)) != 1) {
         log_error(log_tag.c_str(), "Handshake Error %i. Errno %s", ret, std::strerror(errno));
+        // Don't offer the same session again if it's the reason of failure
+        if (!session_key.empty())
+            remove_from_session_cache(session_key);
+        set_socket_timeout(socket, {0, 0});
         return NULL;
     }
 
+    if (set_socket_timeout(socket, {0, 0}) == -1) {
+        SSL_CTX_free(client_context);
+        return NULL;
+    }
+
+    count_tls_handshake(tls_session_resumed(client_context),
+                        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_time).count());
+
+    // Save session for next connections. Resumed session may come with new ticket, so save it too
+    int session_size = tls_session_export(client_context, NULL, 0);
+    if (!session_key.empty() && session_size > 0)
+    {
+        session.resize(session_size);
+        if (tls_session_export(client_context, reinterpret_cast<unsigned char *>(&session[0]), session.size()) == session_size)
+            add_to_session_cache(session_key, session);
+    }
+
     // Switch socket to non-blocking mode
     if( (arg = fcntl(socket, F_GETFL, NULL)) < 0) {
         log_error(log_tag.c_str(), "Failed to set non-blocking mode for socket. Error: %s", std::strerror(errno));
@@ -2,12 +2,20 @@
 #define DPITUNNEL_SNI_H
 
 #include <tlse.h>
+#include <memory>
 #include <string>
 
+int recv_string_tls(int & socket, SSL *context, std::string & message, size_t max_size, unsigned int & last_char, bool & is_eof);
 int recv_string_tls(int & socket, SSL *context, std::string & message, unsigned int & last_char);
+int recv_string_tls(int & socket, SSL *context, std::string & message, struct timeval timeout, unsigned int & last_char);
 int send_string_tls(int & socket, TLSContext *context, const std::string & string_to_send, unsigned int last_char);
-SSL* init_tls_server_server(const std::string & sni_str, const std::vector<std::string> & sni_arr);
+int encrypt_string_tls(SSL *context, const std::string & string_to_encrypt, unsigned int last_char, std::string & encrypted);
+int verify_certificate(struct TLSContext *context, struct TLSCertificate **certificate_chain, int len);
+int init_root_store();
+void deinit_root_store();
+std::shared_ptr<SSL> init_tls_server_server(const std::string & sni_str, const std::vector<std::string> & sni_arr);
 SSL* init_tls_server_client(int & client_socket, SSL* server_context);
-SSL* init_tls_client(int & client_socket, std::string & sni, bool is_set_sni);
+SSL* init_tls_client(int & client_socket, std::string & sni, bool is_set_sni,
+                     tls_validation_function verify_callback = verify_certificate);
 
 #endif //DPITUNNEL_SNI_H
@@ -1,15 +1,26 @@
 #include "dpi-bypass.h"
 #include "fileIO.h"
 #include "sni_cert_gen.h"
+#include "cert_store.h"
+#include "stats.h"
 #include <openssl/err.h>
 #include <openssl/conf.h>
 #include <openssl/pem.h>
 #include <openssl/rand.h>
 #include <openssl/x509v3.h>
 
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
 extern struct Settings settings;
 
-const int RSA_KEY_BITS = 2048;
+// Leaf keys are ECDSA P-256. Generating them is cheap, but pool removes it from connection path at all
+const int LEAF_KEY_CURVE = NID_X9_62_prime256v1;
+const size_t KEY_POOL_SIZE = 8;
+const long CERT_VALIDITY_TIME = (long)2*365*24*3600;
+const long CERT_RENEW_TIME = (long)7*24*3600;
+const std::string CERT_STORE_FILE = "certs.db";
 const std::string REQ_DN_C = "RU";
 const std::string REQ_DN_ST = "The Great Russia";
 const std::string REQ_DN_L = "Secret city";
@@ -19,7 +30,18 @@ const std::string REQ_DN_OU = "Research";
 std::string root_crt;
 std::string root_key;
 
-std::map<std::string, GeneratedCA> certCache;
+
+// Parsed root CA. Loaded once on first certificate generation
+EVP_PKEY *ca_key = NULL;
+X509 *ca_crt = NULL;
+std::mutex ca_mutex;
+
+// Pre-generated leaf keys. Background thread keeps pool full
+std::vector<EVP_PKEY *> key_pool;
+std::mutex key_pool_mutex;
+std::condition_variable key_pool_condition;
+std::thread key_pool_thread;
+bool is_key_pool_stopping;
 
 int load_ca(EVP_PKEY **ca_key, X509 **ca_crt)
 {
@@ -64,106 +86,96 @@ int add_ext(STACK_OF(X509_EXTENSION) *sk, int nid, const char *value) {
     return 1;
 }
 
-int generate_key_csr(EVP_PKEY **key, X509_REQ **req, const std::vector<std::string> & sni_arr)
+EVP_PKEY* generate_leaf_key()
 {
-    *key = NULL;
-    *req = NULL;
-    RSA *rsa = NULL;
-    BIGNUM *e = NULL;
+    EC_KEY *ec_key = EC_KEY_new_by_curve_name(LEAF_KEY_CURVE);
+    if (!ec_key)
+        return NULL;
 
-    *key = EVP_PKEY_new();
-    if (!*key){
-        EVP_PKEY_free(*key);
-        X509_REQ_free(*req);
-        RSA_free(rsa);
-        BN_free(e);
-        return 0;
-
-    }
-    *req = X509_REQ_new();
-    if (!*req)
-    {
-        EVP_PKEY_free(*key);
-        X509_REQ_free(*req);
-        RSA_free(rsa);
-        BN_free(e);
-        return 0;
-    }
-    rsa = RSA_new();
-    if (!rsa)
+    /* Curve must be saved by name, tlse doesn't support explicit parameters. */
+    EC_KEY_set_asn1_flag(ec_key, OPENSSL_EC_NAMED_CURVE);
+    if (!EC_KEY_generate_key(ec_key))
     {
-        EVP_PKEY_free(*key);
-        X509_REQ_free(*req);
-        RSA_free(rsa);
-        BN_free(e);
-        return 0;
+        EC_KEY_free(ec_key);
+        return NULL;
     }
-    e = BN_new();
-    if (!e)
+
+    EVP_PKEY *key = EVP_PKEY_new();
+    if (!key || !EVP_PKEY_assign_EC_KEY(key, ec_key))
     {
-        EVP_PKEY_free(*key);
-        X509_REQ_free(*req);
-        RSA_free(rsa);
-        BN_free(e);
-        return 0;
+        EVP_PKEY_free(key);
+        EC_KEY_free(ec_key);
+        return NULL;
     }
 
-    BN_set_word(e, 65537);
-    if (!RSA_generate_key_ex(rsa, RSA_KEY_BITS, e, NULL))
+    return key;
+}
+
+void key_pool_cycle()
+{
+    std::unique_lock<std::mutex> lock(key_pool_mutex);
+    while(true)
     {
-        EVP_PKEY_free(*key);
-        X509_REQ_free(*req);
-        RSA_free(rsa);
-        BN_free(e);
-        return 0;
+        key_pool_condition.wait(lock, []{ return is_key_pool_stopping || key_pool.size() < KEY_POOL_SIZE; });
+        if(is_key_pool_stopping)
+            return;
+
+        // Generate without lock, so connections can take ready keys meanwhile
+        lock.unlock();
+        EVP_PKEY *key = generate_leaf_key();
+        lock.lock();
+
+        if(key)
+            key_pool.push_back(key);
     }
-    if (!EVP_PKEY_assign_RSA(*key, rsa))
+}
+
+EVP_PKEY* take_leaf_key()
+{
     {
-        EVP_PKEY_free(*key);
-        X509_REQ_free(*req);
-        RSA_free(rsa);
-        BN_free(e);
-        return 0;
+        std::lock_guard<std::mutex> lock(key_pool_mutex);
+        if(!key_pool.empty())
+        {
+            EVP_PKEY *key = key_pool.back();
+            key_pool.pop_back();
+            key_pool_condition.notify_one();
+            return key;
+        }
     }
 
-    X509_REQ_set_pubkey(*req, *key);
-
-    /* Set the DN of the request. */
-    X509_NAME *name = X509_REQ_get_subject_name(*req);
-    X509_NAME_add_entry_by_txt(name, "C", MBSTRING_ASC,
-                               reinterpret_cast<const unsigned char *>(REQ_DN_C.c_str()), -1, -1, 0);
-    X509_NAME_add_entry_by_txt(name, "ST", MBSTRING_ASC,
-                               reinterpret_cast<const unsigned char *>(REQ_DN_ST.c_str()), -1, -1, 0);
-    X509_NAME_add_entry_by_txt(name, "L", MBSTRING_ASC,
-                               reinterpret_cast<const unsigned char *>(REQ_DN_L.c_str()), -1, -1, 0);
-    X509_NAME_add_entry_by_txt(name, "O", MBSTRING_ASC,
-                               reinterpret_cast<const unsigned char *>(REQ_DN_O.c_str()), -1, -1, 0);
-    X509_NAME_add_entry_by_txt(name, "OU", MBSTRING_ASC,
-                               reinterpret_cast<const unsigned char *>(REQ_DN_OU.c_str()), -1, -1, 0);
-    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
-                               reinterpret_cast<const unsigned char *>(sni_arr[0].c_str()), -1, -1, 0);
-
-    /* Add alternative name
-     * DON'T need. We add extensions, while sign certificate
-    STACK_OF(X509_EXTENSION) *exts = sk_X509_EXTENSION_new_null();
-    add_ext(exts, NID_subject_alt_name, ("DNS: " + REQ_DN_CN).c_str());
+    // Pool is exhausted by burst of new hosts
+    return generate_leaf_key();
+}
 
-    X509_REQ_add_extensions(*req, exts);
-    sk_X509_EXTENSION_pop_free(exts, X509_EXTENSION_free);*/
+void init_cert_gen()
+{
+    is_key_pool_stopping = false;
+    key_pool_thread = std::thread(key_pool_cycle);
+}
 
-    /* Self-sign the request to prove that we posses the key. */
-    if (!X509_REQ_sign(*req, *key, EVP_sha256()))
+void deinit_cert_gen()
+{
     {
-        EVP_PKEY_free(*key);
-        X509_REQ_free(*req);
-        RSA_free(rsa);
-        BN_free(e);
-        return 0;
+        std::lock_guard<std::mutex> lock(key_pool_mutex);
+        is_key_pool_stopping = true;
     }
+    key_pool_condition.notify_one();
+    if(key_pool_thread.joinable())
+        key_pool_thread.join();
 
-    BN_free(e);
+    for(EVP_PKEY *key : key_pool)
+        EVP_PKEY_free(key);
+    key_pool.clear();
 
-    return 1;
+    // Root CA files can be regenerated while service is stopped
+    std::lock_guard<std::mutex> lock(ca_mutex);
+    EVP_PKEY_free(ca_key);
+    X509_free(ca_crt);
+    ca_key = NULL;
+    ca_crt = NULL;
+    deinit_cert_store();
+    root_key.clear();
+    root_crt.clear();
 }
 
 int generate_set_random_serial(X509 *crt)
@@ -206,10 +218,10 @@ int add_ext(X509 *cert, int nid, const char *value)
 
 int generate_signed_key_pair(EVP_PKEY *ca_key, X509 *ca_crt, EVP_PKEY **key, X509 **crt, const std::vector<std::string> & sni_arr)
 {
-    /* Generate the private key and corresponding CSR. */
-    X509_REQ *req = NULL;
-    if (!generate_key_csr(key, &req, sni_arr)) {
-        fprintf(stderr, "Failed to generate key and/or CSR!");
+    /* Take pre-generated private key. */
+    *key = take_leaf_key();
+    if (!*key) {
+        fprintf(stderr, "Failed to generate key!");
         return 0;
     }
 
@@ -218,7 +230,6 @@ int generate_signed_key_pair(EVP_PKEY *ca_key, X509 *ca_crt, EVP_PKEY **key, X50
     if (!*crt)
     {
         EVP_PKEY_free(*key);
-        X509_REQ_free(req);
         X509_free(*crt);
         return 0;
     }
@@ -228,7 +239,6 @@ int generate_signed_key_pair(EVP_PKEY *ca_key, X509 *ca_crt, EVP_PKEY **key, X50
     if (!generate_set_random_serial(*crt))
     {
         EVP_PKEY_free(*key);
-        X509_REQ_free(req);
         X509_free(*crt);
         return 0;
     }
@@ -247,25 +257,32 @@ int generate_signed_key_pair(EVP_PKEY *ca_key, X509 *ca_crt, EVP_PKEY **key, X50
 
     /* Set validity of certificate to 2 years. */
     X509_gmtime_adj(X509_get_notBefore(*crt), 0);
-    X509_gmtime_adj(X509_get_notAfter(*crt), (long)2*365*24*3600);
+    X509_gmtime_adj(X509_get_notAfter(*crt), CERT_VALIDITY_TIME);
 
-    /* Get the request's subject and just use it (we don't bother checking it since we generated
-     * it ourself). Also take the request's public key. */
-    X509_set_subject_name(*crt, X509_REQ_get_subject_name(req));
-    EVP_PKEY *req_pubkey = X509_REQ_get_pubkey(req);
-    X509_set_pubkey(*crt, req_pubkey);
-    EVP_PKEY_free(req_pubkey);
+    /* Set the DN of the certificate. There is no CSR, so CA signature is the only one made. */
+    X509_NAME *name = X509_get_subject_name(*crt);
+    X509_NAME_add_entry_by_txt(name, "C", MBSTRING_ASC,
+                               reinterpret_cast<const unsigned char *>(REQ_DN_C.c_str()), -1, -1, 0);
+    X509_NAME_add_entry_by_txt(name, "ST", MBSTRING_ASC,
+                               reinterpret_cast<const unsigned char *>(REQ_DN_ST.c_str()), -1, -1, 0);
+    X509_NAME_add_entry_by_txt(name, "L", MBSTRING_ASC,
+                               reinterpret_cast<const unsigned char *>(REQ_DN_L.c_str()), -1, -1, 0);
+    X509_NAME_add_entry_by_txt(name, "O", MBSTRING_ASC,
+                               reinterpret_cast<const unsigned char *>(REQ_DN_O.c_str()), -1, -1, 0);
+    X509_NAME_add_entry_by_txt(name, "OU", MBSTRING_ASC,
+                               reinterpret_cast<const unsigned char *>(REQ_DN_OU.c_str()), -1, -1, 0);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                               reinterpret_cast<const unsigned char *>(sni_arr[0].c_str()), -1, -1, 0);
+    X509_set_pubkey(*crt, *key);
 
     /* Now perform the actual signing with the CA. */
     if (X509_sign(*crt, ca_key, EVP_sha256()) == 0)
     {
         EVP_PKEY_free(*key);
-        X509_REQ_free(req);
         X509_free(*crt);
         return 0;
     }
 
-    X509_REQ_free(req);
     return 1;
 }
 
@@ -284,7 +301,8 @@ void key_to_pem(EVP_PKEY *key, uint8_t **key_bytes, size_t *key_size)
 {
     /* Convert private key to PEM format. */
     BIO *bio = BIO_new(BIO_s_mem());
-    PEM_write_bio_PrivateKey(bio, key, NULL, NULL, 0, NULL, NULL);
+    /* tlse reads EC keys in SEC1 format only. */
+    PEM_write_bio_ECPrivateKey(bio, EVP_PKEY_get0_EC_KEY(key), NULL, NULL, 0, NULL, NULL);
     *key_size = BIO_pending(bio);
     *key_bytes = (uint8_t *)malloc(*key_size + 1);
     BIO_read(bio, *key_bytes, *key_size);
@@ -309,25 +327,31 @@ int generate_ssl_cert(const std::string & sni_str, const std::vector<std::string
 {
     std::string log_tag = "CPP/generate_ssl_cert";
 
-    // First of all, try to find certificate in cache
-    auto it = certCache.find(sni_str);
-    if (it != certCache.end())
+    std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
     {
-        generatedCa = it->second;
-        return 0;
+        std::lock_guard<std::mutex> lock(ca_mutex);
+        // Load certs from file
+        if (root_crt.empty() || root_key.empty())
+            if (read_certs_from_file() != 0)
+                return -1;
+        // Move them to openssl
+        if (!ca_key) {
+            if (!load_ca(&ca_key, &ca_crt)) {
+                log_error(log_tag.c_str(), "Failed to load CA certificate and/or key!");
+                return -1;
+            }
+            // Open certificates saved by previous runs. Store is tied to CA, so it's opened once with it.
+            // On failure certificates are only generated, store isn't retried until service restarts
+            if (init_cert_store(settings.app_files_dir + "/" + CERT_STORE_FILE, root_crt) == -1)
+                log_error(log_tag.c_str(), "Failed to open certificate store, generated certificates won't be saved");
+        }
     }
 
-    // Load root CA key and cert.
-    EVP_PKEY *ca_key = NULL;
-    X509 *ca_crt = NULL;
-    // Load certs from file
-    if (root_crt.empty() || root_key.empty())
-        if (read_certs_from_file() != 0)
-            return -1;
-    // Move them to openssl
-    if (!load_ca(&ca_key, &ca_crt)) {
-        log_error(log_tag.c_str(), "Failed to load CA certificate and/or key!");
-        return -1;
+    if (find_in_cert_store(sni_str, generatedCa) == 0)
+    {
+        stats.cert_store_hits++;
+        return 0;
     }
 
     // Generate keypair
@@ -336,8 +360,6 @@ int generate_ssl_cert(const std::string & sni_str, const std::vector<std::string
 
     int ret = generate_signed_key_pair(ca_key, ca_crt, &key, &crt, sni_arr);
     if (!ret) {
-        EVP_PKEY_free(ca_key);
-        X509_free(ca_crt);
         log_error(log_tag.c_str(), "Failed to generate key pair!");
         return -1;
     }
@@ -356,16 +378,16 @@ int generate_ssl_cert(const std::string & sni_str, const std::vector<std::string
                 std::string(reinterpret_cast<char const*>(key_bytes), key_size)};
     generatedCa = cert;
 
-    // Store cert in cache
-    certCache[sni_str] = cert;
+    // Save it for next runs. It is regenerated a bit before certificate expires
+    add_to_cert_store(sni_str, cert, time(NULL) + CERT_VALIDITY_TIME - CERT_RENEW_TIME);
 
     // Free stuff.
-    EVP_PKEY_free(ca_key);
     EVP_PKEY_free(key);
-    X509_free(ca_crt);
     X509_free(crt);
     free(key_bytes);
     free(crt_bytes);
 
+    count_cert_generation(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_time).count());
+
     return 0;
-}
\ No newline at end of file
+}
@@ -6,6 +6,8 @@ struct GeneratedCA
     std::string       private_key_pem;
 };
 
+void init_cert_gen();
+void deinit_cert_gen();
 int generate_ssl_cert(const std::string & sni_str, const std::vector<std::string> & sni_arr, struct GeneratedCA & generatedCa);
 
 #endif //DPITUNNEL_SNI_CERT_GEN_H
@@ -4,113 +4,186 @@
 #include "sni.h"
 #include "dns.h"
 #include "hostlist.h"
+#include "stats.h"
+
+#include <fcntl.h>
 
 extern struct Settings settings;
 
-int recv_string(int & socket, std::string & message, unsigned int & last_char)
+// How long to wait for socket to become writable or for proxy server response
+extern const struct timeval SEND_TIMEOUT = {10, 0};
+// How long blocking TLS handshake waits for each read or write of peer
+extern const struct timeval HANDSHAKE_TIMEOUT = {10, 0};
+const struct timeval PROXY_RESPONSE_TIMEOUT = {10, 0};
+
+int wait_for_socket(int & socket, short events, struct timeval timeout)
 {
-    std::string log_tag = "CPP/recv_string";
+    std::string log_tag = "CPP/wait_for_socket";
 
-    ssize_t read_size;
-    size_t message_offset = 0;
+    struct pollfd fds[1];
+    fds[0].fd = socket;
+    fds[0].events = events;
+
+    int timeout_ms = timeout.tv_sec * 1000 + timeout.tv_usec / 1000;
 
-    // Set receive timeout on socket
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 50;
-    if(setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, (char *) &timeout, sizeof(timeout)) < 0)
+    while(true)
     {
-        log_error(log_tag.c_str(), "Can't setsockopt on socket");
+        int ret = poll(fds, 1, timeout_ms);
+        count_io(1, 0);
+        if(ret == -1)
+        {
+            if(errno == EINTR)      continue; // All is good. This is just interrrupt.
+            log_error(log_tag.c_str(), "Poll error. Errno: %s", std::strerror(errno));
+            return -1;
+        }
+        if(ret == 0)
+        {
+            log_error(log_tag.c_str(), "Timeout while waiting for socket");
+            return -1;
+        }
+        return 0;
+    }
+}
+
+int set_socket_nonblocking(int & socket)
+{
+    std::string log_tag = "CPP/set_socket_nonblocking";
+
+    long arg;
+    if((arg = fcntl(socket, F_GETFL, NULL)) < 0 || fcntl(socket, F_SETFL, arg | O_NONBLOCK) < 0)
+    {
+        log_error(log_tag.c_str(), "Failed to set non-blocking mode for socket. Error: %s", std::strerror(errno));
         return -1;
     }
 
-    while(true)
+    return 0;
+}
+
+int set_socket_timeout(int & socket, struct timeval timeout)
+{
+    std::string log_tag = "CPP/set_socket_timeout";
+
+    // Zero timeout makes blocking calls wait forever again
+    if(setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, (char *) &timeout, sizeof(timeout)) < 0
+        || setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, (char *) &timeout, sizeof(timeout)) < 0)
     {
-        if(message.size() - message_offset < 1024) // If there isn't any space in message string - just increase it
+        log_error(log_tag.c_str(), "Failed to set timeout for socket. Error: %s", std::strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int connect_with_timeout(int & socket, struct sockaddr_in & address, struct timeval timeout)
+{
+    std::string log_tag = "CPP/connect_with_timeout";
+
+    // Connect in non-blocking mode to be able to limit time
+    long arg;
+    if((arg = fcntl(socket, F_GETFL, NULL)) < 0 || fcntl(socket, F_SETFL, arg | O_NONBLOCK) < 0)
+    {
+        log_error(log_tag.c_str(), "Failed to set non-blocking mode for socket. Error: %s", std::strerror(errno));
+        return -1;
+    }
+
+    if(connect(socket, (struct sockaddr *) &address, sizeof(address)) < 0)
+    {
+        if(errno != EINPROGRESS)
         {
-            message.resize(message.size() + 1024);
+            log_error(log_tag.c_str(), "Can't connect. Errno: %s", std::strerror(errno));
+            return -1;
         }
 
-        read_size = recv(socket, &message[0] + message_offset, message.size() - message_offset, 0);
-        if(read_size < 0)
+        if(wait_for_socket(socket, POLLOUT, timeout) == -1)
+            return -1;
+
+        int error = 0;
+        socklen_t error_size = sizeof(error);
+        if(getsockopt(socket, SOL_SOCKET, SO_ERROR, &error, &error_size) < 0 || error != 0)
         {
-            if(errno == EWOULDBLOCK)	break;
-            if(errno == EINTR)      continue; // All is good. This is just interrrupt.
-            else
-            {
-                log_error(log_tag.c_str(), "There is critical read error. Can't process client. Errno: %s", std::strerror(errno));
-                return -1;
-            }
+            log_error(log_tag.c_str(), "Can't connect. Errno: %s", std::strerror(error != 0 ? error : errno));
+            return -1;
         }
-        else if(read_size == 0) return -1;
-
-        message_offset += read_size;
     }
 
-    // Set position of last character
-    last_char = message_offset;
+    // Restore blocking mode
+    if(fcntl(socket, F_SETFL, arg) < 0)
+    {
+        log_error(log_tag.c_str(), "Failed to set blocking mode for socket. Error: %s", std::strerror(errno));
+        return -1;
+    }
 
     return 0;
 }
 
-int recv_string(int & socket, std::string & message, struct timeval timeout, unsigned int & last_char)
+int recv_string(int & socket, std::string & message, size_t max_size, unsigned int & last_char, bool & is_eof)
 {
     std::string log_tag = "CPP/recv_string";
 
     ssize_t read_size;
     size_t message_offset = 0;
+    uint64_t syscalls = 0;
 
-    if(setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, (char *) &timeout, sizeof(timeout)) < 0)
-    {
-        log_error(log_tag.c_str(), "Can't setsockopt on socket");
-        return -1;
-    }
-
-    bool is_first_time = true;
+    is_eof = false;
 
-    while(true)
+    // Read until socket is drained, peer closes connection or max_size bytes are read. Reads never block, so caller waits for readiness with poll/epoll
+    while(message_offset < max_size)
     {
         if(message.size() - message_offset < 1024) // If there isn't any space in message string - just increase it
         {
-            message.resize(message.size() + 1024);
+            // Use reserved capacity of pooled buffer first
+            message.resize(std::max(message.capacity(), message.size() + 1024));
         }
 
-        read_size = recv(socket, &message[0] + message_offset, message.size() - message_offset, 0);
+        read_size = recv(socket, &message[0] + message_offset, std::min(message.size(), max_size) - message_offset, MSG_DONTWAIT);
+        syscalls++;
         if(read_size < 0)
         {
-            if(errno == EWOULDBLOCK)	break;
+            if(errno == EWOULDBLOCK || errno == EAGAIN)	break;
             if(errno == EINTR)      continue; // All is good. This is just interrrupt.
             else
             {
                 log_error(log_tag.c_str(), "There is critical read error. Can't process client. Errno: %s", std::strerror(errno));
+                count_io(syscalls, message_offset);
                 return -1;
             }
         }
-        else if(read_size == 0) return -1;
-
-        message_offset += read_size;
-
-        if(is_first_time)
+        else if(read_size == 0)
         {
-            struct timeval timeout;
-            timeout.tv_sec = 0;
-            timeout.tv_usec = 50;
-            if(setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, (char *) &timeout, sizeof(timeout)) < 0)
-            {
-                log_error(log_tag.c_str(), "Can't setsockopt on socket");
-                return -1;
-            }
-
-            is_first_time = false;
+            is_eof = true;
+            break;
         }
+
+        message_offset += read_size;
     }
 
+    count_io(syscalls, message_offset);
+
     // Set position of last character
     last_char = message_offset;
 
     return 0;
 }
 
+int recv_string(int & socket, std::string & message, unsigned int & last_char)
+{
+    bool is_eof;
+    if(recv_string(socket, message, SIZE_MAX, last_char, is_eof) == -1)
+        return -1;
+
+    // Data read before connection was closed is returned first, next call fails
+    return is_eof && last_char == 0 ? -1 : 0;
+}
+
+int recv_string(int & socket, std::string & message, struct timeval timeout, unsigned int & last_char)
+{
+    // Wait for first data
+    if(wait_for_socket(socket, POLLIN, timeout) == -1)
+        return -1;
+
+    return recv_string(socket, message, last_char);
+}
+
 int send_string(int & socket, const std::string & string_to_send, unsigned int last_char)
 {
     std::string log_tag = "CPP/send_string";
@@ -121,22 +194,19 @@ int send_string(int & socket, const std::string & string_to_send, unsigned int l
 
     size_t offset = 0;
 
-    // Set send timeout on socket
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 100;
-    if(setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, (char *) &timeout, sizeof(timeout)) < 0)
-    {
-        log_error(log_tag.c_str(), "Can't setsockopt on socket");
-        return -1;
-    }
-
     while(last_char - offset != 0)
     {
         ssize_t send_size = send(socket, string_to_send.c_str() + offset, last_char - offset, 0);
+        count_io(1, 0);
         if(send_size < 0)
         {
             if(errno == EINTR)      continue; // All is good. This is just interrrupt.
+            if(errno == EWOULDBLOCK || errno == EAGAIN) // Socket buffer is full
+            {
+                if(wait_for_socket(socket, POLLOUT, SEND_TIMEOUT) == -1)
+                    return -1;
+                continue;
+            }
             else {
                 log_error(log_tag.c_str(), "There is critical send error. Can't process client. Errno: %s", std::strerror(errno));
                 return -1;
@@ -162,22 +232,19 @@ int send_string(int & socket, const std::string & string_to_send, unsigned int s
 
     size_t offset = 0;
 
-    // Set send timeout on socket
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 100;
-    if(setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, (char *) &timeout, sizeof(timeout)) < 0)
-    {
-        log_error(log_tag.c_str(), "Can't setsockopt on socket");
-        return -1;
-    }
-
     while(last_char - offset != 0)
     {
         ssize_t send_size = send(socket, string_to_send.c_str() + offset, last_char - offset < split_position ? last_char - offset < split_position : split_position, 0);
+        count_io(1, 0);
         if(send_size < 0)
         {
             if(errno == EINTR)	continue; // All is good. This is just interrrupt.
+            if(errno == EWOULDBLOCK || errno == EAGAIN) // Socket buffer is full
+            {
+                if(wait_for_socket(socket, POLLOUT, SEND_TIMEOUT) == -1)
+                    return -1;
+                continue;
+            }
             else
             {
                 log_error(log_tag.c_str(), "There is critical send error. Can't process client. Errno: %s", std::strerror(errno));
@@ -263,7 +330,7 @@ int init_remote_server_socket(int & remote_server_socket, std::string & remote_s
         proxy_message_buffer.resize(0);
         do
         {
-            if(recv_string(remote_server_socket, proxy_message_buffer, last_char) == -1)
+            if(recv_string(remote_server_socket, proxy_message_buffer, PROXY_RESPONSE_TIMEOUT, last_char) == -1)
             {
                 log_error(log_tag.c_str(), "Failed to receive response from proxy server");
                 return -1;
@@ -308,7 +375,7 @@ int init_remote_server_socket(int & remote_server_socket, std::string & remote_s
         proxy_message_buffer.resize(0);
         do
         {
-            if(recv_string(remote_server_socket, proxy_message_buffer, last_char) == -1)
+            if(recv_string(remote_server_socket, proxy_message_buffer, PROXY_RESPONSE_TIMEOUT, last_char) == -1)
             {
                 log_error(log_tag.c_str(), "Failed to receive response from proxy server");
                 return -1;
@@ -383,7 +450,7 @@ int init_remote_server_socket(int & remote_server_socket, std::string & remote_s
         proxy_message_buffer.resize(0);
         do
         {
-            if(recv_string(remote_server_socket, proxy_message_buffer, last_char) == -1)
+            if(recv_string(remote_server_socket, proxy_message_buffer, PROXY_RESPONSE_TIMEOUT, last_char) == -1)
             {
                 log_error(log_tag.c_str(), "Failed to receive response from proxy server");
                 return -1;
@@ -469,7 +536,7 @@ int init_remote_server_socket(int & remote_server_socket, std::string & remote_s
         proxy_message_buffer.resize(0);
         do
         {
-            if(recv_string_tls(remote_server_socket, client_context, proxy_message_buffer, last_char) == -1)
+            if(recv_string_tls(remote_server_socket, client_context, proxy_message_buffer, PROXY_RESPONSE_TIMEOUT, last_char) == -1)
             {
                 log_error(log_tag.c_str(), "Failed to receive response from proxy server");
                 return -1;
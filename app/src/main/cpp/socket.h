@@ -1,6 +1,16 @@
 #ifndef DPITUNNEL_SOCKET_H
 #define DPITUNNEL_SOCKET_H
 
+// How long blocking send waits for socket to become writable
+extern const struct timeval SEND_TIMEOUT;
+// How long blocking TLS handshake waits for each read or write of peer
+extern const struct timeval HANDSHAKE_TIMEOUT;
+
+int wait_for_socket(int & socket, short events, struct timeval timeout);
+int set_socket_nonblocking(int & socket);
+int set_socket_timeout(int & socket, struct timeval timeout);
+int connect_with_timeout(int & socket, struct sockaddr_in & address, struct timeval timeout);
+int recv_string(int & socket, std::string & message, size_t max_size, unsigned int & last_char, bool & is_eof);
 int recv_string(int & socket, std::string & message, unsigned int & last_char);
 int recv_string(int & socket, std::string & message, struct timeval timeout, unsigned int & last_char);
 int send_string(int & socket, const std::string & string_to_send, unsigned int last_char);
@@ -0,0 +1,104 @@
+#include "dpi-bypass.h"
+#include "stats.h"
+
+Stats stats;
+
+void count_io(uint64_t syscalls, uint64_t bytes)
+{
+    // Counters are only read for reporting, so no ordering is needed
+    stats.io_syscalls.fetch_add(syscalls, std::memory_order_relaxed);
+    stats.io_bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void count_cert_generation(uint64_t time_us)
+{
+    stats.cert_generated++;
+    stats.cert_generation_time_us += time_us;
+
+    uint64_t max_time_us = stats.cert_generation_max_time_us;
+    while(time_us > max_time_us && !stats.cert_generation_max_time_us.compare_exchange_weak(max_time_us, time_us));
+}
+
+void count_tls_handshake(bool is_resumed, uint64_t time_us)
+{
+    stats.tls_handshakes++;
+    if(is_resumed)
+        stats.tls_resumed_handshakes++;
+    stats.tls_handshake_time_us += time_us;
+}
+
+void count_mitm_handshake(bool is_resumed, uint64_t time_us)
+{
+    stats.mitm_handshakes++;
+    if(is_resumed)
+        stats.mitm_resumed_handshakes++;
+    stats.mitm_handshake_time_us += time_us;
+}
+
+void reset_stats()
+{
+    stats.io_syscalls = 0;
+    stats.io_bytes = 0;
+    stats.pool_in_use = 0;
+    stats.dns_cache_hits = 0;
+    stats.dns_cache_misses = 0;
+    stats.dns_cache_coalesced = 0;
+    stats.cert_cache_hits = 0;
+    stats.cert_cache_misses = 0;
+    stats.cert_cache_evictions = 0;
+    stats.cert_store_hits = 0;
+    stats.cert_generated = 0;
+    stats.cert_generation_time_us = 0;
+    stats.cert_generation_max_time_us = 0;
+    stats.chain_cache_hits = 0;
+    stats.chain_cache_misses = 0;
+    stats.tls_handshakes = 0;
+    stats.tls_resumed_handshakes = 0;
+    stats.tls_handshake_time_us = 0;
+    stats.mitm_handshakes = 0;
+    stats.mitm_resumed_handshakes = 0;
+    stats.mitm_handshake_time_us = 0;
+    for(unsigned int i = 0; i < BUFFER_CLASSES_COUNT; i++)
+    {
+        stats.pool_free[i] = 0;
+        stats.pool_allocated[i] = 0;
+    }
+}
+
+void log_stats()
+{
+    std::string log_tag = "CPP/stats";
+
+    uint64_t io_syscalls = stats.io_syscalls;
+    uint64_t io_bytes = stats.io_bytes;
+    log_debug(log_tag.c_str(), "I/O: %llu syscalls, %llu bytes, %.1f syscalls per MB",
+              (unsigned long long) io_syscalls, (unsigned long long) io_bytes,
+              io_bytes == 0 ? 0.0 : io_syscalls / (io_bytes / 1048576.0));
+    log_debug(log_tag.c_str(), "Buffer pool: %llu in use, 16K: %llu free, %llu allocated, 64K: %llu free, %llu allocated",
+              (unsigned long long) stats.pool_in_use.load(),
+              (unsigned long long) stats.pool_free[0].load(), (unsigned long long) stats.pool_allocated[0].load(),
+              (unsigned long long) stats.pool_free[1].load(), (unsigned long long) stats.pool_allocated[1].load());
+    log_debug(log_tag.c_str(), "DNS cache: %llu hits, %llu misses, %llu coalesced",
+              (unsigned long long) stats.dns_cache_hits.load(), (unsigned long long) stats.dns_cache_misses.load(),
+              (unsigned long long) stats.dns_cache_coalesced.load());
+    log_debug(log_tag.c_str(), "Certificate cache: %llu hits, %llu misses, %llu evictions",
+              (unsigned long long) stats.cert_cache_hits.load(), (unsigned long long) stats.cert_cache_misses.load(),
+              (unsigned long long) stats.cert_cache_evictions.load());
+    uint64_t cert_generated = stats.cert_generated;
+    log_debug(log_tag.c_str(), "Certificates: %llu loaded from store, %llu generated, generation latency %llu us average, %llu us max",
+              (unsigned long long) stats.cert_store_hits.load(), (unsigned long long) cert_generated,
+              (unsigned long long) (cert_generated == 0 ? 0 : stats.cert_generation_time_us / cert_generated),
+              (unsigned long long) stats.cert_generation_max_time_us.load());
+    log_debug(log_tag.c_str(), "Verified chain cache: %llu hits, %llu misses",
+              (unsigned long long) stats.chain_cache_hits.load(), (unsigned long long) stats.chain_cache_misses.load());
+    uint64_t tls_handshakes = stats.tls_handshakes;
+    log_debug(log_tag.c_str(), "Upstream TLS: %llu handshakes, %llu resumed (%.1f%%), handshake latency %llu us average",
+              (unsigned long long) tls_handshakes, (unsigned long long) stats.tls_resumed_handshakes.load(),
+              tls_handshakes == 0 ? 0.0 : stats.tls_resumed_handshakes * 100.0 / tls_handshakes,
+              (unsigned long long) (tls_handshakes == 0 ? 0 : stats.tls_handshake_time_us / tls_handshakes));
+    uint64_t mitm_handshakes = stats.mitm_handshakes;
+    log_debug(log_tag.c_str(), "MITM TLS: %llu handshakes, %llu resumed (%.1f%%), handshake latency %llu us average",
+              (unsigned long long) mitm_handshakes, (unsigned long long) stats.mitm_resumed_handshakes.load(),
+              mitm_handshakes == 0 ? 0.0 : stats.mitm_resumed_handshakes * 100.0 / mitm_handshakes,
+              (unsigned long long) (mitm_handshakes == 0 ? 0 : stats.mitm_handshake_time_us / mitm_handshakes));
+}
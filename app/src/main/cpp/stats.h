@@ -0,0 +1,51 @@
+#ifndef DPITUNNEL_STATS_H
+#define DPITUNNEL_STATS_H
+
+#include <atomic>
+#include "buffer_pool.h"
+
+struct Stats
+{
+    // Socket syscalls made while relaying data and bytes read by them
+    std::atomic<uint64_t> io_syscalls;
+    std::atomic<uint64_t> io_bytes;
+    // Buffer pool occupancy. Free buffers and allocations are counted per size class
+    std::atomic<uint64_t> pool_in_use;
+    std::atomic<uint64_t> pool_free[BUFFER_CLASSES_COUNT];
+    std::atomic<uint64_t> pool_allocated[BUFFER_CLASSES_COUNT];
+    // DNS cache lookups. Coalesced lookups waited for result of same query made by another thread
+    std::atomic<uint64_t> dns_cache_hits;
+    std::atomic<uint64_t> dns_cache_misses;
+    std::atomic<uint64_t> dns_cache_coalesced;
+    // MITM certificate cache. Misses are loaded from certificate store or generated
+    std::atomic<uint64_t> cert_cache_hits;
+    std::atomic<uint64_t> cert_cache_misses;
+    std::atomic<uint64_t> cert_cache_evictions;
+    std::atomic<uint64_t> cert_store_hits;
+    // Generation is timed, as certificate is generated on connection path
+    std::atomic<uint64_t> cert_generated;
+    std::atomic<uint64_t> cert_generation_time_us;
+    std::atomic<uint64_t> cert_generation_max_time_us;
+    // Upstream certificate chains verified recently. Hits skip signature verification
+    std::atomic<uint64_t> chain_cache_hits;
+    std::atomic<uint64_t> chain_cache_misses;
+    // Upstream TLS handshakes. Resumed ones skip key exchange and certificate transfer
+    std::atomic<uint64_t> tls_handshakes;
+    std::atomic<uint64_t> tls_resumed_handshakes;
+    std::atomic<uint64_t> tls_handshake_time_us;
+    // MITM server handshakes with clients. Resumed ones skip certificate and its signature
+    std::atomic<uint64_t> mitm_handshakes;
+    std::atomic<uint64_t> mitm_resumed_handshakes;
+    std::atomic<uint64_t> mitm_handshake_time_us;
+};
+
+extern Stats stats;
+
+void count_io(uint64_t syscalls, uint64_t bytes);
+void count_cert_generation(uint64_t time_us);
+void count_tls_handshake(bool is_resumed, uint64_t time_us);
+void count_mitm_handshake(bool is_resumed, uint64_t time_us);
+void reset_stats();
+void log_stats();
+
+#endif //DPITUNNEL_STATS_H
@@ -0,0 +1,372 @@
+// Multi-block ChaCha20 and two-way Poly1305 kernels for tlse.c
+//
+// Included from tlse.c next to the scalar implementation. SSE2 and NEON are part of the x86 and
+// armeabi-v7a/arm64-v8a ABIs and are used whenever the compiler targets them, AVX2 ChaCha20 is
+// selected at runtime. Input shorter than one SIMD chunk is left to the scalar code.
+
+#if defined(__SSE2__)
+    #define TLS_CHACHA_SIMD
+    #define TLS_CHACHA_SIMD_SSE2
+    #include <immintrin.h>
+    #include <cpuid.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    #define TLS_CHACHA_SIMD
+    #define TLS_CHACHA_SIMD_NEON
+    #include <arm_neon.h>
+#endif
+
+#ifdef TLS_CHACHA_SIMD
+#define TLS_CHACHA_SIMD_CHUNK (4 * CHACHA_BLOCKLEN)
+
+#ifdef TLS_CHACHA_SIMD_SSE2
+#define TLS_SSE2_ROTL(x, n) _mm_or_si128(_mm_slli_epi32(x, n), _mm_srli_epi32(x, 32 - (n)))
+#define TLS_SSE2_ROTL16(x) _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xB1), 0xB1)
+#define TLS_SSE2_QUARTERROUND(a, b, c, d) \
+    a = _mm_add_epi32(a, b); d = TLS_SSE2_ROTL16(_mm_xor_si128(d, a)); \
+    c = _mm_add_epi32(c, d); b = TLS_SSE2_ROTL(_mm_xor_si128(b, c), 12); \
+    a = _mm_add_epi32(a, b); d = TLS_SSE2_ROTL(_mm_xor_si128(d, a), 8); \
+    c = _mm_add_epi32(c, d); b = TLS_SSE2_ROTL(_mm_xor_si128(b, c), 7);
+
+// 4 blocks, lane i of every state word belongs to block counter + i
+static void _private_tls_chacha_4blocks_sse2(const u32 *input, const u8 *m, u8 *c) {
+    __m128i x[16], j[16], t0, t1, t2, t3;
+    int i, b;
+
+    for (i = 0; i < 16; i++)
+        j[i] = _mm_set1_epi32((int)input[i]);
+    j[12] = _mm_add_epi32(j[12], _mm_set_epi32(3, 2, 1, 0));
+    for (i = 0; i < 16; i++)
+        x[i] = j[i];
+
+    for (i = 20; i > 0; i -= 2) {
+        TLS_SSE2_QUARTERROUND(x[0], x[4], x[8], x[12])
+        TLS_SSE2_QUARTERROUND(x[1], x[5], x[9], x[13])
+        TLS_SSE2_QUARTERROUND(x[2], x[6], x[10], x[14])
+        TLS_SSE2_QUARTERROUND(x[3], x[7], x[11], x[15])
+        TLS_SSE2_QUARTERROUND(x[0], x[5], x[10], x[15])
+        TLS_SSE2_QUARTERROUND(x[1], x[6], x[11], x[12])
+        TLS_SSE2_QUARTERROUND(x[2], x[7], x[8], x[13])
+        TLS_SSE2_QUARTERROUND(x[3], x[4], x[9], x[14])
+    }
+
+    for (i = 0; i < 16; i += 4) {
+        __m128i r[4];
+        // transpose words i..i+3 of the 4 blocks
+        t0 = _mm_unpacklo_epi32(_mm_add_epi32(x[i], j[i]), _mm_add_epi32(x[i + 1], j[i + 1]));
+        t1 = _mm_unpacklo_epi32(_mm_add_epi32(x[i + 2], j[i + 2]), _mm_add_epi32(x[i + 3], j[i + 3]));
+        t2 = _mm_unpackhi_epi32(_mm_add_epi32(x[i], j[i]), _mm_add_epi32(x[i + 1], j[i + 1]));
+        t3 = _mm_unpackhi_epi32(_mm_add_epi32(x[i + 2], j[i + 2]), _mm_add_epi32(x[i + 3], j[i + 3]));
+        r[0] = _mm_unpacklo_epi64(t0, t1);
+        r[1] = _mm_unpackhi_epi64(t0, t1);
+        r[2] = _mm_unpacklo_epi64(t2, t3);
+        r[3] = _mm_unpackhi_epi64(t2, t3);
+        for (b = 0; b < 4; b++) {
+            const __m128i *in = (const __m128i *)(m + b * CHACHA_BLOCKLEN + i * 4);
+            _mm_storeu_si128((__m128i *)(c + b * CHACHA_BLOCKLEN + i * 4), _mm_xor_si128(r[b], _mm_loadu_si128(in)));
+        }
+    }
+}
+
+#define TLS_AVX2_ROTL(x, n) _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+#define TLS_AVX2_QUARTERROUND(a, b, c, d) \
+    a = _mm256_add_epi32(a, b); d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot16); \
+    c = _mm256_add_epi32(c, d); b = TLS_AVX2_ROTL(_mm256_xor_si256(b, c), 12); \
+    a = _mm256_add_epi32(a, b); d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot8); \
+    c = _mm256_add_epi32(c, d); b = TLS_AVX2_ROTL(_mm256_xor_si256(b, c), 7);
+
+// 8 blocks, the 128-bit halves of the transposed rows hold blocks b and b + 4
+__attribute__((target("avx2")))
+static void _private_tls_chacha_8blocks_avx2(const u32 *input, const u8 *m, u8 *c) {
+    const __m256i rot16 = _mm256_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+                                          13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2);
+    const __m256i rot8 = _mm256_set_epi8(14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3,
+                                         14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3);
+    __m256i x[16], j[16], t0, t1, t2, t3;
+    int i, b;
+
+    for (i = 0; i < 16; i++)
+        j[i] = _mm256_set1_epi32((int)input[i]);
+    j[12] = _mm256_add_epi32(j[12], _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+    for (i = 0; i < 16; i++)
+        x[i] = j[i];
+
+    for (i = 20; i > 0; i -= 2) {
+        TLS_AVX2_QUARTERROUND(x[0], x[4], x[8], x[12])
+        TLS_AVX2_QUARTERROUND(x[1], x[5], x[9], x[13])
+        TLS_AVX2_QUARTERROUND(x[2], x[6], x[10], x[14])
+        TLS_AVX2_QUARTERROUND(x[3], x[7], x[11], x[15])
+        TLS_AVX2_QUARTERROUND(x[0], x[5], x[10], x[15])
+        TLS_AVX2_QUARTERROUND(x[1], x[6], x[11], x[12])
+        TLS_AVX2_QUARTERROUND(x[2], x[7], x[8], x[13])
+        TLS_AVX2_QUARTERROUND(x[3], x[4], x[9], x[14])
+    }
+
+    for (i = 0; i < 16; i += 4) {
+        __m256i r[4];
+        t0 = _mm256_unpacklo_epi32(_mm256_add_epi32(x[i], j[i]), _mm256_add_epi32(x[i + 1], j[i + 1]));
+        t1 = _mm256_unpacklo_epi32(_mm256_add_epi32(x[i + 2], j[i + 2]), _mm256_add_epi32(x[i + 3], j[i + 3]));
+        t2 = _mm256_unpackhi_epi32(_mm256_add_epi32(x[i], j[i]), _mm256_add_epi32(x[i + 1], j[i + 1]));
+        t3 = _mm256_unpackhi_epi32(_mm256_add_epi32(x[i + 2], j[i + 2]), _mm256_add_epi32(x[i + 3], j[i + 3]));
+        r[0] = _mm256_unpacklo_epi64(t0, t1);
+        r[1] = _mm256_unpackhi_epi64(t0, t1);
+        r[2] = _mm256_unpacklo_epi64(t2, t3);
+        r[3] = _mm256_unpackhi_epi64(t2, t3);
+        for (b = 0; b < 4; b++) {
+            u32 lo = b * CHACHA_BLOCKLEN + i * 4;
+            u32 hi = lo + 4 * CHACHA_BLOCKLEN;
+            _mm_storeu_si128((__m128i *)(c + lo), _mm_xor_si128(_mm256_castsi256_si128(r[b]), _mm_loadu_si128((const __m128i *)(m + lo))));
+            _mm_storeu_si128((__m128i *)(c + hi), _mm_xor_si128(_mm256_extracti128_si256(r[b], 1), _mm_loadu_si128((const __m128i *)(m + hi))));
+        }
+    }
+}
+
+static int _private_tls_has_avx2() {
+    static int avx2 = -1;
+    unsigned int a, b, c, d;
+    int res = 0;
+
+    if (avx2 >= 0)
+        return avx2;
+    // AVX2 (leaf 7 EBX bit 5) and OS support for the ymm state (OSXSAVE, XCR0 bits 1 and 2)
+    if ((__get_cpuid(1, &a, &b, &c, &d)) && (c & (1U << 27)) && (__get_cpuid_max(0, NULL) >= 7)) {
+        unsigned int xcr0_lo, xcr0_hi;
+        __asm__ volatile ("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+        __cpuid_count(7, 0, a, b, c, d);
+        res = ((xcr0_lo & 6) == 6) && (b & (1U << 5));
+    }
+    avx2 = res;
+    return res;
+}
+#endif
+
+#ifdef TLS_CHACHA_SIMD_NEON
+#define TLS_NEON_ROTL(x, n) vsriq_n_u32(vshlq_n_u32(x, n), x, 32 - (n))
+#define TLS_NEON_ROTL16(x) vreinterpretq_u32_u16(vrev32q_u16(vreinterpretq_u16_u32(x)))
+#define TLS_NEON_QUARTERROUND(a, b, c, d) \
+    a = vaddq_u32(a, b); d = veorq_u32(d, a); d = TLS_NEON_ROTL16(d); \
+    c = vaddq_u32(c, d); b = veorq_u32(b, c); b = TLS_NEON_ROTL(b, 12); \
+    a = vaddq_u32(a, b); d = veorq_u32(d, a); d = TLS_NEON_ROTL(d, 8); \
+    c = vaddq_u32(c, d); b = veorq_u32(b, c); b = TLS_NEON_ROTL(b, 7);
+
+// 4 blocks, lane i of every state word belongs to block counter + i
+static void _private_tls_chacha_4blocks_neon(const u32 *input, const u8 *m, u8 *c) {
+    static const u32 lanes[4] = {0, 1, 2, 3};
+    uint32x4_t x[16], j[16];
+    uint32x4x2_t t01, t23;
+    int i, b;
+
+    for (i = 0; i < 16; i++)
+        j[i] = vdupq_n_u32(input[i]);
+    j[12] = vaddq_u32(j[12], vld1q_u32(lanes));
+    for (i = 0; i < 16; i++)
+        x[i] = j[i];
+
+    for (i = 20; i > 0; i -= 2) {
+        TLS_NEON_QUARTERROUND(x[0], x[4], x[8], x[12])
+        TLS_NEON_QUARTERROUND(x[1], x[5], x[9], x[13])
+        TLS_NEON_QUARTERROUND(x[2], x[6], x[10], x[14])
+        TLS_NEON_QUARTERROUND(x[3], x[7], x[11], x[15])
+        TLS_NEON_QUARTERROUND(x[0], x[5], x[10], x[15])
+        TLS_NEON_QUARTERROUND(x[1], x[6], x[11], x[12])
+        TLS_NEON_QUARTERROUND(x[2], x[7], x[8], x[13])
+        TLS_NEON_QUARTERROUND(x[3], x[4], x[9], x[14])
+    }
+
+    for (i = 0; i < 16; i += 4) {
+        uint32x4_t r[4];
+        // transpose words i..i+3 of the 4 blocks
+        t01 = vtrnq_u32(vaddq_u32(x[i], j[i]), vaddq_u32(x[i + 1], j[i + 1]));
+        t23 = vtrnq_u32(vaddq_u32(x[i + 2], j[i + 2]), vaddq_u32(x[i + 3], j[i + 3]));
+        r[0] = vcombine_u32(vget_low_u32(t01.val[0]), vget_low_u32(t23.val[0]));
+        r[1] = vcombine_u32(vget_low_u32(t01.val[1]), vget_low_u32(t23.val[1]));
+        r[2] = vcombine_u32(vget_high_u32(t01.val[0]), vget_high_u32(t23.val[0]));
+        r[3] = vcombine_u32(vget_high_u32(t01.val[1]), vget_high_u32(t23.val[1]));
+        for (b = 0; b < 4; b++) {
+            const u8 *in = m + b * CHACHA_BLOCKLEN + i * 4;
+            vst1q_u8(c + b * CHACHA_BLOCKLEN + i * 4, veorq_u8(vreinterpretq_u8_u32(r[b]), vld1q_u8(in)));
+        }
+    }
+}
+#endif
+
+// Encrypts whole SIMD chunks, advances the block counter in input[12] and returns the processed byte count.
+// The caller makes sure the 32-bit counter does not wrap inside the processed range.
+static u32 _private_tls_chacha_simd(u32 *input, const u8 *m, u8 *c, u32 bytes) {
+    u32 done = 0;
+
+#ifdef TLS_CHACHA_SIMD_SSE2
+    if ((bytes >= 2 * TLS_CHACHA_SIMD_CHUNK) && (_private_tls_has_avx2())) {
+        for (; bytes - done >= 2 * TLS_CHACHA_SIMD_CHUNK; done += 2 * TLS_CHACHA_SIMD_CHUNK) {
+            _private_tls_chacha_8blocks_avx2(input, m + done, c + done);
+            input[12] += 8;
+        }
+    }
+#endif
+    for (; bytes - done >= TLS_CHACHA_SIMD_CHUNK; done += TLS_CHACHA_SIMD_CHUNK) {
+#ifdef TLS_CHACHA_SIMD_SSE2
+        _private_tls_chacha_4blocks_sse2(input, m + done, c + done);
+#else
+        _private_tls_chacha_4blocks_neon(input, m + done, c + done);
+#endif
+        input[12] += 4;
+    }
+    return done;
+}
+
+// Poly1305 over pairs of 16 byte blocks in base 2^26. Two accumulators run in the vector lanes:
+// every pair is multiplied by r^2, except the last one where the second lane uses r, so
+// lane0 + lane1 gives the same h as the scalar Horner evaluation.
+static size_t _private_tls_poly1305_simd(const unsigned long r[5], unsigned long h[5], const unsigned char *m, size_t bytes) {
+    unsigned long long d0, d1, d2, d3, d4;
+    unsigned long long s[5], q[5];
+    u32 r2[5];
+    size_t done = 0;
+    unsigned long long c;
+    int i;
+
+    if (bytes < 2 * poly1305_block_size)
+        return 0;
+
+    // r^2, partially reduced like the scalar code
+    for (i = 0; i < 5; i++)
+        s[i] = r[i] * 5;
+    d0 = (unsigned long long)r[0] * r[0] + (unsigned long long)r[1] * s[4] + (unsigned long long)r[2] * s[3] + (unsigned long long)r[3] * s[2] + (unsigned long long)r[4] * s[1];
+    d1 = (unsigned long long)r[0] * r[1] + (unsigned long long)r[1] * r[0] + (unsigned long long)r[2] * s[4] + (unsigned long long)r[3] * s[3] + (unsigned long long)r[4] * s[2];
+    d2 = (unsigned long long)r[0] * r[2] + (unsigned long long)r[1] * r[1] + (unsigned long long)r[2] * r[0] + (unsigned long long)r[3] * s[4] + (unsigned long long)r[4] * s[3];
+    d3 = (unsigned long long)r[0] * r[3] + (unsigned long long)r[1] * r[2] + (unsigned long long)r[2] * r[1] + (unsigned long long)r[3] * r[0] + (unsigned long long)r[4] * s[4];
+    d4 = (unsigned long long)r[0] * r[4] + (unsigned long long)r[1] * r[3] + (unsigned long long)r[2] * r[2] + (unsigned long long)r[3] * r[1] + (unsigned long long)r[4] * r[0];
+              c = d0 >> 26; q[0] = d0 & 0x3ffffff;
+    d1 += c;  c = d1 >> 26; q[1] = d1 & 0x3ffffff;
+    d2 += c;  c = d2 >> 26; q[2] = d2 & 0x3ffffff;
+    d3 += c;  c = d3 >> 26; q[3] = d3 & 0x3ffffff;
+    d4 += c;  c = d4 >> 26; q[4] = d4 & 0x3ffffff;
+    q[0] += c * 5; c = q[0] >> 26; q[0] &= 0x3ffffff;
+    q[1] += c;
+    for (i = 0; i < 5; i++)
+        r2[i] = (u32)q[i];
+
+    {
+#ifdef TLS_CHACHA_SIMD_SSE2
+        const __m128i mask = _mm_set_epi32(0, 0x3ffffff, 0, 0x3ffffff);
+        const __m128i hibit = _mm_set_epi32(0, 1 << 24, 0, 1 << 24);
+        __m128i H[5], R[5], S[5], M[5], D[5], C, LO, HI;
+
+        for (i = 0; i < 5; i++) {
+            H[i] = _mm_set_epi32(0, 0, 0, (int)h[i]);
+            R[i] = _mm_set_epi32(0, (int)r2[i], 0, (int)r2[i]);
+            S[i] = _mm_set_epi32(0, (int)(r2[i] * 5), 0, (int)(r2[i] * 5));
+        }
+#else
+        const uint64x2_t mask = vdupq_n_u64(0x3ffffff);
+        const uint32x2_t hibit = vdup_n_u32(1 << 24);
+        uint32x2_t H[5], R[5], S[5], M[5];
+        uint64x2_t D[5], C, LO, HI;
+        u32 lane[2];
+
+        for (i = 0; i < 5; i++) {
+            lane[0] = (u32)h[i];
+            lane[1] = 0;
+            H[i] = vld1_u32(lane);
+            R[i] = vdup_n_u32(r2[i]);
+            S[i] = vdup_n_u32(r2[i] * 5);
+        }
+#endif
+        for (; bytes - done >= 2 * poly1305_block_size; done += 2 * poly1305_block_size) {
+            if (bytes - done < 4 * poly1305_block_size) {
+                // last pair: second lane is multiplied by r
+#ifdef TLS_CHACHA_SIMD_SSE2
+                for (i = 0; i < 5; i++) {
+                    R[i] = _mm_set_epi32(0, (int)r[i], 0, (int)r2[i]);
+                    S[i] = _mm_set_epi32(0, (int)(r[i] * 5), 0, (int)(r2[i] * 5));
+                }
+#else
+                for (i = 0; i < 5; i++) {
+                    lane[0] = r2[i];
+                    lane[1] = (u32)r[i];
+                    R[i] = vld1_u32(lane);
+                    lane[0] = r2[i] * 5;
+                    lane[1] = (u32)(r[i] * 5);
+                    S[i] = vld1_u32(lane);
+                }
+#endif
+            }
+            // split both blocks into 26-bit limbs, lane k holds block k
+#ifdef TLS_CHACHA_SIMD_SSE2
+            LO = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)(m + done)), _mm_loadl_epi64((const __m128i *)(m + done + 16)));
+            HI = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)(m + done + 8)), _mm_loadl_epi64((const __m128i *)(m + done + 24)));
+            M[0] = _mm_and_si128(LO, mask);
+            M[1] = _mm_and_si128(_mm_srli_epi64(LO, 26), mask);
+            LO = _mm_or_si128(_mm_srli_epi64(LO, 52), _mm_slli_epi64(HI, 12));
+            M[2] = _mm_and_si128(LO, mask);
+            M[3] = _mm_and_si128(_mm_srli_epi64(LO, 26), mask);
+            M[4] = _mm_or_si128(_mm_srli_epi64(HI, 40), hibit);
+            for (i = 0; i < 5; i++)
+                H[i] = _mm_add_epi64(H[i], M[i]);
+
+            D[0] = _mm_add_epi64(_mm_add_epi64(_mm_add_epi64(_mm_add_epi64(_mm_mul_epu32(H[0], R[0]), _mm_mul_epu32(H[1], S[4])), _mm_mul_epu32(H[2], S[3])), _mm_mul_epu32(H[3], S[2])), _mm_mul_epu32(H[4], S[1]));
+            D[1] = _mm_add_epi64(_mm_add_epi64(_mm_add_epi64(_mm_add_epi64(_mm_mul_epu32(H[0], R[1]), _mm_mul_epu32(H[1], R[0])), _mm_mul_epu32(H[2], S[4])), _mm_mul_epu32(H[3], S[3])), _mm_mul_epu32(H[4], S[2]));
+            D[2] = _mm_add_epi64(_mm_add_epi64(_mm_add_epi64(_mm_add_epi64(_mm_mul_epu32(H[0], R[2]), _mm_mul_epu32(H[1], R[1])), _mm_mul_epu32(H[2], R[0])), _mm_mul_epu32(H[3], S[4])), _mm_mul_epu32(H[4], S[3]));
+            D[3] = _mm_add_epi64(_mm_add_epi64(_mm_add_epi64(_mm_add_epi64(_mm_mul_epu32(H[0], R[3]), _mm_mul_epu32(H[1], R[2])), _mm_mul_epu32(H[2], R[1])), _mm_mul_epu32(H[3], R[0])), _mm_mul_epu32(H[4], S[4]));
+            D[4] = _mm_add_epi64(_mm_add_epi64(_mm_add_epi64(_mm_add_epi64(_mm_mul_epu32(H[0], R[4]), _mm_mul_epu32(H[1], R[3])), _mm_mul_epu32(H[2], R[2])), _mm_mul_epu32(H[3], R[1])), _mm_mul_epu32(H[4], R[0]));
+
+                                      C = _mm_srli_epi64(D[0], 26); H[0] = _mm_and_si128(D[0], mask);
+            D[1] = _mm_add_epi64(D[1], C); C = _mm_srli_epi64(D[1], 26); H[1] = _mm_and_si128(D[1], mask);
+            D[2] = _mm_add_epi64(D[2], C); C = _mm_srli_epi64(D[2], 26); H[2] = _mm_and_si128(D[2], mask);
+            D[3] = _mm_add_epi64(D[3], C); C = _mm_srli_epi64(D[3], 26); H[3] = _mm_and_si128(D[3], mask);
+            D[4] = _mm_add_epi64(D[4], C); C = _mm_srli_epi64(D[4], 26); H[4] = _mm_and_si128(D[4], mask);
+            H[0] = _mm_add_epi64(H[0], _mm_add_epi64(C, _mm_slli_epi64(C, 2)));
+            C = _mm_srli_epi64(H[0], 26); H[0] = _mm_and_si128(H[0], mask);
+            H[1] = _mm_add_epi64(H[1], C);
+#else
+            LO = vcombine_u64(vreinterpret_u64_u8(vld1_u8(m + done)), vreinterpret_u64_u8(vld1_u8(m + done + 16)));
+            HI = vcombine_u64(vreinterpret_u64_u8(vld1_u8(m + done + 8)), vreinterpret_u64_u8(vld1_u8(m + done + 24)));
+            M[0] = vmovn_u64(vandq_u64(LO, mask));
+            M[1] = vmovn_u64(vandq_u64(vshrq_n_u64(LO, 26), mask));
+            LO = vorrq_u64(vshrq_n_u64(LO, 52), vshlq_n_u64(HI, 12));
+            M[2] = vmovn_u64(vandq_u64(LO, mask));
+            M[3] = vmovn_u64(vandq_u64(vshrq_n_u64(LO, 26), mask));
+            M[4] = vorr_u32(vmovn_u64(vshrq_n_u64(HI, 40)), hibit);
+            for (i = 0; i < 5; i++)
+                H[i] = vadd_u32(H[i], M[i]);
+
+            D[0] = vmlal_u32(vmlal_u32(vmlal_u32(vmlal_u32(vmull_u32(H[0], R[0]), H[1], S[4]), H[2], S[3]), H[3], S[2]), H[4], S[1]);
+            D[1] = vmlal_u32(vmlal_u32(vmlal_u32(vmlal_u32(vmull_u32(H[0], R[1]), H[1], R[0]), H[2], S[4]), H[3], S[3]), H[4], S[2]);
+            D[2] = vmlal_u32(vmlal_u32(vmlal_u32(vmlal_u32(vmull_u32(H[0], R[2]), H[1], R[1]), H[2], R[0]), H[3], S[4]), H[4], S[3]);
+            D[3] = vmlal_u32(vmlal_u32(vmlal_u32(vmlal_u32(vmull_u32(H[0], R[3]), H[1], R[2]), H[2], R[1]), H[3], R[0]), H[4], S[4]);
+            D[4] = vmlal_u32(vmlal_u32(vmlal_u32(vmlal_u32(vmull_u32(H[0], R[4]), H[1], R[3]), H[2], R[2]), H[3], R[1]), H[4], R[0]);
+
+                                   C = vshrq_n_u64(D[0], 26); H[0] = vmovn_u64(vandq_u64(D[0], mask));
+            D[1] = vaddq_u64(D[1], C); C = vshrq_n_u64(D[1], 26); H[1] = vmovn_u64(vandq_u64(D[1], mask));
+            D[2] = vaddq_u64(D[2], C); C = vshrq_n_u64(D[2], 26); H[2] = vmovn_u64(vandq_u64(D[2], mask));
+            D[3] = vaddq_u64(D[3], C); C = vshrq_n_u64(D[3], 26); H[3] = vmovn_u64(vandq_u64(D[3], mask));
+            D[4] = vaddq_u64(D[4], C); C = vshrq_n_u64(D[4], 26); H[4] = vmovn_u64(vandq_u64(D[4], mask));
+            D[0] = vaddq_u64(vmovl_u32(H[0]), vaddq_u64(C, vshlq_n_u64(C, 2)));
+            C = vshrq_n_u64(D[0], 26); H[0] = vmovn_u64(vandq_u64(D[0], mask));
+            H[1] = vadd_u32(H[1], vmovn_u64(C));
+#endif
+        }
+
+        // h = lane0 + lane1
+        for (i = 0; i < 5; i++) {
+#ifdef TLS_CHACHA_SIMD_SSE2
+            unsigned long long l[2];
+            _mm_storeu_si128((__m128i *)l, H[i]);
+            q[i] = l[0] + l[1];
+#else
+            vst1_u32(lane, H[i]);
+            q[i] = (unsigned long long)lane[0] + lane[1];
+#endif
+        }
+    }
+                   c = q[0] >> 26; q[0] &= 0x3ffffff;
+    q[1] += c;     c = q[1] >> 26; q[1] &= 0x3ffffff;
+    q[2] += c;     c = q[2] >> 26; q[2] &= 0x3ffffff;
+    q[3] += c;     c = q[3] >> 26; q[3] &= 0x3ffffff;
+    q[4] += c;     c = q[4] >> 26; q[4] &= 0x3ffffff;
+    q[0] += c * 5; c = q[0] >> 26; q[0] &= 0x3ffffff;
+    q[1] += c;
+    for (i = 0; i < 5; i++)
+        h[i] = (unsigned long)q[i];
+    return done;
+}
+#endif
@@ -13536,6 +13536,13 @@ LTC_EXPORT int LTC_CALL XSTRCMP(const char *s1, const char *s2);
  #define LTC_NO_BSWAP
 #endif
 
+/* Hardware AES/GHASH/SHA-256 kernels selected at runtime, see libtomcrypt_hw.c */
+#if !defined(LTC_NO_ASM) && !defined(LTC_NO_HW_ACCEL) && defined(__GNUC__)
+ #if defined(__x86_64__) || defined(__i386__) || defined(__aarch64__)
+  #define LTC_HW_ACCEL
+ #endif
+#endif
+
 /* #define ENDIAN_LITTLE */
 /* #define ENDIAN_BIG */
 
@@ -13995,6 +14002,11 @@ struct saferp_key {
 struct rijndael_key {
     ulong32 eK[60], dK[60];
     int     Nr;
+#ifdef LTC_HW_ACCEL
+    /* encryption round keys in the byte order of the AES instructions, valid if hw is set */
+    unsigned char hwK[240];
+    int     hw;
+#endif
 };
 #endif
 
@@ -17079,6 +17091,8 @@ int pkcs_5_alg2(const unsigned char *password, unsigned long password_len,
 /* $Revision: 1.21 $ */
 /* $Date: 2006/12/16 19:34:05 $ */ 
 
+#include "libtomcrypt_hw.c"
+
 /* $Source: /cvs/libtom/libtomcrypt/src/misc/crypt/crypt_argchk.c,v $ */
 /* $Revision: 1.5 $ */
 /* $Date: 2006/12/28 01:27:24 $ */
@@ -29918,6 +29932,13 @@ static int  sha256_compress(hash_state * md, unsigned char *buf)
 #endif
     int i;
 
+#ifdef LTC_HW_ACCEL
+    if (ltc_hw_has(LTC_HW_SHA256)) {
+        ltc_hw_sha256_compress(md->sha256.state, buf);
+        return CRYPT_OK;
+    }
+#endif
+
     /* copy state into S */
     for (i = 0; i < 8; i++) {
         S[i] = md->sha256.state[i];
@@ -32215,6 +32236,15 @@ int SETUP(const unsigned char *key, int keylen, int num_rounds, symmetric_key *s
     *rk   = *rrk;
 #endif /* ENCRYPT_ONLY */
 
+#ifdef LTC_HW_ACCEL
+    skey->rijndael.hw = ltc_hw_has(LTC_HW_AES) != 0;
+    if (skey->rijndael.hw) {
+        for (i = 0; i < 4 * (skey->rijndael.Nr + 1); i++) {
+            STORE32H(skey->rijndael.eK[i], skey->rijndael.hwK + 4 * i);
+        }
+    }
+#endif
+
     return CRYPT_OK;
 }
 
@@ -32238,6 +32268,13 @@ int ECB_ENC(const unsigned char *pt, unsigned char *ct, symmetric_key *skey)
     LTC_ARGCHK(ct != NULL);
     LTC_ARGCHK(skey != NULL);
 
+#ifdef LTC_HW_ACCEL
+    if (skey->rijndael.hw) {
+        ltc_hw_aes_encrypt(skey->rijndael.hwK, skey->rijndael.Nr, pt, ct);
+        return CRYPT_OK;
+    }
+#endif
+
     Nr = skey->rijndael.Nr;
     rk = skey->rijndael.eK;
 
@@ -33360,6 +33397,12 @@ int gcm_init(gcm_state *gcm, int cipher,
    gcm->pttotlen = 0;
 
 #ifdef LTC_GCM_TABLES
+#ifdef LTC_HW_ACCEL
+   /* gcm_mult_h() uses carry-less multiply instructions instead of the tables */
+   if (ltc_hw_has(LTC_HW_GHASH)) {
+      return CRYPT_OK;
+   }
+#endif
    /* setup tables */
 
    /* generate the first table as it has no shifting (from which we make the other tables) */
@@ -33471,8 +33514,37 @@ int gcm_process(gcm_state *gcm,
    }
 
    x = 0;
+#ifdef LTC_HW_ACCEL
+   /* whole blocks: the first one uses the key stream already in buf, the rest are CTR encrypted in bulk */
+   if (gcm->buflen == 0 && ptlen >= 16 && cipher_descriptor[gcm->cipher].ecb_encrypt == rijndael_ecb_encrypt &&
+       gcm->K.rijndael.hw && ltc_hw_has(LTC_HW_GHASH)) {
+      unsigned long blocks = ptlen / 16;
+
+      if (direction == GCM_ENCRYPT) {
+         for (y = 0; y < 16; y++) {
+             ct[y] = pt[y] ^ gcm->buf[y];
+         }
+         ltc_hw_aes_ctr(gcm->K.rijndael.hwK, gcm->K.rijndael.Nr, gcm->Y, pt + 16, ct + 16, blocks - 1);
+         ltc_hw_ghash(gcm->X, gcm->H, ct, blocks);
+      } else {
+         /* hash first, pt and ct may be the same buffer */
+         ltc_hw_ghash(gcm->X, gcm->H, ct, blocks);
+         for (y = 0; y < 16; y++) {
+             pt[y] = ct[y] ^ gcm->buf[y];
+         }
+         ltc_hw_aes_ctr(gcm->K.rijndael.hwK, gcm->K.rijndael.Nr, gcm->Y, ct + 16, pt + 16, blocks - 1);
+      }
+      gcm->pttotlen += blocks * CONST64(128);
+      /* next key stream block */
+      for (y = 15; y >= 12; y--) {
+          if (++gcm->Y[y] & 255) { break; }
+      }
+      ltc_hw_aes_encrypt(gcm->K.rijndael.hwK, gcm->K.rijndael.Nr, gcm->Y, gcm->buf);
+      x = blocks * 16;
+   }
+#endif
 #ifdef LTC_FAST
-   if (gcm->buflen == 0) {
+   if (gcm->buflen == 0 && x == 0) {
       if (direction == GCM_ENCRYPT) { 
          for (x = 0; x < (ptlen & ~15); x += 16) {
              /* ctr encrypt */
@@ -33574,6 +33646,12 @@ int gcm_process(gcm_state *gcm,
 void gcm_mult_h(gcm_state *gcm, unsigned char *I)
 {
    unsigned char T[16];
+#ifdef LTC_HW_ACCEL
+   if (ltc_hw_has(LTC_HW_GHASH)) {
+      ltc_hw_ghash(I, gcm->H, NULL, 1);
+      return;
+   }
+#endif
 #ifdef LTC_GCM_TABLES
    int x, y;
 #ifdef LTC_GCM_TABLES_SSE2
@@ -0,0 +1,470 @@
+/* Hardware AES, GHASH and SHA-256 kernels for libtomcrypt.c
+ *
+ * Included from libtomcrypt.c after the headers when LTC_HW_ACCEL is defined. Support is detected at
+ * runtime and the portable code is used on CPUs without the extensions:
+ *  - x86/x86_64: AES-NI, PCLMULQDQ and SHA extensions (functions are built with target attributes)
+ *  - aarch64: ARMv8 Crypto Extensions (AES, PMULL, SHA2) (functions are built with target attributes)
+ */
+
+#ifdef LTC_HW_ACCEL
+
+#define LTC_HW_AES    1
+#define LTC_HW_GHASH  2
+#define LTC_HW_SHA256 4
+
+static const uint32_t ltc_hw_sha256_K[64] = {
+    0x428a2f98UL, 0x71374491UL, 0xb5c0fbcfUL, 0xe9b5dba5UL, 0x3956c25bUL, 0x59f111f1UL, 0x923f82a4UL, 0xab1c5ed5UL,
+    0xd807aa98UL, 0x12835b01UL, 0x243185beUL, 0x550c7dc3UL, 0x72be5d74UL, 0x80deb1feUL, 0x9bdc06a7UL, 0xc19bf174UL,
+    0xe49b69c1UL, 0xefbe4786UL, 0x0fc19dc6UL, 0x240ca1ccUL, 0x2de92c6fUL, 0x4a7484aaUL, 0x5cb0a9dcUL, 0x76f988daUL,
+    0x983e5152UL, 0xa831c66dUL, 0xb00327c8UL, 0xbf597fc7UL, 0xc6e00bf3UL, 0xd5a79147UL, 0x06ca6351UL, 0x14292967UL,
+    0x27b70a85UL, 0x2e1b2138UL, 0x4d2c6dfcUL, 0x53380d13UL, 0x650a7354UL, 0x766a0abbUL, 0x81c2c92eUL, 0x92722c85UL,
+    0xa2bfe8a1UL, 0xa81a664bUL, 0xc24b8b70UL, 0xc76c51a3UL, 0xd192e819UL, 0xd6990624UL, 0xf40e3585UL, 0x106aa070UL,
+    0x19a4c116UL, 0x1e376c08UL, 0x2748774cUL, 0x34b0bcb5UL, 0x391c0cb3UL, 0x4ed8aa4aUL, 0x5b9cca4fUL, 0x682e6ff3UL,
+    0x748f82eeUL, 0x78a5636fUL, 0x84c87814UL, 0x8cc70208UL, 0x90befffaUL, 0xa4506cebUL, 0xbef9a3f7UL, 0xc67178f2UL
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define LTC_HW_TARGET_AES __attribute__((target("aes,pclmul,ssse3,sse4.1")))
+#define LTC_HW_TARGET_SHA __attribute__((target("sha,ssse3,sse4.1")))
+
+static int ltc_hw_detect(void)
+{
+    unsigned int a, b, c, d;
+    int caps = 0;
+
+    if (!__get_cpuid(1, &a, &b, &c, &d)) {
+        return 0;
+    }
+    /* SSSE3 (bit 9) and SSE4.1 (bit 19) are used for byte shuffles and lane inserts */
+    if (!(c & (1U << 9)) || !(c & (1U << 19))) {
+        return 0;
+    }
+    if (c & (1U << 25)) {
+        caps |= LTC_HW_AES;
+    }
+    if (c & (1U << 1)) {
+        caps |= LTC_HW_GHASH;
+    }
+    if (__get_cpuid_max(0, NULL) >= 7) {
+        __cpuid_count(7, 0, a, b, c, d);
+        if (b & (1U << 29)) {
+            caps |= LTC_HW_SHA256;
+        }
+    }
+    return caps;
+}
+
+LTC_HW_TARGET_AES
+static inline __m128i ltc_hw_aes_block(const unsigned char *rk, int Nr, __m128i b)
+{
+    int r;
+
+    b = _mm_xor_si128(b, _mm_loadu_si128((const __m128i *) rk));
+    for (r = 1; r < Nr; r++) {
+        b = _mm_aesenc_si128(b, _mm_loadu_si128((const __m128i *) (rk + 16 * r)));
+    }
+    return _mm_aesenclast_si128(b, _mm_loadu_si128((const __m128i *) (rk + 16 * Nr)));
+}
+
+LTC_HW_TARGET_AES
+static void ltc_hw_aes_encrypt(const unsigned char *rk, int Nr, const unsigned char *in, unsigned char *out)
+{
+    __m128i b = ltc_hw_aes_block(rk, Nr, _mm_loadu_si128((const __m128i *) in));
+    _mm_storeu_si128((__m128i *) out, b);
+}
+
+/* For each block increment the 32-bit big endian counter in Y[12..15], then out = in ^ E(Y) */
+LTC_HW_TARGET_AES
+static void ltc_hw_aes_ctr(const unsigned char *rk, int Nr, unsigned char *Y,
+                           const unsigned char *in, unsigned char *out, unsigned long blocks)
+{
+    const __m128i base = _mm_loadu_si128((const __m128i *) Y);
+    __m128i b0, b1, b2, b3, k;
+    ulong32 ctr;
+    int r;
+
+    LOAD32H(ctr, Y + 12);
+    while (blocks >= 4) {
+        b0 = _mm_insert_epi32(base, (int) __builtin_bswap32((uint32_t) (ctr + 1)), 3);
+        b1 = _mm_insert_epi32(base, (int) __builtin_bswap32((uint32_t) (ctr + 2)), 3);
+        b2 = _mm_insert_epi32(base, (int) __builtin_bswap32((uint32_t) (ctr + 3)), 3);
+        b3 = _mm_insert_epi32(base, (int) __builtin_bswap32((uint32_t) (ctr + 4)), 3);
+        ctr += 4;
+
+        k = _mm_loadu_si128((const __m128i *) rk);
+        b0 = _mm_xor_si128(b0, k);
+        b1 = _mm_xor_si128(b1, k);
+        b2 = _mm_xor_si128(b2, k);
+        b3 = _mm_xor_si128(b3, k);
+        for (r = 1; r < Nr; r++) {
+            k = _mm_loadu_si128((const __m128i *) (rk + 16 * r));
+            b0 = _mm_aesenc_si128(b0, k);
+            b1 = _mm_aesenc_si128(b1, k);
+            b2 = _mm_aesenc_si128(b2, k);
+            b3 = _mm_aesenc_si128(b3, k);
+        }
+        k = _mm_loadu_si128((const __m128i *) (rk + 16 * Nr));
+        b0 = _mm_aesenclast_si128(b0, k);
+        b1 = _mm_aesenclast_si128(b1, k);
+        b2 = _mm_aesenclast_si128(b2, k);
+        b3 = _mm_aesenclast_si128(b3, k);
+
+        _mm_storeu_si128((__m128i *) out, _mm_xor_si128(b0, _mm_loadu_si128((const __m128i *) in)));
+        _mm_storeu_si128((__m128i *) (out + 16), _mm_xor_si128(b1, _mm_loadu_si128((const __m128i *) (in + 16))));
+        _mm_storeu_si128((__m128i *) (out + 32), _mm_xor_si128(b2, _mm_loadu_si128((const __m128i *) (in + 32))));
+        _mm_storeu_si128((__m128i *) (out + 48), _mm_xor_si128(b3, _mm_loadu_si128((const __m128i *) (in + 48))));
+        in += 64;
+        out += 64;
+        blocks -= 4;
+    }
+    while (blocks--) {
+        ctr++;
+        b0 = ltc_hw_aes_block(rk, Nr, _mm_insert_epi32(base, (int) __builtin_bswap32((uint32_t) ctr), 3));
+        _mm_storeu_si128((__m128i *) out, _mm_xor_si128(b0, _mm_loadu_si128((const __m128i *) in)));
+        in += 16;
+        out += 16;
+    }
+    STORE32H(ctr, Y + 12);
+}
+
+/* GF(2^128) multiply of byte reversed operands, Intel carry-less multiplication white paper, algorithm 5 */
+LTC_HW_TARGET_AES
+static inline __m128i ltc_hw_gf_mult(__m128i a, __m128i b)
+{
+    __m128i t3, t4, t5, t6, t7, t8, t9;
+
+    t3 = _mm_clmulepi64_si128(a, b, 0x00);
+    t4 = _mm_clmulepi64_si128(a, b, 0x10);
+    t5 = _mm_clmulepi64_si128(a, b, 0x01);
+    t6 = _mm_clmulepi64_si128(a, b, 0x11);
+
+    t4 = _mm_xor_si128(t4, t5);
+    t5 = _mm_slli_si128(t4, 8);
+    t4 = _mm_srli_si128(t4, 8);
+    t3 = _mm_xor_si128(t3, t5);
+    t6 = _mm_xor_si128(t6, t4);
+
+    /* shift the 256-bit product left by one bit */
+    t7 = _mm_srli_epi32(t3, 31);
+    t8 = _mm_srli_epi32(t6, 31);
+    t3 = _mm_slli_epi32(t3, 1);
+    t6 = _mm_slli_epi32(t6, 1);
+    t9 = _mm_srli_si128(t7, 12);
+    t8 = _mm_slli_si128(t8, 4);
+    t7 = _mm_slli_si128(t7, 4);
+    t3 = _mm_or_si128(t3, t7);
+    t6 = _mm_or_si128(t6, t8);
+    t6 = _mm_or_si128(t6, t9);
+
+    /* reduce modulo x^128 + x^7 + x^2 + x + 1 */
+    t7 = _mm_slli_epi32(t3, 31);
+    t8 = _mm_slli_epi32(t3, 30);
+    t9 = _mm_slli_epi32(t3, 25);
+    t7 = _mm_xor_si128(t7, t8);
+    t7 = _mm_xor_si128(t7, t9);
+    t8 = _mm_srli_si128(t7, 4);
+    t7 = _mm_slli_si128(t7, 12);
+    t3 = _mm_xor_si128(t3, t7);
+
+    t4 = _mm_srli_epi32(t3, 1);
+    t5 = _mm_srli_epi32(t3, 2);
+    t9 = _mm_srli_epi32(t3, 7);
+    t4 = _mm_xor_si128(t4, t5);
+    t4 = _mm_xor_si128(t4, t9);
+    t4 = _mm_xor_si128(t4, t8);
+    t3 = _mm_xor_si128(t3, t4);
+    return _mm_xor_si128(t6, t3);
+}
+
+/* X = (X ^ in[i]) * H for every 16 byte block of in, X = X * H if in is NULL */
+LTC_HW_TARGET_AES
+static void ltc_hw_ghash(unsigned char *X, const unsigned char *H, const unsigned char *in, unsigned long blocks)
+{
+    const __m128i swap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m128i h = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) H), swap);
+    __m128i x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) X), swap);
+
+    if (in == NULL) {
+        x = ltc_hw_gf_mult(x, h);
+    }
+    else {
+        for (; blocks > 0; blocks--, in += 16) {
+            x = _mm_xor_si128(x, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) in), swap));
+            x = ltc_hw_gf_mult(x, h);
+        }
+    }
+    _mm_storeu_si128((__m128i *) X, _mm_shuffle_epi8(x, swap));
+}
+
+LTC_HW_TARGET_SHA
+static void ltc_hw_sha256_compress(ulong32 *state, const unsigned char *buf)
+{
+    const __m128i swap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    __m128i abef, cdgh, abef_save, cdgh_save, msg[4], tmp;
+    uint32_t s[8];
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        s[i] = (uint32_t) state[i];
+    }
+    tmp  = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) s), 0xB1);
+    cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) (s + 4)), 0x1B);
+    abef = _mm_alignr_epi8(tmp, cdgh, 8);
+    cdgh = _mm_blend_epi16(cdgh, tmp, 0xF0);
+    abef_save = abef;
+    cdgh_save = cdgh;
+
+    for (i = 0; i < 4; i++) {
+        msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (buf + 16 * i)), swap);
+    }
+    for (i = 0; i < 16; i++) {
+        if (i >= 4) {
+            tmp = _mm_alignr_epi8(msg[(i - 1) & 3], msg[(i - 2) & 3], 4);
+            msg[i & 3] = _mm_sha256msg1_epu32(msg[i & 3], msg[(i - 3) & 3]);
+            msg[i & 3] = _mm_sha256msg2_epu32(_mm_add_epi32(msg[i & 3], tmp), msg[(i - 1) & 3]);
+        }
+        tmp  = _mm_add_epi32(msg[i & 3], _mm_loadu_si128((const __m128i *) (ltc_hw_sha256_K + 4 * i)));
+        cdgh = _mm_sha256rnds2_epu32(cdgh, abef, tmp);
+        abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(tmp, 0x0E));
+    }
+
+    abef = _mm_add_epi32(abef, abef_save);
+    cdgh = _mm_add_epi32(cdgh, cdgh_save);
+    tmp  = _mm_shuffle_epi32(abef, 0x1B);
+    cdgh = _mm_shuffle_epi32(cdgh, 0xB1);
+    _mm_storeu_si128((__m128i *) s, _mm_blend_epi16(tmp, cdgh, 0xF0));
+    _mm_storeu_si128((__m128i *) (s + 4), _mm_alignr_epi8(cdgh, tmp, 8));
+    for (i = 0; i < 8; i++) {
+        state[i] = s[i];
+    }
+}
+
+#elif defined(__aarch64__)
+
+/* Before clang 16 arm_neon.h declares crypto intrinsics only if the file is built with them. They are
+ * always_inline, so declaring them is enough, they are only expanded in the functions with the attribute */
+#if defined(__clang__) && __clang_major__ < 16 && !defined(__ARM_FEATURE_CRYPTO)
+ #define __ARM_FEATURE_CRYPTO 1
+ #define __ARM_FEATURE_AES 1
+ #define __ARM_FEATURE_SHA2 1
+ #define LTC_HW_UNDEF_FEATURE_CRYPTO
+#endif
+#include <arm_neon.h>
+#ifdef LTC_HW_UNDEF_FEATURE_CRYPTO
+ #undef __ARM_FEATURE_CRYPTO
+ #undef __ARM_FEATURE_AES
+ #undef __ARM_FEATURE_SHA2
+ #undef LTC_HW_UNDEF_FEATURE_CRYPTO
+#endif
+#include <sys/auxv.h>
+
+#if defined(__clang__) && __clang_major__ >= 16
+ #define LTC_HW_TARGET_CRYPTO __attribute__((target("aes,sha2")))
+#elif defined(__clang__)
+ #define LTC_HW_TARGET_CRYPTO __attribute__((target("crypto")))
+#else
+ #define LTC_HW_TARGET_CRYPTO __attribute__((target("+crypto")))
+#endif
+
+#ifndef HWCAP_AES
+ #define HWCAP_AES   (1 << 3)
+#endif
+#ifndef HWCAP_PMULL
+ #define HWCAP_PMULL (1 << 4)
+#endif
+#ifndef HWCAP_SHA2
+ #define HWCAP_SHA2  (1 << 6)
+#endif
+
+static int ltc_hw_detect(void)
+{
+    unsigned long hwcap = getauxval(AT_HWCAP);
+    int caps = 0;
+
+    if (hwcap & HWCAP_AES) {
+        caps |= LTC_HW_AES;
+    }
+    if (hwcap & HWCAP_PMULL) {
+        caps |= LTC_HW_GHASH;
+    }
+    if (hwcap & HWCAP_SHA2) {
+        caps |= LTC_HW_SHA256;
+    }
+    return caps;
+}
+
+LTC_HW_TARGET_CRYPTO
+static inline uint8x16_t ltc_hw_aes_block(const unsigned char *rk, int Nr, uint8x16_t b)
+{
+    int r;
+
+    /* AESE xors the round key before SubBytes/ShiftRows, so the last key is added separately */
+    for (r = 0; r < Nr - 1; r++) {
+        b = vaesmcq_u8(vaeseq_u8(b, vld1q_u8(rk + 16 * r)));
+    }
+    b = vaeseq_u8(b, vld1q_u8(rk + 16 * (Nr - 1)));
+    return veorq_u8(b, vld1q_u8(rk + 16 * Nr));
+}
+
+LTC_HW_TARGET_CRYPTO
+static void ltc_hw_aes_encrypt(const unsigned char *rk, int Nr, const unsigned char *in, unsigned char *out)
+{
+    vst1q_u8(out, ltc_hw_aes_block(rk, Nr, vld1q_u8(in)));
+}
+
+/* For each block increment the 32-bit big endian counter in Y[12..15], then out = in ^ E(Y) */
+LTC_HW_TARGET_CRYPTO
+static void ltc_hw_aes_ctr(const unsigned char *rk, int Nr, unsigned char *Y,
+                           const unsigned char *in, unsigned char *out, unsigned long blocks)
+{
+    const uint32x4_t base = vreinterpretq_u32_u8(vld1q_u8(Y));
+    uint8x16_t b0, b1, b2, b3, k;
+    ulong32 ctr;
+    int r;
+
+    LOAD32H(ctr, Y + 12);
+    while (blocks >= 4) {
+        b0 = vreinterpretq_u8_u32(vsetq_lane_u32(__builtin_bswap32((uint32_t) (ctr + 1)), base, 3));
+        b1 = vreinterpretq_u8_u32(vsetq_lane_u32(__builtin_bswap32((uint32_t) (ctr + 2)), base, 3));
+        b2 = vreinterpretq_u8_u32(vsetq_lane_u32(__builtin_bswap32((uint32_t) (ctr + 3)), base, 3));
+        b3 = vreinterpretq_u8_u32(vsetq_lane_u32(__builtin_bswap32((uint32_t) (ctr + 4)), base, 3));
+        ctr += 4;
+
+        for (r = 0; r < Nr - 1; r++) {
+            k = vld1q_u8(rk + 16 * r);
+            b0 = vaesmcq_u8(vaeseq_u8(b0, k));
+            b1 = vaesmcq_u8(vaeseq_u8(b1, k));
+            b2 = vaesmcq_u8(vaeseq_u8(b2, k));
+            b3 = vaesmcq_u8(vaeseq_u8(b3, k));
+        }
+        k = vld1q_u8(rk + 16 * (Nr - 1));
+        b0 = vaeseq_u8(b0, k);
+        b1 = vaeseq_u8(b1, k);
+        b2 = vaeseq_u8(b2, k);
+        b3 = vaeseq_u8(b3, k);
+        k = vld1q_u8(rk + 16 * Nr);
+
+        vst1q_u8(out, veorq_u8(veorq_u8(b0, k), vld1q_u8(in)));
+        vst1q_u8(out + 16, veorq_u8(veorq_u8(b1, k), vld1q_u8(in + 16)));
+        vst1q_u8(out + 32, veorq_u8(veorq_u8(b2, k), vld1q_u8(in + 32)));
+        vst1q_u8(out + 48, veorq_u8(veorq_u8(b3, k), vld1q_u8(in + 48)));
+        in += 64;
+        out += 64;
+        blocks -= 4;
+    }
+    while (blocks--) {
+        ctr++;
+        b0 = vreinterpretq_u8_u32(vsetq_lane_u32(__builtin_bswap32((uint32_t) ctr), base, 3));
+        vst1q_u8(out, veorq_u8(ltc_hw_aes_block(rk, Nr, b0), vld1q_u8(in)));
+        in += 16;
+        out += 16;
+    }
+    STORE32H(ctr, Y + 12);
+}
+
+/* GF(2^128) multiply of bit reflected operands (vrbitq_u8 of the GCM byte order), so lane 0 holds
+ * the low 64 coefficients and the product is reduced modulo x^128 + x^7 + x^2 + x + 1 directly */
+LTC_HW_TARGET_CRYPTO
+static inline uint64x2_t ltc_hw_gf_mult(uint64x2_t a, uint64x2_t b)
+{
+    const poly64_t r = 0x87;
+    uint64_t a0 = vgetq_lane_u64(a, 0), a1 = vgetq_lane_u64(a, 1);
+    uint64_t b0 = vgetq_lane_u64(b, 0), b1 = vgetq_lane_u64(b, 1);
+    uint64x2_t lo, hi, mid, t;
+    uint64_t w0, w1, w2, w3;
+
+    lo  = vreinterpretq_u64_p128(vmull_p64((poly64_t) a0, (poly64_t) b0));
+    hi  = vreinterpretq_u64_p128(vmull_p64((poly64_t) a1, (poly64_t) b1));
+    mid = veorq_u64(vreinterpretq_u64_p128(vmull_p64((poly64_t) a0, (poly64_t) b1)),
+                    vreinterpretq_u64_p128(vmull_p64((poly64_t) a1, (poly64_t) b0)));
+
+    w0 = vgetq_lane_u64(lo, 0);
+    w1 = vgetq_lane_u64(lo, 1) ^ vgetq_lane_u64(mid, 0);
+    w2 = vgetq_lane_u64(hi, 0) ^ vgetq_lane_u64(mid, 1);
+    w3 = vgetq_lane_u64(hi, 1);
+
+    /* x^128 = x^7 + x^2 + x + 1, fold the top word first, then the word it overflowed into */
+    t = vreinterpretq_u64_p128(vmull_p64((poly64_t) w3, r));
+    w1 ^= vgetq_lane_u64(t, 0);
+    w2 ^= vgetq_lane_u64(t, 1);
+    t = vreinterpretq_u64_p128(vmull_p64((poly64_t) w2, r));
+    w0 ^= vgetq_lane_u64(t, 0);
+    w1 ^= vgetq_lane_u64(t, 1);
+
+    return vcombine_u64(vcreate_u64(w0), vcreate_u64(w1));
+}
+
+/* X = (X ^ in[i]) * H for every 16 byte block of in, X = X * H if in is NULL */
+LTC_HW_TARGET_CRYPTO
+static void ltc_hw_ghash(unsigned char *X, const unsigned char *H, const unsigned char *in, unsigned long blocks)
+{
+    uint64x2_t h = vreinterpretq_u64_u8(vrbitq_u8(vld1q_u8(H)));
+    uint64x2_t x = vreinterpretq_u64_u8(vrbitq_u8(vld1q_u8(X)));
+
+    if (in == NULL) {
+        x = ltc_hw_gf_mult(x, h);
+    }
+    else {
+        for (; blocks > 0; blocks--, in += 16) {
+            x = veorq_u64(x, vreinterpretq_u64_u8(vrbitq_u8(vld1q_u8(in))));
+            x = ltc_hw_gf_mult(x, h);
+        }
+    }
+    vst1q_u8(X, vrbitq_u8(vreinterpretq_u8_u64(x)));
+}
+
+LTC_HW_TARGET_CRYPTO
+static void ltc_hw_sha256_compress(ulong32 *state, const unsigned char *buf)
+{
+    uint32x4_t abcd, efgh, abcd_save, efgh_save, msg[4], tmp, tmp2;
+    uint32_t s[8];
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        s[i] = (uint32_t) state[i];
+    }
+    abcd = abcd_save = vld1q_u32(s);
+    efgh = efgh_save = vld1q_u32(s + 4);
+
+    for (i = 0; i < 4; i++) {
+        msg[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(buf + 16 * i)));
+    }
+    for (i = 0; i < 16; i++) {
+        if (i >= 4) {
+            msg[i & 3] = vsha256su0q_u32(msg[i & 3], msg[(i - 3) & 3]);
+            msg[i & 3] = vsha256su1q_u32(msg[i & 3], msg[(i - 2) & 3], msg[(i - 1) & 3]);
+        }
+        tmp  = vaddq_u32(msg[i & 3], vld1q_u32(ltc_hw_sha256_K + 4 * i));
+        tmp2 = abcd;
+        abcd = vsha256hq_u32(abcd, efgh, tmp);
+        efgh = vsha256h2q_u32(efgh, tmp2, tmp);
+    }
+
+    vst1q_u32(s, vaddq_u32(abcd, abcd_save));
+    vst1q_u32(s + 4, vaddq_u32(efgh, efgh_save));
+    for (i = 0; i < 8; i++) {
+        state[i] = s[i];
+    }
+}
+
+#endif
+
+static int ltc_hw_caps = -1;
+
+/* Detection result is the same in every thread, so the unsynchronized cache is harmless */
+static int ltc_hw_has(int feature)
+{
+    int caps = ltc_hw_caps;
+
+    if (caps < 0) {
+        caps = ltc_hw_detect();
+        ltc_hw_caps = caps;
+    }
+    return caps & feature;
+}
+
+#endif /* LTC_HW_ACCEL */
@@ -172,6 +172,8 @@
 #define TLS_MAX_RSA_KEY   2048
 
 #define TLS_MAXTLS_APP_SIZE      0x4000
+// free space kept in message_buffer for each socket read, one full record with padding and mac
+#define TLS_READ_CHUNK            0x4800
 // max 1 second sleep
 #define TLS_MAX_ERROR_SLEEP_uS    1000000
 // max 5 seconds context sleep
@@ -179,6 +181,11 @@
 
 #define TLS_V13_MAX_KEY_SIZE      32
 #define TLS_V13_MAX_IV_SIZE       12
+// session ticket lifetime hint, session store shouldn't keep tickets longer
+#define TLS_V13_TICKET_LIFETIME   1800
+
+// serialized session without ticket: format, version, cipher, session id and secret with their lengths
+#define TLS_MAX_SERVER_SESSION_SIZE (9 + TLS_MAX_SESSION_ID + TLS_MAX_HASH_SIZE)
 
 #define VERSION_SUPPORTED(version, err)  if ((version != TLS_V13) && (version != TLS_V12) && (version != TLS_V11) && (version != TLS_V10) && (version != DTLS_V13) && (version != DTLS_V12) && (version != DTLS_V10)) { if ((version == SSL_V30) && (context->connection_status == 0)) { version = TLS_V12; } else { DEBUG_PRINT("UNSUPPORTED TLS VERSION %x\n", (int)version); return err;} }
 #define CHECK_SIZE(size, buf_size, err)  if (((int)(size) > (int)(buf_size)) || ((int)(buf_size) < 0)) return err;
@@ -279,6 +286,8 @@ typedef struct chacha_ctx chacha_ctx;
 static const char sigma[] = "expand 32-byte k";
 static const char tau[] = "expand 16-byte k";
 
+#include "chacha20_simd.c"
+
 static inline void chacha_keysetup(chacha_ctx *x, const u8 *k, u32 kbits) {
     const char *constants;
 
@@ -357,6 +366,19 @@ static inline void chacha_encrypt_bytes(chacha_ctx *x, const u8 *m, u8 *c, u32 b
     if (!bytes)
         return;
 
+#ifdef TLS_CHACHA_SIMD
+    if ((unsigned long long)x->input[12] + bytes / CHACHA_BLOCKLEN <= 0xFFFFFFFFULL) {
+        u32 done = _private_tls_chacha_simd(x->input, m, c, bytes);
+        m += done;
+        c += done;
+        bytes -= done;
+        if (!bytes) {
+            x->unused = 0;
+            return;
+        }
+    }
+#endif
+
     j0 = x->input[0];
     j1 = x->input[1];
     j2 = x->input[2];
@@ -610,6 +632,14 @@ static void _private_tls_poly1305_blocks(poly1305_state_internal_t *st, const un
     unsigned long long d0,d1,d2,d3,d4;
     unsigned long c;
 
+#ifdef TLS_CHACHA_SIMD
+    if (!st->final) {
+        size_t done = _private_tls_poly1305_simd(st->r, st->h, m, bytes);
+        m += done;
+        bytes -= done;
+    }
+#endif
+
     r0 = st->r[0];
     r1 = st->r[1];
     r2 = st->r[2];
@@ -1174,6 +1204,20 @@ struct TLSContext {
     unsigned char local_random[TLS_SERVER_RANDOM_SIZE];
     unsigned char session[TLS_MAX_SESSION_ID];
     unsigned char session_size;
+    // TLS 1.2 client session resumption: offered session id, saved master secret and session ticket
+    unsigned char resume_session[TLS_MAX_SESSION_ID];
+    unsigned char resume_session_size;
+    unsigned char *resume_master_key;
+    unsigned int resume_master_key_len;
+    unsigned short resume_cipher;
+    unsigned short resume_version;
+    unsigned char *session_ticket;
+    unsigned short session_ticket_len;
+    unsigned char resumed;
+    // server session store, inherited by child contexts. Resumed TLS 1.3 server session keeps its PSK in resume_master_key
+    tls_session_get_function session_get;
+    tls_session_put_function session_put;
+    unsigned short psk_identity;
     unsigned short cipher;
     unsigned short version;
     unsigned char is_server;
@@ -1202,6 +1246,8 @@ struct TLSContext {
     
     unsigned char *message_buffer;
     unsigned int message_buffer_len;
+    // allocated size of message_buffer, the buffer is kept between reads
+    unsigned int message_buffer_size;
     uint64_t remote_sequence_number;
     uint64_t local_sequence_number;
     
@@ -1211,9 +1257,15 @@ struct TLSContext {
     
     unsigned char *tls_buffer;
     unsigned int tls_buffer_len;
+    // allocated size of tls_buffer, records of one write are appended without realloc each time
+    unsigned int tls_buffer_size;
     
     unsigned char *application_buffer;
     unsigned int application_buffer_len;
+    // SSL_read destination, decrypted application data is copied here directly
+    unsigned char *read_target;
+    unsigned int read_target_len;
+    unsigned int read_target_pos;
     unsigned char is_child;
     unsigned char exportable;
     unsigned char *exportable_keys;
@@ -1230,10 +1282,12 @@ struct TLSContext {
     unsigned int cached_handshake_len;
     unsigned char client_verified;
     // handshake messages flags
-    unsigned char hs_messages[11];
+    unsigned char hs_messages[12];
     void *user_data;
     struct TLSCertificate **root_certificates;
     unsigned int root_count;
+    // shared root store; root_certificates then points to its certificates and isn't owned by context
+    struct TLSRootStore *root_store;
 #ifdef TLS_ACCEPT_SECURE_RENEGOTIATION
     unsigned char *verify_data;
     unsigned char verify_len;
@@ -1256,6 +1310,16 @@ struct TLSContext {
 #endif
 };
 
+#define TLS_ROOT_STORE_BUCKETS  256
+
+struct TLSRootStore {
+    struct TLSCertificate **certificates;
+    unsigned int count;
+    // certificate indexes ordered by subject hash bucket; bucket b is index[buckets[b]] .. index[buckets[b + 1] - 1]
+    unsigned int *index;
+    unsigned int buckets[TLS_ROOT_STORE_BUCKETS + 1];
+};
+
 struct TLSPacket {
     unsigned char *buf;
     unsigned int len;
@@ -1325,6 +1389,9 @@ static const unsigned char TLS_EC_secp521r1_OID[] = {0x2B, 0x81, 0x04, 0x00, 0x2
 struct TLSCertificate *asn1_parse(struct TLSContext *context, const unsigned char *buffer, unsigned int size, int client_cert);
 int _private_tls_update_hash(struct TLSContext *context, const unsigned char *in, unsigned int len);
 struct TLSPacket *tls_build_finished(struct TLSContext *context);
+#ifdef WITH_TLS_13
+struct TLSPacket *tls_build_new_session_ticket(struct TLSContext *context, const unsigned char *resumption_secret, unsigned int secret_len);
+#endif
 unsigned int _private_tls_hmac_message(unsigned char local, struct TLSContext *context, const unsigned char *buf, int buf_len, const unsigned char *buf2, int buf_len2, unsigned char *out, unsigned int outlen, uint64_t remote_sequence_number);
 int tls_random(unsigned char *key, int len);
 void tls_destroy_packet(struct TLSPacket *packet);
@@ -2764,7 +2831,11 @@ int _private_tls13_key(struct TLSContext *context, int handshake) {
         DEBUG_DUMP_HEX_LABEL("salt", salt, mac_length);
         _private_tls_hkdf_extract(mac_length, prk, mac_length, salt, mac_length, earlysecret, mac_length);
     } else {
-        _private_tls_hkdf_extract(mac_length, prk, mac_length, NULL, 0, earlysecret, mac_length);
+        // resumed session starts from pre-shared key instead of zeros
+        if ((context->is_server) && (context->resumed) && (context->resume_master_key) && (context->resume_master_key_len == mac_length))
+            _private_tls_hkdf_extract(mac_length, prk, mac_length, NULL, 0, context->resume_master_key, mac_length);
+        else
+            _private_tls_hkdf_extract(mac_length, prk, mac_length, NULL, 0, earlysecret, mac_length);
         // derive secret for handshake "tls13 derived":
         DEBUG_DUMP_HEX_LABEL("null hash", hash, mac_length);
         _private_tls_hkdf_expand_label(mac_length, salt, mac_length, prk, mac_length, "derived", 7, hash, mac_length);
@@ -3317,6 +3388,17 @@ void tls_certificate_set_sign_key(struct TLSCertificate *cert, const unsigned ch
         cert->sign_len = len;
 }
 
+const unsigned char *tls_certificate_der(struct TLSCertificate *cert, unsigned int *len) {
+    if ((!cert) || (!cert->bytes) || (!cert->len)) {
+        if (len)
+            *len = 0;
+        return NULL;
+    }
+    if (len)
+        *len = cert->len;
+    return cert->bytes;
+}
+
 char *tls_certificate_to_string(struct TLSCertificate *cert, char *buffer, int len) {
     unsigned int i;
     if (!buffer)
@@ -4240,6 +4322,36 @@ int _private_tls_get_hash(struct TLSContext *context, unsigned char *hout) {
     return hash_size;
 }
 
+#ifdef WITH_TLS_13
+// TLS 1.3 transcript hash as if handshake message was already added; handshake hash itself is left unchanged
+int _private_tls_get_hash_with(struct TLSContext *context, unsigned char type, const unsigned char *buf, unsigned int buf_len, unsigned char *hout) {
+    if (!context)
+        return 0;
+    
+    TLSHash *hash = _private_tls_ensure_hash(context);
+    int hash_size = _private_tls_mac_length(context);
+    hash_state md;
+    if (hash->created)
+        memcpy(&md, &hash->hash, sizeof(hash_state));
+    else
+    if (hash_size == TLS_SHA384_MAC_SIZE)
+        sha384_init(&md);
+    else
+        sha256_init(&md);
+    if (hash_size == TLS_SHA384_MAC_SIZE) {
+        sha384_process(&md, &type, 1);
+        sha384_process(&md, buf, buf_len);
+        sha384_done(&md, hout);
+    } else {
+        sha256_process(&md, &type, 1);
+        sha256_process(&md, buf, buf_len);
+        sha256_done(&md, hout);
+        hash_size = TLS_SHA256_MAC_SIZE;
+    }
+    return hash_size;
+}
+#endif
+
 int _private_tls_write_packet(struct TLSPacket *packet) {
     if (!packet)
         return -1;
@@ -4248,11 +4360,19 @@ int _private_tls_write_packet(struct TLSPacket *packet) {
         return -1;
     
     if (context->tls_buffer) {
-        int len = context->tls_buffer_len + packet->len;
-        context->tls_buffer = (unsigned char *)TLS_REALLOC(context->tls_buffer, len);
-        if (!context->tls_buffer) {
-            context->tls_buffer_len = 0;
-            return -1;
+        unsigned int len = context->tls_buffer_len + packet->len;
+        if (len > context->tls_buffer_size) {
+            // grow geometrically, a bulk write appends many records in a row
+            unsigned int new_size = context->tls_buffer_size * 2;
+            if (new_size < len)
+                new_size = len;
+            context->tls_buffer = (unsigned char *)TLS_REALLOC(context->tls_buffer, new_size);
+            if (!context->tls_buffer) {
+                context->tls_buffer_len = 0;
+                context->tls_buffer_size = 0;
+                return -1;
+            }
+            context->tls_buffer_size = new_size;
         }
         memcpy(context->tls_buffer + context->tls_buffer_len, packet->buf, packet->len);
         context->tls_buffer_len = len;
@@ -4261,6 +4381,7 @@ int _private_tls_write_packet(struct TLSPacket *packet) {
         return written;
     }
     context->tls_buffer_len = packet->len;
+    context->tls_buffer_size = packet->size;
     context->tls_buffer = packet->buf;
     packet->buf = NULL;
     packet->len = 0;
@@ -4275,6 +4396,20 @@ int _private_tls_write_app_data(struct TLSContext *context, const unsigned char
     if ((!buf) || (!buf_len))
         return 0;
     
+    unsigned int total_len = buf_len;
+    // SSL_read in progress: hand the decrypted record straight to the caller, keeping order with buffered data
+    if ((context->read_target) && (!context->application_buffer_len)) {
+        unsigned int copy_len = context->read_target_len - context->read_target_pos;
+        if (copy_len > buf_len)
+            copy_len = buf_len;
+        memcpy(context->read_target + context->read_target_pos, buf, copy_len);
+        context->read_target_pos += copy_len;
+        buf += copy_len;
+        buf_len -= copy_len;
+        if (!buf_len)
+            return total_len;
+    }
+    
     int len = context->application_buffer_len + buf_len;
     context->application_buffer = (unsigned char *)TLS_REALLOC(context->application_buffer, len);
     if (!context->application_buffer) {
@@ -4283,7 +4418,7 @@ int _private_tls_write_app_data(struct TLSContext *context, const unsigned char
     }
     memcpy(context->application_buffer + context->application_buffer_len, buf, buf_len);
     context->application_buffer_len = len;
-    return buf_len;
+    return total_len;
 }
 
 const unsigned char *tls_get_write_buffer(struct TLSContext *context, unsigned int *outlen) {
@@ -4356,6 +4491,7 @@ void tls_buffer_clear(struct TLSContext *context) {
         TLS_FREE(context->tls_buffer);
         context->tls_buffer = NULL;
         context->tls_buffer_len = 0;
+        context->tls_buffer_size = 0;
     }
 }
 
@@ -4447,6 +4583,9 @@ struct TLSContext *tls_accept(struct TLSContext *context) {
         child->exportable = context->exportable;
         child->root_certificates = context->root_certificates;
         child->root_count = context->root_count;
+        child->root_store = context->root_store;
+        child->session_get = context->session_get;
+        child->session_put = context->session_put;
 #ifdef TLS_FORWARD_SECRECY
         child->default_dhe_p = context->default_dhe_p;
         child->default_dhe_g = context->default_dhe_g;
@@ -4575,7 +4714,7 @@ void tls_destroy_context(struct TLSContext *context) {
             for (i = 0; i < context->certificates_count; i++)
                 tls_destroy_certificate(context->certificates[i]);
         }
-        if (context->root_certificates) {
+        if ((context->root_certificates) && (!context->root_store)) {
             for (i = 0; i < context->root_count; i++)
                 tls_destroy_certificate(context->root_certificates[i]);
             TLS_FREE(context->root_certificates);
@@ -4606,6 +4745,8 @@ void tls_destroy_context(struct TLSContext *context) {
     context->client_certificates = NULL;
     TLS_FREE(context->master_key);
     TLS_FREE(context->premaster_key);
+    TLS_FREE(context->resume_master_key);
+    TLS_FREE(context->session_ticket);
     if (context->crypto.created)
         _private_tls_crypto_done(context);
     TLS_FREE(context->message_buffer);
@@ -5424,9 +5565,124 @@ struct TLSPacket *tls_build_server_key_exchange(struct TLSContext *context, int
     return packet;
 }
 
+struct TLSSessionData {
+    unsigned short version;
+    unsigned short cipher;
+    const unsigned char *session;
+    unsigned char session_size;
+    // TLS 1.2 master secret or TLS 1.3 resumption PSK
+    const unsigned char *secret;
+    unsigned char secret_len;
+    const unsigned char *ticket;
+    unsigned short ticket_len;
+};
+
+int _private_tls_session_write(const struct TLSSessionData *data, unsigned char *buffer, unsigned int buf_len) {
+    unsigned int size = 1 + 2 + 2 + 1 + data->session_size + 1 + data->secret_len + 2 + data->ticket_len;
+    if (!buffer)
+        return size;
+    if (buf_len < size)
+        return TLS_NO_MEMORY;
+    unsigned int pos = 0;
+    // format version
+    buffer[pos++] = 1;
+    buffer[pos++] = data->version >> 8;
+    buffer[pos++] = data->version & 0xFF;
+    buffer[pos++] = data->cipher >> 8;
+    buffer[pos++] = data->cipher & 0xFF;
+    buffer[pos++] = data->session_size;
+    if (data->session_size)
+        memcpy(buffer + pos, data->session, data->session_size);
+    pos += data->session_size;
+    buffer[pos++] = data->secret_len;
+    memcpy(buffer + pos, data->secret, data->secret_len);
+    pos += data->secret_len;
+    buffer[pos++] = data->ticket_len >> 8;
+    buffer[pos++] = data->ticket_len & 0xFF;
+    if (data->ticket_len)
+        memcpy(buffer + pos, data->ticket, data->ticket_len);
+    pos += data->ticket_len;
+    return pos;
+}
+
+int _private_tls_session_read(struct TLSSessionData *data, const unsigned char *buffer, unsigned int buf_len) {
+    unsigned int pos = 0;
+    if ((buf_len < 6) || (buffer[pos++] != 1))
+        return TLS_BROKEN_PACKET;
+    data->version = buffer[pos] * 0x100 + buffer[pos + 1];
+    pos += 2;
+    data->cipher = buffer[pos] * 0x100 + buffer[pos + 1];
+    pos += 2;
+    data->session_size = buffer[pos++];
+    if ((data->session_size > TLS_MAX_SESSION_ID) || (buf_len - pos < (unsigned int)data->session_size + 1))
+        return TLS_BROKEN_PACKET;
+    data->session = buffer + pos;
+    pos += data->session_size;
+    data->secret_len = buffer[pos++];
+    if ((!data->secret_len) || (buf_len - pos < (unsigned int)data->secret_len + 2))
+        return TLS_BROKEN_PACKET;
+    data->secret = buffer + pos;
+    pos += data->secret_len;
+    data->ticket_len = buffer[pos] * 0x100 + buffer[pos + 1];
+    pos += 2;
+    if (buf_len - pos < data->ticket_len)
+        return TLS_BROKEN_PACKET;
+    data->ticket = buffer + pos;
+    return 0;
+}
+
+int _private_tls_session_find(struct TLSContext *context, const unsigned char *id, unsigned int id_len, struct TLSSessionData *data, unsigned char *buffer, unsigned int buf_len) {
+    if ((!context->session_get) || (!id_len) || (context->dtls))
+        return 0;
+    int size = context->session_get(context, id, id_len, buffer, buf_len);
+    if ((size <= 0) || ((unsigned int)size > buf_len))
+        return 0;
+    if (_private_tls_session_read(data, buffer, size))
+        return 0;
+    // session must be resumed with the same protocol version and cipher
+    if ((data->version != context->version) || (data->cipher != context->cipher))
+        return 0;
+    return 1;
+}
+
+void _private_tls_session_save(struct TLSContext *context, const unsigned char *id, unsigned int id_len, const unsigned char *secret, unsigned int secret_len) {
+    if ((!context->session_put) || (!id_len) || (id_len > TLS_MAX_SESSION_ID) || (!secret) || (!secret_len) || (secret_len > TLS_MAX_HASH_SIZE) || (context->dtls))
+        return;
+    struct TLSSessionData data;
+    memset(&data, 0, sizeof(data));
+    data.version = context->version;
+    data.cipher = context->cipher;
+    data.session = id;
+    data.session_size = id_len;
+    data.secret = secret;
+    data.secret_len = secret_len;
+    unsigned char buffer[TLS_MAX_SERVER_SESSION_SIZE];
+    int size = _private_tls_session_write(&data, buffer, sizeof(buffer));
+    if (size > 0)
+        context->session_put(context, id, id_len, buffer, size);
+}
+
 void _private_tls_set_session_id(struct TLSContext *context) {
     if (((context->version == TLS_V13) || (context->version == DTLS_V13)) && (context->session_size == TLS_MAX_SESSION_ID))
         return;
+    // resumed session keeps id offered by client
+    if ((context->is_server) && (context->resumed))
+        return;
+    if ((!context->is_server) && (context->resume_master_key)) {
+        // offer saved session; with a ticket, server echoes our (random) session id if it accepts the ticket
+        if (context->resume_session_size) {
+            memcpy(context->session, context->resume_session, context->resume_session_size);
+            context->session_size = context->resume_session_size;
+            return;
+        }
+        if (tls_random(context->session, TLS_MAX_SESSION_ID)) {
+            context->session_size = TLS_MAX_SESSION_ID;
+            memcpy(context->resume_session, context->session, TLS_MAX_SESSION_ID);
+            context->resume_session_size = TLS_MAX_SESSION_ID;
+        } else
+            context->session_size = 0;
+        return;
+    }
     if (tls_random(context->session, TLS_MAX_SESSION_ID))
         context->session_size = TLS_MAX_SESSION_ID;
     else
@@ -5553,6 +5809,9 @@ struct TLSPacket *tls_build_hello(struct TLSContext *context, int tls13_downgrad
                 extension_len += 6;
             else
                 extension_len += 9;
+            // selected pre-shared key
+            if ((context->is_server) && (context->resumed) && (context->connection_status != 4))
+                extension_len += 6;
         }
         if ((context->is_server) && (context->negotiated_alpn) && (context->version != TLS_V13) && (context->version != DTLS_V13)) {
 #else
@@ -5773,6 +6032,9 @@ struct TLSPacket *tls_build_hello(struct TLSContext *context, int tls13_downgrad
 #endif
                 if (sni_len)
                     extension_len += sni_len + 9;
+                // session ticket (TLS 1.2 only)
+                if ((!context->is_server) && ((context->version == TLS_V12) || (context->version == DTLS_V12)))
+                    extension_len += 4 + context->session_ticket_len;
 #ifdef WITH_TLS_13
                 if ((!context->is_server) && ((context->version == TLS_V13) || (context->version == DTLS_V13))) {
 #ifdef TLS_CURVE25519
@@ -5829,6 +6091,13 @@ struct TLSPacket *tls_build_hello(struct TLSContext *context, int tls13_downgrad
                         }
                     }
                 }
+                if ((!context->is_server) && ((context->version == TLS_V12) || (context->version == DTLS_V12))) {
+                    // empty ticket asks server for a new one
+                    tls_packet_uint16(packet, 0x23);
+                    tls_packet_uint16(packet, context->session_ticket_len);
+                    if (context->session_ticket_len)
+                        tls_packet_append(packet, context->session_ticket, context->session_ticket_len);
+                }
             }
         }
 #ifdef WITH_TLS_13
@@ -5920,6 +6189,12 @@ struct TLSPacket *tls_build_hello(struct TLSContext *context, int tls13_downgrad
 #endif
                 }
             }
+            if ((context->is_server) && (context->resumed) && (context->connection_status != 4)) {
+                // pre shared key
+                tls_packet_uint16(packet, 0x29);
+                tls_packet_uint16(packet, 2);
+                tls_packet_uint16(packet, context->psk_identity);
+            }
             if (!context->is_server) {
                 // signature algorithms
                 tls_packet_uint16(packet, 0x0D);
@@ -6368,6 +6643,92 @@ int _private_tls_parse_key_share(struct TLSContext *context, const unsigned char
 }
 #endif
 
+#ifdef WITH_TLS_13
+int _private_tls13_accept_psk(struct TLSContext *context, const unsigned char *buf, int psk_offset, int psk_size) {
+    unsigned int mac_length = _private_tls_mac_length(context);
+    if ((!context->session_get) || (context->dtls) || (psk_size < 2))
+        return 0;
+    unsigned short identities_len = ntohs(*(unsigned short *)&buf[psk_offset]);
+    if (identities_len + 4 > psk_size)
+        return 0;
+    const unsigned char *identities = &buf[psk_offset + 2];
+    // binders are not part of transcript hash they sign
+    int binders_offset = psk_offset + 2 + identities_len;
+    unsigned short binders_len = ntohs(*(unsigned short *)&buf[binders_offset]);
+    if (binders_len + identities_len + 4 > psk_size)
+        return 0;
+    const unsigned char *binders = &buf[binders_offset + 2];
+
+    int i = 0;
+    int j = 0;
+    unsigned short index = 0;
+    while (i + 2 <= identities_len) {
+        unsigned short id_len = ntohs(*(unsigned short *)&identities[i]);
+        i += 2;
+        // identity and obfuscated ticket age
+        if (i + id_len + 4 > identities_len)
+            return 0;
+        const unsigned char *id = &identities[i];
+        i += id_len + 4;
+        if (j >= binders_len)
+            return 0;
+        unsigned char binder_len = binders[j++];
+        if (j + binder_len > binders_len)
+            return 0;
+        const unsigned char *binder = &binders[j];
+        j += binder_len;
+
+        struct TLSSessionData data;
+        unsigned char session_buffer[TLS_MAX_SERVER_SESSION_SIZE];
+        if ((binder_len == mac_length) && (_private_tls_session_find(context, id, id_len, &data, session_buffer, sizeof(session_buffer))) && (data.secret_len == mac_length)) {
+            unsigned char hash[TLS_MAX_HASH_SIZE];
+            unsigned char empty_hash[TLS_MAX_HASH_SIZE];
+            unsigned char early_secret[TLS_MAX_HASH_SIZE];
+            unsigned char binder_key[TLS_MAX_HASH_SIZE];
+            unsigned char finished_key[TLS_MAX_HASH_SIZE];
+            unsigned char expected[TLS_MAX_HASH_SIZE];
+            unsigned long expected_len = TLS_MAX_HASH_SIZE;
+
+            hash_state md;
+            if (mac_length == TLS_SHA384_MAC_SIZE) {
+                sha384_init(&md);
+                sha384_done(&md, empty_hash);
+            } else {
+                sha256_init(&md);
+                sha256_done(&md, empty_hash);
+            }
+            int hash_len = _private_tls_get_hash_with(context, 0x01, buf, binders_offset, hash);
+            _private_tls_hkdf_extract(mac_length, early_secret, mac_length, NULL, 0, data.secret, mac_length);
+            _private_tls_hkdf_expand_label(mac_length, binder_key, mac_length, early_secret, mac_length, "res binder", 10, empty_hash, mac_length);
+            _private_tls_hkdf_expand_label(mac_length, finished_key, mac_length, binder_key, mac_length, "finished", 8, NULL, 0);
+
+            hmac_state hmac;
+            hmac_init(&hmac, _private_tls_get_hash_idx(context), finished_key, mac_length);
+            hmac_process(&hmac, hash, hash_len);
+            hmac_done(&hmac, expected, &expected_len);
+            // wrong binder: don't use the key, full handshake is still safe
+            if ((expected_len != mac_length) || (memcmp(expected, binder, mac_length))) {
+                DEBUG_PRINT("PSK BINDER VERIFICATION FAILED\n");
+                return 0;
+            }
+
+            TLS_FREE(context->resume_master_key);
+            context->resume_master_key = (unsigned char *)TLS_MALLOC(mac_length);
+            if (!context->resume_master_key)
+                return 0;
+            memcpy(context->resume_master_key, data.secret, mac_length);
+            context->resume_master_key_len = mac_length;
+            context->psk_identity = index;
+            context->resumed = 1;
+            DEBUG_PRINT("SESSION RESUMED (PSK %i)\n", (int)index);
+            return 1;
+        }
+        index++;
+    }
+    return 0;
+}
+#endif
+
 int tls_parse_hello(struct TLSContext *context, const unsigned char *buf, int buf_len, unsigned int *write_packets, unsigned int *dtls_verified) {
     *write_packets = 0;
     *dtls_verified = 0;
@@ -6515,11 +6876,15 @@ int tls_parse_hello(struct TLSContext *context, const unsigned char *buf, int bu
     }
     
     
-    if (res > 2)
+    // extensions are optional, hello may end right after compression
+    if ((res > 2) && (buf_len - res >= 2))
         res += 2;
 #ifdef WITH_TLS_13
     const unsigned char *key_share = NULL;
     unsigned short key_size = 0;
+    int psk_offset = 0;
+    unsigned short psk_size = 0;
+    int psk_dhe = 0;
 #endif
     while (buf_len - res >= 4) {
         // have extensions
@@ -6661,6 +7026,10 @@ int tls_parse_hello(struct TLSContext *context, const unsigned char *buf, int bu
             if (extension_type == 0x29) {
                 // pre shared key
                 DEBUG_DUMP_HEX_LABEL("EXTENSION, PRE SHARED KEY", &buf[res], extension_len);
+                if (context->is_server) {
+                    psk_offset = res;
+                    psk_size = extension_len;
+                }
             } else
             if (extension_type == 0x33) {
                 // key share
@@ -6686,6 +7055,14 @@ int tls_parse_hello(struct TLSContext *context, const unsigned char *buf, int bu
             if (extension_type == 0x2D) {
                 // psk key exchange modes
                 DEBUG_DUMP_HEX_LABEL("EXTENSION, PSK KEY EXCHANGE MODES", &buf[res], extension_len);
+                if ((context->is_server) && (buf[res] < extension_len)) {
+                    int i;
+                    for (i = 1; i <= buf[res]; i++) {
+                        // psk_dhe_ke, key share is still used
+                        if (buf[res + i] == 1)
+                            psk_dhe = 1;
+                    }
+                }
             }
 #endif
             res += extension_len;
@@ -6730,15 +7107,87 @@ int tls_parse_hello(struct TLSContext *context, const unsigned char *buf, int bu
                 return key_share_err;
         }
         // we have key share
-        if (context->is_server)
+        if (context->is_server) {
             context->connection_status = 3;
-        else
+            // pre-shared key of saved session replaces certificate authentication
+            if ((psk_size) && (psk_dhe))
+                _private_tls13_accept_psk(context, buf, psk_offset, psk_size);
+        } else
             context->connection_status = 2;
     }
 #endif
+    if ((context->is_server) && (context->session_size) && (context->version != TLS_V13) && (context->version != DTLS_V13)) {
+        struct TLSSessionData data;
+        unsigned char session_buffer[TLS_MAX_SERVER_SESSION_SIZE];
+        if (_private_tls_session_find(context, context->session, context->session_size, &data, session_buffer, sizeof(session_buffer))) {
+            // abbreviated handshake, keys are derived from saved master secret after server hello
+            DEBUG_PRINT("SESSION RESUMED\n");
+            TLS_FREE(context->master_key);
+            context->master_key = (unsigned char *)TLS_MALLOC(data.secret_len);
+            if (!context->master_key)
+                return TLS_NO_MEMORY;
+            memcpy(context->master_key, data.secret, data.secret_len);
+            context->master_key_len = data.secret_len;
+            context->resumed = 1;
+        }
+    }
+    if ((!context->is_server) && (context->resume_master_key) && (context->version == context->resume_version) && (context->cipher == context->resume_cipher) &&
+        (context->session_size) && (context->session_size == context->resume_session_size) && (!memcmp(context->session, context->resume_session, context->session_size))) {
+        // server accepted saved session: no certificate and key exchange, keys are derived from saved master secret
+        DEBUG_PRINT("SESSION RESUMED\n");
+        TLS_FREE(context->master_key);
+        context->master_key = (unsigned char *)TLS_MALLOC(context->resume_master_key_len);
+        if (!context->master_key)
+            return TLS_NO_MEMORY;
+        memcpy(context->master_key, context->resume_master_key, context->resume_master_key_len);
+        context->master_key_len = context->resume_master_key_len;
+        if (!_private_tls_expand_key(context))
+            return TLS_BROKEN_PACKET;
+        context->resumed = 1;
+        // wait for server change cipher spec and finished
+        context->connection_status = 2;
+    } else
+    if ((!context->is_server) && (context->session_ticket)) {
+        // saved session was refused, its ticket is useless now
+        TLS_FREE(context->session_ticket);
+        context->session_ticket = NULL;
+        context->session_ticket_len = 0;
+    }
     return res;
 }
 
+int tls_parse_session_ticket(struct TLSContext *context, const unsigned char *buf, int buf_len) {
+    int res = 0;
+    CHECK_SIZE(3, buf_len, TLS_NEED_MORE_DATA)
+    unsigned int size = buf[0] * 0x10000 + buf[1] * 0x100 + buf[2];
+    res += 3;
+    if (context->dtls) {
+        int dtls_check = _private_dtls_check_packet(buf, buf_len);
+        if (dtls_check < 0)
+            return dtls_check;
+        res += 8;
+    }
+    CHECK_SIZE(size, buf_len - res, TLS_NEED_MORE_DATA)
+    if (size < 6)
+        return TLS_BROKEN_PACKET;
+    // ticket lifetime hint is ignored, caller limits lifetime of saved sessions
+    unsigned short ticket_len = ntohs(*(unsigned short *)&buf[res + 4]);
+    if (ticket_len > size - 6)
+        return TLS_BROKEN_PACKET;
+    TLS_FREE(context->session_ticket);
+    context->session_ticket = NULL;
+    context->session_ticket_len = 0;
+    if (ticket_len) {
+        context->session_ticket = (unsigned char *)TLS_MALLOC(ticket_len);
+        if (!context->session_ticket)
+            return TLS_NO_MEMORY;
+        memcpy(context->session_ticket, &buf[res + 6], ticket_len);
+        context->session_ticket_len = ticket_len;
+    }
+    DEBUG_PRINT("SESSION TICKET: %i bytes\n", (int)ticket_len);
+    return res + size;
+}
+
 int tls_parse_certificate(struct TLSContext *context, const unsigned char *buf, int buf_len, int is_client) {
     int res = 0;
     CHECK_SIZE(3, buf_len, TLS_NEED_MORE_DATA)
@@ -7309,11 +7758,22 @@ int tls_parse_finished(struct TLSContext *context, const unsigned char *buf, int
             return TLS_NOT_VERIFIED;
         }
         if (context->is_server) {
+            // resumption secret covers client finished too
+            unsigned char resumption_hash[TLS_MAX_SHA_SIZE];
+            int resumption_hash_len = 0;
+            if ((context->session_put) && (!context->dtls))
+                resumption_hash_len = _private_tls_get_hash_with(context, 0x14, buf, res + size, resumption_hash);
             context->connection_status = 0xFF;
             res += size;
             _private_tls13_key(context, 0);
             context->local_sequence_number = 0;
             context->remote_sequence_number = 0;
+            if ((resumption_hash_len) && (context->master_key) && (context->master_key_len == hash_len)) {
+                unsigned char resumption_secret[TLS_MAX_SHA_SIZE];
+                _private_tls_hkdf_expand_label(hash_len, resumption_secret, hash_len, context->master_key, context->master_key_len, "res master", 10, resumption_hash, resumption_hash_len);
+                DEBUG_PRINT("<= SENDING NEW SESSION TICKET\n");
+                _private_tls_write_packet(tls_build_new_session_ticket(context, resumption_secret, hash_len));
+            }
             return res;
         }
     } else
@@ -7361,7 +7821,11 @@ int tls_parse_finished(struct TLSContext *context, const unsigned char *buf, int
 #endif
         TLS_FREE(out);
     }
-    if (context->is_server)
+    // in resumed session client sends its finished after server's
+    if ((context->is_server) && (context->resumed))
+        context->connection_status = 0xFF;
+    else
+    if ((context->is_server) || (context->resumed))
         *write_packets = 3;
     else
         context->connection_status = 0xFF;
@@ -7665,6 +8129,15 @@ int tls_parse_payload(struct TLSContext *context, const unsigned char *buf, int
                 }
 #endif
                 break;
+                // new session ticket
+            case 0x04:
+                CHECK_HANDSHAKE_STATE(context, 11, 1);
+                DEBUG_PRINT(" => NEW SESSION TICKET\n");
+                if ((context->is_server) || (context->version == TLS_V13) || (context->version == DTLS_V13))
+                    payload_res = TLS_UNEXPECTED_MESSAGE;
+                else
+                    payload_res = tls_parse_session_ticket(context, buf + 1, payload_size);
+                break;
 #ifdef WITH_TLS_13
             case 0x08:
                 // encrypted extensions ... ignore it for now
@@ -7786,14 +8259,17 @@ int tls_parse_payload(struct TLSContext *context, const unsigned char *buf, int
                         context->cipher_spec_set = 1;
                         DEBUG_PRINT("<= SENDING ENCRYPTED EXTENSIONS\n");
                         _private_tls_write_packet(tls_build_encrypted_extensions(context));
-                        if (context->request_client_certificate) {
-                            DEBUG_PRINT("<= SENDING CERTIFICATE REQUEST\n");
-                            _private_tls_write_packet(tls_certificate_request(context));
+                        // resumed session is authenticated by pre-shared key
+                        if (!context->resumed) {
+                            if (context->request_client_certificate) {
+                                DEBUG_PRINT("<= SENDING CERTIFICATE REQUEST\n");
+                                _private_tls_write_packet(tls_certificate_request(context));
+                            }
+                            DEBUG_PRINT("<= SENDING CERTIFICATE\n");
+                            _private_tls_write_packet(tls_build_certificate(context));
+                            DEBUG_PRINT("<= SENDING CERTIFICATE VERIFY\n");
+                            _private_tls_write_packet(tls_build_certificate_verify(context));
                         }
-                        DEBUG_PRINT("<= SENDING CERTIFICATE\n");
-                        _private_tls_write_packet(tls_build_certificate(context));
-                        DEBUG_PRINT("<= SENDING CERTIFICATE VERIFY\n");
-                        _private_tls_write_packet(tls_build_certificate_verify(context));
                         DEBUG_PRINT("<= SENDING FINISHED\n");
                         _private_tls_write_packet(tls_build_finished(context));
                         // new key
@@ -7805,6 +8281,21 @@ int tls_parse_payload(struct TLSContext *context, const unsigned char *buf, int
                     }
 #endif
                     _private_tls_write_packet(tls_build_hello(context, 0));
+                    if (context->resumed) {
+                        // abbreviated handshake: server finishes first, client answers with its change cipher spec and finished
+                        if (!_private_tls_expand_key(context)) {
+                            _private_tls_write_packet(tls_build_alert(context, 1, internal_error));
+                            context->critical_error = 1;
+                            break;
+                        }
+                        DEBUG_PRINT("<= SENDING CHANGE CIPHER SPEC\n");
+                        _private_tls_write_packet(tls_build_change_cipher_spec(context));
+                        context->cipher_spec_set = 1;
+                        DEBUG_PRINT("<= SENDING FINISHED\n");
+                        _private_tls_write_packet(tls_build_finished(context));
+                        context->connection_status = 2;
+                        break;
+                    }
                     DEBUG_PRINT("<= SENDING CERTIFICATE\n");
                     _private_tls_write_packet(tls_build_certificate(context));
                     int ephemeral_cipher = tls_cipher_is_ephemeral(context);
@@ -7825,6 +8316,9 @@ int tls_parse_payload(struct TLSContext *context, const unsigned char *buf, int
                 _private_tls_write_packet(tls_build_change_cipher_spec(context));
                 _private_tls_write_packet(tls_build_finished(context));
                 context->connection_status = 0xFF;
+                // keep master secret of full handshake for abbreviated ones
+                if (context->is_server)
+                    _private_tls_session_save(context, context->session, context->session_size, context->master_key, context->master_key_len);
                 break;
             case 4:
                 // dtls only
@@ -7926,12 +8420,8 @@ int tls_parse_message(struct TLSContext *context, unsigned char *buf, int buf_le
             _private_random_sleep(context, TLS_MAX_ERROR_SLEEP_uS);
             return TLS_BROKEN_PACKET;
         }
-        pt = (unsigned char *)TLS_MALLOC(length);
-        if (!pt) {
-            DEBUG_PRINT("Error in TLS_MALLOC (%i bytes)\n", (int)length);
-            _private_random_sleep(context, TLS_MAX_ERROR_SLEEP_uS);
-            return TLS_NO_MEMORY;
-        }
+        // records are decrypted in place, buf is owned by the caller (usually message_buffer)
+        pt = buf + header_size;
 
         unsigned char aad[16];
         int aad_size = sizeof(aad);
@@ -7983,7 +8473,6 @@ int tls_parse_message(struct TLSContext *context, unsigned char *buf, int buf_le
 #endif
             if (pt_length < 0) {
                 DEBUG_PRINT("Invalid packet length");
-                TLS_FREE(pt);
                 _private_random_sleep(context, TLS_MAX_ERROR_SLEEP_uS);
                 return TLS_BROKEN_PACKET;
             }
@@ -7992,9 +8481,9 @@ int tls_parse_message(struct TLSContext *context, unsigned char *buf, int buf_le
             
             int res0 = gcm_add_iv(&context->crypto.ctx_remote.aes_gcm_remote, iv, 12);
             int res1 = gcm_add_aad(&context->crypto.ctx_remote.aes_gcm_remote, aad, aad_size);
-            memset(pt, 0, length);
             DEBUG_PRINT("PT SIZE: %i\n", pt_length);
-            int res2 = gcm_process(&context->crypto.ctx_remote.aes_gcm_remote, pt, pt_length, buf + header_size + delta, GCM_DECRYPT);
+            pt += delta;
+            int res2 = gcm_process(&context->crypto.ctx_remote.aes_gcm_remote, pt, pt_length, pt, GCM_DECRYPT);
             unsigned char tag[32];
             unsigned long taglen = 32;
             int res3 = gcm_done(&context->crypto.ctx_remote.aes_gcm_remote, tag, &taglen);
@@ -8010,7 +8499,6 @@ int tls_parse_message(struct TLSContext *context, unsigned char *buf, int buf_le
                 DEBUG_PRINT("INTEGRITY CHECK FAILED (msg length %i)\n", pt_length);
                 DEBUG_DUMP_HEX_LABEL("TAG RECEIVED", buf + header_size + delta + pt_length, taglen);
                 DEBUG_DUMP_HEX_LABEL("TAG COMPUTED", tag, taglen);
-                TLS_FREE(pt);
                 _private_random_sleep(context, TLS_MAX_ERROR_SLEEP_uS);
                 _private_tls_write_packet(tls_build_alert(context, 1, bad_record_mac));
                 return TLS_INTEGRITY_FAILED;
@@ -8028,7 +8516,6 @@ int tls_parse_message(struct TLSContext *context, unsigned char *buf, int buf_le
             aad_size = 16;
             if (pt_length < 0) {
                 DEBUG_PRINT("Invalid packet length");
-                TLS_FREE(pt);
                 _private_random_sleep(context, TLS_MAX_ERROR_SLEEP_uS);
                 return TLS_BROKEN_PACKET;
             }
@@ -8063,11 +8550,7 @@ int tls_parse_message(struct TLSContext *context, unsigned char *buf, int buf_le
 
             chacha_ivupdate(&context->crypto.ctx_remote.chacha_remote, context->crypto.ctx_remote_mac.remote_aead_iv, sequence, (unsigned char *)&counter);
 
-            chacha_encrypt_bytes(&context->crypto.ctx_remote.chacha_remote, buf + header_size, pt, pt_length);
-            DEBUG_DUMP_HEX_LABEL("decrypted", pt, pt_length);
-            ptr = pt;
-            length = (unsigned short)pt_length;
-
+            // authenticate the ciphertext before it is overwritten by the in place decryption
             chacha20_poly1305_key(&context->crypto.ctx_remote.chacha_remote, poly1305_key);
             poly1305_context ctx;
             _private_tls_poly1305_init(&ctx, poly1305_key);
@@ -8092,7 +8575,6 @@ int tls_parse_message(struct TLSContext *context, unsigned char *buf, int buf_le
                 DEBUG_PRINT("INTEGRITY CHECK FAILED (msg length %i)\n", length);
                 DEBUG_DUMP_HEX_LABEL("POLY1305 TAG RECEIVED", buf + header_size + pt_length, POLY1305_TAGLEN);
                 DEBUG_DUMP_HEX_LABEL("POLY1305 TAG COMPUTED", mac_tag, POLY1305_TAGLEN);
-                TLS_FREE(pt);
 
                 // silently ignore packet for DTLS
                 if (context->dtls)
@@ -8102,11 +8584,15 @@ int tls_parse_message(struct TLSContext *context, unsigned char *buf, int buf_le
                 _private_tls_write_packet(tls_build_alert(context, 1, bad_record_mac));
                 return TLS_INTEGRITY_FAILED;
             }
+
+            chacha_encrypt_bytes(&context->crypto.ctx_remote.chacha_remote, pt, pt, pt_length);
+            DEBUG_DUMP_HEX_LABEL("decrypted", pt, pt_length);
+            ptr = pt;
+            length = (unsigned short)pt_length;
 #endif
         } else {
-            int err = _private_tls_crypto_decrypt(context, buf + header_size, pt, length);
+            int err = _private_tls_crypto_decrypt(context, pt, pt, length);
             if (err) {
-                TLS_FREE(pt);
                 DEBUG_PRINT("Decryption error %i\n", (int)err);
                 _private_random_sleep(context, TLS_MAX_ERROR_SLEEP_uS);
                 return TLS_BROKEN_PACKET;
@@ -8121,7 +8607,6 @@ int tls_parse_message(struct TLSContext *context, unsigned char *buf, int buf_le
                 int limit = length - 1;
                 for (i = length - padding; i < limit; i++) {
                     if (pt[i] != padding_byte) {
-                        TLS_FREE(pt);
                         DEBUG_PRINT("BROKEN PACKET (POODLE ?)\n");
                         _private_random_sleep(context, TLS_MAX_ERROR_SLEEP_uS);
                         _private_tls_write_packet(tls_build_alert(context, 1, decrypt_error));
@@ -8151,7 +8636,6 @@ int tls_parse_message(struct TLSContext *context, unsigned char *buf, int buf_le
             
             unsigned int mac_size = _private_tls_mac_length(context);
             if ((length < mac_size) || (!mac_size)) {
-                TLS_FREE(pt);
                 DEBUG_PRINT("BROKEN PACKET\n");
                 _private_random_sleep(context, TLS_MAX_ERROR_SLEEP_uS);
                 _private_tls_write_packet(tls_build_alert(context, 1, decrypt_error));
@@ -8170,7 +8654,6 @@ int tls_parse_message(struct TLSContext *context, unsigned char *buf, int buf_le
                 DEBUG_PRINT("INTEGRITY CHECK FAILED (msg length %i)\n", length);
                 DEBUG_DUMP_HEX_LABEL("HMAC RECEIVED", message_hmac, mac_size);
                 DEBUG_DUMP_HEX_LABEL("HMAC COMPUTED", hmac_out, hmac_out_len);
-                TLS_FREE(pt);
 
                 // silently ignore packet for DTLS
                 if (context->dtls)
@@ -8253,10 +8736,8 @@ int tls_parse_message(struct TLSContext *context, unsigned char *buf, int buf_le
             break;
         default:
             DEBUG_PRINT("NOT UNDERSTOOD MESSAGE TYPE: %x\n", (int)type);
-            TLS_FREE(pt);
             return TLS_NOT_UNDERSTOOD;
     }
-    TLS_FREE(pt);
     
     if (payload_res < 0)
         return payload_res;
@@ -8495,11 +8976,44 @@ int tls_certificate_chain_is_valid(struct TLSCertificate **certificates, int len
     return 0;
 }
 
+unsigned int _private_tls_name_hash(const unsigned char *country, const unsigned char *state, const unsigned char *location, const unsigned char *entity, const unsigned char *subject) {
+    const unsigned char *fields[] = { country, state, location, entity, subject };
+    unsigned int hash = 2166136261U;
+    int i;
+    // FNV-1a over all fields, each one terminated by zero byte
+    for (i = 0; i < 5; i++) {
+        const unsigned char *field = fields[i];
+        if (field) {
+            while (*field) {
+                hash ^= *field++;
+                hash *= 16777619U;
+            }
+        }
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
 int tls_certificate_chain_is_valid_root(struct TLSContext *context, struct TLSCertificate **certificates, int len) {
     if ((!certificates) || (!len) || (!context->root_certificates) || (!context->root_count))
         return bad_certificate;
     int i;
     unsigned int j;
+    if (context->root_store) {
+        struct TLSRootStore *store = context->root_store;
+        // look only at roots whose subject matches issuer of the certificate
+        for (i = 0; i < len; i++) {
+            unsigned int bucket = _private_tls_name_hash(certificates[i]->issuer_country, certificates[i]->issuer_state, certificates[i]->issuer_location, certificates[i]->issuer_entity, certificates[i]->issuer_subject) % TLS_ROOT_STORE_BUCKETS;
+            for (j = store->buckets[bucket]; j < store->buckets[bucket + 1]; j++) {
+                struct TLSCertificate *root = store->certificates[store->index[j]];
+                if (tls_certificate_is_valid(root))
+                    continue;
+                if (tls_certificate_verify_signature(certificates[i], root))
+                    return 0;
+            }
+        }
+        // names are matched by the parsed fields only; fall back to full scan before rejecting the chain
+    }
     for (i = 0; i < len; i++) {
         for (j = 0; j < context->root_count; j++) {
             // check if root certificate expired
@@ -8958,12 +9472,13 @@ int tls_clear_certificates(struct TLSContext *context) {
     if ((!context) || (!context->is_server) || (context->is_child))
         return TLS_GENERIC_ERROR;
 
-    if (context->root_certificates) {
+    if ((context->root_certificates) && (!context->root_store)) {
         for (i = 0; i < context->root_count; i++)
             tls_destroy_certificate(context->root_certificates[i]);
     }
     context->root_certificates = NULL;
     context->root_count = 0;
+    context->root_store = NULL;
     if (context->private_key)
         tls_destroy_certificate(context->private_key);
     context->private_key = NULL;
@@ -9228,9 +9743,14 @@ struct TLSPacket *tls_build_finished(struct TLSContext *context) {
         } else
 #endif
         {
-            hash_len = _private_tls_done_hash(context, hash);
+            // in resumed session client finished comes next, so handshake hash is still needed
+            if (context->resumed)
+                hash_len = _private_tls_get_hash(context, hash);
+            else
+                hash_len = _private_tls_done_hash(context, hash);
             _private_tls_prf(context, out, TLS_MIN_FINISHED_OPAQUE_LEN, context->master_key, context->master_key_len, (unsigned char *)"server finished", 15, hash, hash_len, NULL, 0);
-            _private_tls_destroy_hash(context);
+            if (!context->resumed)
+                _private_tls_destroy_hash(context);
         }
     } else {
 #ifdef WITH_TLS_13
@@ -9287,6 +9807,36 @@ struct TLSPacket *tls_build_finished(struct TLSContext *context) {
     return packet;
 }
 
+#ifdef WITH_TLS_13
+struct TLSPacket *tls_build_new_session_ticket(struct TLSContext *context, const unsigned char *resumption_secret, unsigned int secret_len) {
+    unsigned char ticket[TLS_MAX_SESSION_ID];
+    unsigned char ticket_age_add[4];
+    unsigned char psk[TLS_MAX_HASH_SIZE];
+    // one ticket per connection, so nonce doesn't have to change
+    static const unsigned char nonce[1] = {0};
+
+    if ((secret_len > TLS_MAX_HASH_SIZE) || (!tls_random(ticket, sizeof(ticket))) || (!tls_random(ticket_age_add, sizeof(ticket_age_add))))
+        return NULL;
+    // ticket is just a random id of session kept by server
+    _private_tls_hkdf_expand_label(secret_len, psk, secret_len, resumption_secret, secret_len, "resumption", 10, nonce, sizeof(nonce));
+    _private_tls_session_save(context, ticket, sizeof(ticket), psk, secret_len);
+
+    struct TLSPacket *packet = tls_create_packet(context, TLS_HANDSHAKE, context->version, 0);
+    tls_packet_uint8(packet, 0x04);
+    tls_packet_uint24(packet, 4 + 4 + 1 + sizeof(nonce) + 2 + sizeof(ticket) + 2);
+    tls_packet_uint32(packet, TLS_V13_TICKET_LIFETIME);
+    tls_packet_append(packet, ticket_age_add, sizeof(ticket_age_add));
+    tls_packet_uint8(packet, sizeof(nonce));
+    tls_packet_append(packet, nonce, sizeof(nonce));
+    tls_packet_uint16(packet, sizeof(ticket));
+    tls_packet_append(packet, ticket, sizeof(ticket));
+    // no extensions
+    tls_packet_uint16(packet, 0);
+    tls_packet_update(packet);
+    return packet;
+}
+#endif
+
 struct TLSPacket *tls_build_change_cipher_spec(struct TLSContext *context) {
     struct TLSPacket *packet = tls_create_packet(context, TLS_CHANGE_CIPHER, context->version, 64);
     tls_packet_uint8(packet, 1);
@@ -9361,32 +9911,21 @@ int _private_tls_read_from_file(const char *fname, void *buf, int max_len) {
     return 0;
 }
 
-int tls_consume_stream(struct TLSContext *context, const unsigned char *buf, int buf_len, tls_validation_function certificate_verify) {
-    if (!context)
-        return TLS_GENERIC_ERROR;
-
-    if (context->critical_error)
-        return TLS_BROKEN_CONNECTION;
-
-    if (buf_len <= 0) {
-        DEBUG_PRINT("tls_consume_stream called with buf_len %i\n", buf_len);
+int _private_tls_reserve_message_buffer(struct TLSContext *context, unsigned int size) {
+    if (context->message_buffer_size - context->message_buffer_len >= size)
         return 0;
-    }
-
-    if (!buf) {
-        DEBUG_PRINT("tls_consume_stream called NULL buffer\n");
-        context->critical_error = 1;
+    unsigned int new_size = context->message_buffer_size ? context->message_buffer_size * 2 : TLS_READ_CHUNK;
+    while (new_size - context->message_buffer_len < size)
+        new_size *= 2;
+    unsigned char *new_buffer = (unsigned char *)TLS_REALLOC(context->message_buffer, new_size);
+    if (!new_buffer)
         return TLS_NO_MEMORY;
-    }
+    context->message_buffer = new_buffer;
+    context->message_buffer_size = new_size;
+    return 0;
+}
 
-    unsigned int orig_len = context->message_buffer_len;
-    context->message_buffer_len += buf_len;
-    context->message_buffer = (unsigned char *)TLS_REALLOC(context->message_buffer, context->message_buffer_len);
-    if (!context->message_buffer) {
-        context->message_buffer_len = 0;
-        return TLS_NO_MEMORY;
-    }
-    memcpy(context->message_buffer + orig_len, buf, buf_len);
+int _private_tls_consume_message_buffer(struct TLSContext *context, tls_validation_function certificate_verify) {
     unsigned int index = 0;
     unsigned int tls_buffer_len = context->message_buffer_len;
     int err_flag = 0;
@@ -9425,23 +9964,47 @@ int tls_consume_stream(struct TLSContext *context, const unsigned char *buf, int
     if (err_flag) {
         DEBUG_PRINT("ERROR IN CONSUME: %i\n", err_flag);
         context->message_buffer_len = 0;
+        context->message_buffer_size = 0;
         TLS_FREE(context->message_buffer);
         context->message_buffer = NULL;
         return err_flag;
     }
     if (index) {
         context->message_buffer_len -= index;
-        if (context->message_buffer_len) {
-            // no realloc here
+        // no realloc here, the buffer is reused by the next read
+        if (context->message_buffer_len)
             memmove(context->message_buffer, context->message_buffer + index, context->message_buffer_len);
-        } else {
-            TLS_FREE(context->message_buffer);
-            context->message_buffer = NULL;
-        }
     }
     return index;
 }
 
+int tls_consume_stream(struct TLSContext *context, const unsigned char *buf, int buf_len, tls_validation_function certificate_verify) {
+    if (!context)
+        return TLS_GENERIC_ERROR;
+
+    if (context->critical_error)
+        return TLS_BROKEN_CONNECTION;
+
+    if (buf_len <= 0) {
+        DEBUG_PRINT("tls_consume_stream called with buf_len %i\n", buf_len);
+        return 0;
+    }
+
+    if (!buf) {
+        DEBUG_PRINT("tls_consume_stream called NULL buffer\n");
+        context->critical_error = 1;
+        return TLS_NO_MEMORY;
+    }
+
+    if (_private_tls_reserve_message_buffer(context, buf_len)) {
+        context->message_buffer_len = 0;
+        return TLS_NO_MEMORY;
+    }
+    memcpy(context->message_buffer + context->message_buffer_len, buf, buf_len);
+    context->message_buffer_len += buf_len;
+    return _private_tls_consume_message_buffer(context, certificate_verify);
+}
+
 void tls_close_notify(struct TLSContext *context) {
     if ((!context) || (context->critical_error))
         return;
@@ -9755,6 +10318,7 @@ struct TLSContext *tls_import_context(const unsigned char *buffer, unsigned int
             if (context->tls_buffer) {
                 memcpy(context->tls_buffer, &buffer[buf_pos], tls_buffer_len);
                 context->tls_buffer_len = tls_buffer_len;
+                context->tls_buffer_size = tls_buffer_len;
             }
             buf_pos += tls_buffer_len;
         }
@@ -9768,6 +10332,7 @@ struct TLSContext *tls_import_context(const unsigned char *buffer, unsigned int
             if (context->message_buffer) {
                 memcpy(context->message_buffer, &buffer[buf_pos], message_buffer_len);
                 context->message_buffer_len = message_buffer_len;
+                context->message_buffer_size = message_buffer_len;
             }
             buf_pos += message_buffer_len;
         }
@@ -9844,8 +10409,78 @@ int tls_sni_set(struct TLSContext *context, const char *sni) {
     return 0;
 }
 
-int tls_load_root_certificates(struct TLSContext *context, const unsigned char *pem_buffer, int pem_size) {
+int tls_session_export(struct TLSContext *context, unsigned char *buffer, unsigned int buf_len) {
+    if ((!context) || (context->is_server) || (context->critical_error) || (context->connection_status != 0xFF))
+        return TLS_GENERIC_ERROR;
+    if (((context->version != TLS_V12) && (context->version != DTLS_V12)) || (!context->master_key) || (context->master_key_len > 0xFF))
+        return TLS_GENERIC_ERROR;
+    // nothing to resume with
+    if ((!context->session_size) && (!context->session_ticket_len))
+        return 0;
+    struct TLSSessionData data;
+    data.version = context->version;
+    data.cipher = context->cipher;
+    data.session = context->session;
+    data.session_size = context->session_size;
+    data.secret = context->master_key;
+    data.secret_len = context->master_key_len;
+    data.ticket = context->session_ticket;
+    data.ticket_len = context->session_ticket_len;
+    return _private_tls_session_write(&data, buffer, buf_len);
+}
+
+int tls_session_import(struct TLSContext *context, const unsigned char *buffer, unsigned int buf_len) {
+    if ((!context) || (context->is_server) || (context->critical_error) || (context->connection_status != 0) || (!buffer))
+        return TLS_GENERIC_ERROR;
+    struct TLSSessionData data;
+    if (_private_tls_session_read(&data, buffer, buf_len))
+        return TLS_BROKEN_PACKET;
+    // session must be resumed with the same protocol version
+    if (data.version != context->version)
+        return TLS_GENERIC_ERROR;
+
+    TLS_FREE(context->resume_master_key);
+    context->resume_master_key = (unsigned char *)TLS_MALLOC(data.secret_len);
+    if (!context->resume_master_key)
+        return TLS_NO_MEMORY;
+    memcpy(context->resume_master_key, data.secret, data.secret_len);
+    context->resume_master_key_len = data.secret_len;
+    TLS_FREE(context->session_ticket);
+    context->session_ticket = NULL;
+    context->session_ticket_len = 0;
+    if (data.ticket_len) {
+        context->session_ticket = (unsigned char *)TLS_MALLOC(data.ticket_len);
+        if (!context->session_ticket) {
+            TLS_FREE(context->resume_master_key);
+            context->resume_master_key = NULL;
+            return TLS_NO_MEMORY;
+        }
+        memcpy(context->session_ticket, data.ticket, data.ticket_len);
+        context->session_ticket_len = data.ticket_len;
+    }
+    memcpy(context->resume_session, data.session, data.session_size);
+    context->resume_session_size = data.session_size;
+    context->resume_version = data.version;
+    context->resume_cipher = data.cipher;
+    return 0;
+}
+
+int tls_session_resumed(struct TLSContext *context) {
     if (!context)
+        return 0;
+    return context->resumed;
+}
+
+int tls_set_session_store(struct TLSContext *context, tls_session_get_function get_session, tls_session_put_function put_session) {
+    if ((!context) || (!context->is_server) || (context->is_child))
+        return TLS_GENERIC_ERROR;
+    context->session_get = get_session;
+    context->session_put = put_session;
+    return 0;
+}
+
+int tls_load_root_certificates(struct TLSContext *context, const unsigned char *pem_buffer, int pem_size) {
+    if ((!context) || (context->root_store))
         return TLS_GENERIC_ERROR;
     
     unsigned int len;
@@ -9886,6 +10521,89 @@ int tls_load_root_certificates(struct TLSContext *context, const unsigned char *
     return context->root_count;
 }
 
+struct TLSRootStore *tls_root_store_load(const unsigned char *pem_buffer, int pem_size) {
+    struct TLSContext *context = tls_create_context(0, TLS_V12);
+    if (!context)
+        return NULL;
+    struct TLSRootStore *store = (struct TLSRootStore *)TLS_MALLOC(sizeof(struct TLSRootStore));
+    if (!store) {
+        tls_destroy_context(context);
+        return NULL;
+    }
+    memset(store, 0, sizeof(struct TLSRootStore));
+    if (tls_load_root_certificates(context, pem_buffer, pem_size) <= 0) {
+        TLS_FREE(store);
+        tls_destroy_context(context);
+        return NULL;
+    }
+    // take parsed certificates from temporary context
+    store->certificates = context->root_certificates;
+    store->count = context->root_count;
+    context->root_certificates = NULL;
+    context->root_count = 0;
+    tls_destroy_context(context);
+
+    store->index = (unsigned int *)TLS_MALLOC(store->count * sizeof(unsigned int));
+    if (!store->index) {
+        tls_root_store_free(store);
+        return NULL;
+    }
+    // counting sort of certificates by subject hash bucket
+    unsigned int i;
+    unsigned int *hashes = (unsigned int *)TLS_MALLOC(store->count * sizeof(unsigned int));
+    if (!hashes) {
+        tls_root_store_free(store);
+        return NULL;
+    }
+    for (i = 0; i < store->count; i++) {
+        struct TLSCertificate *cert = store->certificates[i];
+        hashes[i] = _private_tls_name_hash(cert->country, cert->state, cert->location, cert->entity, cert->subject) % TLS_ROOT_STORE_BUCKETS;
+        store->buckets[hashes[i] + 1]++;
+    }
+    for (i = 0; i < TLS_ROOT_STORE_BUCKETS; i++)
+        store->buckets[i + 1] += store->buckets[i];
+    unsigned int positions[TLS_ROOT_STORE_BUCKETS];
+    memcpy(positions, store->buckets, sizeof(positions));
+    for (i = 0; i < store->count; i++)
+        store->index[positions[hashes[i]]++] = i;
+    TLS_FREE(hashes);
+    return store;
+}
+
+int tls_root_store_count(struct TLSRootStore *store) {
+    if (!store)
+        return 0;
+    return store->count;
+}
+
+int tls_set_root_store(struct TLSContext *context, struct TLSRootStore *store) {
+    if ((!context) || (!store) || (context->is_child))
+        return TLS_GENERIC_ERROR;
+    if ((context->root_certificates) && (!context->root_store)) {
+        unsigned int i;
+        for (i = 0; i < context->root_count; i++)
+            tls_destroy_certificate(context->root_certificates[i]);
+        TLS_FREE(context->root_certificates);
+    }
+    context->root_store = store;
+    context->root_certificates = store->certificates;
+    context->root_count = store->count;
+    return 0;
+}
+
+void tls_root_store_free(struct TLSRootStore *store) {
+    unsigned int i;
+    if (!store)
+        return;
+    if (store->certificates) {
+        for (i = 0; i < store->count; i++)
+            tls_destroy_certificate(store->certificates[i]);
+        TLS_FREE(store->certificates);
+    }
+    TLS_FREE(store->index);
+    TLS_FREE(store);
+}
+
 int tls_default_verify(struct TLSContext *context, struct TLSCertificate **certificate_chain, int len) {
     int i;
     int err;
@@ -10094,7 +10812,8 @@ int _tls_ssl_private_send_pending(int client_sock, struct TLSContext *context) {
         else
             res = send(client_sock, (char *)&out_buffer[out_buffer_index], out_buffer_len, 0);
         if (res <= 0) {
-            if ((!write_cb) && (res < 0)) {
+            // keep the unsent tail for non-blocking sockets, SSL_flush() sends it later
+            if (res < 0) {
 #ifdef _WIN32
                 if (WSAGetLastError() == WSAEWOULDBLOCK) {
                     context->tls_buffer_len = out_buffer_len;
@@ -10289,25 +11008,38 @@ int _private_tls_safe_read(struct TLSContext *context, void *buffer, int buf_siz
     return recv(ssl_data->fd, (char *)buffer, buf_size, 0);
 }
 
+int _private_tls_safe_read_message(struct TLSContext *context) {
+    // read straight into the tail of message_buffer, records are then decrypted in place
+    if (_private_tls_reserve_message_buffer(context, TLS_READ_CHUNK))
+        return TLS_NO_MEMORY;
+    int read_size = _private_tls_safe_read(context, context->message_buffer + context->message_buffer_len, context->message_buffer_size - context->message_buffer_len);
+    if (read_size > 0)
+        context->message_buffer_len += read_size;
+    return read_size;
+}
+
 int SSL_accept(struct TLSContext *context) {
     if (!context)
         return TLS_GENERIC_ERROR;
     SSLUserData *ssl_data = (SSLUserData *)context->user_data;
-    if ((!ssl_data) || (ssl_data->fd < 0))
+    if ((!ssl_data) || (ssl_data->fd < 0) || (context->critical_error))
         return TLS_GENERIC_ERROR;
-    if (tls_established(context))
+    if (tls_established(context) == 1)
         return 1;
-    unsigned char client_message[0xFFFF];
     // accept
     int read_size = 0;
-    while ((read_size = _private_tls_safe_read(context, (char *)client_message, sizeof(client_message))) > 0) {
-        if (tls_consume_stream(context, client_message, read_size, ssl_data->certificate_verify) >= 0) {
+    while ((read_size = _private_tls_safe_read_message(context)) > 0) {
+        if (_private_tls_consume_message_buffer(context, ssl_data->certificate_verify) >= 0) {
             int res = _tls_ssl_private_send_pending(ssl_data->fd, context);
             if (res < 0)
                 return res;
         }
-        if (tls_established(context))
+        // failed handshake is not established either
+        int established = tls_established(context);
+        if (established == 1)
             return 1;
+        if (established < 0)
+            return TLS_GENERIC_ERROR;
     }
     if (read_size <= 0)
         return TLS_BROKEN_CONNECTION;
@@ -10328,10 +11060,9 @@ int SSL_connect(struct TLSContext *context) {
         return res;
     
     int read_size;
-    unsigned char client_message[0xFFFF];
 
-    while ((read_size = _private_tls_safe_read(context, (char *)client_message, sizeof(client_message))) > 0) {
-        if (tls_consume_stream(context, client_message, read_size, ssl_data->certificate_verify) >= 0) {
+    while ((read_size = _private_tls_safe_read_message(context)) > 0) {
+        if (_private_tls_consume_message_buffer(context, ssl_data->certificate_verify) >= 0) {
             res = _tls_ssl_private_send_pending(ssl_data->fd, context);
             if (res < 0)
                 return res;
@@ -10362,15 +11093,37 @@ int SSL_write(struct TLSContext *context, const void *buf, unsigned int len) {
     if ((!ssl_data) || (ssl_data->fd < 0))
         return TLS_GENERIC_ERROR;
     
-    int written_size = tls_write(context, (const unsigned char *)buf, len);
+    // encrypt everything into full size records first, then flush them with a single send
+    unsigned int written_size = 0;
+    while (written_size < len) {
+        int res = tls_write(context, (const unsigned char *)buf + written_size, len - written_size);
+        if (res <= 0) {
+            if (!written_size)
+                return res;
+            break;
+        }
+        written_size += res;
+    }
     if (written_size > 0) {
         int res = _tls_ssl_private_send_pending(ssl_data->fd, context);
-        if (res <= 0)
+        // records the socket didn't accept stay in the write buffer, the data is still consumed
+        if ((res <= 0) && (!context->tls_buffer_len))
             return res;
     }
     return written_size;
 }
 
+int SSL_flush(struct TLSContext *context) {
+    if (!context)
+        return TLS_GENERIC_ERROR;
+    SSLUserData *ssl_data = (SSLUserData *)context->user_data;
+    if ((!ssl_data) || (ssl_data->fd < 0))
+        return TLS_GENERIC_ERROR;
+    if (!context->tls_buffer_len)
+        return 0;
+    return _tls_ssl_private_send_pending(ssl_data->fd, context);
+}
+
 int SSL_read(struct TLSContext *context, void *buf, unsigned int len) {
     if (!context)
         return TLS_GENERIC_ERROR;
@@ -10383,25 +11136,30 @@ int SSL_read(struct TLSContext *context, void *buf, unsigned int len) {
         return TLS_GENERIC_ERROR;
     if (tls_established(context) != 1)
         return TLS_GENERIC_ERROR;
+    if (!len)
+        return 0;
     
-    if (!context->application_buffer_len) {
-        unsigned char client_message[0xFFFF];
-        // accept
-        int read_size;
-        while ((read_size = _private_tls_safe_read(context, (char *)client_message, sizeof(client_message))) > 0) {
-            if (tls_consume_stream(context, client_message, read_size, ssl_data->certificate_verify) > 0) {
-                _tls_ssl_private_send_pending(ssl_data->fd, context);
-                break;
-            }
-            if ((context->critical_error) && (!context->application_buffer_len)) {
-                return TLS_GENERIC_ERROR;
-            }
-        }
-        if ((read_size <= 0) && (!context->application_buffer_len))
-            return read_size;
+    // records are read into message_buffer, decrypted in place and copied once into buf
+    context->read_target = (unsigned char *)buf;
+    context->read_target_len = len;
+    context->read_target_pos = 0;
+    int read_size;
+    while ((read_size = _private_tls_safe_read_message(context)) > 0) {
+        if (_private_tls_consume_message_buffer(context, ssl_data->certificate_verify) > 0)
+            _tls_ssl_private_send_pending(ssl_data->fd, context);
+        // records without application data (tickets, key updates) don't end the read
+        if ((context->read_target_pos) || (context->critical_error))
+            break;
     }
-    
-    return tls_read(context, (unsigned char *)buf, len);
+    unsigned int delivered = context->read_target_pos;
+    context->read_target = NULL;
+    context->read_target_len = 0;
+    context->read_target_pos = 0;
+    if (delivered)
+        return delivered;
+    if (context->critical_error)
+        return TLS_GENERIC_ERROR;
+    return read_size;
 }
 
 int SSL_pending(struct TLSContext *context) {
@@ -186,11 +186,15 @@ typedef enum {
 struct TLSPacket;
 struct TLSCertificate;
 struct TLSContext;
+struct TLSRootStore;
 struct ECCCurveParameters;
 typedef struct TLSContext TLS;
 typedef struct TLSCertificate Certificate;
 
 typedef int (*tls_validation_function)(struct TLSContext *context, struct TLSCertificate **certificate_chain, int len);
+// server session store: get copies serialized session into buffer and returns its size (0 if unknown), put saves it
+typedef int (*tls_session_get_function)(struct TLSContext *context, const unsigned char *id, unsigned int id_len, unsigned char *session, unsigned int session_len);
+typedef void (*tls_session_put_function)(struct TLSContext *context, const unsigned char *id, unsigned int id_len, const unsigned char *session, unsigned int session_len);
 
 /*
   Global initialization. Optional, as it will be called automatically;
@@ -210,6 +214,8 @@ void tls_certificate_set_key(struct TLSCertificate *cert, const unsigned char *v
 void tls_certificate_set_priv(struct TLSCertificate *cert, const unsigned char *val, int len);
 void tls_certificate_set_sign_key(struct TLSCertificate *cert, const unsigned char *val, int len);
 char *tls_certificate_to_string(struct TLSCertificate *cert, char *buffer, int len);
+// DER encoding of certificate received from peer, NULL for locally loaded certificates
+const unsigned char *tls_certificate_der(struct TLSCertificate *cert, unsigned int *len);
 void tls_certificate_set_exponent(struct TLSCertificate *cert, const unsigned char *val, int len);
 void tls_certificate_set_serial(struct TLSCertificate *cert, const unsigned char *val, int len);
 void tls_certificate_set_algorithm(unsigned int *algorithm, const unsigned char *val, int len);
@@ -273,6 +279,7 @@ int tls_parse_server_hello_done(struct TLSContext *context, const unsigned char
 int tls_parse_finished(struct TLSContext *context, const unsigned char *buf, int buf_len, unsigned int *write_packets);
 int tls_parse_verify(struct TLSContext *context, const unsigned char *buf, int buf_len);
 int tls_parse_payload(struct TLSContext *context, const unsigned char *buf, int buf_len, tls_validation_function certificate_verify);
+/* Encrypted records are decrypted in place, buf is overwritten with the plaintext. */
 int tls_parse_message(struct TLSContext *context, unsigned char *buf, int buf_len, tls_validation_function certificate_verify);
 int tls_certificate_verify_signature(struct TLSCertificate *cert, struct TLSCertificate *parent);
 int tls_certificate_chain_is_valid(struct TLSCertificate **certificates, int len);
@@ -337,7 +344,19 @@ int tls_request_client_certificate(struct TLSContext *context);
 int tls_client_verified(struct TLSContext *context);
 const char *tls_sni(struct TLSContext *context);
 int tls_sni_set(struct TLSContext *context, const char *sni);
+// TLS 1.2 client session resumption (session id and session ticket). Export after handshake, import before connect
+int tls_session_export(struct TLSContext *context, unsigned char *buffer, unsigned int buf_len);
+int tls_session_import(struct TLSContext *context, const unsigned char *buffer, unsigned int buf_len);
+int tls_session_resumed(struct TLSContext *context);
+// server session resumption (TLS 1.2 session id, TLS 1.3 ticket). Set on server context, inherited by tls_accept
+int tls_set_session_store(struct TLSContext *context, tls_session_get_function get_session, tls_session_put_function put_session);
 int tls_load_root_certificates(struct TLSContext *context, const unsigned char *pem_buffer, int pem_size);
+// immutable root certificate store, parsed once and shared by any number of contexts (and threads)
+struct TLSRootStore *tls_root_store_load(const unsigned char *pem_buffer, int pem_size);
+int tls_root_store_count(struct TLSRootStore *store);
+// the store must outlive every context it is set on
+int tls_set_root_store(struct TLSContext *context, struct TLSRootStore *store);
+void tls_root_store_free(struct TLSRootStore *store);
 int tls_default_verify(struct TLSContext *context, struct TLSCertificate **certificate_chain, int len);
 void tls_print_certificate(const char *fname);
 int tls_add_alpn(struct TLSContext *context, const char *alpn);
@@ -402,6 +421,7 @@ int tls_remote_error(struct TLSContext *context);
     int SSL_connect(struct TLSContext *context);
     int SSL_shutdown(struct TLSContext *context);
     int SSL_write(struct TLSContext *context, const void *buf, unsigned int len);
+    int SSL_flush(struct TLSContext *context);
     int SSL_read(struct TLSContext *context, void *buf, unsigned int len);
     int SSL_pending(struct TLSContext *context);
     int SSL_set_io(struct TLSContext *context, void *recv, void *send);
@@ -0,0 +1,343 @@
+#include "tun2http.h"
+
+extern int pipefds[2];
+extern struct worker *workers[TUN_WORKERS_MAX];
+extern int worker_count;
+
+struct worker *create_worker(int index, int dispatched) {
+    struct worker *w = calloc(1, sizeof(struct worker));
+    if (w == NULL) {
+        log_android(ANDROID_LOG_ERROR, "worker %d alloc failed", index);
+        return NULL;
+    }
+
+    w->index = index;
+    w->dispatched = dispatched;
+
+    // Create signal pipe
+    if (pipe(w->pipefds)) {
+        log_android(ANDROID_LOG_ERROR, "Create pipe error %d: %s", errno, strerror(errno));
+        free(w);
+        return NULL;
+    }
+    for (int i = 0; i < 2; i++) {
+        int flags = fcntl(w->pipefds[i], F_GETFL, 0);
+        if (flags < 0 || fcntl(w->pipefds[i], F_SETFL, flags | O_NONBLOCK) < 0)
+            log_android(ANDROID_LOG_ERROR, "fcntl pipefds[%d] O_NONBLOCK error %d: %s",
+                        i, errno, strerror(errno));
+    }
+
+    if (pthread_mutex_init(&w->lock, NULL))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_init failed");
+
+    init_sessions(w);
+    w->inbox = NULL;
+    w->inbox_tail = &w->inbox;
+    w->returned = NULL;
+
+    return w;
+}
+
+static void free_packet_chain(struct packet_buffer *b) {
+    while (b != NULL) {
+        struct packet_buffer *n = b->next;
+        put_packet_buffer(NULL, b->data);
+        b = n;
+    }
+}
+
+void destroy_worker(struct worker *w) {
+    if (w == NULL)
+        return;
+
+    log_android(ANDROID_LOG_WARN, "worker %d dispatched %d received %llu dropped %llu",
+                w->index, w->dispatched,
+                (unsigned long long) w->received, (unsigned long long) w->dropped);
+
+    clear_sessions(w);
+    free_packet_chain(w->inbox);
+    free_packet_chain(w->returned);
+
+    for (int i = 0; i < 2; i++)
+        if (close(w->pipefds[i]))
+            log_android(ANDROID_LOG_ERROR, "Close pipe error %d: %s", errno, strerror(errno));
+
+    if (pthread_mutex_destroy(&w->lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_destroy failed");
+
+    free(w);
+}
+
+int get_packet_worker(const uint8_t *pkt, size_t length, int workers) {
+    // Same flow key as the sessions, so a worker sees every packet of its sessions
+    uint8_t protocol;
+    const void *saddr;
+    const void *daddr;
+    size_t off;
+
+    if (workers <= 1 || length < 1)
+        return 0;
+
+    uint8_t version = (*pkt) >> 4;
+    if (version == 4) {
+        if (length < sizeof(struct iphdr))
+            return 0;
+
+        const struct iphdr *ip4hdr = (const struct iphdr *) pkt;
+        protocol = ip4hdr->protocol;
+        saddr = &ip4hdr->saddr;
+        daddr = &ip4hdr->daddr;
+        off = (size_t) ip4hdr->ihl * 4;
+    } else if (version == 6) {
+        if (length < sizeof(struct ip6_hdr))
+            return 0;
+
+        const struct ip6_hdr *ip6hdr = (const struct ip6_hdr *) pkt;
+        saddr = &ip6hdr->ip6_src;
+        daddr = &ip6hdr->ip6_dst;
+
+        // Skip extension headers like handle_ip
+        off = sizeof(struct ip6_hdr);
+        protocol = ip6hdr->ip6_nxt;
+        if (!is_upper_layer(protocol)) {
+            size_t eoff = sizeof(struct ip6_hdr);
+            while (eoff + sizeof(struct ip6_ext) <= length) {
+                const struct ip6_ext *ext = (const struct ip6_ext *) (pkt + eoff);
+                if (!is_lower_layer(ext->ip6e_nxt) || is_upper_layer(protocol))
+                    break;
+                protocol = ext->ip6e_nxt;
+                eoff += (8 + ext->ip6e_len);
+            }
+            if (is_upper_layer(protocol))
+                off = eoff;
+            else
+                protocol = ip6hdr->ip6_nxt;
+        }
+    } else
+        return 0;
+
+    __be16 source = 0;
+    __be16 dest = 0;
+    if (protocol == IPPROTO_ICMP || protocol == IPPROTO_ICMPV6)
+        protocol = (uint8_t) (version == 4 ? IPPROTO_ICMP : IPPROTO_ICMPV6);
+    else if (protocol == IPPROTO_TCP || protocol == IPPROTO_UDP) {
+        // Source and destination ports are at the same offset for both
+        if (off + sizeof(struct udphdr) > length)
+            return 0;
+        const struct udphdr *udphdr = (const struct udphdr *) (pkt + off);
+        source = udphdr->source;
+        dest = udphdr->dest;
+    } else
+        return 0;
+
+    uint32_t hash = get_session_hash(protocol, version, saddr, daddr, source, dest);
+    return (int) (((uint64_t) hash * (uint32_t) workers) >> 32);
+}
+
+static void dispatch_packets(struct arguments *args, uint8_t **batch, size_t *lengths, int count) {
+    struct packet_buffer *head[TUN_WORKERS_MAX];
+    struct packet_buffer **tail[TUN_WORKERS_MAX];
+    int queued[TUN_WORKERS_MAX];
+    for (int i = 0; i < worker_count; i++) {
+        head[i] = NULL;
+        tail[i] = &head[i];
+        queued[i] = 0;
+    }
+
+    // Group the batch by worker, keeping the order of each flow
+    for (int i = 0; i < count; i++) {
+        int index = get_packet_worker(batch[i], lengths[i], worker_count);
+        struct packet_buffer *b = PACKET_BUFFER(batch[i]);
+        b->length = lengths[i];
+        b->next = NULL;
+        *tail[index] = b;
+        tail[index] = &b->next;
+        queued[index]++;
+    }
+
+    for (int i = 0; i < worker_count; i++) {
+        struct worker *w = workers[i];
+        struct packet_buffer *returned;
+        int wakeup = 0;
+
+        if (pthread_mutex_lock(&w->lock))
+            log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
+
+        if (queued[i] > 0) {
+            if (w->inboxed + queued[i] > TUN_QUEUE_MAX)
+                w->dropped += queued[i];
+            else {
+                wakeup = (w->inbox == NULL);
+                *w->inbox_tail = head[i];
+                w->inbox_tail = tail[i];
+                w->inboxed += queued[i];
+                head[i] = NULL;
+            }
+        }
+
+        // Take back the buffers of packets the worker handled
+        returned = w->returned;
+        w->returned = NULL;
+
+        if (pthread_mutex_unlock(&w->lock))
+            log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
+
+        // Packets of a worker which doesn't keep up are dropped like on a full tun queue
+        while (head[i] != NULL) {
+            struct packet_buffer *n = head[i]->next;
+            put_packet_buffer(args->pool, head[i]->data);
+            head[i] = n;
+        }
+
+        while (returned != NULL) {
+            struct packet_buffer *n = returned->next;
+            put_packet_buffer(args->pool, returned->data);
+            returned = n;
+        }
+
+        if (wakeup && write(w->pipefds[1], "p", 1) < 0 && errno != EAGAIN)
+            log_android(ANDROID_LOG_WARN, "Write pipe error %d: %s", errno, strerror(errno));
+    }
+}
+
+void *handle_tun(void *a) {
+    struct arguments *args = (struct arguments *) a;
+    log_android(ANDROID_LOG_WARN, "Start dispatcher tun=%d workers %d", args->tun, worker_count);
+
+    // Packet buffers and read batching of this thread, the workers write the tun
+    args->pool = create_packet_pool();
+    args->io = create_tun_io();
+
+    int stopping = 0;
+    int error = 0;
+
+    // Open epoll file
+    int epoll_fd = epoll_create(1);
+    if (epoll_fd < 0) {
+        log_android(ANDROID_LOG_ERROR, "epoll create error %d: %s", errno, strerror(errno));
+        stopping = 1;
+    }
+
+    // Monitor stop events
+    struct epoll_event ev_pipe;
+    memset(&ev_pipe, 0, sizeof(struct epoll_event));
+    ev_pipe.events = EPOLLIN | EPOLLERR;
+    ev_pipe.data.ptr = &ev_pipe;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pipefds[0], &ev_pipe)) {
+        log_android(ANDROID_LOG_ERROR, "epoll add pipe error %d: %s", errno, strerror(errno));
+        stopping = 1;
+    }
+
+    // Monitor tun events
+    struct epoll_event ev_tun;
+    memset(&ev_tun, 0, sizeof(struct epoll_event));
+    ev_tun.events = EPOLLIN | EPOLLERR;
+    ev_tun.data.ptr = NULL;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, args->tun, &ev_tun)) {
+        log_android(ANDROID_LOG_ERROR, "epoll add tun error %d: %s", errno, strerror(errno));
+        stopping = 1;
+    }
+
+    // Loop
+    while (!stopping && !error) {
+        struct epoll_event ev[2];
+        int ready = epoll_wait(epoll_fd, ev, 2, -1);
+        if (ready < 0) {
+            if (errno == EINTR)
+                continue;
+            log_android(ANDROID_LOG_ERROR, "epoll tun %d dispatcher error %d: %s",
+                        args->tun, errno, strerror(errno));
+            error = 1;
+            break;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            if (ev[i].data.ptr == &ev_pipe) {
+                // Check pipe
+                stopping = 1;
+                uint8_t buffer[1];
+                if (read(pipefds[0], buffer, 1) < 0)
+                    log_android(ANDROID_LOG_WARN, "Read pipe error %d: %s",
+                                errno, strerror(errno));
+                else
+                    log_android(ANDROID_LOG_WARN, "Read pipe");
+                break;
+            }
+
+            if (ev[i].events & EPOLLERR) {
+                error = 1;
+                break;
+            }
+
+            if (ev[i].events & EPOLLIN) {
+                uint8_t *batch[TUN_BATCH];
+                size_t lengths[TUN_BATCH];
+                int count = read_tun(args, batch, lengths, &error);
+                dispatch_packets(args, batch, lengths, count);
+            }
+        }
+    }
+
+    // Stop the workers, there is nothing left to handle without the tun
+    if (error)
+        for (int i = 0; i < worker_count; i++)
+            if (write(workers[i]->pipefds[1], "x", 1) < 0)
+                log_android(ANDROID_LOG_WARN, "Write pipe error %d: %s", errno, strerror(errno));
+
+    // Close epoll file
+    if (epoll_fd >= 0 && close(epoll_fd))
+        log_android(ANDROID_LOG_ERROR,
+                    "epoll close error %d: %s", errno, strerror(errno));
+
+    destroy_tun_io(args);
+    args->io = NULL;
+    destroy_packet_pool(args->pool);
+    args->pool = NULL;
+
+    log_android(ANDROID_LOG_WARN, "Stopped dispatcher tun=%d", args->tun);
+
+    // Cleanup
+    free(args);
+    return NULL;
+}
+
+int receive_packets(const struct arguments *args, const int epoll_fd,
+                    int sessions, int maxsessions) {
+    struct worker *w = args->worker;
+
+    if (pthread_mutex_lock(&w->lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
+    struct packet_buffer *inbox = w->inbox;
+    w->inbox = NULL;
+    w->inbox_tail = &w->inbox;
+    w->inboxed = 0;
+    if (pthread_mutex_unlock(&w->lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
+
+    // Handle IP from the dispatcher
+    int count = 0;
+    struct packet_buffer *b = inbox;
+    while (b != NULL) {
+        handle_ip(args, b->data, b->length, epoll_fd, sessions, maxsessions);
+        count++;
+        if (b->next == NULL)
+            break;
+        b = b->next;
+    }
+
+    // Give the buffers back to the dispatcher pool
+    if (inbox != NULL) {
+        if (pthread_mutex_lock(&w->lock))
+            log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
+        b->next = w->returned;
+        w->returned = inbox;
+        w->received += count;
+        if (pthread_mutex_unlock(&w->lock))
+            log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
+    }
+
+    // Replies of the batch in one burst
+    flush_tun(args);
+
+    return count;
+}
@@ -112,9 +112,8 @@ uint8_t *find_data(uint8_t *data, size_t data_len, char *value) {
     return 0;
 }
 
-uint_t patch_buffer[2*MTU];
-
-uint8_t *patch_http_url(uint8_t *data, size_t *data_len) {
+// buffer holds *data_len + 7 + 511 bytes, it is owned by the caller so workers don't share it
+uint8_t *patch_http_url(uint8_t *data, size_t *data_len, uint8_t *buffer) {
     __android_log_print(ANDROID_LOG_VERBOSE, LOG_TAG, "patch_http_url start");
 
     char hostname[1024];
@@ -197,7 +196,7 @@ uint8_t *patch_http_url(uint8_t *data, size_t *data_len) {
         return 0;
     }
 
-    uint8_t *new_data = &patch_buffer[0];
+    uint8_t *new_data = buffer;
     LOG("patch_http_url start patch");
     memcpy(new_data, data, pos1);
 
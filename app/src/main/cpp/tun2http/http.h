@@ -8,6 +8,6 @@ int get_header(const char *header, const char *data, size_t data_len, char *valu
 int next_header(const char **data, size_t *len);
 uint8_t *find_data(uint8_t *data, size_t data_len, char *value);
 
-uint8_t *patch_http_url(uint8_t *data, size_t *data_len);
+uint8_t *patch_http_url(uint8_t *data, size_t *data_len, uint8_t *buffer);
 
 #endif //TUN2HTTP_TLS_H
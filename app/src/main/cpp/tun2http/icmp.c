@@ -1,7 +1,6 @@
 
 #include "tun2http.h"
 
-extern struct ng_session *ng_session;
 extern FILE *pcap_file;
 
 int get_icmp_timeout(const struct icmp_session *u, int sessions, int maxsessions) {
@@ -13,6 +12,13 @@ int get_icmp_timeout(const struct icmp_session *u, int sessions, int maxsessions
     return timeout;
 }
 
+// Time from which check_icmp_session closes the session
+time_t get_icmp_deadline(const struct icmp_session *u, int sessions, int maxsessions) {
+    if (u->stop)
+        return 0;
+    return u->time + get_icmp_timeout(u, sessions, maxsessions) + 1;
+}
+
 int check_icmp_session(const struct arguments *args, struct ng_session *s,
                        int sessions, int maxsessions) {
     time_t now = time(NULL);
@@ -68,7 +74,7 @@ void check_icmp_socket(const struct arguments *args, const struct epoll_event *e
             s->icmp.time = time(NULL);
 
             uint16_t blen = (uint16_t) (s->icmp.version == 4 ? ICMP4_MAXMSG : ICMP6_MAXMSG);
-            uint8_t *buffer = malloc(blen);
+            uint8_t *buffer = get_packet_buffer(args->pool, blen);
             ssize_t bytes = recv(s->socket, buffer, blen, 0);
             if (bytes < 0) {
                 // Socket error
@@ -123,7 +129,7 @@ void check_icmp_socket(const struct arguments *args, const struct epoll_event *e
                 if (write_icmp(args, &s->icmp, buffer, (size_t) bytes) < 0)
                     s->icmp.stop = 1;
             }
-            free(buffer);
+            put_packet_buffer(args->pool, buffer);
         }
     }
 }
@@ -158,15 +164,12 @@ jboolean handle_icmp(const struct arguments *args,
     }
 
     // Search session
-    struct ng_session *cur = ng_session;
-    while (cur != NULL &&
-           !((cur->protocol == IPPROTO_ICMP || cur->protocol == IPPROTO_ICMPV6) &&
-             !cur->icmp.stop && cur->icmp.version == version &&
-             (version == 4 ? cur->icmp.saddr.ip4 == ip4->saddr &&
-                             cur->icmp.daddr.ip4 == ip4->daddr
-                           : memcmp(&cur->icmp.saddr.ip6, &ip6->ip6_src, 16) == 0 &&
-                             memcmp(&cur->icmp.daddr.ip6, &ip6->ip6_dst, 16) == 0)))
-        cur = cur->next;
+    struct ng_session *cur = find_session(
+            args,
+            (uint8_t) (version == 4 ? IPPROTO_ICMP : IPPROTO_ICMPV6), version,
+            version == 4 ? (const void *) &ip4->saddr : (const void *) &ip6->ip6_src,
+            version == 4 ? (const void *) &ip4->daddr : (const void *) &ip6->ip6_dst,
+            0, 0);
 
     // Create new session if needed
     if (cur == NULL) {
@@ -210,8 +213,7 @@ jboolean handle_icmp(const struct arguments *args,
         if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s->socket, &s->ev))
             log_android(ANDROID_LOG_ERROR, "epoll add icmp error %d: %s", errno, strerror(errno));
 
-        s->next = ng_session;
-        ng_session = s;
+        add_session(args, s);
 
         cur = s;
     }
@@ -295,7 +297,7 @@ ssize_t write_icmp(const struct arguments *args, const struct icmp_session *cur,
     // Build packet
     if (cur->version == 4) {
         len = sizeof(struct iphdr) + datalen;
-        buffer = malloc(len);
+        buffer = get_packet_buffer(args->pool, len);
         struct iphdr *ip4 = (struct iphdr *) buffer;
         if (datalen)
             memcpy(buffer + sizeof(struct iphdr), data, datalen);
@@ -315,7 +317,7 @@ ssize_t write_icmp(const struct arguments *args, const struct icmp_session *cur,
     }
     else {
         len = sizeof(struct ip6_hdr) + datalen;
-        buffer = malloc(len);
+        buffer = get_packet_buffer(args->pool, len);
         struct ip6_hdr *ip6 = (struct ip6_hdr *) buffer;
         if (datalen)
             memcpy(buffer + sizeof(struct ip6_hdr), data, datalen);
@@ -342,9 +344,7 @@ ssize_t write_icmp(const struct arguments *args, const struct icmp_session *cur,
                 args->tun, dest, source, datalen,
                 icmp->icmp_type, icmp->icmp_code, icmp->icmp_id, icmp->icmp_seq);
 
-    ssize_t res = write(args->tun, buffer, len);
-
-    free(buffer);
+    ssize_t res = write_tun(args, buffer, len);
 
     if (res != len) {
         log_android(ANDROID_LOG_ERROR, "write %d/%d", res, len);
@@ -16,6 +16,142 @@ uint16_t get_default_mss(int version) {
         return (uint16_t) (get_mtu() - sizeof(struct ip6_hdr) - sizeof(struct tcphdr));
 }
 
+struct tun_io *create_tun_io() {
+    struct tun_io *io = calloc(1, sizeof(struct tun_io));
+    if (io == NULL) {
+        log_android(ANDROID_LOG_ERROR, "tun io alloc failed");
+        return NULL;
+    }
+    io->queue_tail = &io->queue;
+    return io;
+}
+
+void destroy_tun_io(const struct arguments *args) {
+    struct tun_io *io = args->io;
+    if (io == NULL)
+        return;
+
+    log_android(ANDROID_LOG_WARN,
+                "tun wakeups %llu packets %llu batches %llu/%llu/%llu/%llu/%llu/%llu"
+                " bursts %llu dropped %llu",
+                (unsigned long long) io->wakeups, (unsigned long long) io->packets,
+                (unsigned long long) io->batches[0], (unsigned long long) io->batches[1],
+                (unsigned long long) io->batches[2], (unsigned long long) io->batches[3],
+                (unsigned long long) io->batches[4], (unsigned long long) io->batches[5],
+                (unsigned long long) io->bursts, (unsigned long long) io->dropped);
+
+    struct packet_buffer *b = io->queue;
+    while (b != NULL) {
+        struct packet_buffer *n = b->next;
+        put_packet_buffer(args->pool, b->data);
+        b = n;
+    }
+    free(io);
+}
+
+// Takes the packet buffer, the packet is written on the next flush
+ssize_t write_tun(const struct arguments *args, uint8_t *buffer, size_t len) {
+    struct tun_io *io = args->io;
+    if (io == NULL) {
+        ssize_t res = write(args->tun, buffer, len);
+        put_packet_buffer(args->pool, buffer);
+        return res;
+    }
+
+    if (io->queued >= TUN_BATCH && flush_tun(args) && io->queued >= TUN_QUEUE_MAX) {
+        log_android(ANDROID_LOG_ERROR, "tun queue full, dropped %u bytes", len);
+        io->dropped++;
+        put_packet_buffer(args->pool, buffer);
+        return -1;
+    }
+
+    struct packet_buffer *b = PACKET_BUFFER(buffer);
+    b->length = len;
+    b->next = NULL;
+    *io->queue_tail = b;
+    io->queue_tail = &b->next;
+    io->queued++;
+    return len;
+}
+
+// Returns 1 if packets are left until the tun is writable
+int flush_tun(const struct arguments *args) {
+    struct tun_io *io = args->io;
+    if (io == NULL || io->queue == NULL)
+        return 0;
+
+    io->bursts++;
+    while (io->queue != NULL) {
+        struct packet_buffer *b = io->queue;
+        ssize_t res = write(args->tun, b->data, b->length);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res < 0 && errno == EAGAIN) {
+            log_android(ANDROID_LOG_WARN, "tun %d write pending %d packets",
+                        args->tun, io->queued);
+            return 1;
+        }
+        if (res != b->length)
+            log_android(ANDROID_LOG_ERROR, "tun %d write %d/%d error %d: %s",
+                        args->tun, res, b->length, errno, strerror(errno));
+
+        io->queue = b->next;
+        if (io->queue == NULL)
+            io->queue_tail = &io->queue;
+        io->queued--;
+        put_packet_buffer(args->pool, b->data);
+    }
+    return 0;
+}
+
+int read_tun(const struct arguments *args, uint8_t **batch, size_t *lengths, int *error) {
+    // Drain the non blocking tun, the rest is read on the next wakeup
+    int count = 0;
+    *error = 0;
+    while (count < TUN_BATCH) {
+        uint8_t *buffer = get_packet_buffer(args->pool, get_mtu() * 2);
+        ssize_t length = read(args->tun, buffer, get_mtu());
+        if (length < 0) {
+            put_packet_buffer(args->pool, buffer);
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN) {
+                log_android(ANDROID_LOG_ERROR, "tun %d read error %d: %s",
+                            args->tun, errno, strerror(errno));
+                *error = 1;
+            }
+            break;
+        } else if (length == 0) {
+            // tun eof
+            put_packet_buffer(args->pool, buffer);
+
+            log_android(ANDROID_LOG_ERROR, "tun %d empty read", args->tun);
+            *error = 1;
+            break;
+        }
+
+        if (length > max_tun_msg) {
+            max_tun_msg = length;
+            log_android(ANDROID_LOG_WARN, "Maximum tun msg length %d", max_tun_msg);
+        }
+        batch[count] = buffer;
+        lengths[count] = (size_t) length;
+        count++;
+    }
+
+    if (count > 0 && args->io != NULL) {
+        int bucket = 0;
+        while (bucket < TUN_BATCH_BUCKETS - 1 && (count >> (bucket + 1)) > 0)
+            bucket++;
+        args->io->wakeups++;
+        args->io->packets += count;
+        args->io->batches[bucket]++;
+    }
+    log_android(ANDROID_LOG_DEBUG, "tun %d batch %d packets", args->tun, count);
+
+    return count;
+}
+
 int check_tun(const struct arguments *args,
               const struct epoll_event *ev,
               const int epoll_fd,
@@ -27,36 +163,22 @@ int check_tun(const struct arguments *args,
 
     // Check tun read
     if (ev->events & EPOLLIN) {
-        uint8_t *buffer = malloc(get_mtu()*2);
-        ssize_t length = read(args->tun, buffer, get_mtu());
-        if (length < 0) {
-            free(buffer);
-
-            log_android(ANDROID_LOG_ERROR, "tun %d read error %d: %s",
-                        args->tun, errno, strerror(errno));
-            if (errno == EINTR || errno == EAGAIN)
-                // Retry later
-                return 0;
-            else {
-                return -1;
-            }
-        } else if (length > 0) {
-            if (length > max_tun_msg) {
-                max_tun_msg = length;
-                log_android(ANDROID_LOG_WARN, "Maximum tun msg length %d", max_tun_msg);
-            }
-
-            // Handle IP from tun
-            handle_ip(args, buffer, (size_t) length, epoll_fd, sessions, maxsessions);
+        uint8_t *batch[TUN_BATCH];
+        size_t lengths[TUN_BATCH];
+        int error;
+        int count = read_tun(args, batch, lengths, &error);
+
+        // Handle IP from tun
+        for (int i = 0; i < count; i++) {
+            handle_ip(args, batch[i], lengths[i], epoll_fd, sessions, maxsessions);
+            put_packet_buffer(args->pool, batch[i]);
+        }
 
-            free(buffer);
-        } else {
-            // tun eof
-            free(buffer);
+        // Replies of the batch in one burst
+        flush_tun(args);
 
-            log_android(ANDROID_LOG_ERROR, "tun %d empty read", args->tun);
+        if (error)
             return -1;
-        }
     }
 
     return 0;
@@ -0,0 +1,105 @@
+#include "tun2http.h"
+
+static const size_t packet_pool_size[PACKET_POOL_CLASSES] = {
+        PACKET_POOL_SMALL,
+        PACKET_POOL_LARGE
+};
+
+static const int packet_pool_keep[PACKET_POOL_CLASSES] = {
+        PACKET_POOL_KEEP,
+        PACKET_POOL_KEEP_LARGE
+};
+
+static struct packet_buffer *alloc_packet_buffer(size_t size) {
+    struct packet_buffer *b = malloc(sizeof(struct packet_buffer) + size);
+    if (b == NULL) {
+        log_android(ANDROID_LOG_ERROR, "packet buffer alloc %u failed", size);
+        return NULL;
+    }
+    b->next = NULL;
+    b->size = size;
+    b->length = 0;
+    return b;
+}
+
+struct packet_pool *create_packet_pool() {
+    struct packet_pool *pool = calloc(1, sizeof(struct packet_pool));
+    if (pool == NULL) {
+        log_android(ANDROID_LOG_ERROR, "packet pool alloc failed");
+        return NULL;
+    }
+
+    for (int i = 0; i < PACKET_POOL_INIT; i++) {
+        struct packet_buffer *b = alloc_packet_buffer(PACKET_POOL_SMALL);
+        if (b == NULL)
+            break;
+        b->next = pool->free[0];
+        pool->free[0] = b;
+        pool->free_count[0]++;
+    }
+
+    return pool;
+}
+
+void destroy_packet_pool(struct packet_pool *pool) {
+    if (pool == NULL)
+        return;
+
+    log_android(ANDROID_LOG_WARN, "packet pool hits %llu misses %llu",
+                (unsigned long long) pool->hits, (unsigned long long) pool->misses);
+
+    for (int c = 0; c < PACKET_POOL_CLASSES; c++) {
+        struct packet_buffer *b = pool->free[c];
+        while (b != NULL) {
+            struct packet_buffer *n = b->next;
+            free(b);
+            b = n;
+        }
+    }
+    free(pool);
+}
+
+uint8_t *get_packet_buffer(struct packet_pool *pool, size_t size) {
+    int c = 0;
+    while (c < PACKET_POOL_CLASSES && size > packet_pool_size[c])
+        c++;
+
+    struct packet_buffer *b;
+    if (pool != NULL && c < PACKET_POOL_CLASSES && pool->free[c] != NULL) {
+        b = pool->free[c];
+        pool->free[c] = b->next;
+        pool->free_count[c]--;
+        pool->hits++;
+    } else {
+        if (pool != NULL)
+            pool->misses++;
+
+        // Allocated at the class size to be kept on release
+        b = alloc_packet_buffer(c < PACKET_POOL_CLASSES ? packet_pool_size[c] : size);
+        if (b == NULL)
+            return NULL;
+        if (c == PACKET_POOL_CLASSES)
+            b->size = 0;
+    }
+
+    return b->data;
+}
+
+void put_packet_buffer(struct packet_pool *pool, uint8_t *buffer) {
+    if (buffer == NULL)
+        return;
+
+    struct packet_buffer *b = PACKET_BUFFER(buffer);
+
+    int c = 0;
+    while (c < PACKET_POOL_CLASSES && b->size != packet_pool_size[c])
+        c++;
+
+    if (pool == NULL || c == PACKET_POOL_CLASSES || pool->free_count[c] >= packet_pool_keep[c])
+        free(b);
+    else {
+        b->next = pool->free[c];
+        pool->free[c] = b;
+        pool->free_count[c]++;
+    }
+}
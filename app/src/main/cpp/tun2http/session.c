@@ -2,34 +2,462 @@
 #include "tun2http.h"
 
 extern JavaVM *jvm;
-extern int pipefds[2];
-extern pthread_t thread_id;
-extern pthread_mutex_t lock;
+extern atomic_int session_total;
 
-struct ng_session *ng_session = NULL;
+void init_sessions(struct worker *w) {
+    for (int i = 0; i < SESSION_LISTS; i++) {
+        w->session[i] = NULL;
+        w->session_count[i] = 0;
+    }
+    w->touched = NULL;
+    memset(w->timer_wheel, 0, sizeof(w->timer_wheel));
+    w->timer_due = NULL;
+    w->timer_wheel_time = 0;
+    w->timer_scale = 0;
+    w->table = NULL;
+    w->table_size = 0;
+    w->table_used = 0;
+}
+
+void clear_sessions(struct worker *w) {
+    for (int i = 0; i < SESSION_LISTS; i++) {
+        atomic_fetch_sub(&session_total, w->session_count[i]);
+        struct ng_session *s = w->session[i];
+        while (s != NULL) {
+            if (s->socket >= 0 && close(s->socket))
+                log_android(ANDROID_LOG_ERROR, "close %d error %d: %s",
+                            s->socket, errno, strerror(errno));
+            if (s->protocol == IPPROTO_TCP)
+                clear_tcp_data(&s->tcp);
+            struct ng_session *p = s;
+            s = s->next;
+            free(p);
+        }
+    }
+    free(w->table);
+    init_sessions(w);
+}
+
+static int get_session_list(uint8_t protocol) {
+    if (protocol == IPPROTO_TCP)
+        return SESSION_TCP;
+    else if (protocol == IPPROTO_UDP)
+        return SESSION_UDP;
+    else
+        return SESSION_ICMP;
+}
+
+static int is_session_active(const struct ng_session *s) {
+    if (s->protocol == IPPROTO_ICMP || s->protocol == IPPROTO_ICMPV6)
+        return !s->icmp.stop;
+    else if (s->protocol == IPPROTO_UDP)
+        return s->udp.state == UDP_ACTIVE;
+    else
+        return s->tcp.state != TCP_CLOSING && s->tcp.state != TCP_CLOSE;
+}
+
+static uint32_t mix_session_hash(uint32_t h, uint32_t k) {
+    k *= 0xcc9e2d51;
+    k = (k << 15) | (k >> 17);
+    k *= 0x1b873593;
+    h ^= k;
+    h = (h << 13) | (h >> 19);
+    return h * 5 + 0xe6546b64;
+}
+
+uint32_t get_session_hash(uint8_t protocol, int version,
+                          const void *saddr, const void *daddr,
+                          __be16 source, __be16 dest) {
+    int words = (version == 4 ? 1 : 4);
+    uint32_t h = ((uint32_t) protocol << 8) | (uint32_t) version;
+    uint32_t k;
+    for (int i = 0; i < words; i++) {
+        memcpy(&k, (const uint8_t *) saddr + i * 4, 4);
+        h = mix_session_hash(h, k);
+        memcpy(&k, (const uint8_t *) daddr + i * 4, 4);
+        h = mix_session_hash(h, k);
+    }
+    h = mix_session_hash(h, ((uint32_t) source << 16) | dest);
+
+    // Final avalanche, low bits select the slot
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
 
-void init(const struct arguments *args) {
-    ng_session = NULL;
+static uint32_t get_session_key_hash(const struct ng_session *s) {
+    if (s->protocol == IPPROTO_TCP)
+        return get_session_hash(s->protocol, s->tcp.version, &s->tcp.saddr, &s->tcp.daddr,
+                                s->tcp.source, s->tcp.dest);
+    else if (s->protocol == IPPROTO_UDP)
+        return get_session_hash(s->protocol, s->udp.version, &s->udp.saddr, &s->udp.daddr,
+                                s->udp.source, s->udp.dest);
+    else
+        return get_session_hash(s->protocol, s->icmp.version, &s->icmp.saddr, &s->icmp.daddr,
+                                0, 0);
 }
 
-void clear() {
-    struct ng_session *s = ng_session;
+static int is_session_key(const struct ng_session *s, uint8_t protocol, int version,
+                   const void *saddr, const void *daddr,
+                   __be16 source, __be16 dest) {
+    if (s->protocol != protocol)
+        return 0;
+
+    size_t len = (version == 4 ? 4 : 16);
+    if (protocol == IPPROTO_TCP)
+        return s->tcp.version == version &&
+               s->tcp.source == source && s->tcp.dest == dest &&
+               memcmp(&s->tcp.saddr, saddr, len) == 0 &&
+               memcmp(&s->tcp.daddr, daddr, len) == 0;
+    else if (protocol == IPPROTO_UDP)
+        return s->udp.version == version &&
+               s->udp.source == source && s->udp.dest == dest &&
+               memcmp(&s->udp.saddr, saddr, len) == 0 &&
+               memcmp(&s->udp.daddr, daddr, len) == 0;
+    else
+        // Stopped ICMP sessions are replaced by a new session with the same addresses
+        return !s->icmp.stop && s->icmp.version == version &&
+               memcmp(&s->icmp.saddr, saddr, len) == 0 &&
+               memcmp(&s->icmp.daddr, daddr, len) == 0;
+}
+
+struct ng_session *find_session(const struct arguments *args,
+                                uint8_t protocol, int version,
+                                const void *saddr, const void *daddr,
+                                __be16 source, __be16 dest) {
+    struct worker *w = args->worker;
+    if (w->table == NULL)
+        return NULL;
+
+    uint32_t hash = get_session_hash(protocol, version, saddr, daddr, source, dest);
+    uint32_t mask = w->table_size - 1;
+    for (uint32_t i = hash & mask; w->table[i] != NULL; i = (i + 1) & mask) {
+        struct ng_session *s = w->table[i];
+        if (s->hash == hash && is_session_key(s, protocol, version, saddr, daddr, source, dest)) {
+            // Caller handles a packet of the session, its state can change
+            touch_session(args, s);
+            return s;
+        }
+    }
+    return NULL;
+}
+
+static void insert_session_slot(struct ng_session **table, uint32_t size, struct ng_session *s) {
+    uint32_t mask = size - 1;
+    uint32_t i = s->hash & mask;
+    while (table[i] != NULL)
+        i = (i + 1) & mask;
+    table[i] = s;
+}
+
+static int grow_session_table(struct worker *w) {
+    uint32_t size = (w->table_size ? w->table_size * 2 : SESSION_TABLE_MIN);
+    struct ng_session **table = calloc(size, sizeof(struct ng_session *));
+    if (table == NULL) {
+        log_android(ANDROID_LOG_ERROR, "session table grow to %u failed", size);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < w->table_size; i++)
+        if (w->table[i] != NULL)
+            insert_session_slot(table, size, w->table[i]);
+
+    free(w->table);
+    w->table = table;
+    w->table_size = size;
+    return 0;
+}
+
+void add_session(const struct arguments *args, struct ng_session *s) {
+    struct worker *w = args->worker;
+
+    // Keep load factor at most 1/2 for short probe sequences, one slot always stays empty
+    s->hash = get_session_key_hash(s);
+    if ((w->table_used + 1) * 2 > w->table_size &&
+        grow_session_table(w) < 0 && w->table_used + 1 >= w->table_size)
+        log_android(ANDROID_LOG_ERROR, "session table full, session not indexed");
+    else {
+        insert_session_slot(w->table, w->table_size, s);
+        w->table_used++;
+    }
+
+    int list = get_session_list(s->protocol);
+    s->prev = NULL;
+    s->next = w->session[list];
+    if (s->next != NULL)
+        s->next->prev = s;
+    w->session[list] = s;
+
+    // Counted and scheduled on the next update, the caller usually keeps handling the session
+    s->timer_next = NULL;
+    s->timer_pprev = NULL;
+    s->deadline = 0;
+    s->active = 0;
+    s->touched = 0;
+    touch_session(args, s);
+}
+
+static void link_timer(struct ng_session **head, struct ng_session *s) {
+    s->timer_next = *head;
+    if (s->timer_next != NULL)
+        s->timer_next->timer_pprev = &s->timer_next;
+    s->timer_pprev = head;
+    *head = s;
+}
+
+static void unlink_timer(struct ng_session *s) {
+    if (s->timer_pprev == NULL)
+        return;
+    *s->timer_pprev = s->timer_next;
+    if (s->timer_next != NULL)
+        s->timer_next->timer_pprev = s->timer_pprev;
+    s->timer_next = NULL;
+    s->timer_pprev = NULL;
+}
+
+static void update_session_count(struct worker *w, struct ng_session *s) {
+    uint8_t active = (uint8_t) is_session_active(s);
+    if (active != s->active) {
+        w->session_count[get_session_list(s->protocol)] += (active ? 1 : -1);
+        atomic_fetch_add(&session_total, active ? 1 : -1);
+        s->active = active;
+    }
+}
+
+static void update_session_counts(struct worker *w) {
+    struct ng_session *s = w->touched;
     while (s != NULL) {
-        if (s->socket >= 0 && close(s->socket))
-            log_android(ANDROID_LOG_ERROR, "close %d error %d: %s",
-                        s->socket, errno, strerror(errno));
-        if (s->protocol == IPPROTO_TCP)
-            clear_tcp_data(&s->tcp);
-        struct ng_session *p = s;
-        s = s->next;
-        free(p);
+        update_session_count(w, s);
+        s = s->timer_next;
+    }
+}
+
+void touch_session(const struct arguments *args, struct ng_session *s) {
+    struct worker *w = args->worker;
+    if (!s->touched) {
+        // The deadline can change with the session state, schedule again on the next check
+        unlink_timer(s);
+        link_timer(&w->touched, s);
+        s->touched = 1;
+    }
+}
+
+void remove_session(const struct arguments *args, struct ng_session *s) {
+    struct worker *w = args->worker;
+    unlink_timer(s);
+
+    int list = get_session_list(s->protocol);
+    if (s->active) {
+        w->session_count[list]--;
+        atomic_fetch_sub(&session_total, 1);
+    }
+
+    if (s->prev == NULL)
+        w->session[list] = s->next;
+    else
+        s->prev->next = s->next;
+    if (s->next != NULL)
+        s->next->prev = s->prev;
+
+    // Backward shift deletion keeps probe sequences without tombstones
+    if (w->table == NULL)
+        return;
+    uint32_t mask = w->table_size - 1;
+    uint32_t i = s->hash & mask;
+    while (w->table[i] != NULL && w->table[i] != s)
+        i = (i + 1) & mask;
+    if (w->table[i] == NULL)
+        return;
+
+    uint32_t j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        if (w->table[j] == NULL)
+            break;
+        uint32_t k = w->table[j]->hash & mask;
+        if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+            w->table[i] = w->table[j];
+            i = j;
+        }
+    }
+    w->table[i] = NULL;
+    w->table_used--;
+}
+
+static void touch_all_sessions(const struct arguments *args) {
+    struct worker *w = args->worker;
+    for (int list = 0; list < SESSION_LISTS; list++)
+        for (struct ng_session *s = w->session[list]; s != NULL; s = s->next)
+            touch_session(args, s);
+}
+
+static time_t get_session_deadline(const struct ng_session *s, int sessions, int maxsessions) {
+    if (s->protocol == IPPROTO_ICMP || s->protocol == IPPROTO_ICMPV6)
+        return get_icmp_deadline(&s->icmp, sessions, maxsessions);
+    else if (s->protocol == IPPROTO_UDP)
+        return get_udp_deadline(&s->udp, sessions, maxsessions);
+    else
+        return get_tcp_deadline(&s->tcp, sessions, maxsessions);
+}
+
+static void schedule_session(struct worker *w, struct ng_session *s, time_t deadline) {
+    s->deadline = deadline;
+    if (deadline < w->timer_wheel_time) {
+        link_timer(&w->timer_due, s);
+        return;
+    }
+
+    // Lowest level with a slot span covering the delay, beyond the wheel it is rechecked
+    time_t delta = deadline - w->timer_wheel_time;
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 &&
+           delta >= ((time_t) 1 << (TIMER_WHEEL_BITS * (level + 1))))
+        level++;
+    if (delta >= ((time_t) 1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)))
+        deadline = w->timer_wheel_time + ((time_t) 1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+
+    int slot = (int) ((deadline >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1));
+    link_timer(&w->timer_wheel[level][slot], s);
+}
+
+static void tick_timer_wheel(struct worker *w) {
+    // Move the timers of the slot starting now down to the lower levels
+    for (int level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+        int shift = TIMER_WHEEL_BITS * level;
+        if ((w->timer_wheel_time & (((time_t) 1 << shift) - 1)) == 0) {
+            int slot = (int) ((w->timer_wheel_time >> shift) & (TIMER_WHEEL_SLOTS - 1));
+            struct ng_session *s;
+            while ((s = w->timer_wheel[level][slot]) != NULL) {
+                unlink_timer(s);
+                schedule_session(w, s, s->deadline);
+            }
+        }
+    }
+
+    int slot = (int) (w->timer_wheel_time & (TIMER_WHEEL_SLOTS - 1));
+    struct ng_session *s;
+    while ((s = w->timer_wheel[0][slot]) != NULL) {
+        unlink_timer(s);
+        link_timer(&w->timer_due, s);
     }
-    ng_session = NULL;
+
+    w->timer_wheel_time++;
+}
+
+static int get_timer_timeout(struct worker *w, time_t now) {
+    time_t next = now + EPOLL_TIMEOUT;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        // Slots are processed from the first slot boundary not processed yet
+        int shift = TIMER_WHEEL_BITS * level;
+        time_t unit = (time_t) 1 << shift;
+        time_t start = (w->timer_wheel_time + unit - 1) & ~(unit - 1);
+        int current = (int) ((start >> shift) & (TIMER_WHEEL_SLOTS - 1));
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++)
+            if (w->timer_wheel[level][slot] != NULL) {
+                time_t at = start + ((slot - current) & (TIMER_WHEEL_SLOTS - 1)) * unit;
+                if (at < next)
+                    next = at;
+            }
+    }
+    return (int) (next > now ? next - now : 1);
+}
+
+static int reschedule_session(const struct arguments *args, struct ng_session *s,
+                              int sessions, int maxsessions, time_t earliest, time_t now,
+                              int epoll_fd, struct ng_session **again) {
+    struct worker *w = args->worker;
+
+    // Epoll interest follows the session state. TCP sessions waiting for window or buffer
+    // space stay touched and are checked again on the next wakeup
+    int wait = (s->protocol == IPPROTO_TCP && s->socket >= 0 &&
+                monitor_tcp_session(args, s, epoll_fd));
+    update_session_count(w, s);
+
+    time_t deadline = get_session_deadline(s, sessions, maxsessions);
+    if (wait && deadline > now) {
+        link_timer(again, s);
+        s->touched = 1;
+        return 1;
+    }
+
+    schedule_session(w, s, deadline < earliest ? earliest : deadline);
+    return 0;
+}
+
+static int check_sessions(const struct arguments *args, int sessions, int maxsessions,
+                          int epoll_fd, int *recheck) {
+    struct worker *w = args->worker;
+    time_t now = time(NULL);
+
+    // Reschedule everything after the clock was changed or a long sleep instead of ticking
+    if (now < w->timer_wheel_time - 1 ||
+        now - w->timer_wheel_time >= TIMER_WHEEL_SLOTS * TIMER_WHEEL_SLOTS) {
+        log_android(ANDROID_LOG_WARN, "Timer wheel reset from %ld to %ld",
+                    (long) w->timer_wheel_time, (long) now);
+        touch_all_sessions(args);
+        w->timer_wheel_time = now;
+    }
+
+    // Timeouts shrink with more sessions, deadlines scheduled before are at most
+    // TIMER_RESCALE percent of the timeout late
+    int scale = 100 - sessions * 100 / maxsessions;
+    if (scale < w->timer_scale - TIMER_RESCALE) {
+        log_android(ANDROID_LOG_DEBUG, "Timer rescale from %d to %d", w->timer_scale, scale);
+        touch_all_sessions(args);
+        w->timer_scale = scale;
+    } else if (scale > w->timer_scale)
+        w->timer_scale = scale;
+
+    // Only touched and due sessions are updated, so the cost doesn't grow with idle sessions
+    struct ng_session *s;
+    struct ng_session *again = NULL;
+    *recheck = 0;
+    while ((s = w->touched) != NULL) {
+        unlink_timer(s);
+        s->touched = 0;
+        *recheck |= reschedule_session(args, s, sessions, maxsessions, 0, now, epoll_fd, &again);
+    }
+
+    while (w->timer_wheel_time <= now)
+        tick_timer_wheel(w);
+
+    // Check sessions with passed deadlines only
+    while ((s = w->timer_due) != NULL) {
+        unlink_timer(s);
+
+        int del = 0;
+        if (s->protocol == IPPROTO_ICMP || s->protocol == IPPROTO_ICMPV6)
+            del = check_icmp_session(args, s, sessions, maxsessions);
+        else if (s->protocol == IPPROTO_UDP)
+            del = check_udp_session(args, s, sessions, maxsessions);
+        else if (s->protocol == IPPROTO_TCP)
+            del = check_tcp_session(args, s, sessions, maxsessions);
+
+        if (del) {
+            remove_session(args, s);
+            if (s->protocol == IPPROTO_TCP)
+                clear_tcp_data(&s->tcp);
+            free(s);
+        } else
+            *recheck |= reschedule_session(args, s, sessions, maxsessions,
+                                           w->timer_wheel_time, now, epoll_fd, &again);
+    }
+
+    while ((s = again) != NULL) {
+        unlink_timer(s);
+        link_timer(&w->touched, s);
+    }
+
+    return get_timer_timeout(w, now);
 }
 
 void *handle_events(void *a) {
     struct arguments *args = (struct arguments *) a;
-    log_android(ANDROID_LOG_WARN, "Start events tun=%d thread %x", args->tun, thread_id);
+    struct worker *w = args->worker;
+    log_android(ANDROID_LOG_WARN, "Start events tun=%d worker %d", args->tun, w->index);
 
     // Attach to Java
     JNIEnv *env;
@@ -40,6 +468,10 @@ void *handle_events(void *a) {
     }
     args->env = env;
 
+    // Packet buffers and tun batching of this thread
+    args->pool = create_packet_pool();
+    args->io = create_tun_io();
+
     // Get max sessions
     int maxsessions = 1024;
     struct rlimit rlim;
@@ -51,6 +483,8 @@ void *handle_events(void *a) {
     maxsessions = (int) (rlim.rlim_cur * SESSION_LIMIT / 100);
     if (maxsessions > 1000)
         maxsessions = 1000;
+    if (maxsessions < 1)
+        maxsessions = 1;
 
     // Terminate existing sessions not allowed anymore
     check_allowed(args);
@@ -64,20 +498,20 @@ void *handle_events(void *a) {
         stopping = 1;
     }
 
-    // Monitor stop events
+    // Monitor stop events and dispatched packets
     struct epoll_event ev_pipe;
     memset(&ev_pipe, 0, sizeof(struct epoll_event));
     ev_pipe.events = EPOLLIN | EPOLLERR;
     ev_pipe.data.ptr = &ev_pipe;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pipefds[0], &ev_pipe)) {
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, w->pipefds[0], &ev_pipe)) {
         log_android(ANDROID_LOG_ERROR, "epoll add pipe error %d: %s", errno, strerror(errno));
         stopping = 1;
     }
 
-    // Monitor tun events
+    // Monitor tun events, dispatched workers only wait for it to be writable
     struct epoll_event ev_tun;
     memset(&ev_tun, 0, sizeof(struct epoll_event));
-    ev_tun.events = EPOLLIN | EPOLLERR;
+    ev_tun.events = EPOLLERR | (w->dispatched ? 0 : EPOLLIN);
     ev_tun.data.ptr = NULL;
     if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, args->tun, &ev_tun)) {
         log_android(ANDROID_LOG_ERROR, "epoll add tun error %d: %s", errno, strerror(errno));
@@ -85,96 +519,36 @@ void *handle_events(void *a) {
     }
 
     // Loop
-    long long last_check = 0;
     while (!stopping) {
-        log_android(ANDROID_LOG_DEBUG, "Loop thread %x", thread_id);
+        log_android(ANDROID_LOG_DEBUG, "Loop worker %d", w->index);
 
-        int recheck = 0;
-        int timeout = EPOLL_TIMEOUT;
+        int recheck;
 
         // Count sessions
-        int isessions = 0;
-        int usessions = 0;
-        int tsessions = 0;
-        struct ng_session *s = ng_session;
-        while (s != NULL) {
-            if (s->protocol == IPPROTO_ICMP || s->protocol == IPPROTO_ICMPV6) {
-                if (!s->icmp.stop)
-                    isessions++;
-            } else if (s->protocol == IPPROTO_UDP) {
-                if (s->udp.state == UDP_ACTIVE)
-                    usessions++;
-            } else if (s->protocol == IPPROTO_TCP) {
-                if (s->tcp.state != TCP_CLOSING && s->tcp.state != TCP_CLOSE)
-                    tsessions++;
-                if (s->socket >= 0)
-                    recheck = recheck | monitor_tcp_session(args, s, epoll_fd);
-            }
-            s = s->next;
-        }
-        int sessions = isessions + usessions + tsessions;
+        update_session_counts(w);
+        int isessions = w->session_count[SESSION_ICMP];
+        int usessions = w->session_count[SESSION_UDP];
+        int tsessions = w->session_count[SESSION_TCP];
+        // Sockets are shared by all workers, so the limit and timeouts use the sessions of all
+        int sessions = atomic_load(&session_total);
 
         // Check sessions
-        long long ms = get_ms();
-        if (ms - last_check > EPOLL_MIN_CHECK) {
-            last_check = ms;
-
-            time_t now = time(NULL);
-            struct ng_session *sl = NULL;
-            s = ng_session;
-            while (s != NULL) {
-                int del = 0;
-                if (s->protocol == IPPROTO_ICMP || s->protocol == IPPROTO_ICMPV6) {
-                    del = check_icmp_session(args, s, sessions, maxsessions);
-                    if (!s->icmp.stop && !del) {
-                        int stimeout = s->icmp.time +
-                                       get_icmp_timeout(&s->icmp, sessions, maxsessions) - now + 1;
-                        if (stimeout > 0 && stimeout < timeout)
-                            timeout = stimeout;
-                    }
-                } else if (s->protocol == IPPROTO_UDP) {
-                    del = check_udp_session(args, s, sessions, maxsessions);
-                    if (s->udp.state == UDP_ACTIVE && !del) {
-                        int stimeout = s->udp.time +
-                                       get_udp_timeout(&s->udp, sessions, maxsessions) - now + 1;
-                        if (stimeout > 0 && stimeout < timeout)
-                            timeout = stimeout;
-                    }
-                } else if (s->protocol == IPPROTO_TCP) {
-                    del = check_tcp_session(args, s, sessions, maxsessions);
-                    if (s->tcp.state != TCP_CLOSING && s->tcp.state != TCP_CLOSE && !del) {
-                        int stimeout = s->tcp.time +
-                                       get_tcp_timeout(&s->tcp, sessions, maxsessions) - now + 1;
-                        if (stimeout > 0 && stimeout < timeout)
-                            timeout = stimeout;
-                    }
-                }
-
-                if (del) {
-                    if (sl == NULL)
-                        ng_session = s->next;
-                    else
-                        sl->next = s->next;
-
-                    struct ng_session *c = s;
-                    s = s->next;
-                    if (c->protocol == IPPROTO_TCP)
-                        clear_tcp_data(&c->tcp);
-                    free(c);
-                } else {
-                    sl = s;
-                    s = s->next;
-                }
-            }
-        } else {
-            recheck = 1;
-            log_android(ANDROID_LOG_DEBUG, "Skipped session checks");
-        }
+        int timeout = check_sessions(args, sessions, maxsessions, epoll_fd, &recheck);
 
         log_android(ANDROID_LOG_DEBUG,
-                    "sessions ICMP %d UDP %d TCP %d max %d/%d timeout %d recheck %d",
+                    "sessions ICMP %d UDP %d TCP %d all %d/%d timeout %d recheck %d",
                     isessions, usessions, tsessions, sessions, maxsessions, timeout, recheck);
 
+        // Write queued packets, if the tun is full stop reading it until it is writable
+        unsigned int tun_events = EPOLLERR |
+                                  (flush_tun(args) ? EPOLLOUT : (w->dispatched ? 0 : EPOLLIN));
+        if (tun_events != ev_tun.events) {
+            ev_tun.events = tun_events;
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, args->tun, &ev_tun))
+                log_android(ANDROID_LOG_ERROR, "epoll mod tun error %d: %s",
+                            errno, strerror(errno));
+        }
+
         // Poll
         struct epoll_event ev[EPOLL_EVENTS];
         int ready = epoll_wait(epoll_fd, ev, EPOLL_EVENTS,
@@ -183,12 +557,12 @@ void *handle_events(void *a) {
         if (ready < 0) {
             if (errno == EINTR) {
                 log_android(ANDROID_LOG_DEBUG,
-                            "epoll interrupted tun %d thread %x", args->tun, thread_id);
+                            "epoll interrupted tun %d worker %d", args->tun, w->index);
                 continue;
             } else {
                 log_android(ANDROID_LOG_ERROR,
-                            "epoll tun %d thread %x error %d: %s",
-                            args->tun, thread_id, errno, strerror(errno));
+                            "epoll tun %d worker %d error %d: %s",
+                            args->tun, w->index, errno, strerror(errno));
                 break;
             }
         }
@@ -196,23 +570,23 @@ void *handle_events(void *a) {
         if (ready == 0)
             log_android(ANDROID_LOG_DEBUG, "epoll timeout");
         else {
-
-            if (pthread_mutex_lock(&lock))
-                log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
-
             int error = 0;
 
             for (int i = 0; i < ready; i++) {
                 if (ev[i].data.ptr == &ev_pipe) {
-                    // Check pipe
-                    stopping = 1;
-                    uint8_t buffer[1];
-                    if (read(pipefds[0], buffer, 1) < 0)
+                    // Check pipe, x stops the worker and p wakes it for dispatched packets
+                    uint8_t buffer[32];
+                    ssize_t bytes = read(w->pipefds[0], buffer, sizeof(buffer));
+                    if (bytes < 0 && errno != EAGAIN)
                         log_android(ANDROID_LOG_WARN, "Read pipe error %d: %s",
                                     errno, strerror(errno));
-                    else
+                    if (bytes > 0 && memchr(buffer, 'x', (size_t) bytes) != NULL) {
                         log_android(ANDROID_LOG_WARN, "Read pipe");
-                    break;
+                        stopping = 1;
+                        break;
+                    }
+
+                    receive_packets(args, epoll_fd, sessions, maxsessions);
 
                 } else if (ev[i].data.ptr == NULL) {
                     // Check upstream
@@ -223,9 +597,8 @@ void *handle_events(void *a) {
                                 (ev[i].events & EPOLLERR) != 0,
                                 (ev[i].events & EPOLLHUP) != 0);
 
-                    while (!error && is_readable(args->tun))
-                        if (check_tun(args, &ev[i], epoll_fd, sessions, maxsessions) < 0)
-                            error = 1;
+                    if (check_tun(args, &ev[i], epoll_fd, sessions, maxsessions) < 0)
+                        error = 1;
 
                 } else {
                     // Check downstream
@@ -249,15 +622,13 @@ void *handle_events(void *a) {
                             check_udp_socket(args, &ev[i]);
                     } else if (session->protocol == IPPROTO_TCP)
                         check_tcp_socket(args, &ev[i], epoll_fd);
+                    touch_session(args, session);
                 }
 
                 if (error)
                     break;
             }
 
-            if (pthread_mutex_unlock(&lock))
-                log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
-
             if (error)
                 break;
         }
@@ -268,6 +639,11 @@ void *handle_events(void *a) {
         log_android(ANDROID_LOG_ERROR,
                     "epoll close error %d: %s", errno, strerror(errno));
 
+    destroy_tun_io(args);
+    args->io = NULL;
+    destroy_packet_pool(args->pool);
+    args->pool = NULL;
+
     (*env)->DeleteGlobalRef(env, args->instance);
 
     // Detach from Java
@@ -275,83 +651,80 @@ void *handle_events(void *a) {
     if (rs != JNI_OK)
         log_android(ANDROID_LOG_ERROR, "DetachCurrentThread failed");
 
-    // Cleanup
-    free(args);
+    log_android(ANDROID_LOG_WARN, "Stopped events tun=%d worker %d", args->tun, w->index);
 
-    log_android(ANDROID_LOG_WARN, "Stopped events tun=%d thread %x", args->tun, thread_id);
-    thread_id = 0;
+    // Cleanup, the sessions are cleared with the worker after join
+    free(args);
     return NULL;
 }
 
 void check_allowed(const struct arguments *args) {
+    struct worker *w = args->worker;
     char source[INET6_ADDRSTRLEN + 1];
     char dest[INET6_ADDRSTRLEN + 1];
 
-    struct ng_session *l = NULL;
-    struct ng_session *s = ng_session;
-    while (s != NULL) {
-        if (s->protocol == IPPROTO_ICMP || s->protocol == IPPROTO_ICMPV6) {
-            if (!s->icmp.stop) {
-                if (s->icmp.version == 4) {
-                    inet_ntop(AF_INET, &s->icmp.saddr.ip4, source, sizeof(source));
-                    inet_ntop(AF_INET, &s->icmp.daddr.ip4, dest, sizeof(dest));
-                } else {
-                    inet_ntop(AF_INET6, &s->icmp.saddr.ip6, source, sizeof(source));
-                    inet_ntop(AF_INET6, &s->icmp.daddr.ip6, dest, sizeof(dest));
-                }
-
+    for (int list = 0; list < SESSION_LISTS; list++) {
+        struct ng_session *s = w->session[list];
+        while (s != NULL) {
+            if (s->protocol == IPPROTO_ICMP || s->protocol == IPPROTO_ICMPV6) {
+                if (!s->icmp.stop) {
+                    if (s->icmp.version == 4) {
+                        inet_ntop(AF_INET, &s->icmp.saddr.ip4, source, sizeof(source));
+                        inet_ntop(AF_INET, &s->icmp.daddr.ip4, dest, sizeof(dest));
+                    } else {
+                        inet_ntop(AF_INET6, &s->icmp.saddr.ip6, source, sizeof(source));
+                        inet_ntop(AF_INET6, &s->icmp.daddr.ip6, dest, sizeof(dest));
+                    }
 
-                s->icmp.stop = 1;
-                log_android(ANDROID_LOG_WARN, "ICMP terminate %d uid %d",
-                            s->socket, s->icmp.uid);
-            }
 
-        } else if (s->protocol == IPPROTO_UDP) {
-            if (s->udp.state == UDP_ACTIVE) {
-                if (s->udp.version == 4) {
-                    inet_ntop(AF_INET, &s->udp.saddr.ip4, source, sizeof(source));
-                    inet_ntop(AF_INET, &s->udp.daddr.ip4, dest, sizeof(dest));
-                } else {
-                    inet_ntop(AF_INET6, &s->udp.saddr.ip6, source, sizeof(source));
-                    inet_ntop(AF_INET6, &s->udp.daddr.ip6, dest, sizeof(dest));
+                    s->icmp.stop = 1;
+                    log_android(ANDROID_LOG_WARN, "ICMP terminate %d uid %d",
+                                s->socket, s->icmp.uid);
                 }
 
-                s->udp.state = UDP_FINISHING;
-                log_android(ANDROID_LOG_WARN, "UDP terminate session socket %d uid %d",
-                            s->socket, s->udp.uid);
-            } else if (s->udp.state == UDP_BLOCKED) {
-                log_android(ANDROID_LOG_WARN, "UDP remove blocked session uid %d", s->udp.uid);
+            } else if (s->protocol == IPPROTO_UDP) {
+                if (s->udp.state == UDP_ACTIVE) {
+                    if (s->udp.version == 4) {
+                        inet_ntop(AF_INET, &s->udp.saddr.ip4, source, sizeof(source));
+                        inet_ntop(AF_INET, &s->udp.daddr.ip4, dest, sizeof(dest));
+                    } else {
+                        inet_ntop(AF_INET6, &s->udp.saddr.ip6, source, sizeof(source));
+                        inet_ntop(AF_INET6, &s->udp.daddr.ip6, dest, sizeof(dest));
+                    }
 
-                if (l == NULL)
-                    ng_session = s->next;
-                else
-                    l->next = s->next;
+                    s->udp.state = UDP_FINISHING;
+                    log_android(ANDROID_LOG_WARN, "UDP terminate session socket %d uid %d",
+                                s->socket, s->udp.uid);
+                } else if (s->udp.state == UDP_BLOCKED) {
+                    log_android(ANDROID_LOG_WARN, "UDP remove blocked session uid %d", s->udp.uid);
 
-                struct ng_session *c = s;
-                s = s->next;
-                free(c);
-                continue;
-            }
+                    struct ng_session *c = s;
+                    s = s->next;
+                    remove_session(args, c);
+                    free(c);
+                    continue;
+                }
 
-        } else if (s->protocol == IPPROTO_TCP) {
-            if (s->tcp.state != TCP_CLOSING && s->tcp.state != TCP_CLOSE) {
-                if (s->tcp.version == 4) {
-                    inet_ntop(AF_INET, &s->tcp.saddr.ip4, source, sizeof(source));
-                    inet_ntop(AF_INET, &s->tcp.daddr.ip4, dest, sizeof(dest));
-                } else {
-                    inet_ntop(AF_INET6, &s->tcp.saddr.ip6, source, sizeof(source));
-                    inet_ntop(AF_INET6, &s->tcp.daddr.ip6, dest, sizeof(dest));
+            } else if (s->protocol == IPPROTO_TCP) {
+                if (s->tcp.state != TCP_CLOSING && s->tcp.state != TCP_CLOSE) {
+                    if (s->tcp.version == 4) {
+                        inet_ntop(AF_INET, &s->tcp.saddr.ip4, source, sizeof(source));
+                        inet_ntop(AF_INET, &s->tcp.daddr.ip4, dest, sizeof(dest));
+                    } else {
+                        inet_ntop(AF_INET6, &s->tcp.saddr.ip6, source, sizeof(source));
+                        inet_ntop(AF_INET6, &s->tcp.daddr.ip6, dest, sizeof(dest));
+                    }
+
+                    write_rst(args, &s->tcp);
+                    log_android(ANDROID_LOG_WARN, "TCP terminate socket %d uid %d",
+                                s->socket, s->tcp.uid);
                 }
 
-                write_rst(args, &s->tcp);
-                log_android(ANDROID_LOG_WARN, "TCP terminate socket %d uid %d",
-                            s->socket, s->tcp.uid);
             }
 
+            touch_session(args, s);
+            s = s->next;
         }
-
-        l = s;
-        s = s->next;
     }
 }
 
@@ -2,8 +2,6 @@
 #include "tls.h"
 #include "http.h"
 
-extern struct ng_session *ng_session;
-
 void clear_tcp_data(struct tcp_session *cur) {
     struct segment *s = cur->forward;
     while (s != NULL) {
@@ -29,6 +27,16 @@ int get_tcp_timeout(const struct tcp_session *t, int sessions, int maxsessions)
     return timeout;
 }
 
+// Time from which check_tcp_session changes the session state
+time_t get_tcp_deadline(const struct tcp_session *t, int sessions, int maxsessions) {
+    if (t->state == TCP_CLOSING)
+        return 0;
+    else if (t->state == TCP_CLOSE)
+        return t->time + TCP_KEEP_TIMEOUT + 1;
+    else
+        return t->time + get_tcp_timeout(t, sessions, maxsessions) + 1;
+}
+
 int check_tcp_session(const struct arguments *args, struct ng_session *s,
                       int sessions, int maxsessions) {
     time_t now = time(NULL);
@@ -310,8 +318,11 @@ void check_tcp_socket(const struct arguments *args,
                     size_t len = s->tcp.forward->len - s->tcp.forward->sent;
                     size_t newlen = len;
                     uint8_t *new_data = 0;
+                    uint8_t *patch = 0;
                     if (htons(s->tcp.dest) == 80) {
-                        new_data = patch_http_url(data, &newlen);
+                        patch = get_packet_buffer(args->pool, len + 7 + 512);
+                        if (patch)
+                            new_data = patch_http_url(data, &newlen, patch);
                         if (new_data) {
                             data = new_data;
                         }
@@ -322,6 +333,7 @@ void check_tcp_socket(const struct arguments *args,
                                         (unsigned int) (MSG_NOSIGNAL | (s->tcp.forward->psh
                                                                         ? 0
                                                                         : MSG_MORE)));
+                    put_packet_buffer(args->pool, patch);
                     if (sent > len) {
                         sent = len;
                     }
@@ -397,7 +409,7 @@ void check_tcp_socket(const struct arguments *args,
 
                     uint32_t buffer_size = (send_window > s->tcp.mss
                                             ? s->tcp.mss : send_window);
-                    uint8_t *buffer = malloc(buffer_size);
+                    uint8_t *buffer = get_packet_buffer(args->pool, buffer_size);
                     ssize_t bytes = recv(s->socket, buffer, (size_t) buffer_size, 0);
                     if (bytes < 0) {
                         // Socket error
@@ -441,7 +453,7 @@ void check_tcp_socket(const struct arguments *args,
                         if (write_data(args, &s->tcp, buffer, (size_t) bytes) >= 0)
                             s->tcp.local_seq += bytes;
                     }
-                    free(buffer);
+                    put_packet_buffer(args->pool, buffer);
                 }
             }
         }
@@ -528,16 +540,12 @@ jboolean handle_tcp(const struct arguments *args,
     redirect.rport = args->proxyPort;
 
     // Search session
-    struct ng_session *cur = ng_session;
-    while (cur != NULL &&
-           !(cur->protocol == IPPROTO_TCP &&
-             cur->tcp.version == version &&
-             cur->tcp.source == tcphdr->source && cur->tcp.dest == tcphdr->dest &&
-             (version == 4 ? cur->tcp.saddr.ip4 == ip4->saddr &&
-                             cur->tcp.daddr.ip4 == ip4->daddr
-                           : memcmp(&cur->tcp.saddr.ip6, &ip6->ip6_src, 16) == 0 &&
-                             memcmp(&cur->tcp.daddr.ip6, &ip6->ip6_dst, 16) == 0)))
-        cur = cur->next;
+    struct ng_session *cur = find_session(
+            args,
+            IPPROTO_TCP, version,
+            version == 4 ? (const void *) &ip4->saddr : (const void *) &ip6->ip6_src,
+            version == 4 ? (const void *) &ip4->daddr : (const void *) &ip6->ip6_dst,
+            tcphdr->source, tcphdr->dest);
 
 
     // Prepare logging
@@ -689,8 +697,7 @@ jboolean handle_tcp(const struct arguments *args,
                 log_android(ANDROID_LOG_ERROR, "epoll add tcp error %d: %s",
                             errno, strerror(errno));
 
-            s->next = ng_session;
-            ng_session = s;
+            add_session(args, s);
         } else {
             log_android(ANDROID_LOG_WARN, "%s unknown session", packet);
 
@@ -1101,7 +1108,7 @@ ssize_t write_tcp(const struct arguments *args, const struct tcp_session *cur,
     uint8_t *options;
     if (cur->version == 4) {
         len = sizeof(struct iphdr) + sizeof(struct tcphdr) + optlen + datalen;
-        buffer = malloc(len);
+        buffer = get_packet_buffer(args->pool, len);
         struct iphdr *ip4 = (struct iphdr *) buffer;
         tcp = (struct tcphdr *) (buffer + sizeof(struct iphdr));
         options = buffer + sizeof(struct iphdr) + sizeof(struct tcphdr);
@@ -1132,7 +1139,7 @@ ssize_t write_tcp(const struct arguments *args, const struct tcp_session *cur,
         csum = calc_checksum(0, (uint8_t *) &pseudo, sizeof(struct ippseudo));
     } else {
         len = sizeof(struct ip6_hdr) + sizeof(struct tcphdr) + optlen + datalen;
-        buffer = malloc(len);
+        buffer = get_packet_buffer(args->pool, len);
         struct ip6_hdr *ip6 = (struct ip6_hdr *) buffer;
         tcp = (struct tcphdr *) (buffer + sizeof(struct ip6_hdr));
         options = buffer + sizeof(struct ip6_hdr) + sizeof(struct tcphdr);
@@ -1212,9 +1219,7 @@ ssize_t write_tcp(const struct arguments *args, const struct tcp_session *cur,
                 ntohl(tcp->ack_seq) - cur->remote_start,
                 datalen);
 
-    ssize_t res = write(args->tun, buffer, len);
-
-    free(buffer);
+    ssize_t res = write_tun(args, buffer, len);
 
     if (res != len) {
         log_android(ANDROID_LOG_ERROR, "TCP write %d/%d", res, len);
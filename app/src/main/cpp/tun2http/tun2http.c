@@ -3,12 +3,13 @@
 
 JavaVM *jvm = NULL;
 int pipefds[2];
-pthread_t thread_id = 0;
-pthread_mutex_t lock;
+struct worker *workers[TUN_WORKERS_MAX];
+int worker_count = 0;
+atomic_int session_total = 0; // active sessions of all workers, they share one limit
+pthread_t dispatch_thread_id = 0;
 int loglevel = ANDROID_LOG_WARN;
 
 extern int max_tun_msg;
-extern struct ng_session *ng_session;
 
 // JNI
 
@@ -51,15 +52,7 @@ JNIEXPORT void JNICALL
 Java_ru_evgeniy_dpitunnel_service_Tun2HttpVpnService_jni_1init(JNIEnv *env, jobject instance) {
     loglevel = ANDROID_LOG_WARN;
 
-    struct arguments args;
-    args.env = env;
-    args.instance = instance;
-    init(&args);
-
-    if (pthread_mutex_init(&lock, NULL))
-        log_android(ANDROID_LOG_ERROR, "pthread_mutex_init failed");
-
-    // Create signal pipe
+    // Create signal pipe of the dispatcher
     if (pipe(pipefds))
         log_android(ANDROID_LOG_ERROR, "Create pipe error %d: %s", errno, strerror(errno));
     else
@@ -73,44 +66,90 @@ Java_ru_evgeniy_dpitunnel_service_Tun2HttpVpnService_jni_1init(JNIEnv *env, jobj
 
 JNIEXPORT void JNICALL
 Java_ru_evgeniy_dpitunnel_service_Tun2HttpVpnService_jni_1start(
-        JNIEnv *env, jobject instance, jint tun, jboolean fwd53, jint rcode, jstring proxyIp, jint proxyPort) {
+        JNIEnv *env, jobject instance, jint tun, jboolean fwd53, jint rcode, jstring proxyIp, jint proxyPort,
+        jint threads) {
 
     const char *proxy_ip = (*env)->GetStringUTFChars(env, proxyIp, 0);
 
     max_tun_msg = 0;
 
-    // Set blocking
+    // Set non blocking, tun reads and writes are batched by the events threads
     int flags = fcntl(tun, F_GETFL, 0);
-    if (flags < 0 || fcntl(tun, F_SETFL, flags & ~O_NONBLOCK) < 0)
-        log_android(ANDROID_LOG_ERROR, "fcntl tun ~O_NONBLOCK error %d: %s",
+    if (flags < 0 || fcntl(tun, F_SETFL, flags | O_NONBLOCK) < 0)
+        log_android(ANDROID_LOG_ERROR, "fcntl tun O_NONBLOCK error %d: %s",
                     errno, strerror(errno));
 
-    if (thread_id && pthread_kill(thread_id, 0) == 0)
-        log_android(ANDROID_LOG_ERROR, "Already running thread %x", thread_id);
+    if (worker_count > 0)
+        log_android(ANDROID_LOG_ERROR, "Already running %d workers", worker_count);
     else {
         jint rs = (*env)->GetJavaVM(env, &jvm);
         if (rs != JNI_OK)
             log_android(ANDROID_LOG_ERROR, "GetJavaVM failed");
 
-        // Get arguments
-        struct arguments *args = malloc(sizeof(struct arguments));
-        // args->env = will be set in thread
-        args->instance = (*env)->NewGlobalRef(env, instance);
-        args->tun = tun;
-        args->fwd53 = fwd53;
-        args->rcode = rcode;
-        strcpy(args->proxyIp, proxy_ip);
-        args->proxyPort = proxyPort;
-
-
-        // Start native thread
-        int err = pthread_create(&thread_id, NULL, handle_events, (void *) args);
-        if (err == 0)
-            log_android(ANDROID_LOG_WARN, "Started thread %x", thread_id);
-        else
-            log_android(ANDROID_LOG_ERROR, "pthread_create error %d: %s", err, strerror(err));
+        // One worker per core by default
+        int count = threads;
+        if (count <= 0)
+            count = (int) sysconf(_SC_NPROCESSORS_ONLN);
+        if (count < 1)
+            count = 1;
+        if (count > TUN_WORKERS_MAX)
+            count = TUN_WORKERS_MAX;
+
+        // A single worker reads the tun itself, more are fed by the dispatcher
+        for (int i = 0; i < count; i++) {
+            workers[i] = create_worker(i, count > 1);
+            if (workers[i] == NULL)
+                break;
+            worker_count++;
+        }
+        if (worker_count < count) {
+            for (int i = 0; i < worker_count; i++)
+                destroy_worker(workers[i]);
+            worker_count = 0;
+        }
 
+        for (int i = 0; i < worker_count; i++) {
+            // Get arguments
+            struct arguments *args = malloc(sizeof(struct arguments));
+            // args->env = will be set in thread
+            args->instance = (*env)->NewGlobalRef(env, instance);
+            args->tun = tun;
+            args->fwd53 = fwd53;
+            args->rcode = rcode;
+            strcpy(args->proxyIp, proxy_ip);
+            args->proxyPort = proxyPort;
+            args->pool = NULL; // created by the thread
+            args->io = NULL;
+            args->worker = workers[i];
+
+            // Start native thread
+            int err = pthread_create(&workers[i]->thread_id, NULL, handle_events, (void *) args);
+            if (err == 0)
+                log_android(ANDROID_LOG_WARN, "Started worker %d thread %x",
+                            i, workers[i]->thread_id);
+            else
+                log_android(ANDROID_LOG_ERROR, "pthread_create error %d: %s", err, strerror(err));
+        }
 
+        if (worker_count > 1) {
+            struct arguments *args = malloc(sizeof(struct arguments));
+            args->env = NULL; // the dispatcher doesn't call Java
+            args->instance = NULL;
+            args->tun = tun;
+            args->fwd53 = fwd53;
+            args->rcode = rcode;
+            strcpy(args->proxyIp, proxy_ip);
+            args->proxyPort = proxyPort;
+            args->pool = NULL;
+            args->io = NULL;
+            args->worker = NULL;
+
+            int err = pthread_create(&dispatch_thread_id, NULL, handle_tun, (void *) args);
+            if (err == 0)
+                log_android(ANDROID_LOG_WARN, "Started dispatcher thread %x", dispatch_thread_id);
+            else
+                log_android(ANDROID_LOG_ERROR, "pthread_create error %d: %s", err, strerror(err));
+        }
     }
 
     (*env)->ReleaseStringUTFChars(env, proxyIp, proxy_ip);
@@ -119,10 +158,16 @@ Java_ru_evgeniy_dpitunnel_service_Tun2HttpVpnService_jni_1start(
 JNIEXPORT void JNICALL
 Java_ru_evgeniy_dpitunnel_service_Tun2HttpVpnService_jni_1stop(
         JNIEnv *env, jobject instance, jint tun) {
-    pthread_t t = thread_id;
-    log_android(ANDROID_LOG_WARN, "Stop tun %d  thread %x", tun, t);
+    log_android(ANDROID_LOG_WARN, "Stop tun %d workers %d", tun, worker_count);
+    if (worker_count == 0) {
+        log_android(ANDROID_LOG_WARN, "Not running");
+        return;
+    }
+
+    // Stop the dispatcher first so no packets are left for stopped workers
+    pthread_t t = dispatch_thread_id;
     if (t && pthread_kill(t, 0) == 0) {
-        log_android(ANDROID_LOG_WARN, "Write pipe thread %x", t);
+        log_android(ANDROID_LOG_WARN, "Write pipe dispatcher thread %x", t);
         if (write(pipefds[1], "x", 1) < 0)
             log_android(ANDROID_LOG_WARN, "Write pipe error %d: %s", errno, strerror(errno));
         else {
@@ -131,12 +176,31 @@ Java_ru_evgeniy_dpitunnel_service_Tun2HttpVpnService_jni_1stop(
             if (err != 0)
                 log_android(ANDROID_LOG_WARN, "pthread_join error %d: %s", err, strerror(err));
         }
+    }
+    dispatch_thread_id = 0;
+
+    for (int i = 0; i < worker_count; i++) {
+        t = workers[i]->thread_id;
+        if (t && pthread_kill(t, 0) == 0) {
+            log_android(ANDROID_LOG_WARN, "Write pipe worker %d thread %x", i, t);
+            if (write(workers[i]->pipefds[1], "x", 1) < 0)
+                log_android(ANDROID_LOG_WARN, "Write pipe error %d: %s", errno, strerror(errno));
+            else {
+                log_android(ANDROID_LOG_WARN, "Join thread %x", t);
+                int err = pthread_join(t, NULL);
+                if (err != 0)
+                    log_android(ANDROID_LOG_WARN, "pthread_join error %d: %s", err, strerror(err));
+            }
+        }
+    }
 
-        clear();
+    for (int i = 0; i < worker_count; i++) {
+        destroy_worker(workers[i]);
+        workers[i] = NULL;
+    }
+    worker_count = 0;
 
-        log_android(ANDROID_LOG_WARN, "Stopped thread %x", t);
-    } else
-        log_android(ANDROID_LOG_WARN, "Not running thread %x", t);
+    log_android(ANDROID_LOG_WARN, "Stopped");
 }
 
 JNIEXPORT jint JNICALL
@@ -149,11 +213,6 @@ JNIEXPORT void JNICALL
 Java_ru_evgeniy_dpitunnel_service_Tun2HttpVpnService_jni_1done(JNIEnv *env, jobject instance) {
     log_android(ANDROID_LOG_INFO, "Done");
 
-    clear();
-
-    if (pthread_mutex_destroy(&lock))
-        log_android(ANDROID_LOG_ERROR, "pthread_mutex_destroy failed");
-
     for (int i = 0; i < 2; i++)
         if (close(pipefds[i]))
             log_android(ANDROID_LOG_ERROR, "Close pipe error %d: %s", errno, strerror(errno));
@@ -1,11 +1,13 @@
 #include <jni.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <ctype.h>
 #include <time.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <dirent.h>
@@ -55,6 +57,22 @@
 // https://en.wikipedia.org/wiki/Maximum_segment_lifetime
 
 #define SESSION_LIMIT 40 // percent
+#define SESSION_TABLE_MIN 256 // slots, power of two
+
+// Session expiry timer wheel, one second ticks
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 3 // 64^3 seconds, longer deadlines are rechecked
+#define TIMER_RESCALE 10 // percent timeout scale drop rescheduling all sessions
+
+// Per-protocol session lists
+#define SESSION_ICMP 0
+#define SESSION_UDP 1
+#define SESSION_TCP 2
+#define SESSION_LISTS 3
+
+// Tun packets are dispatched by flow hash to workers owning the sessions
+#define TUN_WORKERS_MAX 16
 
 #define TCP_CONNECT_NOT_SENT -1
 #define TCP_CONNECT_SENT 0
@@ -62,6 +80,78 @@
 
 #define MTU 10000
 
+// Packet buffers reused by the tun I/O paths of an events thread
+#define PACKET_POOL_CLASSES 2
+#define PACKET_POOL_SMALL (2 * MTU) // bytes, tun reads and TCP packets
+#define PACKET_POOL_LARGE IP_MAXPACKET // bytes, UDP and ICMP datagrams
+#define PACKET_POOL_INIT 8 // small buffers allocated up front
+#define PACKET_POOL_KEEP 64 // free small buffers kept
+#define PACKET_POOL_KEEP_LARGE 4 // free large buffers kept
+
+#define PACKET_BUFFER(buffer) \
+    ((struct packet_buffer *) ((uint8_t *) (buffer) - offsetof(struct packet_buffer, data)))
+
+struct packet_buffer {
+    struct packet_buffer *next;
+    size_t size; // 0 if not from a pool class
+    size_t length; // packet bytes while queued for the tun
+    uint8_t data[];
+};
+
+struct packet_pool {
+    struct packet_buffer *free[PACKET_POOL_CLASSES];
+    int free_count[PACKET_POOL_CLASSES];
+    uint64_t hits;
+    uint64_t misses; // free list empty or size above the largest class
+};
+
+// Tun reads are handled and tun writes are flushed in batches
+#define TUN_BATCH 32 // packets read per tun wakeup, queued packets flushed in bursts
+#define TUN_BATCH_BUCKETS 6 // wakeups by packets read: 1, 2-3, 4-7, 8-15, 16-31, 32
+#define TUN_QUEUE_MAX 1024 // packets waiting for a writable tun
+
+struct tun_io {
+    struct packet_buffer *queue; // outbound packets in order
+    struct packet_buffer **queue_tail;
+    int queued;
+    uint64_t wakeups;
+    uint64_t packets;
+    uint64_t batches[TUN_BATCH_BUCKETS];
+    uint64_t bursts;
+    uint64_t dropped;
+};
+
+struct ng_session;
+
+// Sessions and dispatched packets of one events thread, only the inbox is shared
+struct worker {
+    int index;
+    int dispatched; // packets come from the dispatcher instead of the tun
+    pthread_t thread_id;
+    int pipefds[2]; // stop and packet wakeups
+
+    // Sessions, see session.c
+    struct ng_session *session[SESSION_LISTS];
+    int session_count[SESSION_LISTS];
+    struct ng_session *touched;
+    struct ng_session **table;
+    uint32_t table_size;
+    uint32_t table_used;
+    struct ng_session *timer_wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    struct ng_session *timer_due;
+    time_t timer_wheel_time; // next tick to process
+    int timer_scale; // highest timeout scale scheduled since the last rescale
+
+    // Packets from the dispatcher and their buffers given back to it, under lock
+    pthread_mutex_t lock;
+    struct packet_buffer *inbox;
+    struct packet_buffer **inbox_tail;
+    int inboxed;
+    struct packet_buffer *returned;
+    uint64_t received;
+    uint64_t dropped;
+};
+
 struct arguments {
     JNIEnv *env;
     jobject instance;
@@ -70,6 +160,9 @@ struct arguments {
     jint rcode;
     char proxyIp[128];
     int proxyPort;
+    struct packet_pool *pool; // owned by the events thread
+    struct tun_io *io; // owned by the events thread
+    struct worker *worker; // NULL for the dispatcher
 };
 
 struct allowed {
@@ -184,7 +277,21 @@ struct ng_session {
     };
     jint socket;
     struct epoll_event ev;
+
+    // Sessions of the same protocol list
     struct ng_session *next;
+    struct ng_session *prev;
+
+    // Flow hash for the session table
+    uint32_t hash;
+
+    // Expiry timer, either in a timer wheel slot or in the touched list
+    // waiting to be counted and scheduled again
+    struct ng_session *timer_next;
+    struct ng_session **timer_pprev;
+    time_t deadline;
+    uint8_t touched;
+    uint8_t active;
 };
 
 // IPv6
@@ -288,9 +395,35 @@ void report_error(const struct arguments *args, jint error, const char *fmt, ...
 
 void check_allowed(const struct arguments *args);
 
-void init(const struct arguments *args);
+void init_sessions(struct worker *w);
+
+void clear_sessions(struct worker *w);
+
+uint32_t get_session_hash(uint8_t protocol, int version,
+                          const void *saddr, const void *daddr,
+                          __be16 source, __be16 dest);
+
+struct ng_session *find_session(const struct arguments *args,
+                                uint8_t protocol, int version,
+                                const void *saddr, const void *daddr,
+                                __be16 source, __be16 dest);
+
+void add_session(const struct arguments *args, struct ng_session *s);
+
+void remove_session(const struct arguments *args, struct ng_session *s);
 
-void clear();
+void touch_session(const struct arguments *args, struct ng_session *s);
+
+struct worker *create_worker(int index, int dispatched);
+
+void destroy_worker(struct worker *w);
+
+void *handle_tun(void *a);
+
+int get_packet_worker(const uint8_t *pkt, size_t length, int workers);
+
+int receive_packets(const struct arguments *args, const int epoll_fd,
+                    int sessions, int maxsessions);
 
 int check_icmp_session(const struct arguments *args,
                        struct ng_session *s,
@@ -312,6 +445,30 @@ int get_udp_timeout(const struct udp_session *u, int sessions, int maxsessions);
 
 int get_tcp_timeout(const struct tcp_session *t, int sessions, int maxsessions);
 
+time_t get_icmp_deadline(const struct icmp_session *u, int sessions, int maxsessions);
+
+time_t get_udp_deadline(const struct udp_session *u, int sessions, int maxsessions);
+
+time_t get_tcp_deadline(const struct tcp_session *t, int sessions, int maxsessions);
+
+struct packet_pool *create_packet_pool();
+
+void destroy_packet_pool(struct packet_pool *pool);
+
+uint8_t *get_packet_buffer(struct packet_pool *pool, size_t size);
+
+void put_packet_buffer(struct packet_pool *pool, uint8_t *buffer);
+
+struct tun_io *create_tun_io();
+
+void destroy_tun_io(const struct arguments *args);
+
+ssize_t write_tun(const struct arguments *args, uint8_t *buffer, size_t len);
+
+int flush_tun(const struct arguments *args);
+
+int read_tun(const struct arguments *args, uint8_t **batch, size_t *lengths, int *error);
+
 uint16_t get_mtu();
 
 uint16_t get_default_mss(int version);
@@ -1,7 +1,6 @@
 
 #include "tun2http.h"
 
-extern struct ng_session *ng_session;
 extern FILE *pcap_file;
 
 int get_udp_timeout(const struct udp_session *u, int sessions, int maxsessions) {
@@ -13,6 +12,16 @@ int get_udp_timeout(const struct udp_session *u, int sessions, int maxsessions)
     return timeout;
 }
 
+// Time from which check_udp_session changes the session state
+time_t get_udp_deadline(const struct udp_session *u, int sessions, int maxsessions) {
+    if (u->state == UDP_ACTIVE)
+        return u->time + get_udp_timeout(u, sessions, maxsessions) + 1;
+    else if (u->state == UDP_FINISHING)
+        return 0;
+    else
+        return u->time + UDP_KEEP_TIMEOUT + 1;
+}
+
 int check_udp_session(const struct arguments *args, struct ng_session *s,
                       int sessions, int maxsessions) {
     time_t now = time(NULL);
@@ -85,7 +94,7 @@ void check_udp_socket(const struct arguments *args, const struct epoll_event *ev
         if (ev->events & EPOLLIN) {
             s->udp.time = time(NULL);
 
-            uint8_t *buffer = malloc(s->udp.mss);
+            uint8_t *buffer = get_packet_buffer(args->pool, s->udp.mss);
             ssize_t bytes = recv(s->socket, buffer, s->udp.mss, 0);
             if (bytes < 0) {
                 // Socket error
@@ -123,7 +132,7 @@ void check_udp_socket(const struct arguments *args, const struct epoll_event *ev
                         s->udp.state = UDP_FINISHING;
                 }
             }
-            free(buffer);
+            put_packet_buffer(args->pool, buffer);
         }
     }
 }
@@ -139,16 +148,12 @@ int has_udp_session(const struct arguments *args, const uint8_t *pkt, const uint
         return 1;
 
     // Search session
-    struct ng_session *cur = ng_session;
-    while (cur != NULL &&
-           !(cur->protocol == IPPROTO_UDP &&
-             cur->udp.version == version &&
-             cur->udp.source == udphdr->source && cur->udp.dest == udphdr->dest &&
-             (version == 4 ? cur->udp.saddr.ip4 == ip4->saddr &&
-                             cur->udp.daddr.ip4 == ip4->daddr
-                           : memcmp(&cur->udp.saddr.ip6, &ip6->ip6_src, 16) == 0 &&
-                             memcmp(&cur->udp.daddr.ip6, &ip6->ip6_dst, 16) == 0)))
-        cur = cur->next;
+    struct ng_session *cur = find_session(
+            args,
+            IPPROTO_UDP, version,
+            version == 4 ? (const void *) &ip4->saddr : (const void *) &ip6->ip6_src,
+            version == 4 ? (const void *) &ip4->daddr : (const void *) &ip6->ip6_dst,
+            udphdr->source, udphdr->dest);
 
     return (cur != NULL);
 }
@@ -197,8 +202,7 @@ void block_udp(const struct arguments *args,
     s->udp.state = UDP_BLOCKED;
     s->socket = -1;
 
-    s->next = ng_session;
-    ng_session = s;
+    add_session(args, s);
 }
 
 void resolve_host_with_local_dns_server(const struct arguments *args, struct ng_session *cur, const uint8_t *data, size_t datalen) {
@@ -247,13 +251,13 @@ void resolve_host_with_local_dns_server(const struct arguments *args, struct ng_
     }
 
     // Receive data
-    uint8_t* buf = malloc(1024 * sizeof(uint8_t));
+    uint8_t* buf = get_packet_buffer(args->pool, 1024);
     int len = sizeof(servaddr);
     int recvCnt = recvfrom(local_dns_server_socket, buf, 1024, MSG_WAITALL, (struct sockaddr *) &servaddr, &len);
 
     // Check received data
     if(recvCnt <= 0) {
-        free(buf);
+        put_packet_buffer(args->pool, buf);
         log_error(log_tag, "Failed to receive data from local DNS server");
         return;
     }
@@ -268,7 +272,7 @@ void resolve_host_with_local_dns_server(const struct arguments *args, struct ng_
     }
 
     // Free memory
-    free(buf);
+    put_packet_buffer(args->pool, buf);
 }
 
 jboolean handle_udp(const struct arguments *args,
@@ -285,16 +289,12 @@ jboolean handle_udp(const struct arguments *args,
     const size_t datalen = length - (data - pkt);
 
     // Search session
-    struct ng_session *cur = ng_session;
-    while (cur != NULL &&
-           !(cur->protocol == IPPROTO_UDP &&
-             cur->udp.version == version &&
-             cur->udp.source == udphdr->source && cur->udp.dest == udphdr->dest &&
-             (version == 4 ? cur->udp.saddr.ip4 == ip4->saddr &&
-                             cur->udp.daddr.ip4 == ip4->daddr
-                           : memcmp(&cur->udp.saddr.ip6, &ip6->ip6_src, 16) == 0 &&
-                             memcmp(&cur->udp.daddr.ip6, &ip6->ip6_dst, 16) == 0)))
-        cur = cur->next;
+    struct ng_session *cur = find_session(
+            args,
+            IPPROTO_UDP, version,
+            version == 4 ? (const void *) &ip4->saddr : (const void *) &ip6->ip6_src,
+            version == 4 ? (const void *) &ip4->daddr : (const void *) &ip6->ip6_dst,
+            udphdr->source, udphdr->dest);
 
     char source[INET6_ADDRSTRLEN + 1];
     char dest[INET6_ADDRSTRLEN + 1];
@@ -361,8 +361,7 @@ jboolean handle_udp(const struct arguments *args,
         if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s->socket, &s->ev))
             log_android(ANDROID_LOG_ERROR, "epoll add udp error %d: %s", errno, strerror(errno));
 
-        s->next = ng_session;
-        ng_session = s;
+        add_session(args, s);
 
         cur = s;
     }
@@ -513,7 +512,7 @@ ssize_t write_udp(const struct arguments *args, const struct udp_session *cur,
     // Build packet
     if (cur->version == 4) {
         len = sizeof(struct iphdr) + sizeof(struct udphdr) + datalen;
-        buffer = malloc(len);
+        buffer = get_packet_buffer(args->pool, len);
         struct iphdr *ip4 = (struct iphdr *) buffer;
         udp = (struct udphdr *) (buffer + sizeof(struct iphdr));
         if (datalen)
@@ -543,7 +542,7 @@ ssize_t write_udp(const struct arguments *args, const struct udp_session *cur,
         csum = calc_checksum(0, (uint8_t *) &pseudo, sizeof(struct ippseudo));
     } else {
         len = sizeof(struct ip6_hdr) + sizeof(struct udphdr) + datalen;
-        buffer = malloc(len);
+        buffer = get_packet_buffer(args->pool, len);
         struct ip6_hdr *ip6 = (struct ip6_hdr *) buffer;
         udp = (struct udphdr *) (buffer + sizeof(struct ip6_hdr));
         if (datalen)
@@ -591,9 +590,7 @@ ssize_t write_udp(const struct arguments *args, const struct udp_session *cur,
                 "UDP sending to tun %d from %s/%u to %s/%u data %u",
                 args->tun, dest, ntohs(cur->dest), source, ntohs(cur->source), len);
 
-    ssize_t res = write(args->tun, buffer, len);
-
-    free(buffer);
+    ssize_t res = write_tun(args, buffer, len);
 
     if (res != len) {
         log_android(ANDROID_LOG_ERROR, "write %d/%d", res, len);
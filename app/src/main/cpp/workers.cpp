@@ -0,0 +1,111 @@
+#include "dpi-bypass.h"
+#include "workers.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+#include <sys/eventfd.h>
+
+extern bool stop_flag;
+
+std::vector<std::thread> workers;
+std::mutex clients_queue_mutex;
+std::condition_variable clients_queue_condition;
+std::queue<int> clients_queue;
+
+// Connections accepted, but not closed yet. Includes queued, being set up and relayed connections
+std::atomic<unsigned int> active_connections(0);
+unsigned int max_active_connections;
+// Signaled when connection is released while limit is reached, so accept cycle can continue
+int connection_released_fd = -1;
+
+void worker_cycle(int (*process_client)(int))
+{
+    while(true)
+    {
+        int client_socket;
+        {
+            std::unique_lock<std::mutex> lock(clients_queue_mutex);
+            clients_queue_condition.wait(lock, []{ return stop_flag || !clients_queue.empty(); });
+            if(stop_flag)
+                return;
+            client_socket = clients_queue.front();
+            clients_queue.pop();
+        }
+
+        // If connection was passed to reactor, it will be released when closed
+        if(process_client(client_socket) == -1)
+            release_connection();
+    }
+}
+
+int init_workers(unsigned int workers_count, unsigned int max_connections, int (*process_client)(int))
+{
+    std::string log_tag = "CPP/init_workers";
+
+    active_connections = 0;
+    max_active_connections = max_connections;
+
+    if((connection_released_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+    {
+        log_error(log_tag.c_str(), "Can't create eventfd. Errno: %s", std::strerror(errno));
+        return -1;
+    }
+
+    if(workers_count == 0)
+        workers_count = 1;
+
+    for(unsigned int i = 0; i < workers_count; i++)
+        workers.emplace_back(worker_cycle, process_client);
+
+    log_debug(log_tag.c_str(), "Started %u workers, connections limit %u", workers_count, max_connections);
+
+    return 0;
+}
+
+void deinit_workers()
+{
+    // Wake up all workers. They will see stop_flag and exit
+    {
+        std::lock_guard<std::mutex> lock(clients_queue_mutex);
+        clients_queue_condition.notify_all();
+    }
+    for(auto& worker : workers)
+        if(worker.joinable())
+            worker.join();
+    workers.clear();
+
+    // Close clients that weren't processed
+    while(!clients_queue.empty())
+    {
+        close(clients_queue.front());
+        clients_queue.pop();
+    }
+
+    close(connection_released_fd);
+    connection_released_fd = -1;
+}
+
+void add_client(int client_socket)
+{
+    active_connections++;
+
+    std::lock_guard<std::mutex> lock(clients_queue_mutex);
+    clients_queue.push(client_socket);
+    clients_queue_condition.notify_one();
+}
+
+bool is_connections_limit_reached()
+{
+    return max_active_connections != 0 && active_connections >= max_active_connections;
+}
+
+void release_connection()
+{
+    if(active_connections-- == max_active_connections && connection_released_fd != -1)
+    {
+        uint64_t value = 1;
+        write(connection_released_fd, &value, sizeof(value));
+    }
+}
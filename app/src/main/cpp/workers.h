@@ -0,0 +1,10 @@
+#ifndef DPITUNNEL_WORKERS_H
+#define DPITUNNEL_WORKERS_H
+
+int init_workers(unsigned int workers_count, unsigned int max_connections, int (*process_client)(int));
+void deinit_workers();
+void add_client(int client_socket);
+bool is_connections_limit_reached();
+void release_connection();
+
+#endif //DPITUNNEL_WORKERS_H
@@ -59,7 +59,7 @@ public class Tun2HttpVpnService extends VpnService {
 
     public native void jni_init();
 
-    public native void jni_start(int tun, boolean fwd53, int rcode, String proxyIp, int proxyPort);
+    public native void jni_start(int tun, boolean fwd53, int rcode, String proxyIp, int proxyPort, int workers);
 
     public native void jni_stop(int tun);
 
@@ -167,8 +167,9 @@ public class Tun2HttpVpnService extends VpnService {
         prefs = PreferenceManager.getDefaultSharedPreferences(this);
         String proxyHost = "127.0.0.1";
         int proxyPort = Integer.valueOf(prefs.getString("other_bind_port", null));
+        int workers = Integer.valueOf(prefs.getString("other_vpn_workers", "0"));
         if (proxyPort != 0 && !TextUtils.isEmpty(proxyHost)) {
-            jni_start(vpn.getFd(), false, 3, proxyHost, proxyPort);
+            jni_start(vpn.getFd(), false, 3, proxyHost, proxyPort, workers);
         }
     }
 